@@ -14,11 +14,14 @@ public enum DebugOption : String {
      Debug options
      */
     case shortExposure = "short-exposure"
+    case recordSession = "record-session"
 
     var defaultValue: Bool {
         switch self {
         case .shortExposure:
             return false
+        case .recordSession:
+            return false
         }
     }
 }
@@ -0,0 +1,282 @@
+//
+//  FrameQuality.hpp
+//  StarGazer
+//
+//  Scores frames on a small thumbnail before alignment, so frames with clouds, shake or a sudden change in brightness
+//  can be rejected before detection, matching and RANSAC.
+//
+
+#ifndef FrameQuality_hpp
+#define FrameQuality_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "FrameView.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Measurements of a single frame, taken on its thumbnail. Levels are 8 bit.
+ */
+struct FrameQuality {
+    /**
+     * Median of the thumbnail.
+     */
+    float background = 0;
+
+    /**
+     * Noise of the background, estimated from the median absolute deviation.
+     */
+    float noise = 0;
+
+    /**
+     * Number of local maxima clearly above the background, a rough estimate of the visible stars.
+     */
+    int starEstimate = 0;
+
+    /**
+     * Average share of the light of a star in its brightest pixel, drops when stars are trailed or out of focus.
+     */
+    float sharpness = 0;
+
+    /**
+     * Change of the background relative to the recent frames.
+     */
+    float brightnessJump = 0;
+
+    /**
+     * Quality relative to the reference in range [0, 1], usable as weight of the frame.
+     */
+    float score = 1;
+
+    /**
+     * Why the frame was rejected, nullptr if it was accepted.
+     */
+    const char *rejection = nullptr;
+};
+
+/**
+ * Limits of the pre-screen, relative to the reference frame.
+ */
+struct QualityLimits {
+    /**
+     * Longest side of the thumbnail. Stars need to survive downscaling, so the thumbnail should not be much smaller.
+     */
+    int thumbnailSize = 512;
+
+    /**
+     * Frames with fewer stars than this fraction of the stars of the reference are clouded.
+     */
+    float minStarFraction = 0.3f;
+
+    /**
+     * Frames with a sharpness below this fraction of the sharpness of the reference are blurred.
+     */
+    float minSharpnessFraction = 0.6f;
+
+    /**
+     * Frames whose background changes by more than this fraction from the recent frames are rejected.
+     */
+    float maxBrightnessJump = 0.5f;
+};
+
+/**
+ * Scores frames against the first frame it has seen, the reference.
+ * The recent background is an exponential average over all frames, so a lasting change in brightness is only
+ * rejected for a few frames while a single headlight is rejected.
+ * With a foreground mask only the sky is measured, so lights and movement in the foreground do not reject frames.
+ */
+class QualityScreen {
+private:
+    /**
+     * Weight of the newest frame in the recent background.
+     */
+    const float RECENT_WEIGHT = 0.2f;
+
+    /**
+     * Peaks have to exceed the background by this many times the noise, and at least by MIN_PEAK_EXCESS.
+     */
+    const float PEAK_SIGMA = 5;
+    const float MIN_PEAK_EXCESS = 3;
+
+    /**
+     * Backgrounds darker than this are treated as this bright when comparing them, so noise in a black sky is no jump.
+     */
+    const float MIN_BACKGROUND = 8;
+
+    QualityLimits limits;
+
+    /**
+     * Foreground mask at full resolution, float or 8 bit fixed point. Shared, never written.
+     */
+    Mat mask;
+
+    /**
+     * Sky of the thumbnail, 8 bit. Eroded, so the neighbourhood of every measured peak is sky as well.
+     */
+    Mat thumbnailSky;
+
+    bool hasReference = false;
+    FrameQuality reference;
+    float recentBackground = 0;
+
+    Mat thumbnail;
+    Mat gray;
+    Mat dilated;
+    Mat deviation;
+    vector<Point> peaks;
+
+    /**
+     * Median of an 8 bit image from its histogram, only of the pixels set in the mask unless it is empty.
+     */
+    static float median(const Mat &image, const Mat &mask = Mat()) {
+        int histogram[256] = {0};
+        size_t total = 0;
+        for (int y = 0; y < image.rows; y++) {
+            const uchar *row = image.ptr<uchar>(y);
+            const uchar *maskRow = mask.empty() ? nullptr : mask.ptr<uchar>(y);
+            for (int x = 0; x < image.cols; x++) {
+                if (!maskRow || maskRow[x]) {
+                    histogram[row[x]]++;
+                    total++;
+                }
+            }
+        }
+        size_t half = total / 2, count = 0;
+        for (int i = 0; i < 256; i++) {
+            count += histogram[i];
+            if (count > half) {
+                return (float) i;
+            }
+        }
+        return 255;
+    }
+
+    static float ratio(float value, float referenceValue) {
+        return referenceValue > 0 ? value / referenceValue : 1;
+    }
+
+public:
+    QualityScreen(QualityLimits limits = QualityLimits()) : limits(limits) {
+    }
+
+    /**
+     * Sets the foreground mask, set before the reference is evaluated. The mask is shared and must not be written
+     * while it is set.
+     */
+    void setMask(const Mat &mask) {
+        this->mask = mask;
+        thumbnailSky.release();
+    }
+
+    /**
+     * Measures a frame without comparing it to the reference.
+     */
+    void measure(const FrameView &frame, FrameQuality &quality) {
+        Size size = frame.size();
+        double scale = std::min(1.0, (double) limits.thumbnailSize / std::max(size.width, size.height));
+        frame.downscale(Size(std::max(1, cvRound(size.width * scale)), std::max(1, cvRound(size.height * scale))), thumbnail);
+        cvtColor(thumbnail, gray, COLOR_RGB2GRAY);
+
+        if (!mask.empty() && thumbnailSky.size() != gray.size()) {
+            Mat downscaled;
+            resize(mask, downscaled, gray.size(), 0, 0, INTER_AREA);
+            double half = mask.depth() == CV_8U ? 127.5 : 0.5;
+            cv::threshold(downscaled, downscaled, half, 255, THRESH_BINARY);
+            downscaled.convertTo(thumbnailSky, CV_8U);
+            erode(thumbnailSky, thumbnailSky, getStructuringElement(MORPH_RECT, Size(3, 3)));
+            if (countNonZero(thumbnailSky) == 0) {
+                // Too little sky to measure, the whole frame is measured instead
+                thumbnailSky = Mat(gray.size(), CV_8U, Scalar(255));
+            }
+        }
+        Mat sky = mask.empty() ? Mat() : thumbnailSky;
+
+        quality.background = median(gray, sky);
+        absdiff(gray, Scalar::all(quality.background), deviation);
+        quality.noise = 1.4826f * median(deviation, sky);
+
+        // Stars are the local maxima clearly above the background
+        float limit = quality.background + std::max(PEAK_SIGMA * quality.noise, MIN_PEAK_EXCESS);
+        dilate(gray, dilated, getStructuringElement(MORPH_RECT, Size(3, 3)));
+        peaks.clear();
+        for (int y = 1; y < gray.rows - 1; y++) {
+            const uchar *row = gray.ptr<uchar>(y);
+            const uchar *dilatedRow = dilated.ptr<uchar>(y);
+            const uchar *skyRow = sky.empty() ? nullptr : sky.ptr<uchar>(y);
+            for (int x = 1; x < gray.cols - 1; x++) {
+                if (row[x] > limit && row[x] == dilatedRow[x] && (!skyRow || skyRow[x])) {
+                    peaks.emplace_back(x, y);
+                }
+            }
+        }
+        quality.starEstimate = (int) peaks.size();
+
+        // Share of the light of the 3x3 neighbourhood in the peak
+        double sharpness = 0;
+        for (auto &peak: peaks) {
+            double center = gray.at<uchar>(peak) - quality.background;
+            double total = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    total += std::max(0.0, gray.at<uchar>(peak.y + dy, peak.x + dx) - (double) quality.background);
+                }
+            }
+            sharpness += total > 0 ? center / total : 0;
+        }
+        quality.sharpness = peaks.empty() ? 0 : (float) (sharpness / peaks.size());
+    }
+
+    /**
+     * Measures a frame and decides if it is good enough to be aligned. The first frame becomes the reference.
+     * @return False if the frame clearly fails, quality.rejection holds the reason.
+     */
+    bool evaluate(const FrameView &frame, FrameQuality &quality) {
+        quality = FrameQuality();
+        measure(frame, quality);
+
+        if (!hasReference) {
+            hasReference = true;
+            reference = quality;
+            recentBackground = quality.background;
+            return true;
+        }
+
+        quality.brightnessJump = std::abs(quality.background - recentBackground) / std::max(recentBackground, MIN_BACKGROUND);
+        recentBackground += RECENT_WEIGHT * (quality.background - recentBackground);
+
+        float stars = ratio(quality.starEstimate, reference.starEstimate);
+        float sharpness = ratio(quality.sharpness, reference.sharpness);
+        quality.score = std::min(1.0f, stars) * std::min(1.0f, sharpness) * std::max(0.0f, 1 - quality.brightnessJump);
+
+        if (quality.brightnessJump > limits.maxBrightnessJump) {
+            quality.rejection = "brightness jump";
+        } else if (stars < limits.minStarFraction) {
+            quality.rejection = "too few stars";
+        } else if (sharpness < limits.minSharpnessFraction) {
+            quality.rejection = "blurred";
+        }
+        return quality.rejection == nullptr;
+    }
+
+    bool isReferenced() {
+        return hasReference;
+    }
+
+    const FrameQuality &getReference() {
+        return reference;
+    }
+
+    /**
+     * Sets the reference measurements, e.g. those of a resumed stack, instead of taking them from the next frame.
+     */
+    void setReference(const FrameQuality &quality) {
+        hasReference = true;
+        reference = quality;
+        recentBackground = quality.background;
+    }
+};
+
+#endif /* FrameQuality_hpp */
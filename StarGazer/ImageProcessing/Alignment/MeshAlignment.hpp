@@ -0,0 +1,282 @@
+//
+//  MeshAlignment.hpp
+//  StarGazer
+//
+//  Corrects the global homography of a frame locally, so the lens distortion of wide angle lenses does not smear the
+//  stars towards the edges of the stack.
+//
+
+#ifndef MeshAlignment_hpp
+#define MeshAlignment_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "TaskScheduler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Splits the stack into a grid of cells and fits an affine correction of the global homography to the matched stars
+ * of every cell. Cells with too few stars for a stable affine fit are only corrected by a translation. The corrections
+ * are evaluated at the vertices of the grid, averaged between neighbouring cells and blended bilinearly, so the warp
+ * is continuous across cells.
+ *
+ * The distortion of a lens changes slowly as the sky moves through the frame, so the vertex offsets are averaged over
+ * frames and expanded into a dense table of offsets in stack coordinates. The table is only rebuilt when the offsets
+ * moved noticeably, accumulation adds the cached offset to the position the homography maps every stack pixel to.
+ */
+class MeshAlignment {
+private:
+    /**
+     * Matches a cell needs for an affine fit. Six parameters fitted to a handful of stars with centroid noise tilt and
+     * shear the cell, so the fit needs twice the matches of its parameters.
+     */
+    static const int MIN_CELL_MATCHES = 12;
+
+    /**
+     * Matches a cell needs for a translation, cells with fewer matches keep the global homography.
+     */
+    static const int MIN_TRANSLATION_MATCHES = 4;
+
+    /**
+     * Weight of the offsets of the newest frame in the averaged offsets.
+     */
+    constexpr static const double RECENT_WEIGHT = 0.3;
+
+    /**
+     * The table is rebuilt once an offset moved more than this many pixels. A quarter pixel stays well below the width
+     * of a star, smaller changes are mostly the noise of the fits and rebuilding the table costs a pass over the stack.
+     */
+    constexpr static const double REBUILD_THRESHOLD = 0.25;
+
+    Size size;
+    int cols;
+    int rows;
+    Size2d cellSize;
+
+    /**
+     * Averaged offset of every vertex in frame pixels, CV_32FC2 of (rows + 1) x (cols + 1).
+     */
+    Mat vertexOffsets;
+
+    /**
+     * Vertex offsets the table was built from.
+     */
+    Mat builtOffsets;
+
+    /**
+     * Offset of every stack pixel in 1 / OFFSET_SCALE frame pixels, CV_16SC2. Empty while there is no correction.
+     */
+    Mat offsets;
+
+    /**
+     * Fits a translation from the predicted to the measured frame positions, the mean of the differences.
+     */
+    static Matx23d fitTranslation(const vector<Point2f> &predicted, const vector<Point2f> &measured) {
+        Point2d sum(0, 0);
+        for (size_t i = 0; i < predicted.size(); i++) {
+            sum += Point2d(measured[i] - predicted[i]);
+        }
+        sum *= 1.0 / predicted.size();
+        return Matx23d(1, 0, sum.x, 0, 1, sum.y);
+    }
+
+    /**
+     * Fits an affine map from the predicted to the measured frame positions by least squares.
+     */
+    static bool fitAffine(const vector<Point2f> &predicted, const vector<Point2f> &measured, Matx23d &affine) {
+        int n = (int) predicted.size();
+        Mat a(2 * n, 6, CV_64F, Scalar(0)), b(2 * n, 1, CV_64F);
+        for (int i = 0; i < n; i++) {
+            double *rowX = a.ptr<double>(2 * i), *rowY = a.ptr<double>(2 * i + 1);
+            rowX[0] = rowY[3] = predicted[i].x;
+            rowX[1] = rowY[4] = predicted[i].y;
+            rowX[2] = rowY[5] = 1;
+            b.at<double>(2 * i) = measured[i].x;
+            b.at<double>(2 * i + 1) = measured[i].y;
+        }
+        Mat solution;
+        if (!solve(a, b, solution, DECOMP_QR)) {
+            return false;
+        }
+        affine = Matx23d((const double *) solution.data);
+        return true;
+    }
+
+    static Point2d apply(const Matx33d &h, const Point2d &p) {
+        Vec3d mapped = h * Vec3d(p.x, p.y, 1);
+        return Point2d(mapped[0] / mapped[2], mapped[1] / mapped[2]);
+    }
+
+    Point2d vertex(int x, int y) {
+        return Point2d(x * cellSize.width, y * cellSize.height);
+    }
+
+    /**
+     * Expands the vertex offsets into the table, every stack pixel interpolated bilinearly between its 4 vertices.
+     */
+    void buildTable() {
+        offsets.create(size, CV_16SC2);
+        parallelFor(Range(0, size.height), [&](const Range &range) {
+            for (int y = range.start; y < range.end; y++) {
+                double gy = std::min(y / cellSize.height, rows - 1e-6);
+                int y0 = (int) gy;
+                float fy = (float) (gy - y0);
+                const Vec2f *top = vertexOffsets.ptr<Vec2f>(y0), *bottom = vertexOffsets.ptr<Vec2f>(y0 + 1);
+                Vec2s *row = offsets.ptr<Vec2s>(y);
+                for (int x = 0; x < size.width; x++) {
+                    double gx = std::min(x / cellSize.width, cols - 1e-6);
+                    int x0 = (int) gx;
+                    float fx = (float) (gx - x0);
+                    Vec2f offset = (top[x0] * (1 - fx) + top[x0 + 1] * fx) * (1 - fy)
+                                   + (bottom[x0] * (1 - fx) + bottom[x0 + 1] * fx) * fy;
+                    row[x] = Vec2s(saturate_cast<short>(offset[0] * OFFSET_SCALE),
+                                   saturate_cast<short>(offset[1] * OFFSET_SCALE));
+                }
+            }
+        });
+        vertexOffsets.copyTo(builtOffsets);
+    }
+
+public:
+    /**
+     * Offsets are stored in fixed point with this many steps per pixel.
+     */
+    static const int OFFSET_SCALE = 16;
+
+    /**
+     * Offsets larger than this many pixels are not lens distortion but bad matches, the cell is skipped.
+     */
+    constexpr static const double MAX_OFFSET = 4;
+
+    /**
+     * Offset of a stack pixel in frame pixels. Pixels outside of the table, e.g. of a mosaic beyond the reference
+     * frame, take the offset of the closest pixel of the table.
+     * @param offsets Table of offsets, see getOffsets
+     */
+    static Vec2f offsetAt(const Mat &offsets, int x, int y) {
+        const Vec2s &offset = offsets.at<Vec2s>(std::min(std::max(y, 0), offsets.rows - 1),
+                                                std::min(std::max(x, 0), offsets.cols - 1));
+        return Vec2f(offset[0], offset[1]) * (1.0f / OFFSET_SCALE);
+    }
+
+    /**
+     * @param size Size of the stack
+     * @param cells Cells along the longer side of the stack, the cells are close to square
+     */
+    MeshAlignment(Size size, int cells) : size(size) {
+        cells = std::max(cells, 1);
+        double cellEdge = (double) std::max(size.width, size.height) / cells;
+        cols = std::max(1, cvRound(size.width / cellEdge));
+        rows = std::max(1, cvRound(size.height / cellEdge));
+        cellSize = Size2d((double) size.width / cols, (double) size.height / rows);
+        vertexOffsets = Mat::zeros(rows + 1, cols + 1, CV_32FC2);
+        builtOffsets = vertexOffsets.clone();
+    }
+
+    /**
+     * Bytes of the table.
+     */
+    static size_t tableBytes(Size size) {
+        return (size_t) size.area() * 2 * sizeof(short);
+    }
+
+    /**
+     * Fits the corrections of a frame and updates the table if the averaged offsets moved.
+     * @param stackPoints Matched stars in stack coordinates
+     * @param framePoints Matched stars in frame coordinates
+     * @param h Global homography aligning the frame with the stack
+     * @param inliers Inlier mask of the homography, all matches are used if empty
+     */
+    void fit(const vector<Point2i> &stackPoints, const vector<Point2i> &framePoints, const Mat &h,
+             const vector<uchar> &inliers) {
+        Matx33d inverse = Matx33d(h).inv();
+
+        // Sort the inliers into the cells, a star also counts for the neighbouring cells it is close to
+        vector<vector<int>> cellMatches(rows * cols);
+        for (size_t i = 0; i < stackPoints.size(); i++) {
+            if (!inliers.empty() && (i >= inliers.size() || !inliers[i])) {
+                continue;
+            }
+            double gx = stackPoints[i].x / cellSize.width, gy = stackPoints[i].y / cellSize.height;
+            int x0 = std::max(0, (int) floor(gx - 0.5)), x1 = std::min(cols - 1, (int) floor(gx + 0.5));
+            int y0 = std::max(0, (int) floor(gy - 0.5)), y1 = std::min(rows - 1, (int) floor(gy + 0.5));
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    cellMatches[y * cols + x].push_back((int) i);
+                }
+            }
+        }
+
+        // Offsets of the 4 vertices of every cell with enough matches, the cells are fitted in parallel
+        vector<Vec2f> cellOffsets(rows * cols * 4);
+        vector<uchar> fitted(rows * cols, 0);
+        parallelFor(Range(0, rows * cols), [&](const Range &range) {
+            vector<Point2f> predicted, measured;
+            for (int cell = range.start; cell < range.end; cell++) {
+                if ((int) cellMatches[cell].size() < MIN_TRANSLATION_MATCHES) {
+                    continue;
+                }
+                predicted.clear();
+                measured.clear();
+                for (int i: cellMatches[cell]) {
+                    predicted.push_back(apply(inverse, Point2d(stackPoints[i])));
+                    measured.push_back(Point2f(framePoints[i]));
+                }
+                Matx23d affine;
+                if ((int) predicted.size() < MIN_CELL_MATCHES) {
+                    affine = fitTranslation(predicted, measured);
+                } else if (!fitAffine(predicted, measured, affine)) {
+                    continue;
+                }
+
+                bool plausible = true;
+                for (int v = 0; v < 4; v++) {
+                    Point2d p = apply(inverse, vertex(cell % cols + (v & 1), cell / cols + (v >> 1)));
+                    Vec2d corrected = affine * Vec3d(p.x, p.y, 1);
+                    Vec2f offset((float) (corrected[0] - p.x), (float) (corrected[1] - p.y));
+                    plausible &= std::abs(offset[0]) < MAX_OFFSET && std::abs(offset[1]) < MAX_OFFSET;
+                    cellOffsets[cell * 4 + v] = offset;
+                }
+                fitted[cell] = plausible;
+            }
+        });
+
+        // Every vertex averages the offsets of its fitted cells and is averaged over frames
+        for (int y = 0; y <= rows; y++) {
+            for (int x = 0; x <= cols; x++) {
+                Vec2f sum(0, 0);
+                int count = 0;
+                for (int v = 0; v < 4; v++) {
+                    int cellX = x - (v & 1), cellY = y - (v >> 1);
+                    if (cellX < 0 || cellY < 0 || cellX >= cols || cellY >= rows || !fitted[cellY * cols + cellX]) {
+                        continue;
+                    }
+                    sum += cellOffsets[(cellY * cols + cellX) * 4 + v];
+                    count++;
+                }
+                if (count > 0) {
+                    Vec2f &offset = vertexOffsets.at<Vec2f>(y, x);
+                    offset += (sum * (1.0f / count) - offset) * (float) RECENT_WEIGHT;
+                }
+            }
+        }
+
+        double moved = norm(vertexOffsets, builtOffsets, NORM_INF);
+        if (moved > REBUILD_THRESHOLD) {
+            buildTable();
+        }
+    }
+
+    /**
+     * Table of offsets, in 1 / OFFSET_SCALE pixels in the frame for every stack pixel. Empty before the first
+     * correction. Shared, must not be written to.
+     */
+    const Mat &getOffsets() const {
+        return offsets;
+    }
+};
+
+#endif /* MeshAlignment_hpp */
@@ -0,0 +1,228 @@
+//
+//  StarDetector.hpp
+//  StarGazer
+//
+//  Prepares frames for star detection and detects their stars, reusing its buffers between frames.
+//
+
+#ifndef StarDetector_hpp
+#define StarDetector_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "homography.hpp"
+#include "blend.hpp"
+#include "FrameView.hpp"
+#include "MaskTiles.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Detects stars at full resolution or coarse to fine, with the foreground masked out.
+ * Not thread safe, every thread detecting stars needs its own detector.
+ */
+class StarDetector {
+private:
+    /**
+     * Number of times frames are downsampled by 2 before detection, 0 for full resolution.
+     */
+    int levels;
+
+    /**
+     * Foreground mask at full resolution, float or 8 bit fixed point. Shared, never written.
+     */
+    Mat mask;
+
+    /**
+     * Tile classification of the mask, so sky and foreground tiles are copied or cleared instead of multiplied.
+     * Empty if tiles are disabled.
+     */
+    MaskTiles maskTiles;
+    int maskTileSize = 0;
+
+    /**
+     * Header on the frame if it can be used as a Mat directly.
+     */
+    Mat frameHeader;
+    Mat imageMasked;
+
+    /**
+     * Downsampled frame, mask and masked frame used for coarse to fine detection.
+     */
+    Mat coarseImage;
+    Mat coarseMask;
+    Mat coarseMasked;
+    MaskTiles coarseMaskTiles;
+
+    /**
+     * 8 bit map of hot pixels at full resolution, cleared in the detection image. Shared, never written.
+     */
+    Mat hotPixels;
+
+    /**
+     * Hot pixel map at the resolution of coarse to fine detection, a coarse pixel is hot if any of its pixels is.
+     */
+    Mat coarseHotPixels;
+
+    Mat threshMat;
+    StarDetectionBuffers buffers;
+
+    /**
+     * Clears the hot pixels of the full resolution detection image before thresholding, so they neither count as stars
+     * when the threshold is searched nor lift it. The image is copied first if it is the frame itself.
+     */
+    const Mat &clearHotPixels(const Mat &image, Size frameSize) {
+        if (hotPixels.empty() || hotPixels.size() != frameSize) {
+            return image;
+        }
+        if (image.data != imageMasked.data) {
+            image.copyTo(imageMasked);
+        }
+        imageMasked.setTo(Scalar::all(0), hotPixels);
+        return imageMasked;
+    }
+
+    /**
+     * Clears the hot pixels of a coarse detection image, a buffer of the detector, in place.
+     */
+    void clearCoarseHotPixels(Mat &image, Size frameSize) {
+        if (hotPixels.empty() || hotPixels.size() != frameSize) {
+            return;
+        }
+        if (coarseHotPixels.size() != image.size()) {
+            resize(hotPixels, coarseHotPixels, image.size(), 0, 0, INTER_AREA);
+            cv::threshold(coarseHotPixels, coarseHotPixels, 0, 255, THRESH_BINARY);
+        }
+        image.setTo(Scalar::all(0), coarseHotPixels);
+    }
+
+    /**
+     * Drops the stars centered on hot pixels. Coarse to fine detection refines the stars in the full resolution frame,
+     * which still holds the hot pixels.
+     */
+    void removeHotPixels(vector<Point2i> &stars) {
+        if (hotPixels.empty()) {
+            return;
+        }
+        stars.erase(std::remove_if(stars.begin(), stars.end(), [&](const Point2i &star) {
+            return star.x >= 0 && star.y >= 0 && star.x < hotPixels.cols && star.y < hotPixels.rows &&
+                   hotPixels.at<uchar>(star) != 0;
+        }), stars.end());
+    }
+
+    /**
+     * Full resolution frame with the mask applied.
+     * Without a mask a frame in stack layout is used as is, no copy is made.
+     */
+    const Mat &maskedImage(const FrameView &frame) {
+        bool isMat = frame.asMat(frameHeader);
+        if (mask.empty() && isMat) {
+            return frameHeader;
+        }
+        if (isMat) {
+            maskTiles.apply(frameHeader, mask, imageMasked);
+            return imageMasked;
+        }
+
+        // Full resolution detection needs the frame as a Mat, only the detection input is converted
+        frame.toMat(imageMasked);
+        if (!mask.empty()) {
+            maskTiles.apply(imageMasked, mask, imageMasked);
+        }
+        return imageMasked;
+    }
+
+public:
+    StarDetector(int levels = 0) : levels(std::max(levels, 0)) {
+    }
+
+    /**
+     * Sets the foreground mask. The mask is shared and must not be written while it is set.
+     * @param tileSize Edge length of the tiles the mask is classified in, 0 to multiply every pixel with the mask
+     */
+    void setMask(const Mat &mask, int tileSize = MaskTiles::DEFAULT_TILE_SIZE) {
+        this->mask = mask;
+        maskTileSize = tileSize;
+        maskTiles = mask.empty() || tileSize <= 0 ? MaskTiles() : MaskTiles(mask, tileSize);
+        coarseMask.release();
+        coarseMaskTiles = MaskTiles();
+    }
+
+    /**
+     * Sets the hot pixel map of the calibration, see Calibration::getHotPixels. Empty to keep all stars.
+     */
+    void setHotPixels(const Mat &hotPixels) {
+        this->hotPixels = hotPixels;
+        coarseHotPixels.release();
+    }
+
+    int getLevels() {
+        return levels;
+    }
+
+    /**
+     * Changes the number of downsampling levels. Thresholds depend on the levels, the caller keeps one per level.
+     */
+    void setLevels(int levels) {
+        levels = std::max(levels, 0);
+        if (levels == this->levels) {
+            return;
+        }
+        this->levels = levels;
+        coarseMask.release();
+        coarseMaskTiles = MaskTiles();
+        coarseHotPixels.release();
+    }
+
+    /**
+     * Returns the image stars are detected in, downsampled if coarse to fine detection is enabled.
+     * The mask is applied and the hot pixels are cleared at the detection resolution. Valid until the next call.
+     */
+    const Mat &detectionImage(const FrameView &frame) {
+        if (levels == 0) {
+            return clearHotPixels(maskedImage(frame), frame.size());
+        }
+        downsampleForDetection(frame, levels, coarseImage);
+        if (mask.empty()) {
+            clearCoarseHotPixels(coarseImage, frame.size());
+            return coarseImage;
+        }
+        if (coarseMask.size() != coarseImage.size()) {
+            resize(mask, coarseMask, coarseImage.size(), 0, 0, INTER_AREA);
+            if (maskTileSize > 0) {
+                coarseMaskTiles = MaskTiles(coarseMask, std::max(maskTileSize >> levels, 8));
+            }
+        }
+        coarseMaskTiles.apply(coarseImage, coarseMask, coarseMasked);
+        clearCoarseHotPixels(coarseMasked, frame.size());
+        return coarseMasked;
+    }
+
+    /**
+     * Finds a threshold that detects a reasonable number of stars in the image returned by detectionImage.
+     * Returns infinity if no threshold could be found.
+     */
+    float findThreshold(const Mat &detectionInput) {
+        Mat input = detectionInput;
+        return getThreshold(input, levels);
+    }
+
+    /**
+     * Detects the stars of a frame in the image returned by detectionImage.
+     * Returns a suggestion for the threshold of the next frame.
+     */
+    float detect(const Mat &detectionInput, const FrameView &frame, float threshold, vector<Point2i> &stars) {
+        float nextThreshold;
+        if (levels == 0) {
+            nextThreshold = getStarCenters(detectionInput, threshold, threshMat, stars, buffers);
+        } else {
+            nextThreshold = getStarCentersCoarseToFine(detectionInput, frame, levels, threshold, threshMat, stars, buffers);
+        }
+        removeHotPixels(stars);
+        return nextThreshold;
+    }
+};
+
+#endif /* StarDetector_hpp */
@@ -144,7 +144,11 @@ public:
 
     }
 
-    void matchStars(vector<Point2i> &stars, vector<DMatch> &matches, Mat &constellationVis) {
+    /**
+     Matches stars against the stars of the reference image.
+     @param matchedConstellations If set, receives every constellation that was matched, e.g. for visualisation.
+     */
+    void matchStars(vector<Point2i> &stars, vector<DMatch> &matches, vector<Constellation> *matchedConstellations = nullptr) {
         vector<Constellation> constellations;
         std::cout << "Generating consts" << std::endl;
         generateConstellations(stars, constellations, 6);
@@ -163,10 +167,9 @@ public:
             if (dists[0] < constellation.length() * MAX_DISTANCE_THRESHOLD) {
                 matches.push_back(DMatch(baseConstellations[indices[0]].index, constellation.index, dists[0]));
 
-                // Draw the constellation
-                line(constellationVis, constellation.base, constellation.left, Scalar(255, 0, 255), 3);
-                line(constellationVis, constellation.base, constellation.right, Scalar(255, 0, 255), 3);
-                line(constellationVis, constellation.left, constellation.right, Scalar(255, 0, 255), 3);
+                if (matchedConstellations != nullptr) {
+                    matchedConstellations->push_back(constellation);
+                }
             }
 
         }
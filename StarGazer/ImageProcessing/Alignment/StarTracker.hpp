@@ -0,0 +1,138 @@
+//
+//  StarTracker.hpp
+//  StarGazer
+//
+//  Follows the stars of the reference frame from frame to frame, so consecutive frames do not need a full detection.
+//
+
+#ifndef StarTracker_hpp
+#define StarTracker_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "homography.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Re-measures the stars of the reference frame in small windows around their predicted positions.
+ * Positions are predicted with the homography of the last aligned frame, stars only move a few pixels between frames.
+ * Every measured star is matched to its reference star directly, no constellation matching is needed.
+ *
+ * A full detection is requested every detectionInterval frames and whenever too many stars were lost.
+ */
+class StarTracker {
+private:
+    vector<Point2i> referenceStars;
+
+    /**
+     * Maps reference coordinates to the coordinates of the last aligned frame.
+     */
+    Mat referenceToFrame;
+
+    int windowRadius;
+    int detectionInterval;
+    double minTrackedFraction;
+
+    int framesSinceDetection = 0;
+    bool valid = true;
+
+    /**
+     * Foreground mask at full resolution, float or 8 bit fixed point. Shared, never written.
+     */
+    Mat mask;
+
+    vector<Point2f> referencePoints;
+    vector<Point2f> predictedPoints;
+    Mat window;
+
+public:
+    /**
+     * @param referenceStars Stars of the reference frame, the indices are used as queryIdx of the matches
+     * @param windowRadius Radius of the window a star is searched in
+     * @param detectionInterval Number of tracked frames after which a full detection is requested
+     * @param minTrackedFraction Fraction of the predicted stars that have to be found for tracking to succeed
+     */
+    StarTracker(const vector<Point2i> &referenceStars, int windowRadius, int detectionInterval, double minTrackedFraction = 0.5) :
+            referenceStars(referenceStars), windowRadius(std::max(windowRadius, 1)), detectionInterval(std::max(detectionInterval, 1)),
+            minTrackedFraction(minTrackedFraction) {
+        referenceToFrame = Mat::eye(3, 3, CV_64FC1);
+        for (auto &star: referenceStars) {
+            referencePoints.push_back(Point2f(star.x, star.y));
+        }
+    }
+
+    /**
+     * Sets the foreground mask, applied to every window so foreground lights are not taken for stars.
+     * The mask is shared and must not be written while it is set.
+     */
+    void setMask(const Mat &mask) {
+        this->mask = mask;
+    }
+
+    /**
+     * True if the next frame should be tracked instead of running a full detection.
+     */
+    bool isDue() {
+        return valid && framesSinceDetection < detectionInterval;
+    }
+
+    /**
+     * Tracks the reference stars in a new frame.
+     * @param threshold Minimum brightness of a star above the local background
+     * @param stars Receives the measured stars
+     * @param matches Receives a match from every reference star to its measured star
+     * @param minMatches Minimum number of stars that have to be found
+     * @return False if too many stars were lost, a full detection is needed in that case.
+     */
+    bool track(const FrameView &image, float threshold, vector<Point2i> &stars, vector<DMatch> &matches, size_t minMatches) {
+        stars.clear();
+        matches.clear();
+        perspectiveTransform(referencePoints, predictedPoints, referenceToFrame);
+
+        Rect frame(windowRadius, windowRadius, image.size().width - 2 * windowRadius, image.size().height - 2 * windowRadius);
+        int predicted = 0;
+        for (int i = 0; i < predictedPoints.size(); i++) {
+            if (!frame.contains(Point2i(cvRound(predictedPoints[i].x), cvRound(predictedPoints[i].y)))) {
+                continue;
+            }
+            predicted++;
+
+            Point2i center;
+            if (measureStar(image, predictedPoints[i], windowRadius, threshold, center, window, mask)) {
+                matches.push_back(DMatch(i, (int) stars.size(), (float) norm(Point2f(center) - predictedPoints[i])));
+                stars.push_back(center);
+            }
+        }
+
+        std::cout << "Tracked " << stars.size() << " of " << predicted << " stars" << std::endl;
+
+        if (stars.size() < minMatches || stars.size() < predicted * minTrackedFraction) {
+            valid = false;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Updates the prediction with the homography of an aligned frame.
+     * @param h Homography aligning the frame with the reference
+     * @param detected True if the stars of the frame were found by a full detection
+     */
+    void update(const Mat &h, bool detected) {
+        referenceToFrame = h.inv();
+        framesSinceDetection = detected ? 0 : framesSinceDetection + 1;
+        valid = true;
+    }
+
+    /**
+     * Requests a full detection for the next frame, e.g. after a frame could not be aligned.
+     */
+    void invalidate() {
+        valid = false;
+    }
+};
+
+#endif /* StarTracker_hpp */
@@ -52,6 +52,11 @@ const int GAUSSIAN_FILTER_SIZE = 3;
  */
 const int LIGHT_POLLUTION_FILTER_SIZE = 251;
 
+/**
+ * Radius around the brightest pixel used to compute the center of a tracked star.
+ */
+const int STAR_CENTROID_RADIUS = 4;
+
 void createTrackingMask(cv::Mat &segmentation, cv::Mat &mask) {
     mask = segmentation;
 
@@ -184,13 +189,77 @@ void matchStarsSimple(std::vector<cv::Point2i> &points1,
     }
 }
 
+/**
+ Converts an image to grayscale and removes the light pollution, so stars can be thresholded.
+ The result is stored in buffers.gray.
+ @param levels Number of times the image was downsampled by 2, filter sizes are scaled accordingly
+ */
+static void prepareStarImage(const Mat &image, StarDetectionBuffers &buffers, int levels = 0) {
+    cvtColor(image, buffers.gray, cv::COLOR_BGR2GRAY);
+
+    // Blur the image first to be less sensitive to noise
+    GaussianBlur(buffers.gray, buffers.gray, Size(GAUSSIAN_FILTER_SIZE, GAUSSIAN_FILTER_SIZE), 0, 0, BORDER_REPLICATE);
+
+    //Estimate light pollution from image
+    int lightPollutionFilterSize = (LIGHT_POLLUTION_FILTER_SIZE >> levels) | 1;
+    cv::blur(buffers.gray, buffers.lightPollution, Size(lightPollutionFilterSize, lightPollutionFilterSize), cv::Point(-1, -1), BORDER_REPLICATE);
+
+    // Subtract light pollution from image
+    cv::subtract(buffers.gray, buffers.lightPollution, buffers.gray);
+}
+
+/**
+ Thresholds a prepared grayscale image and extracts the centers of all star shaped contours.
+ @param levels Number of times the image was downsampled by 2, area limits are scaled accordingly
+ */
+static void findStarCenters(float threshold, Mat &threshMat, vector <Point2i> &starCenters, StarDetectionBuffers &buffers, int levels = 0) {
+    double areaScale = 1.0 / (1 << (2 * levels));
+    double minArea = MIN_AREA_THRESHOLD * areaScale;
+    double maxArea = MAX_AREA_THRESHOLD * areaScale;
+
+    // Only count stars that fall under the determined threshold
+    cv::threshold(buffers.gray, threshMat, threshold, 255, cv::THRESH_BINARY);
+
+    // Detect contour in the filtered features
+    cv::findContours(threshMat, buffers.contours, buffers.hierarchy, RETR_LIST, CHAIN_APPROX_SIMPLE);
+
+    // Find the center point in every contour
+    for (const vector <Point> &contour: buffers.contours) {
+        if (contour.size() < 2) {
+            continue;
+        }
+
+        // Find the convex hull of the contour to determine contours that are invalid
+        auto area = cv::contourArea(contour);
+        cv::convexHull(contour, buffers.convexHull);
+        auto convexHullArea = cv::contourArea(buffers.convexHull);
+
+        if (convexHullArea == 0) {
+            continue;
+        }
+
+        float ratio = area / convexHullArea;
+
+        // Only select stars over a certain size
+        if (ratio > ROUNDNESS_THRESHOLD && area > minArea && area < maxArea) {
+            Moments moment = cv::moments(contour);
+
+            if (moment.m00 != 0) {
+                int cX = moment.m10 / moment.m00;
+                int cY = moment.m01 / moment.m00;
+                starCenters.emplace_back(Point2i(cX, cY));
+            }
+        }
+    }
+}
+
 /**
  Returns the threshold in the Laplacian of an image under which points are used in the contour detector.
  Aims to get a number of contours(that will later be used as starts) between MIN_NUM_CONTOURS and MAX_NUM_CONTOURS
  
  Returns infinity if no threshold could be found
  */
-float getThreshold(Mat &img) {
+float getThreshold(Mat &img, int levels) {
     /**
      * Only give 100 tries, abort if no threshold could be found
      */
@@ -198,13 +267,19 @@ float getThreshold(Mat &img) {
     
     float currentLower = 0;
     float currentHigher = 255;
+
+    // The prepared image does not depend on the threshold, only compute it once
+    StarDetectionBuffers buffers;
+    prepareStarImage(img, buffers, levels);
+
+    vector <Point2i> stars;
+    Mat contour;
     
     int i = 0;
     while (i++ < 100) {
         // Compute the stars in the current image
-        vector <Point2i> stars;
-        Mat contour;
-        getStarCenters(img, threshold, contour, stars);
+        stars.clear();
+        findStarCenters(threshold, contour, stars, buffers, levels);
 
         std::cout << "Found " << stars.size() << " stars with threshold " << threshold << std::endl;
         
@@ -227,95 +302,170 @@ float getThreshold(Mat &img) {
     return numeric_limits<float>::infinity();
 }
 
+/**
+ Returns the threshold for the next frame based on the number of stars found with the current one.
+ */
+static float adaptThreshold(float threshold, size_t numStars) {
+    // Continously adapt threshold to account for changes in lighting if neccesary.
+    if (numStars > MAX_STARS_ALLOWED) {
+        // To many contours, lower threshold
+        // All values we're interested in are negative -> *1.1 gives a lower value
+        threshold = threshold * 1.01;
+        //std::cout << "Threshold too high, lowering to " << threshold << std::endl;
+    } else if (numStars < MIN_STARS_REQUIRED) {
+        // To little contours, increase threshold
+        threshold = threshold * 0.99;
+        //std::cout << "Threshold too low, raising to " << threshold << std::endl;
+    }
+
+
+    return threshold;
+
+}
+
+float getStarCenters(Mat &image, float threshold, Mat &threshMat, vector <Point2i> &starCenters) {
+    StarDetectionBuffers buffers;
+    return getStarCenters(image, threshold, threshMat, starCenters, buffers);
+}
+
 /**
 Extracts star centers under a athreshold using a lplacian transformation.
 After a Laplacian is applied, the iamge is thesholded and stars are detected using a contour descriptor.
 
  @param threshMat Contains the contours of the stars used to track
+ @param buffers Intermediate images, reused between calls to avoid allocations
  
 Returns a suggestion for a new threshold value. This helps to adapt to changing ligting conditions.
  
  */
-float getStarCenters(Mat &image, float threshold, Mat &threshMat, vector <Point2i> &starCenters) {
-    Mat imGray, lightPollution;
-    cvtColor(image, imGray, cv::COLOR_BGR2GRAY);
-
-    // Blur the image first to be less sensitive to noise
-    GaussianBlur(imGray, imGray, Size(GAUSSIAN_FILTER_SIZE, GAUSSIAN_FILTER_SIZE), 0, 0, BORDER_REPLICATE);
-
-    //Estimate light pollution from image
-    cv::blur(imGray, lightPollution, Size(LIGHT_POLLUTION_FILTER_SIZE, LIGHT_POLLUTION_FILTER_SIZE), cv::Point(-1, -1), BORDER_REPLICATE);
+float getStarCenters(const Mat &image, float threshold, Mat &threshMat, vector <Point2i> &starCenters, StarDetectionBuffers &buffers) {
+    prepareStarImage(image, buffers);
+    findStarCenters(threshold, threshMat, starCenters, buffers);
 
-    // Subtract light pollution from image
-    cv::subtract(imGray, lightPollution, imGray);
+    std::cout << "Detected " << starCenters.size() << " star centers" << std::endl;
 
-    // Detect the stars using a Laplacian
-    //Mat laplacian;
-    //int kernel_size = 3;
-    //int scale = 1;
-    //int delta = 0;
-    //Laplacian(imGray, laplacian, CV_16S, kernel_size, scale, delta, BORDER_REPLICATE);
+    return adaptThreshold(threshold, starCenters.size());
+}
 
-    // detect the stars using canny edge detection
-    Mat edges;
-    Canny(imGray, edges, threshold, threshold * 2, 3, false);
+void downsampleForDetection(const FrameView &image, int levels, Mat &coarse) {
+    double factor = 1.0 / (1 << levels);
+    Size size = image.size();
+    image.downscale(Size(cvRound(size.width * factor), cvRound(size.height * factor)), coarse);
+}
 
-    
-    // Only count stars that fall under the determined threshold
-    cv::threshold(imGray, threshMat, threshold, 255, cv::THRESH_BINARY);
-    threshMat.convertTo(threshMat, CV_8UC1);
+/**
+ Intensity weighted centroid of a grayscale window, only pixels brighter than the background contribute.
+ Returns false if no pixel is brighter than the background.
+ */
+static bool weightedCentroid(const Mat &window, double background, Point2f &centroid) {
+    double sum = 0, sumX = 0, sumY = 0;
+    for (int y = 0; y < window.rows; y++) {
+        const uchar *row = window.ptr<uchar>(y);
+        for (int x = 0; x < window.cols; x++) {
+            double weight = row[x] - background;
+            if (weight > 0) {
+                sum += weight;
+                sumX += weight * x;
+                sumY += weight * y;
+            }
+        }
+    }
 
-    // Detect contour in the filtered features
-    vector <vector<Point>> contours;
-    vector <Vec4i> hierarchy;
-    cv::findContours(threshMat, contours, hierarchy, RETR_LIST, CHAIN_APPROX_SIMPLE);
+    if (sum == 0) {
+        return false;
+    }
+    centroid = Point2f(sumX / sum, sumY / sum);
+    return true;
+}
 
+/**
+ Refines a star center with the intensity weighted centroid of a small window of the full resolution image.
+ Only pixels brighter than the mean of the window contribute.
+ */
+static Point2i refineStarCenter(const FrameView &image, const Point2f &center, int radius, Mat &window) {
+    Point2i fallback(cvRound(center.x), cvRound(center.y));
+    Rect roi(fallback.x - radius, fallback.y - radius, 2 * radius + 1, 2 * radius + 1);
+    roi &= Rect(Point(0, 0), image.size());
+    if (roi.empty()) {
+        return fallback;
+    }
 
-    // Find the center point in every contour
-    for (vector <Point> contour: contours) {
-        if (contour.size() < 2) {
-            continue;
-        }
+    image.gray(roi, window);
+    Point2f centroid;
+    if (!weightedCentroid(window, cv::mean(window)[0], centroid)) {
+        return fallback;
+    }
+    return Point2i(roi.x + cvRound(centroid.x), roi.y + cvRound(centroid.y));
+}
 
-        // Find the convex hull of the contour to determine contours that are invalid
-        auto area = cv::contourArea(contour);
-        std::vector<Point> convexHull;
-        cv::convexHull(contour, convexHull);
-        auto convexHullArea = cv::contourArea(convexHull);
+bool measureStar(const FrameView &image, const Point2f &predicted, int radius, float threshold, Point2i &center, Mat &window,
+                 const Mat &mask) {
+    Point2i origin(cvRound(predicted.x) - radius, cvRound(predicted.y) - radius);
+    Rect roi(origin.x, origin.y, 2 * radius + 1, 2 * radius + 1);
+    if ((roi & Rect(Point(0, 0), image.size())) != roi) {
+        // Only measure stars whose window lies completely inside the frame
+        return false;
+    }
 
-        if (convexHullArea == 0) {
-            continue;
-        }
+    image.gray(roi, window);
+    if (!mask.empty()) {
+        // Foreground lights inside the window are masked out as in a full detection
+        Mat maskWindow;
+        mask(roi).convertTo(maskWindow, CV_32F, mask.depth() == CV_8U ? 1.0 / 255 : 1.0);
+        multiply(window, maskWindow, window, 1, CV_8U);
+    }
+    double background = cv::mean(window)[0];
 
-        float ratio = area / convexHullArea;
+    double peak;
+    Point peakLocation;
+    cv::minMaxLoc(window, nullptr, &peak, nullptr, &peakLocation);
+    if (peak - background < threshold) {
+        return false;
+    }
 
-        // Only select stars over a certain size
-        if (ratio > ROUNDNESS_THRESHOLD && area > MIN_AREA_THRESHOLD && area < MAX_AREA_THRESHOLD) {
-            Moments moment = cv::moments(contour);
+    // A peak on the border of the window most likely belongs to a star that moved out of it or to a neighbour
+    if (peakLocation.x == 0 || peakLocation.y == 0 || peakLocation.x == window.cols - 1 || peakLocation.y == window.rows - 1) {
+        return false;
+    }
 
-            if (moment.m00 != 0) {
-                int cX = moment.m10 / moment.m00;
-                int cY = moment.m01 / moment.m00;
-                starCenters.emplace_back(Point2i(cX, cY));
-            }
-        }
+    // Centroid around the peak, so neighbouring stars inside the window do not pull the center
+    int peakRadius = std::min(STAR_CENTROID_RADIUS, radius);
+    Rect peakRoi = Rect(peakLocation.x - peakRadius, peakLocation.y - peakRadius, 2 * peakRadius + 1, 2 * peakRadius + 1)
+                   & Rect(0, 0, window.cols, window.rows);
+    Point2f centroid;
+    if (!weightedCentroid(window(peakRoi), background, centroid)) {
+        return false;
     }
+    center = Point2i(roi.x + peakRoi.x + cvRound(centroid.x), roi.y + peakRoi.y + cvRound(centroid.y));
+    return true;
+}
 
-    std::cout << "Detected " << starCenters.size() << " star centers" << std::endl;
+/**
+ Coarse to fine star detection.
+ Candidates are detected in the downsampled image, their centers are refined in small windows of the full resolution
+ image. Apart from downsampling, the cost depends on the number of stars rather than the number of pixels.
 
-    // Continously adapt threshold to account for changes in lighting if neccesary.
-    if (starCenters.size() > MAX_STARS_ALLOWED) {
-        // To many contours, lower threshold
-        // All values we're interested in are negative -> *1.1 gives a lower value
-        threshold = threshold * 1.01;
-        //std::cout << "Threshold too high, lowering to " << threshold << std::endl;
-    } else if (starCenters.size() < MIN_STARS_REQUIRED) {
-        // To little contours, increase threshold
-        threshold = threshold * 0.99;
-        //std::cout << "Threshold too low, raising to " << threshold << std::endl;
-    }
+ @param coarseImage fullImage downsampled with downsampleForDetection, optionally masked
+ @param threshMat Contains the contours of the stars at the downsampled resolution
 
+ Returns a suggestion for a new threshold value.
+ */
+float getStarCentersCoarseToFine(const Mat &coarseImage, const FrameView &fullImage, int levels, float threshold, Mat &threshMat,
+                                 vector <Point2i> &starCenters, StarDetectionBuffers &buffers) {
+    prepareStarImage(coarseImage, buffers, levels);
+
+    buffers.candidates.clear();
+    findStarCenters(threshold, threshMat, buffers.candidates, buffers, levels);
+
+    int factor = 1 << levels;
+    int radius = 2 * factor + 2;
+    for (auto &candidate: buffers.candidates) {
+        // Center of the coarse pixel in full resolution coordinates
+        Point2f center((candidate.x + 0.5f) * factor - 0.5f, (candidate.y + 0.5f) * factor - 0.5f);
+        starCenters.push_back(refineStarCenter(fullImage, center, radius, buffers.window));
+    }
 
-    return threshold;
+    std::cout << "Detected " << starCenters.size() << " star centers (coarse to fine)" << std::endl;
 
+    return adaptThreshold(threshold, starCenters.size());
 }
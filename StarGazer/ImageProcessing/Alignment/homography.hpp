@@ -10,16 +10,56 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "FrameView.hpp"
+
 bool combine(cv::Mat &imageBase, cv::Mat &imageNew, cv::Mat &movement, std::size_t numImages, cv::Mat &result);
 
 void createTrackingMask(cv::Mat &segmentation, cv::Mat &mask);
 
 bool alignImages(cv::Mat &im1, cv::Mat &movement, cv::Mat &im2, cv::Mat &im1Reg, cv::Mat &h);
 
-float getThreshold(cv::Mat &img_grayscale);
+/**
+ * Intermediate images and contours of the star detection.
+ * Reusing them between frames avoids allocating full size images for every frame.
+ */
+struct StarDetectionBuffers {
+    cv::Mat gray;
+    cv::Mat lightPollution;
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<cv::Vec4i> hierarchy;
+    std::vector<cv::Point> convexHull;
+    std::vector<cv::Point2i> candidates;
+    cv::Mat window;
+};
+
+/**
+ * Finds a threshold that detects a reasonable number of stars.
+ * @param levels If > 0, img was downsampled with downsampleForDetection and the threshold is used for coarse to fine detection.
+ */
+float getThreshold(cv::Mat &img_grayscale, int levels = 0);
 
 float getStarCenters(cv::Mat &image, float threshold, cv::Mat &threshMat, std::vector<cv::Point2i> &starCenters);
 
+float getStarCenters(const cv::Mat &image, float threshold, cv::Mat &threshMat, std::vector<cv::Point2i> &starCenters, StarDetectionBuffers &buffers);
+
+/**
+ * Downsamples an image by 2^levels for coarse to fine star detection.
+ */
+void downsampleForDetection(const FrameView &image, int levels, cv::Mat &coarse);
+
+float getStarCentersCoarseToFine(const cv::Mat &coarseImage, const FrameView &fullImage, int levels, float threshold, cv::Mat &threshMat,
+                                 std::vector<cv::Point2i> &starCenters, StarDetectionBuffers &buffers);
+
+/**
+ * Measures a single star inside a window around its predicted position.
+ * @param threshold Minimum brightness of the star above the background of the window
+ * @param window Grayscale copy of the window, reused between calls
+ * @param mask Foreground mask of the frame, float or 8 bit fixed point, applied to the window. Empty for no mask.
+ * @return False if no star was found in the window.
+ */
+bool measureStar(const FrameView &image, const cv::Point2f &predicted, int radius, float threshold, cv::Point2i &center, cv::Mat &window,
+                 const cv::Mat &mask = cv::Mat());
+
 /**
  * Match stars based on KD_Tree KNN search. Recommended for large number of stars.
  * @param points1
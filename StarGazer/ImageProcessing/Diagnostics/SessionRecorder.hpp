@@ -0,0 +1,377 @@
+//
+//  SessionRecorder.hpp
+//  StarGazer
+//
+//  Records every frame fed to the ImageMerger together with the decisions taken while merging it.
+//  Recorded sessions can be replayed deterministically with Tools/replay_session.cpp.
+//
+
+#ifndef SessionRecorder_hpp
+#define SessionRecorder_hpp
+
+#include <stdio.h>
+#include <string.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <chrono>
+
+#include "SaveBinaryCV.hpp"
+#include "AdaptiveQuality.hpp"
+#include "FrameQuality.hpp"
+
+#define SESSION_FILENAME "/session.stargazer-rec"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Magic number and version at the start of every recorded session.
+ */
+const int SESSION_MAGIC = 0x53475243;
+const int SESSION_VERSION = 2;
+
+/**
+ Outcome of merging a single frame.
+ */
+enum class FrameDecision : int {
+    Accepted = 0,
+    Reference = 1,
+    NotEnoughStars = 2,
+    NotEnoughMatches = 3,
+    NoHomography = 4,
+    InvalidScale = 5,
+    LowQuality = 6,
+};
+
+inline const char *frameDecisionName(FrameDecision decision) {
+    switch (decision) {
+        case FrameDecision::Accepted: return "accepted";
+        case FrameDecision::Reference: return "reference";
+        case FrameDecision::NotEnoughStars: return "not enough stars";
+        case FrameDecision::NotEnoughMatches: return "not enough matches";
+        case FrameDecision::NoHomography: return "no homography";
+        case FrameDecision::InvalidScale: return "invalid scale";
+        case FrameDecision::LowQuality: return "low quality";
+    }
+    return "unknown";
+}
+
+/**
+ Wall clock time in milliseconds spent in every stage of merging a single frame.
+ */
+struct StageTimings {
+    double masking = 0;
+    double detection = 0;
+    double matching = 0;
+    double homography = 0;
+    double warping = 0;
+    double accumulation = 0;
+    double preview = 0;
+
+    double total() const {
+        return masking + detection + matching + homography + warping + accumulation + preview;
+    }
+};
+
+/**
+ Measures consecutive stages of a frame.
+ */
+class StageTimer {
+private:
+    chrono::steady_clock::time_point start;
+
+public:
+    StageTimer() : start(chrono::steady_clock::now()) {
+    }
+
+    /**
+     Returns the milliseconds passed since the last lap and starts a new lap.
+     */
+    double lap() {
+        auto now = chrono::steady_clock::now();
+        double elapsed = chrono::duration<double, milli>(now - start).count();
+        start = now;
+        return elapsed;
+    }
+};
+
+/**
+ Everything the merger decided about a single frame.
+ */
+struct FrameRecord {
+    int index = 0;
+
+    /**
+     Threshold the stars of this frame were detected with.
+     */
+    float threshold = 0;
+
+    vector<Point2i> stars;
+    vector<DMatch> matches;
+    Mat homography;
+
+    FrameDecision decision = FrameDecision::Accepted;
+    StageTimings timings;
+
+    /**
+     Settings the frame was merged with, adaptive quality picks them from the timing of the device.
+     */
+    QualitySettings quality;
+};
+
+/**
+ Settings of the merger that change its decisions, recorded once per session so a replay decides alike.
+ */
+struct SessionSettings {
+    int detectionLevels = 0;
+    int trackingInterval = 0;
+    int trackingWindowRadius = 12;
+    int maskTileSize = 0;
+    bool screenQuality = false;
+    QualityLimits qualityLimits;
+    bool weightFrames = false;
+    bool adaptiveQuality = false;
+    double frameInterval = 0;
+    float drizzleScale = 0;
+    float drizzleDropSize = 1;
+    int meshCells = 0;
+    bool mosaic = false;
+
+    /**
+     Hot pixel map of the calibration frames, empty without calibration.
+     */
+    Mat hotPixels;
+};
+
+inline void writeSessionSettings(std::ofstream &ofs, const SessionSettings &settings) {
+    int flags = (settings.screenQuality ? 1 : 0) | (settings.weightFrames ? 2 : 0)
+                | (settings.adaptiveQuality ? 4 : 0) | (settings.mosaic ? 8 : 0);
+    ofs.write((const char *) &settings.detectionLevels, sizeof(int));
+    ofs.write((const char *) &settings.trackingInterval, sizeof(int));
+    ofs.write((const char *) &settings.trackingWindowRadius, sizeof(int));
+    ofs.write((const char *) &settings.maskTileSize, sizeof(int));
+    ofs.write((const char *) &settings.meshCells, sizeof(int));
+    ofs.write((const char *) &flags, sizeof(int));
+    ofs.write((const char *) &settings.qualityLimits.thumbnailSize, sizeof(int));
+    ofs.write((const char *) &settings.qualityLimits.minStarFraction, sizeof(float));
+    ofs.write((const char *) &settings.qualityLimits.minSharpnessFraction, sizeof(float));
+    ofs.write((const char *) &settings.qualityLimits.maxBrightnessJump, sizeof(float));
+    ofs.write((const char *) &settings.frameInterval, sizeof(double));
+    ofs.write((const char *) &settings.drizzleScale, sizeof(float));
+    ofs.write((const char *) &settings.drizzleDropSize, sizeof(float));
+    writeMatBinary(ofs, settings.hotPixels);
+}
+
+inline bool readSessionSettings(std::ifstream &ifs, SessionSettings &settings) {
+    int flags = 0;
+    ifs.read((char *) &settings.detectionLevels, sizeof(int));
+    ifs.read((char *) &settings.trackingInterval, sizeof(int));
+    ifs.read((char *) &settings.trackingWindowRadius, sizeof(int));
+    ifs.read((char *) &settings.maskTileSize, sizeof(int));
+    ifs.read((char *) &settings.meshCells, sizeof(int));
+    ifs.read((char *) &flags, sizeof(int));
+    ifs.read((char *) &settings.qualityLimits.thumbnailSize, sizeof(int));
+    ifs.read((char *) &settings.qualityLimits.minStarFraction, sizeof(float));
+    ifs.read((char *) &settings.qualityLimits.minSharpnessFraction, sizeof(float));
+    ifs.read((char *) &settings.qualityLimits.maxBrightnessJump, sizeof(float));
+    ifs.read((char *) &settings.frameInterval, sizeof(double));
+    ifs.read((char *) &settings.drizzleScale, sizeof(float));
+    ifs.read((char *) &settings.drizzleDropSize, sizeof(float));
+    settings.screenQuality = flags & 1;
+    settings.weightFrames = flags & 2;
+    settings.adaptiveQuality = flags & 4;
+    settings.mosaic = flags & 8;
+    settings.hotPixels.release();
+    readMatBinary(ifs, settings.hotPixels);
+    return ifs.good();
+}
+
+/**
+ Seeds every random generator used during alignment, so merging a frame is reproducible.
+ findHomography uses a fixed seed internally, the FLANN trees use the global C generator.
+ */
+inline void seedFrameRandomGenerators(int frameIndex) {
+    cv::setRNGSeed(frameIndex + 1);
+    cvflann::seed_random(frameIndex + 1);
+}
+
+/**
+ Receives every frame and decision of an ImageMerger.
+ */
+class MergeObserver {
+public:
+    virtual ~MergeObserver() {
+    }
+
+    /**
+     Called once with the settings of the merger, before the reference frame.
+     */
+    virtual void sessionStarted(const SessionSettings &settings) {
+    }
+
+    /**
+     Called before a frame is processed. The reference frame has index 0 and carries the segmentation.
+     */
+    virtual void frameStarted(int index, const Mat &image, const Mat &segmentation) {
+    }
+
+    /**
+     Called once the merger has decided about a frame.
+     */
+    virtual void frameFinished(const FrameRecord &record) {
+    }
+};
+
+inline void writeFrameRecord(std::ofstream &ofs, const FrameRecord &record) {
+    int decision = (int) record.decision;
+    int quality[] = {record.quality.detectionLevels, record.quality.ransacIterations, record.quality.similarity,
+                     record.quality.refreshPreview};
+    ofs.write((const char *) &record.threshold, sizeof(float));
+    ofs.write((const char *) &decision, sizeof(int));
+
+    writeMatBinary(ofs, Mat(record.stars));
+
+    int numMatches = (int) record.matches.size();
+    ofs.write((const char *) &numMatches, sizeof(int));
+    for (auto &match: record.matches) {
+        ofs.write((const char *) &match.queryIdx, sizeof(int));
+        ofs.write((const char *) &match.trainIdx, sizeof(int));
+        ofs.write((const char *) &match.distance, sizeof(float));
+    }
+
+    writeMatBinary(ofs, record.homography);
+    ofs.write((const char *) &record.timings, sizeof(StageTimings));
+    ofs.write((const char *) quality, sizeof(quality));
+}
+
+inline bool readFrameRecord(std::ifstream &ifs, FrameRecord &record) {
+    int decision;
+    ifs.read((char *) &record.threshold, sizeof(float));
+    ifs.read((char *) &decision, sizeof(int));
+    record.decision = (FrameDecision) decision;
+
+    Mat stars;
+    readMatBinary(ifs, stars);
+    record.stars.clear();
+    if (!stars.empty()) {
+        record.stars.assign(stars.begin<Point2i>(), stars.end<Point2i>());
+    }
+
+    int numMatches = 0;
+    ifs.read((char *) &numMatches, sizeof(int));
+    record.matches.resize(std::max(numMatches, 0));
+    for (auto &match: record.matches) {
+        ifs.read((char *) &match.queryIdx, sizeof(int));
+        ifs.read((char *) &match.trainIdx, sizeof(int));
+        ifs.read((char *) &match.distance, sizeof(float));
+    }
+
+    record.homography.release();
+    readMatBinary(ifs, record.homography);
+    ifs.read((char *) &record.timings, sizeof(StageTimings));
+
+    int quality[4] = {0};
+    ifs.read((char *) quality, sizeof(quality));
+    record.quality.detectionLevels = quality[0];
+    record.quality.ransacIterations = quality[1];
+    record.quality.similarity = quality[2] != 0;
+    record.quality.refreshPreview = quality[3] != 0;
+
+    return ifs.good();
+}
+
+/**
+ Writes all frames and decisions of a session to a single file in the given directory.
+ Frames are written as they arrive, a session that was interrupted can still be replayed up to the last full frame.
+ */
+class SessionRecorder : public MergeObserver {
+private:
+    std::ofstream ofs;
+
+public:
+    SessionRecorder(string directory) : ofs(directory + SESSION_FILENAME, std::ios::binary) {
+        if (!ofs.is_open()) {
+            std::cout << "Could not open session recording in " << directory << std::endl;
+            return;
+        }
+        ofs.write((const char *) &SESSION_MAGIC, sizeof(int));
+        ofs.write((const char *) &SESSION_VERSION, sizeof(int));
+    }
+
+    void sessionStarted(const SessionSettings &settings) override {
+        if (!ofs.is_open()) {
+            return;
+        }
+        writeSessionSettings(ofs, settings);
+    }
+
+    void frameStarted(int index, const Mat &image, const Mat &segmentation) override {
+        if (!ofs.is_open()) {
+            return;
+        }
+        ofs.write((const char *) &index, sizeof(int));
+        writeMatBinary(ofs, image.isContinuous() ? image : image.clone());
+        writeMatBinary(ofs, segmentation.empty() || segmentation.isContinuous() ? segmentation : segmentation.clone());
+    }
+
+    void frameFinished(const FrameRecord &record) override {
+        if (!ofs.is_open()) {
+            return;
+        }
+        writeFrameRecord(ofs, record);
+        ofs.flush();
+    }
+};
+
+/**
+ Reads a session written by the SessionRecorder frame by frame.
+ Sessions of older versions are rejected, they lack the settings a replay needs.
+ */
+class SessionReader {
+private:
+    std::ifstream ifs;
+    SessionSettings settings;
+
+public:
+    SessionReader(string directory) : ifs(directory + SESSION_FILENAME, std::ios::binary) {
+        int magic = 0, version = 0;
+        ifs.read((char *) &magic, sizeof(int));
+        ifs.read((char *) &version, sizeof(int));
+        if (!ifs.good() || magic != SESSION_MAGIC || version != SESSION_VERSION || !readSessionSettings(ifs, settings)) {
+            ifs.setstate(std::ios::failbit);
+        }
+    }
+
+    bool isOpen() {
+        return ifs.good();
+    }
+
+    /**
+     Settings of the merger the session was recorded with.
+     */
+    const SessionSettings &getSettings() {
+        return settings;
+    }
+
+    /**
+     Reads the next frame with its recorded decision.
+     Returns false at the end of the session or if the last frame was only partially written.
+     */
+    bool next(Mat &image, Mat &segmentation, FrameRecord &record) {
+        int index;
+        ifs.read((char *) &index, sizeof(int));
+        if (!ifs.good()) {
+            return false;
+        }
+
+        image.release();
+        segmentation.release();
+        readMatBinary(ifs, image);
+        readMatBinary(ifs, segmentation);
+
+        record.index = index;
+        return readFrameRecord(ifs, record);
+    }
+};
+
+#endif /* SessionRecorder_hpp */
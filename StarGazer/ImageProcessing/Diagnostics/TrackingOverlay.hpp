@@ -0,0 +1,78 @@
+//
+//  TrackingOverlay.hpp
+//  StarGazer
+//
+//  Vector description of the tracking state of the last merged frame, drawn onto previews on request.
+//
+
+#ifndef TrackingOverlay_hpp
+#define TrackingOverlay_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "StarMatcher.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Stars, matched constellations and homography inliers of a frame, in frame coordinates.
+ * Only rasterised when drawn, at the resolution of the image it is drawn onto.
+ */
+struct TrackingOverlay {
+    /**
+     * Size of the frame the coordinates refer to.
+     */
+    Size frameSize;
+
+    vector<Point2i> stars;
+
+    /**
+     * Constellations of the frame that matched a constellation of the reference frame.
+     */
+    vector<Constellation> triangles;
+
+    /**
+     * Stars that agree with the homography found for the frame.
+     */
+    vector<Point2i> inliers;
+
+    bool empty() const {
+        return stars.empty();
+    }
+
+    void clear() {
+        stars.clear();
+        triangles.clear();
+        inliers.clear();
+    }
+
+    /**
+     * Draws the overlay onto an RGB image of any size.
+     */
+    void draw(Mat &image) const {
+        if (frameSize.width == 0 || frameSize.height == 0) {
+            return;
+        }
+        double scaleX = (double) image.cols / frameSize.width;
+        double scaleY = (double) image.rows / frameSize.height;
+        auto scaled = [&](const Point2i &point) {
+            return Point(cvRound(point.x * scaleX), cvRound(point.y * scaleY));
+        };
+
+        for (auto &triangle: triangles) {
+            line(image, scaled(triangle.base), scaled(triangle.left), Scalar(0, 255, 255), 1, LINE_AA);
+            line(image, scaled(triangle.base), scaled(triangle.right), Scalar(0, 255, 255), 1, LINE_AA);
+            line(image, scaled(triangle.left), scaled(triangle.right), Scalar(0, 255, 255), 1, LINE_AA);
+        }
+        for (auto &star: stars) {
+            circle(image, scaled(star), 3, Scalar(255, 0, 0), 1, LINE_AA);
+        }
+        for (auto &inlier: inliers) {
+            circle(image, scaled(inlier), 5, Scalar(0, 255, 0), 1, LINE_AA);
+        }
+    }
+};
+
+#endif /* TrackingOverlay_hpp */
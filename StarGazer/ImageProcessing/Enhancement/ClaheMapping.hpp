@@ -0,0 +1,182 @@
+//
+//  ClaheMapping.hpp
+//  StarGazer
+//
+//  The local histogram equalisation of equalizeIntensity as a fixed mapping, built once for the whole image and
+//  applied tile by tile, so tiled outputs match across tile borders.
+//
+
+#ifndef ClaheMapping_hpp
+#define ClaheMapping_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "TaskScheduler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Contrast limited adaptive histogram equalisation of the luminance, as applied by equalizeIntensity.
+ * The image is split into a grid of cells and every cell gets its clipped, equalised lookup table. A pixel is mapped
+ * by the tables of the 4 closest cells, interpolated bilinearly, exactly as CLAHE does.
+ *
+ * The tables are built from a downscaled copy of the whole image. The clip limit is relative to the average height
+ * of a histogram and the histograms are kept as fractions, so the tables do not depend on the scale of the copy.
+ * Any tile of the full size image can then be mapped on its own, without seeing the rest of the image.
+ */
+class ClaheMapping {
+private:
+    Size fullSize;
+    Size grid;
+    double clipLimit;
+    int bins = 0;
+
+    /**
+     * One table of bins entries for every cell, cells in row major order.
+     */
+    vector<ushort> tables;
+
+    /**
+     * Clips and equalises the histogram of a cell into its table.
+     */
+    void equalise(vector<float> &histogram, double total, ushort *table) {
+        float limit = (float) (clipLimit * total / bins);
+        float clipped = 0;
+        for (auto &count: histogram) {
+            if (count > limit) {
+                clipped += count - limit;
+                count = limit;
+            }
+        }
+        // The clipped counts are spread evenly over all bins
+        float redistributed = clipped / bins;
+        double sum = 0;
+        double scale = (bins - 1) / total;
+        for (int i = 0; i < bins; i++) {
+            sum += histogram[i] + redistributed;
+            table[i] = saturate_cast<ushort>(std::min(sum * scale, (double) bins - 1));
+        }
+    }
+
+    template<typename T>
+    void mapRows(const Mat &ycrcb, Point origin, Mat &mapped, const Range &rows) const {
+        double cellWidth = (double) fullSize.width / grid.width;
+        double cellHeight = (double) fullSize.height / grid.height;
+        for (int y = rows.start; y < rows.end; y++) {
+            float fy = (float) ((origin.y + y) / cellHeight - 0.5);
+            int y0 = cvFloor(fy), y1 = y0 + 1;
+            float wy = fy - y0;
+            y0 = std::max(y0, 0);
+            y1 = std::min(y1, grid.height - 1);
+
+            const T *row = ycrcb.ptr<T>(y);
+            T *out = mapped.ptr<T>(y);
+            for (int x = 0; x < ycrcb.cols; x++) {
+                float fx = (float) ((origin.x + x) / cellWidth - 0.5);
+                int x0 = cvFloor(fx), x1 = x0 + 1;
+                float wx = fx - x0;
+                x0 = std::max(x0, 0);
+                x1 = std::min(x1, grid.width - 1);
+
+                int value = row[x * 3];
+                const ushort *topLeft = tables.data() + (size_t) (y0 * grid.width + x0) * bins;
+                const ushort *topRight = tables.data() + (size_t) (y0 * grid.width + x1) * bins;
+                const ushort *bottomLeft = tables.data() + (size_t) (y1 * grid.width + x0) * bins;
+                const ushort *bottomRight = tables.data() + (size_t) (y1 * grid.width + x1) * bins;
+                float top = topLeft[value] * (1 - wx) + topRight[value] * wx;
+                float bottom = bottomLeft[value] * (1 - wx) + bottomRight[value] * wx;
+                out[x * 3] = saturate_cast<T>(top * (1 - wy) + bottom * wy);
+                out[x * 3 + 1] = row[x * 3 + 1];
+                out[x * 3 + 2] = row[x * 3 + 2];
+            }
+        }
+    }
+
+public:
+    /**
+     * Longest side of the copy the tables are built from, larger images are downscaled first.
+     */
+    static const int SAMPLE_DIMENSION = 2048;
+
+    ClaheMapping() : clipLimit(0) {
+    }
+
+    /**
+     * @param fullSize Size of the image the tiles are taken from
+     * @param clipLimit Clip limit of the histograms, as for cv::CLAHE
+     * @param grid Number of cells, as for cv::CLAHE
+     */
+    ClaheMapping(Size fullSize, double clipLimit = 1.5, Size grid = Size(8, 8)) :
+            fullSize(fullSize), grid(grid), clipLimit(clipLimit) {
+    }
+
+    bool empty() const {
+        return tables.empty();
+    }
+
+    /**
+     * Builds the tables from the whole image, RGB in 8 or 16 bit. The image may be downscaled from the full size,
+     * the tiles mapped later need the same depth.
+     */
+    void build(const Mat &image) {
+        CV_Assert(image.type() == CV_8UC3 || image.type() == CV_16UC3);
+        Mat sample = image;
+        double factor = (double) SAMPLE_DIMENSION / std::max(image.cols, image.rows);
+        if (factor < 1) {
+            resize(image, sample, Size(), factor, factor, INTER_AREA);
+        }
+        Mat ycrcb, luminance;
+        cvtColor(sample, ycrcb, COLOR_RGB2YCrCb);
+        extractChannel(ycrcb, luminance, 0);
+
+        bins = image.depth() == CV_16U ? 65536 : 256;
+        tables.assign((size_t) grid.area() * bins, 0);
+        parallelFor(Range(0, grid.area()), [&](const Range &range) {
+            vector<float> histogram(bins);
+            for (int cell = range.start; cell < range.end; cell++) {
+                int cellX = cell % grid.width, cellY = cell / grid.width;
+                Rect rect(Point(cellX * luminance.cols / grid.width, cellY * luminance.rows / grid.height),
+                          Point((cellX + 1) * luminance.cols / grid.width, (cellY + 1) * luminance.rows / grid.height));
+                ushort *table = tables.data() + (size_t) cell * bins;
+                if (rect.empty()) {
+                    // A sample smaller than the grid leaves the cell unchanged
+                    for (int i = 0; i < bins; i++) {
+                        table[i] = (ushort) i;
+                    }
+                    continue;
+                }
+
+                std::fill(histogram.begin(), histogram.end(), 0.0f);
+                for (int y = rect.y; y < rect.br().y; y++) {
+                    for (int x = rect.x; x < rect.br().x; x++) {
+                        int value = bins == 256 ? luminance.at<uchar>(y, x) : luminance.at<ushort>(y, x);
+                        histogram[value]++;
+                    }
+                }
+                equalise(histogram, rect.area(), table);
+            }
+        }, grid.area());
+    }
+
+    /**
+     * Equalises a tile of the full size image, RGB of the depth the tables were built from.
+     * @param origin Position of the tile in the full size image
+     */
+    void apply(const Mat &tile, Point origin, Mat &out) const {
+        CV_Assert(!empty() && tile.depth() == (bins == 256 ? CV_8U : CV_16U));
+        Mat ycrcb, mapped(tile.size(), tile.type());
+        cvtColor(tile, ycrcb, COLOR_RGB2YCrCb);
+        parallelFor(Range(0, tile.rows), [&](const Range &rows) {
+            if (bins == 256) {
+                mapRows<uchar>(ycrcb, origin, mapped, rows);
+            } else {
+                mapRows<ushort>(ycrcb, origin, mapped, rows);
+            }
+        });
+        cvtColor(mapped, out, COLOR_YCrCb2RGB);
+    }
+};
+
+#endif /* ClaheMapping_hpp */
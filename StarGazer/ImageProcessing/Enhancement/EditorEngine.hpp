@@ -0,0 +1,356 @@
+//
+//  EditorEngine.hpp
+//  StarGazer
+//
+//  Renders the edited image of a stack. The parameters of an edit are passed explicitly and the engine is immutable
+//  after construction, so one engine can render many presets at once, and many engines can run side by side.
+//
+
+#ifndef EditorEngine_hpp
+#define EditorEngine_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "enhance.hpp"
+#include "blend.hpp"
+#include "MappedCheckpoint.hpp"
+#include "TiledImageWriter.hpp"
+#include "TaskScheduler.hpp"
+#include "ClaheMapping.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Parameters of an edit, in the units of the filters. The setters take the values of the sliders in range [0, 1].
+ */
+struct EditParameters {
+    double starPop = 0;
+    double lightPol = 0;
+    double color = 1;
+    double saturation = 1;
+    double brightness = 1;
+
+    /**
+     Set a starPop value in range [0, 1]
+     */
+    void setStarPop(double factor) {
+        starPop = factor;
+    }
+
+    /**
+     Set a light pollution reduction in range [0, 1]
+     */
+    void setLightPolReduction(double factor) {
+        lightPol = factor;
+    }
+
+    /**
+     Set a color correction level, converted to range [0.75, 1.25]
+     */
+    void setColor(double factor) {
+        color = (factor * 0.5) + 0.75;
+    }
+
+    /**
+     Set a saturation level, converted to range [0.5, 1.5]
+     */
+    void setSaturation(double factor) {
+        saturation = factor + 0.5;
+    }
+
+    /**
+     Set a brightness value, converted to range [0, 2]
+     */
+    void setBrightness(double factor) {
+        brightness = (factor * 2);
+    }
+};
+
+/**
+ Renders a checkpoint with the edit filters: previews on a downscaled copy held by the engine, full resolution images
+ and exports from the mapped checkpoint.
+ All rendering methods are const and keep their buffers on the stack, so they can be called from any number of
+ threads at once.
+ */
+class EditorEngine {
+private:
+    /**
+     Previews are rendered at 1 / PREVIEW_SCALE of the size of the stack.
+     */
+    static const int PREVIEW_SCALE = 3;
+
+    /**
+     Edge length of the tiles of exported images.
+     */
+    static const int EXPORT_TILE_SIZE = 512;
+
+    /**
+     Margin rendered around every exported tile and cropped afterwards. Covers the radius of the light pollution blur,
+     the local histogram equalisation of exported tiles uses a mapping of the whole image instead.
+     */
+    static const int EXPORT_TILE_MARGIN = 100;
+
+    MappedCheckpoint checkpoint;
+    int numImages;
+    double weightSum;
+
+    Mat previewCombined;
+    Mat previewMaxed;
+    Mat previewStacked;
+    Mat previewMask;
+
+    /**
+     Reads an area of the checkpoint as float averages, with a mask of ones if the stack has no foreground.
+     */
+    void readPlanes(const Rect &rect, Mat &combined, Mat &maxed, Mat &stacked, Mat &mask) const {
+        checkpoint.getCombined()(rect).convertTo(combined, CV_32F, 1.0 / weightSum);
+        checkpoint.getMaxed()(rect).convertTo(maxed, CV_32F);
+        checkpoint.getStacked()(rect).convertTo(stacked, CV_32F, 1.0 / numImages);
+
+        const Mat &storedMask = checkpoint.getMask();
+        if (storedMask.empty()) {
+            mask = Mat::ones(rect.size(), CV_32F);
+        } else {
+            storedMask(rect).convertTo(mask, CV_32F, storedMask.depth() == CV_8U ? 1.0 / 255 : 1.0);
+        }
+    }
+
+    /**
+     Downscales a plane of the checkpoint by PREVIEW_SCALE and converts only the downscaled plane to float.
+     OpenCV cannot resize 32 bit integer sums, those are converted in strips of rows instead of as a whole.
+     */
+    static void downscalePlane(const Mat &plane, Size previewSize, double scale, Mat &preview) {
+        // Cropped to a multiple of the scale, so every preview pixel averages the same block as in a single resize
+        Mat cropped = plane(Rect(0, 0, previewSize.width * PREVIEW_SCALE, previewSize.height * PREVIEW_SCALE));
+        if (plane.depth() != CV_32S) {
+            Mat reduced;
+            resize(cropped, reduced, previewSize, 0, 0, INTER_AREA);
+            reduced.convertTo(preview, CV_32F, scale);
+            return;
+        }
+
+        const int stripRows = 64;
+        preview.create(previewSize, CV_MAKETYPE(CV_32F, plane.channels()));
+        Mat strip;
+        for (int y = 0; y < previewSize.height; y += stripRows) {
+            int rows = std::min(stripRows, previewSize.height - y);
+            cropped.rowRange(y * PREVIEW_SCALE, (y + rows) * PREVIEW_SCALE).convertTo(strip, CV_32F, scale);
+            Mat previewRows = preview.rowRange(y, y + rows);
+            resize(strip, previewRows, previewRows.size(), 0, 0, INTER_AREA);
+        }
+    }
+
+public:
+    /**
+     @param path Path of the checkpoint file
+     */
+    EditorEngine(const string &path, int numImages) : checkpoint(path), numImages(numImages) {
+        weightSum = checkpoint.getWeightSum(numImages);
+        if (!checkpoint.isOpen()) {
+            return;
+        }
+        Size previewSize(checkpoint.size().width / PREVIEW_SCALE, checkpoint.size().height / PREVIEW_SCALE);
+        downscalePlane(checkpoint.getCombined(), previewSize, 1.0 / weightSum, previewCombined);
+        downscalePlane(checkpoint.getMaxed(), previewSize, 1, previewMaxed);
+        downscalePlane(checkpoint.getStacked(), previewSize, 1.0 / numImages, previewStacked);
+
+        const Mat &storedMask = checkpoint.getMask();
+        if (storedMask.empty()) {
+            previewMask = Mat::ones(previewSize, CV_32F);
+        } else {
+            downscalePlane(storedMask, previewSize, storedMask.depth() == CV_8U ? 1.0 / 255 : 1.0, previewMask);
+        }
+    }
+
+    EditorEngine(const EditorEngine &) = delete;
+    EditorEngine &operator=(const EditorEngine &) = delete;
+
+    bool empty() const {
+        return !checkpoint.isOpen();
+    }
+
+    Size size() const {
+        return checkpoint.size();
+    }
+
+    /**
+     Applies the filters that precede the equalisation, in 16 bit.
+     */
+    static void applyColorFilters16bit(const EditParameters &parameters, const Mat &imageCombined,
+                                       const Mat &imageMaxed, Mat &result) {
+        // Apply starPop
+        addWeighted(imageCombined, 1 - parameters.starPop, imageMaxed, parameters.starPop, 0, result, CV_32F);
+
+        adaptStarColor(result, result, parameters.color, parameters.saturation, parameters.brightness);
+
+        result *= 256;
+        result.convertTo(result, CV_16U);
+    }
+
+    /**
+     Applies the filters in 16 bit. The inputs are float averages in 8 bit scale and not modified.
+     @param equalisation Mapping of the whole image the equalisation uses, see createEqualisation. nullptr equalises
+                         the inputs on their own, only right if they are the whole image.
+     @param origin Position of the inputs in the image, for the mapping
+     */
+    static void applyFilters16bit(const EditParameters &parameters, const Mat &imageCombined, const Mat &imageMaxed,
+                                  const Mat &foreground, const Mat &mask, Mat &result, bool reduceNoise = false,
+                                  const ClaheMapping *equalisation = nullptr, Point origin = Point()) {
+        applyColorFilters16bit(parameters, imageCombined, imageMaxed, result);
+
+        if (equalisation != nullptr) {
+            equalisation->apply(result, origin, result);
+        } else {
+            equalizeIntensity(result, result);
+        }
+
+        reduceLightPollution(result, result, parameters.lightPol);
+
+        Mat foregroundNormal;
+        foreground.copyTo(foregroundNormal);
+        foregroundNormal *= 256;
+        foregroundNormal.convertTo(foregroundNormal, CV_16U);
+
+        // Apply mask
+        if (!mask.empty()) {
+            applyMask(result, mask, result, CV_16U);
+            applyMask(foregroundNormal, 1 - mask, foregroundNormal, CV_16U);
+
+            addWeighted(foregroundNormal, 1, result, 1, 0, result, CV_16U);
+        }
+
+        if (reduceNoise) {
+            noiseReduction(result, result, 3);
+        }
+    }
+
+    /**
+     Applies the filters in 16 bit to a whole image, band by band on the scheduler with the priority of the current
+     scope, so more urgent work only waits for the end of a band. The inputs are float averages in 8 bit scale.
+     Every stage finishes the whole image before the next one starts. The light pollution blur of a band reads the
+     rows around it, so the result matches filtering the image at once.
+     */
+    static void applyFiltersInBands(const EditParameters &parameters, const Mat &imageCombined, const Mat &imageMaxed,
+                                    const Mat &foreground, const Mat &mask, Mat &result) {
+        Size size = imageCombined.size();
+        Mat filtered(size, CV_16UC3);
+        parallelFor(Range(0, size.height), [&](const Range &rows) {
+            Mat band;
+            applyColorFilters16bit(parameters, imageCombined.rowRange(rows), imageMaxed.rowRange(rows), band);
+            band.copyTo(filtered.rowRange(rows));
+        });
+
+        ClaheMapping equalisation(size);
+        equalisation.build(filtered);
+        Mat equalised(size, CV_16UC3);
+        parallelFor(Range(0, size.height), [&](const Range &rows) {
+            Mat band;
+            equalisation.apply(filtered.rowRange(rows), Point(0, rows.start), band);
+            band.copyTo(equalised.rowRange(rows));
+        });
+        filtered.release();
+
+        result.create(size, CV_16UC3);
+        parallelFor(Range(0, size.height), [&](const Range &rows) {
+            // The rows are a view of the whole image, so the blur replicates the border only at the image edges
+            Mat band, foregroundNormal;
+            reduceLightPollution(equalised.rowRange(rows), band, parameters.lightPol);
+
+            if (!mask.empty()) {
+                Mat maskBand = mask.rowRange(rows);
+                foreground.rowRange(rows).convertTo(foregroundNormal, CV_16U, 256);
+                applyMask(band, maskBand, band, CV_16U);
+                applyMask(foregroundNormal, 1 - maskBand, foregroundNormal, CV_16U);
+                addWeighted(foregroundNormal, 1, band, 1, 0, band, CV_16U);
+            }
+            band.copyTo(result.rowRange(rows));
+        });
+    }
+
+    /**
+     Renders the 8 bit preview, ahead of stacking and exports. Like exports, the preview goes through the 16 bit
+     filters, so both look the same.
+     */
+    void renderPreview(const EditParameters &parameters, Mat &result) const {
+        TaskScope scope(TaskPriority::INTERACTIVE);
+        applyFiltersInBands(parameters, previewCombined, previewMaxed, previewStacked, previewMask, result);
+        result /= 256;
+        result.convertTo(result, CV_8U);
+    }
+
+    /**
+     Renders the image at full resolution.
+     @param to8bit Converts the result to 8 bit, otherwise it stays 16 bit
+     */
+    void render(const EditParameters &parameters, Mat &result, bool to8bit = true) const {
+        TaskScope scope(TaskPriority::BATCH);
+        Mat combined, maxed, stacked, mask;
+        readPlanes(Rect(Point(0, 0), checkpoint.size()), combined, maxed, stacked, mask);
+        applyFiltersInBands(parameters, combined, maxed, stacked, mask, result);
+
+        if (to8bit) {
+            result /= 256;
+            result.convertTo(result, CV_8U);
+        }
+    }
+
+    /**
+     Builds the equalisation of the full resolution image from the preview, once for all tiles of an export.
+     Equalising every tile on its own would map the same level differently in neighbouring tiles.
+     */
+    ClaheMapping createEqualisation(const EditParameters &parameters) const {
+        Mat filtered;
+        applyColorFilters16bit(parameters, previewCombined, previewMaxed, filtered);
+        ClaheMapping mapping(checkpoint.size());
+        mapping.build(filtered);
+        return mapping;
+    }
+
+    /**
+     Renders a tile of the image at full resolution in 16 bit.
+     The filters are applied to the tile and its margin, so the memory needed is independent of the image size.
+     @param equalisation Mapping of the whole image, see createEqualisation
+     */
+    void renderTile(const EditParameters &parameters, const ClaheMapping &equalisation, const Rect &rect,
+                    Mat &tile) const {
+        Rect outer = Rect(rect.x - EXPORT_TILE_MARGIN, rect.y - EXPORT_TILE_MARGIN,
+                          rect.width + 2 * EXPORT_TILE_MARGIN, rect.height + 2 * EXPORT_TILE_MARGIN)
+                     & Rect(Point(0, 0), checkpoint.size());
+
+        Mat combined, maxed, stacked, mask, result;
+        readPlanes(outer, combined, maxed, stacked, mask);
+        applyFilters16bit(parameters, combined, maxed, stacked, mask, result, false, &equalisation, outer.tl());
+        result(rect - outer.tl()).copyTo(tile);
+    }
+
+    /**
+     Streams the image in 16 bit into a tiled TIFF, or a FITS file if the path ends in .fits or .fit.
+     Runs behind previews and stacking.
+     @param token Stops the export, the incomplete file is left behind
+     @return False if the export failed or was cancelled
+     */
+    bool exportImage(const EditParameters &parameters, const string &path,
+                     const CancellationToken &token = CancellationToken()) const {
+        if (empty()) {
+            return false;
+        }
+        TaskScope scope(TaskPriority::BATCH, token);
+        string extension = path.substr(path.find_last_of('.') + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        unique_ptr<TiledImageWriter> writer;
+        if (extension == "fits" || extension == "fit") {
+            writer = std::make_unique<FitsWriter>(path, checkpoint.size());
+        } else {
+            writer = std::make_unique<TiledTiffWriter>(path, checkpoint.size(), EXPORT_TILE_SIZE);
+        }
+        ClaheMapping equalisation = createEqualisation(parameters);
+        return exportTiled(checkpoint.size(), EXPORT_TILE_SIZE, *writer, [&](const Rect &rect, Mat &tile) {
+            renderTile(parameters, equalisation, rect, tile);
+        });
+    }
+};
+
+#endif /* EditorEngine_hpp */
@@ -0,0 +1,296 @@
+//
+//  ExposureFusion.hpp
+//  StarGazer
+//
+//  Fuses bracketed exposures one at a time with the Mertens weights, so the memory does not grow with the number of
+//  exposures. Exposures are aligned by their stars, median threshold bitmaps are only used if the stars fail.
+//
+
+#ifndef ExposureFusion_hpp
+#define ExposureFusion_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "StarDetector.hpp"
+#include "StarMatcher.hpp"
+#include "FrameView.hpp"
+#include "TaskScheduler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Exposure fusion after Mertens et al., computed incrementally.
+ Every exposure is weighted per pixel by its contrast, saturation and well-exposedness. Its Laplacian pyramid is
+ multiplied with the Gaussian pyramid of its weights and added to a running sum, the weight pyramids are summed as
+ well. The result divides both sums level by level and collapses the pyramid.
+ MergeMertens normalises the weights of all exposures before building their pyramids, dividing the summed pyramids
+ instead only differs where the weights change within the blur of a level, and needs no exposure twice.
+ */
+class ExposureFusion {
+private:
+    /**
+     Exponents of the quality measures, the defaults of MergeMertens.
+     */
+    const float CONTRAST_WEIGHT = 1;
+    const float SATURATION_WEIGHT = 1;
+    const float EXPOSURE_WEIGHT = 0;
+
+    /**
+     Stars an exposure needs to be aligned.
+     */
+    const size_t MIN_STARS = 5;
+
+    bool align;
+    int levels = 0;
+    int numExposures = 0;
+
+    /**
+     Sum of the weighted Laplacian pyramids, float RGB.
+     */
+    vector<Mat> weightedSum;
+
+    /**
+     Sum of the weight pyramids, float.
+     */
+    vector<Mat> weightSum;
+
+    StarDetector detector;
+    vector<Point2i> referenceStars;
+    std::unique_ptr<StarMatcher> matcher;
+
+    /**
+     8 bit gray reference for the translation of median threshold bitmaps, set by the first exposure.
+     */
+    Mat referenceGray;
+    Ptr<AlignMTB> bitmapAlignment = createAlignMTB();
+
+    /**
+     Weight of every pixel of an exposure in range [0, 1].
+     */
+    void computeWeights(const Mat &image, Mat &weights) {
+        Mat gray, contrast;
+        cvtColor(image, gray, COLOR_RGB2GRAY);
+        Laplacian(gray, contrast, CV_32F);
+        contrast = abs(contrast);
+
+        weights.create(image.size(), CV_32F);
+        parallelFor(Range(0, image.rows), [&](const Range &range) {
+            for (int y = range.start; y < range.end; y++) {
+                const Vec3f *row = image.ptr<Vec3f>(y);
+                const float *contrastRow = contrast.ptr<float>(y);
+                float *weightRow = weights.ptr<float>(y);
+                for (int x = 0; x < image.cols; x++) {
+                    const Vec3f &pixel = row[x];
+                    float mean = (pixel[0] + pixel[1] + pixel[2]) / 3;
+                    float variance = 0, exposedness = 1;
+                    for (int c = 0; c < 3; c++) {
+                        variance += (pixel[c] - mean) * (pixel[c] - mean);
+                        exposedness *= std::exp(-(pixel[c] - 0.5f) * (pixel[c] - 0.5f) / (2 * 0.2f * 0.2f));
+                    }
+                    float saturation = std::sqrt(variance / 3);
+                    weightRow[x] = std::pow(contrastRow[x], CONTRAST_WEIGHT) * std::pow(saturation, SATURATION_WEIGHT)
+                                   * std::pow(exposedness, EXPOSURE_WEIGHT) + 1e-12f;
+                }
+            }
+        });
+    }
+
+    /**
+     Detects the stars of an exposure. Every exposure finds its own threshold, as the exposures differ in brightness.
+     */
+    void detectStars(const Mat &image, vector<Point2i> &stars) {
+        stars.clear();
+        FrameView view(image);
+        const Mat &detectionImage = detector.detectionImage(view);
+        float threshold = detector.findThreshold(detectionImage);
+        if (threshold != numeric_limits<float>::infinity()) {
+            detector.detect(detectionImage, view, threshold, stars);
+        }
+    }
+
+    static void toGray8(const Mat &image, Mat &gray) {
+        cvtColor(image, gray, COLOR_RGB2GRAY);
+        if (gray.depth() != CV_8U) {
+            gray.convertTo(gray, CV_8U, 1.0 / 257);
+        }
+    }
+
+    /**
+     Makes an exposure the reference of the alignment. Without enough stars in the reference, every exposure is
+     aligned by median threshold bitmaps.
+     */
+    void setReference(const Mat &image) {
+        toGray8(image, referenceGray);
+        detectStars(image, referenceStars);
+        if (referenceStars.size() >= MIN_STARS) {
+            matcher = std::make_unique<StarMatcher>(referenceStars);
+        } else {
+            std::cout << "Reference exposure has not enough stars, aligning by median threshold bitmaps" << std::endl;
+        }
+    }
+
+    /**
+     Aligns an exposure with the reference by their stars, or by the translation of their median threshold bitmaps
+     like AlignMTB if the stars fail.
+     */
+    void alignExposure(const Mat &image, Mat &aligned) {
+        Mat h;
+        if (matcher && alignStars(image, h)) {
+            warpPerspective(image, aligned, h, image.size(), INTER_LINEAR, BORDER_REPLICATE);
+            return;
+        }
+
+        Mat gray;
+        toGray8(image, gray);
+        Point shift = bitmapAlignment->calculateShift(referenceGray, gray);
+        if (matcher) {
+            std::cout << "Exposure " << numExposures << " could not be aligned by its stars, shifted by " << shift
+                      << std::endl;
+        }
+        bitmapAlignment->shiftMat(image, aligned, shift);
+    }
+
+    /**
+     @param h Receives the homography aligning the exposure with the reference
+     @return False if the exposure has not enough stars matching the reference
+     */
+    bool alignStars(const Mat &image, Mat &h) {
+        vector<Point2i> stars;
+        detectStars(image, stars);
+        if (stars.size() < MIN_STARS) {
+            return false;
+        }
+
+        vector<DMatch> matches;
+        matcher->matchStars(stars, matches);
+        vector<Point2i> referencePoints, points;
+        for (auto &match: matches) {
+            referencePoints.push_back(referenceStars[match.queryIdx]);
+            points.push_back(stars[match.trainIdx]);
+        }
+        if (points.size() < MIN_STARS) {
+            return false;
+        }
+        h = findHomography(points, referencePoints, RANSAC, 3);
+        return !h.empty();
+    }
+
+public:
+    /**
+     @param align Aligns every exposure with the first one, by its stars if possible
+     */
+    ExposureFusion(bool align = true) : align(align) {
+    }
+
+    int getNumExposures() {
+        return numExposures;
+    }
+
+    /**
+     Number of stars found in an exposure, for a first pass choosing the exposure added first. The exposure with the
+     most stars is the best reference for the alignment.
+     */
+    size_t countStars(const Mat &exposure) {
+        vector<Point2i> stars;
+        detectStars(exposure, stars);
+        return stars.size();
+    }
+
+    /**
+     Adds an exposure, 8 or 16 bit RGB of the size of the first exposure. The exposure is not kept.
+     The first exposure is the reference every other exposure is aligned with.
+     */
+    void add(const Mat &exposure) {
+        CV_Assert(exposure.channels() == 3);
+        CV_Assert(numExposures == 0 || exposure.size() == weightedSum[0].size());
+
+        Mat aligned = exposure;
+        if (align && numExposures == 0) {
+            setReference(exposure);
+        } else if (align) {
+            alignExposure(exposure, aligned);
+        }
+
+        Mat image;
+        aligned.convertTo(image, CV_32F, exposure.depth() == CV_16U ? 1.0 / 65535 : 1.0 / 255);
+        Mat weights;
+        computeWeights(image, weights);
+
+        if (numExposures == 0) {
+            levels = (int) (std::log(std::min(image.rows, image.cols)) / std::log(2.0f));
+        }
+
+        // The Laplacian pyramid of the exposure and the Gaussian pyramid of its weights are built side by side
+        vector<Mat> imagePyramid, weightPyramid;
+        parallelFor(Range(0, 2), [&](const Range &range) {
+            for (int task = range.start; task < range.end; task++) {
+                if (task == 0) {
+                    buildPyramid(image, imagePyramid, levels);
+                    Mat up;
+                    for (int level = 0; level < levels; level++) {
+                        pyrUp(imagePyramid[level + 1], up, imagePyramid[level].size());
+                        imagePyramid[level] -= up;
+                    }
+                } else {
+                    buildPyramid(weights, weightPyramid, levels);
+                }
+            }
+        }, 2);
+
+        if (numExposures == 0) {
+            for (int level = 0; level <= levels; level++) {
+                weightedSum.push_back(Mat::zeros(imagePyramid[level].size(), CV_32FC3));
+                weightSum.push_back(Mat::zeros(imagePyramid[level].size(), CV_32F));
+            }
+        }
+
+        // Levels are independent, every level is added by its own task
+        parallelFor(Range(0, levels + 1), [&](const Range &range) {
+            for (int level = range.start; level < range.end; level++) {
+                const Mat &laplacian = imagePyramid[level], &weight = weightPyramid[level];
+                Mat &sum = weightedSum[level];
+                for (int y = 0; y < laplacian.rows; y++) {
+                    const Vec3f *laplacianRow = laplacian.ptr<Vec3f>(y);
+                    const float *weightRow = weight.ptr<float>(y);
+                    Vec3f *sumRow = sum.ptr<Vec3f>(y);
+                    for (int x = 0; x < laplacian.cols; x++) {
+                        sumRow[x] += laplacianRow[x] * weightRow[x];
+                    }
+                }
+                weightSum[level] += weight;
+            }
+        }, levels + 1);
+
+        numExposures++;
+    }
+
+    /**
+     Returns the fused image, float RGB in range [0, 1] like MergeMertens. Empty before the first exposure.
+     */
+    void getResult(Mat &result) {
+        if (numExposures == 0) {
+            result.release();
+            return;
+        }
+
+        vector<Mat> pyramid(levels + 1);
+        parallelFor(Range(0, levels + 1), [&](const Range &range) {
+            for (int level = range.start; level < range.end; level++) {
+                Mat weights;
+                cvtColor(weightSum[level], weights, COLOR_GRAY2RGB);
+                divide(weightedSum[level], weights, pyramid[level]);
+            }
+        }, levels + 1);
+
+        Mat up;
+        for (int level = levels; level > 0; level--) {
+            pyrUp(pyramid[level], up, pyramid[level - 1].size());
+            pyramid[level - 1] += up;
+        }
+        result = pyramid[0];
+    }
+};
+
+#endif /* ExposureFusion_hpp */
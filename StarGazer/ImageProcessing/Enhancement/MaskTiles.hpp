@@ -0,0 +1,169 @@
+//
+//  MaskTiles.hpp
+//  StarGazer
+//
+//  Classifies the tiles of a foreground mask once, so per frame work can skip or short-circuit whole tiles.
+//
+
+#ifndef MaskTiles_hpp
+#define MaskTiles_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "blend.hpp"
+#include "TaskScheduler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Content of a tile of the mask. The mask is 1 for sky and 0 for foreground.
+ */
+enum class MaskTileClass : uchar {
+    SKY = 0,
+    FOREGROUND = 1,
+    MIXED = 2,
+};
+
+/**
+ * Rectangle of tiles of the same class.
+ */
+struct MaskRegion {
+    Rect rect;
+    MaskTileClass type;
+};
+
+/**
+ * Tile classification of a soft foreground mask, float in range [0, 1] or 8 bit fixed point.
+ * Tiles are classified by their exact minimum and maximum, so skipping a sky or foreground tile gives the same result
+ * as applying the mask to it.
+ */
+class MaskTiles {
+private:
+    Size size;
+    int tileSize = 0;
+
+    /**
+     * One MaskTileClass per tile.
+     */
+    Mat classes;
+
+public:
+    static const int DEFAULT_TILE_SIZE = 64;
+
+    MaskTiles() {
+    }
+
+    MaskTiles(const Mat &mask, int tileSize = DEFAULT_TILE_SIZE) : size(mask.size()), tileSize(std::max(tileSize, 1)) {
+        double full = mask.depth() == CV_8U ? 255 : 1;
+        classes.create((size.height + this->tileSize - 1) / this->tileSize, (size.width + this->tileSize - 1) / this->tileSize, CV_8U);
+        parallelFor(Range(0, classes.rows), [&](const Range &range) {
+            for (int ty = range.start; ty < range.end; ty++) {
+                for (int tx = 0; tx < classes.cols; tx++) {
+                    double minValue, maxValue;
+                    minMaxLoc(mask(tileRect(tx, ty)), &minValue, &maxValue);
+                    MaskTileClass type = MaskTileClass::MIXED;
+                    if (maxValue <= 0) {
+                        type = MaskTileClass::FOREGROUND;
+                    } else if (minValue >= full) {
+                        type = MaskTileClass::SKY;
+                    }
+                    classes.at<uchar>(ty, tx) = (uchar) type;
+                }
+            }
+        });
+    }
+
+    bool empty() const {
+        return classes.empty();
+    }
+
+    Size getSize() const {
+        return size;
+    }
+
+    Rect tileRect(int tx, int ty) const {
+        return Rect(tx * tileSize, ty * tileSize, tileSize, tileSize) & Rect(Point(0, 0), size);
+    }
+
+    /**
+     * Fraction of the tiles of the given class.
+     */
+    double fraction(MaskTileClass type) const {
+        if (empty()) {
+            return type == MaskTileClass::SKY ? 1 : 0;
+        }
+        return (double) countNonZero(classes == (uchar) type) / classes.total();
+    }
+
+    /**
+     * Splits a rectangle into regions of a single class. Neighbouring tiles of the same class in a row of tiles are
+     * merged into one region, so kernels run on as few and as large regions as possible.
+     * Without a mask, the rectangle is a single sky region.
+     */
+    void regions(const Rect &rect, vector<MaskRegion> &out) const {
+        out.clear();
+        if (empty()) {
+            out.push_back({rect, MaskTileClass::SKY});
+            return;
+        }
+
+        int tx0 = rect.x / tileSize, tx1 = (rect.x + rect.width - 1) / tileSize;
+        int ty0 = rect.y / tileSize, ty1 = (rect.y + rect.height - 1) / tileSize;
+        for (int ty = ty0; ty <= ty1; ty++) {
+            int start = tx0;
+            for (int tx = tx0; tx <= tx1; tx++) {
+                uchar type = classes.at<uchar>(ty, tx);
+                if (tx < tx1 && classes.at<uchar>(ty, tx + 1) == type) {
+                    continue;
+                }
+                Rect run = tileRect(start, ty) | tileRect(tx, ty);
+                out.push_back({run & rect, (MaskTileClass) type});
+                start = tx + 1;
+            }
+        }
+    }
+
+    /**
+     * Same as applyMask with 8 bit output. Sky regions are copied, foreground regions are cleared,
+     * only mixed regions are multiplied with the mask.
+     * @param mask Mask the tiles were classified from
+     */
+    void apply(const Mat &input, const Mat &mask, Mat &output) const {
+        if (empty()) {
+            applyMask(input, mask, output);
+            return;
+        }
+
+        bool inPlace = input.data == output.data;
+        if (!inPlace) {
+            output.create(input.size(), CV_MAKETYPE(CV_8U, input.channels()));
+        }
+        vector<MaskRegion> all;
+        regions(Rect(Point(0, 0), size), all);
+
+        // Regions are processed in parallel, applyMask splits large regions further
+        parallelFor(Range(0, (int) all.size()), [&](const Range &range) {
+            for (int i = range.start; i < range.end; i++) {
+                const Rect &rect = all[i].rect;
+                Mat out = output(rect);
+                switch (all[i].type) {
+                    case MaskTileClass::SKY:
+                        if (!inPlace) {
+                            input(rect).convertTo(out, CV_8U);
+                        }
+                        break;
+                    case MaskTileClass::FOREGROUND:
+                        out.setTo(Scalar::all(0));
+                        break;
+                    case MaskTileClass::MIXED:
+                        applyMask(input(rect), mask(rect), out);
+                        break;
+                }
+            }
+        });
+    }
+};
+
+#endif /* MaskTiles_hpp */
@@ -6,6 +6,7 @@
 //
 
 #include "blend.hpp"
+#include "TaskScheduler.hpp"
 
 
 void blendLighten(Mat im1, Mat im2, Mat out) {
@@ -43,15 +44,56 @@ void blendHardLight(Mat im1, Mat im2, Mat out) {
 }
 
 /**
- Applies a mask to an image. Supports soft masks if mask is float in range [0-1].
+ Applies a mask to an image. Supports soft masks if mask is float in range [0-1] or 8 bit fixed point in range [0-255].
  */
 void applyMask(const Mat &inputImage, const Mat &mask, Mat &outputImage, int type) {
+    if (inputImage.type() == CV_8UC3 && (mask.type() == CV_32FC1 || mask.type() == CV_8UC1) && type == CV_8U && inputImage.size() == mask.size()) {
+        // Common case while stacking, multiply in a single pass without splitting the channels.
+        // Reuses outputImage if it already has the right size.
+        outputImage.create(inputImage.size(), CV_8UC3);
+        bool fixedPoint = mask.type() == CV_8UC1;
+        parallelFor(Range(0, inputImage.rows), [&](const Range &range) {
+            for (int y = range.start; y < range.end; y++) {
+                const uchar *in = inputImage.ptr<uchar>(y);
+                uchar *out = outputImage.ptr<uchar>(y);
+                if (fixedPoint) {
+                    const uchar *m = mask.ptr<uchar>(y);
+                    for (int x = 0; x < inputImage.cols; x++) {
+                        out[3 * x] = (uchar) ((in[3 * x] * m[x] + 127) / 255);
+                        out[3 * x + 1] = (uchar) ((in[3 * x + 1] * m[x] + 127) / 255);
+                        out[3 * x + 2] = (uchar) ((in[3 * x + 2] * m[x] + 127) / 255);
+                    }
+                } else {
+                    const float *m = mask.ptr<float>(y);
+                    for (int x = 0; x < inputImage.cols; x++) {
+                        out[3 * x] = saturate_cast<uchar>(in[3 * x] * m[x]);
+                        out[3 * x + 1] = saturate_cast<uchar>(in[3 * x + 1] * m[x]);
+                        out[3 * x + 2] = saturate_cast<uchar>(in[3 * x + 2] * m[x]);
+                    }
+                }
+            }
+        });
+        return;
+    }
+
+    Mat floatMask = mask;
+    if (mask.depth() == CV_8U) {
+        mask.convertTo(floatMask, CV_32F, 1.0 / 255);
+    }
+
     vector<Mat> channels;
     split(inputImage,channels);
     
-    cv::multiply(channels[0], mask, channels[0], 1.0, type);
-    cv::multiply(channels[1], mask, channels[1], 1.0, type);
-    cv::multiply(channels[2], mask, channels[2], 1.0, type);
+    cv::multiply(channels[0], floatMask, channels[0], 1.0, type);
+    cv::multiply(channels[1], floatMask, channels[1], 1.0, type);
+    cv::multiply(channels[2], floatMask, channels[2], 1.0, type);
 
     merge(channels, outputImage);
 }
+
+/**
+ Inverts a soft mask, 1 - mask for float masks and 255 - mask for 8 bit fixed point masks.
+ */
+void invertMask(const Mat &mask, Mat &inverse) {
+    subtract(Scalar::all(mask.depth() == CV_8U ? 255 : 1), mask, inverse);
+}
@@ -23,4 +23,6 @@ void blendHardLight(Mat im1, Mat im2, Mat out);
 
 void applyMask(const Mat &inputImage, const Mat &mask, Mat &outputImage, int type = CV_8U);
 
+void invertMask(const Mat &mask, Mat &inverse);
+
 #endif /* blend_hpp */
@@ -6,10 +6,27 @@
 //
 
 #include "hdrmerge.hpp"
+#include "ExposureFusion.hpp"
 #include <fstream>
 
 using namespace cv;
 
+/**
+ Index of the exposure with the most stars, it is added first and becomes the reference of the alignment.
+ */
+static int findReference(ExposureFusion &fusion, int count, const std::function<Mat(int)> &load) {
+    int reference = 0;
+    size_t mostStars = 0;
+    for (int i = 0; i < count; i++) {
+        size_t stars = fusion.countStars(load(i));
+        if (stars > mostStars) {
+            mostStars = stars;
+            reference = i;
+        }
+    }
+    return reference;
+}
+
 void hdrMerge(std::vector<cv::Mat> &images, cv::Mat &result, bool align) {
     /*
     Mat response;
@@ -25,12 +42,36 @@ void hdrMerge(std::vector<cv::Mat> &images, cv::Mat &result, bool align) {
     tonemap->process(hdr, ldr);
     */
 
-    if (align) {
-        Ptr<AlignMTB> alignMTB = createAlignMTB();
-        alignMTB->process(images, images);
+    // Exposures are fused one after another, each is released as soon as it was added
+    if (images.empty()) {
+        result.release();
+        return;
     }
+    ExposureFusion fusion(align);
+    int reference = align ? findReference(fusion, (int) images.size(), [&](int i) { return images[i]; }) : 0;
+    fusion.add(images[reference]);
+    images[reference].release();
+    for (auto &image: images) {
+        if (!image.empty()) {
+            fusion.add(image);
+            image.release();
+        }
+    }
+    fusion.getResult(result);
+}
 
-    Ptr<MergeMertens> merge_mertens = createMergeMertens();
-    merge_mertens->process(images, result);
-
+void hdrMerge(int count, const std::function<Mat(int)> &load, Mat &result, bool align) {
+    if (count == 0) {
+        result.release();
+        return;
+    }
+    ExposureFusion fusion(align);
+    int reference = align ? findReference(fusion, count, load) : 0;
+    fusion.add(load(reference));
+    for (int i = 0; i < count; i++) {
+        if (i != reference) {
+            fusion.add(load(i));
+        }
+    }
+    fusion.getResult(result);
 }
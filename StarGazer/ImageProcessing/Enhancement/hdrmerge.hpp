@@ -9,7 +9,19 @@
 #define hdrmerge_hpp
 
 #include <opencv2/opencv.hpp>
+#include <functional>
 
+/**
+ Fuses bracketed exposures with exposure fusion, see ExposureFusion. The exposures are released while they are fused.
+ @param align Aligns the exposures with the one with the most stars, by their stars if possible
+ */
 void hdrMerge(std::vector<cv::Mat> &images, cv::Mat &result, bool align = true);
 
+/**
+ Fuses bracketed exposures that are loaded one at a time, so only a single exposure is in memory at once.
+ With alignment, a first pass loads every exposure to count its stars, the fusion loads them again.
+ @param load Returns the exposure with the given index, 8 or 16 bit RGB
+ */
+void hdrMerge(int count, const std::function<cv::Mat(int)> &load, cv::Mat &result, bool align = true);
+
 #endif /* hdrmerge_hpp */
@@ -0,0 +1,173 @@
+//
+//  MappedCheckpoint.hpp
+//  StarGazer
+//
+//  Maps a checkpoint into memory instead of reading it, so exporting can render the stack tile by tile while only
+//  the pages of the tiles in flight are loaded.
+//
+
+#ifndef MappedCheckpoint_hpp
+#define MappedCheckpoint_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Read only view of a checkpoint as written by writeMatBinary: combined, maxed, stacked, mask and the optional sum
+ * of the weights. The planes are headers onto the mapping and must not be written to.
+ */
+class MappedCheckpoint {
+private:
+    int fd = -1;
+    uchar *data = nullptr;
+    size_t length = 0;
+
+    Mat combined, maxed, stacked, mask;
+    double weightSum = -1;
+
+    /**
+     * Creates a header for the matrix at the offset and advances the offset past it.
+     */
+    bool map(size_t &offset, Mat &mat) {
+        int header[3];
+        if (offset + sizeof(int) > length) {
+            return false;
+        }
+        memcpy(header, data + offset, sizeof(int));
+        if (header[0] == 0) {
+            offset += sizeof(int);
+            return true;
+        }
+        if (offset + sizeof(header) > length) {
+            return false;
+        }
+        memcpy(header, data + offset, sizeof(header));
+        offset += sizeof(header);
+        Mat view(header[0], header[1], header[2], data + offset);
+        size_t bytes = view.elemSize() * view.total();
+        if (offset + bytes > length) {
+            return false;
+        }
+        offset += bytes;
+        mat = view;
+        return true;
+    }
+
+public:
+    /**
+     * @param path Path of the checkpoint file
+     */
+    MappedCheckpoint(const string &path) {
+        fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+            return;
+        }
+        length = info.st_size;
+        void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            length = 0;
+            return;
+        }
+        data = (uchar *) mapping;
+        // Tiles read short runs of many rows, spread over the whole file, so sequential readahead would load the
+        // rows of other tiles. The planes are also read in full, which profits from the usual readahead.
+        madvise(data, length, MADV_NORMAL);
+
+        size_t offset = 0;
+        if (!map(offset, combined) || !map(offset, maxed) || !map(offset, stacked) || !map(offset, mask)) {
+            combined.release();
+            return;
+        }
+        Mat weights;
+        if (offset < length && map(offset, weights) && !weights.empty() && weights.depth() == CV_64F) {
+            // Follows planes of any size, so it is not aligned for a double
+            memcpy(&weightSum, weights.data, sizeof(double));
+        }
+    }
+
+    ~MappedCheckpoint() {
+        combined.release();
+        maxed.release();
+        stacked.release();
+        mask.release();
+        if (data != nullptr) {
+            munmap(data, length);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    MappedCheckpoint(const MappedCheckpoint &) = delete;
+    MappedCheckpoint &operator=(const MappedCheckpoint &) = delete;
+
+    bool isOpen() const {
+        return !combined.empty();
+    }
+
+    Size size() const {
+        return combined.size();
+    }
+
+    /**
+     * Sums of the aligned frames, 16 bit, 32 bit or float.
+     */
+    const Mat &getCombined() const {
+        return combined;
+    }
+
+    const Mat &getMaxed() const {
+        return maxed;
+    }
+
+    /**
+     * Sums of the unaligned frames, 16 or 32 bit.
+     */
+    const Mat &getStacked() const {
+        return stacked;
+    }
+
+    /**
+     * Foreground mask, float or 8 bit fixed point. Empty if the stack has no foreground.
+     */
+    const Mat &getMask() const {
+        return mask;
+    }
+
+    /**
+     * Sum of the weights of the aligned frames, numImages for checkpoints written before frames were weighted.
+     */
+    double getWeightSum(int numImages) const {
+        return weightSum > 0 ? weightSum : numImages;
+    }
+
+    /**
+     * Renders a tile of the linear stack without stretching: the average of the aligned frames on the sky and of the
+     * unaligned frames on the foreground, as 16 bit RGB with the full precision of the sums.
+     */
+    void renderLinear(const Rect &rect, int numImages, Mat &tile) const {
+        Mat sky, foreground;
+        combined(rect).convertTo(sky, CV_32FC3, 256.0 / getWeightSum(numImages));
+        if (!mask.empty()) {
+            stacked(rect).convertTo(foreground, CV_32FC3, 256.0 / numImages);
+            Mat weights;
+            mask(rect).convertTo(weights, CV_32F, mask.depth() == CV_8U ? 1.0 / 255 : 1.0);
+            cvtColor(weights, weights, COLOR_GRAY2RGB);
+            // foreground + weight * (sky - foreground)
+            subtract(sky, foreground, sky);
+            multiply(sky, weights, sky);
+            add(sky, foreground, sky);
+        }
+        sky.convertTo(tile, CV_16UC3);
+    }
+};
+
+#endif /* MappedCheckpoint_hpp */
@@ -0,0 +1,408 @@
+//
+//  TiledImageWriter.hpp
+//  StarGazer
+//
+//  Streams 16 bit RGB images tile by tile into tiled TIFF or FITS files, so exporting never holds the whole image.
+//  Tiles are rendered and encoded in parallel and written in order.
+//
+
+#ifndef TiledImageWriter_hpp
+#define TiledImageWriter_hpp
+
+#include <stdio.h>
+#include <string.h>
+#include <opencv2/opencv.hpp>
+#include <functional>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "TaskScheduler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Writes a 16 bit, 3 channel image in RGB order whose tiles arrive one at a time.
+ */
+class TiledImageWriter {
+public:
+    virtual ~TiledImageWriter() {
+    }
+
+    virtual bool isOpen() = 0;
+
+    /**
+     * Encodes a tile for writing. Called from several threads at once.
+     * @param rect Area of the image covered by the tile
+     * @param tile CV_16UC3 of rect.size()
+     */
+    virtual void encode(const Rect &rect, const Mat &tile, vector<uchar> &encoded) = 0;
+
+    /**
+     * Writes an encoded tile. Called from a single thread, in row major order of the tiles.
+     */
+    virtual bool write(const Rect &rect, const vector<uchar> &encoded) = 0;
+
+    /**
+     * Completes the file once all tiles are written.
+     */
+    virtual bool finish() = 0;
+};
+
+/**
+ * Tiled baseline TIFF with 16 bits per sample, uncompressed or deflate compressed with horizontal differencing.
+ * Tiles are appended as they are written, the directory follows the last tile.
+ * Classic TIFF is limited to 4 GiB, writing fails beyond, e.g. for very large uncompressed stacks.
+ */
+class TiledTiffWriter : public TiledImageWriter {
+private:
+    int fd = -1;
+    Size size;
+    int tileSize;
+    bool compress;
+
+    uint32_t position = 8;
+    vector<uint32_t> tileOffsets;
+    vector<uint32_t> tileByteCounts;
+
+    /**
+     * Offsets of classic TIFF are 32 bit, a file that would grow beyond 4 GiB fails instead of wrapping around.
+     */
+    bool append(const void *data, size_t length) {
+        if (length > std::numeric_limits<uint32_t>::max() - position) {
+            std::cout << "TIFF would exceed 4 GiB, export as FITS instead" << std::endl;
+            return false;
+        }
+        if (::write(fd, data, length) != (ssize_t) length) {
+            return false;
+        }
+        position += (uint32_t) length;
+        return true;
+    }
+
+    static void putShort(vector<uchar> &out, uint16_t value) {
+        out.push_back(value & 0xff);
+        out.push_back(value >> 8);
+    }
+
+    static void putLong(vector<uchar> &out, uint32_t value) {
+        putShort(out, value & 0xffff);
+        putShort(out, value >> 16);
+    }
+
+    /**
+     * Appends a directory entry. Values of up to 4 bytes are stored in the entry, others at the given offset.
+     */
+    static void putEntry(vector<uchar> &out, uint16_t tag, uint16_t type, uint32_t count, uint32_t value) {
+        putShort(out, tag);
+        putShort(out, type);
+        putLong(out, count);
+        if (type == 3 && count == 1) {
+            putShort(out, (uint16_t) value);
+            putShort(out, 0);
+        } else {
+            putLong(out, value);
+        }
+    }
+
+public:
+    /**
+     * @param tileSize Edge length of the tiles, a multiple of 16
+     * @param compress Deflate compresses every tile, tiles are compressed on the encoding threads
+     */
+    TiledTiffWriter(const string &path, Size size, int tileSize = 256, bool compress = true) :
+            size(size), tileSize(tileSize), compress(compress) {
+        CV_Assert(tileSize % 16 == 0);
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return;
+        }
+        // Header, the offset of the directory is filled in by finish
+        const uchar header[8] = {'I', 'I', 42, 0, 0, 0, 0, 0};
+        if (::write(fd, header, 8) != 8) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    ~TiledTiffWriter() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool isOpen() override {
+        return fd >= 0;
+    }
+
+    void encode(const Rect &rect, const Mat &tile, vector<uchar> &encoded) override {
+        // Tiles always have the full tile size, tiles on the right and bottom are padded
+        vector<uint16_t> samples((size_t) tileSize * tileSize * 3, 0);
+        for (int y = 0; y < rect.height; y++) {
+            const ushort *row = tile.ptr<ushort>(y);
+            uint16_t *out = samples.data() + (size_t) y * tileSize * 3;
+            memcpy(out, row, rect.width * 3 * sizeof(uint16_t));
+            if (compress) {
+                // Horizontal differencing, predictor 2, makes the smooth sky compress well
+                for (int x = tileSize - 1; x > 0; x--) {
+                    for (int c = 0; c < 3; c++) {
+                        out[x * 3 + c] -= out[(x - 1) * 3 + c];
+                    }
+                }
+            }
+        }
+
+        // Samples are written in little endian byte order
+        size_t bytes = samples.size() * sizeof(uint16_t);
+        vector<uchar> raw(bytes);
+        for (size_t i = 0; i < samples.size(); i++) {
+            raw[2 * i] = samples[i] & 0xff;
+            raw[2 * i + 1] = samples[i] >> 8;
+        }
+        if (!compress) {
+            encoded.swap(raw);
+            return;
+        }
+
+        uLongf length = compressBound(bytes);
+        encoded.resize(length);
+        if (compress2(encoded.data(), &length, raw.data(), bytes, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            encoded.clear();
+            return;
+        }
+        encoded.resize(length);
+    }
+
+    bool write(const Rect &rect, const vector<uchar> &encoded) override {
+        if (encoded.empty()) {
+            return false;
+        }
+        tileOffsets.push_back(position);
+        tileByteCounts.push_back((uint32_t) encoded.size());
+        return append(encoded.data(), encoded.size());
+    }
+
+    bool finish() override {
+        if (fd < 0) {
+            return false;
+        }
+        // Arrays referenced by the directory, then the directory itself, both on word boundaries
+        if (position % 2 != 0 && !append("", 1)) {
+            return false;
+        }
+        vector<uchar> arrays;
+        uint32_t bitsOffset = position;
+        putShort(arrays, 16);
+        putShort(arrays, 16);
+        putShort(arrays, 16);
+        uint32_t offsetsOffset = bitsOffset + (uint32_t) arrays.size();
+        for (auto offset: tileOffsets) {
+            putLong(arrays, offset);
+        }
+        uint32_t countsOffset = bitsOffset + (uint32_t) arrays.size();
+        for (auto count: tileByteCounts) {
+            putLong(arrays, count);
+        }
+        uint32_t sampleFormatOffset = bitsOffset + (uint32_t) arrays.size();
+        putShort(arrays, 1);
+        putShort(arrays, 1);
+        putShort(arrays, 1);
+        if (arrays.size() % 2 != 0) {
+            arrays.push_back(0);
+        }
+        if (!append(arrays.data(), arrays.size())) {
+            return false;
+        }
+
+        uint32_t directoryOffset = position;
+        uint32_t numTiles = (uint32_t) tileOffsets.size();
+        vector<uchar> directory;
+        uint16_t numEntries = compress ? 13 : 12;
+        putShort(directory, numEntries);
+        // Entries are sorted by tag
+        putEntry(directory, 256, 4, 1, size.width);
+        putEntry(directory, 257, 4, 1, size.height);
+        putEntry(directory, 258, 3, 3, bitsOffset);
+        putEntry(directory, 259, 3, 1, compress ? 8 : 1);
+        putEntry(directory, 262, 3, 1, 2);
+        putEntry(directory, 277, 3, 1, 3);
+        putEntry(directory, 284, 3, 1, 1);
+        if (compress) {
+            putEntry(directory, 317, 3, 1, 2);
+        }
+        putEntry(directory, 322, 3, 1, tileSize);
+        putEntry(directory, 323, 3, 1, tileSize);
+        // Arrays of a single value are stored in the entry itself
+        putEntry(directory, 324, 4, numTiles, numTiles == 1 ? tileOffsets[0] : offsetsOffset);
+        putEntry(directory, 325, 4, numTiles, numTiles == 1 ? tileByteCounts[0] : countsOffset);
+        putEntry(directory, 339, 3, 3, sampleFormatOffset);
+        putLong(directory, 0);
+        CV_Assert(directory.size() == 2 + numEntries * 12 + 4u);
+        if (!append(directory.data(), directory.size())) {
+            return false;
+        }
+
+        uchar offset[4] = {(uchar) (directoryOffset & 0xff), (uchar) ((directoryOffset >> 8) & 0xff),
+                           (uchar) ((directoryOffset >> 16) & 0xff), (uchar) (directoryOffset >> 24)};
+        bool success = pwrite(fd, offset, 4, 4) == 4;
+        close(fd);
+        fd = -1;
+        return success;
+    }
+};
+
+/**
+ * FITS file with a single image of three planes, the format images are exchanged in by astronomy software.
+ * Values are stored as signed 16 bit with an offset of 32768, the FITS way of storing unsigned values.
+ * Rows are stored from the bottom up, so the image keeps its orientation in FITS viewers.
+ */
+class FitsWriter : public TiledImageWriter {
+private:
+    static const int BLOCK_SIZE = 2880;
+
+    int fd = -1;
+    Size size;
+    size_t headerBytes = 0;
+
+    static void putCard(string &header, const string &card) {
+        string padded = card;
+        padded.resize(80, ' ');
+        header += padded;
+    }
+
+    static string keyword(const string &name, const string &value) {
+        string card = name;
+        card.resize(8, ' ');
+        card += "= ";
+        card += string(std::max<size_t>(0, 20 - std::min<size_t>(20, value.size())), ' ') + value;
+        return card;
+    }
+
+public:
+    FitsWriter(const string &path, Size size) : size(size) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return;
+        }
+        string header;
+        putCard(header, keyword("SIMPLE", "T"));
+        putCard(header, keyword("BITPIX", "16"));
+        putCard(header, keyword("NAXIS", "3"));
+        putCard(header, keyword("NAXIS1", std::to_string(size.width)));
+        putCard(header, keyword("NAXIS2", std::to_string(size.height)));
+        putCard(header, keyword("NAXIS3", "3"));
+        putCard(header, keyword("BZERO", "32768"));
+        putCard(header, keyword("BSCALE", "1"));
+        putCard(header, "END");
+        header.resize((header.size() + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE, ' ');
+        headerBytes = header.size();
+        if (::write(fd, header.data(), header.size()) != (ssize_t) header.size()) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    ~FitsWriter() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool isOpen() override {
+        return fd >= 0;
+    }
+
+    /**
+     * Splits the tile into its planes, big endian with the offset applied.
+     */
+    void encode(const Rect &rect, const Mat &tile, vector<uchar> &encoded) override {
+        size_t planeBytes = (size_t) rect.area() * 2;
+        encoded.resize(planeBytes * 3);
+        for (int y = 0; y < rect.height; y++) {
+            const ushort *row = tile.ptr<ushort>(y);
+            for (int x = 0; x < rect.width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    uint16_t value = (uint16_t) (row[x * 3 + c] - 32768);
+                    uchar *out = encoded.data() + c * planeBytes + ((size_t) y * rect.width + x) * 2;
+                    out[0] = value >> 8;
+                    out[1] = value & 0xff;
+                }
+            }
+        }
+    }
+
+    bool write(const Rect &rect, const vector<uchar> &encoded) override {
+        size_t planeBytes = (size_t) rect.area() * 2;
+        for (int c = 0; c < 3; c++) {
+            for (int y = 0; y < rect.height; y++) {
+                int fitsRow = size.height - 1 - (rect.y + y);
+                off_t offset = headerBytes + (((off_t) c * size.height + fitsRow) * size.width + rect.x) * 2;
+                const uchar *row = encoded.data() + c * planeBytes + (size_t) y * rect.width * 2;
+                if (pwrite(fd, row, rect.width * 2, offset) != rect.width * 2) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool finish() override {
+        if (fd < 0) {
+            return false;
+        }
+        // The data is padded to a full block
+        size_t dataBytes = (size_t) size.area() * 3 * 2;
+        size_t padding = (BLOCK_SIZE - dataBytes % BLOCK_SIZE) % BLOCK_SIZE;
+        bool success = ftruncate(fd, headerBytes + dataBytes + padding) == 0;
+        close(fd);
+        fd = -1;
+        return success;
+    }
+};
+
+/**
+ * Renders an image tile by tile and streams it into a writer.
+ * A batch of tiles is rendered and encoded in parallel, then written in order, so memory stays proportional to the
+ * size of a tile times the number of threads. Stops with an incomplete file if the current scope is cancelled.
+ *
+ * @param render Renders the CV_16UC3 tile of a rect, called from several threads at once
+ */
+inline bool exportTiled(Size size, int tileSize, TiledImageWriter &writer,
+                        const std::function<void(const Rect &, Mat &)> &render) {
+    if (!writer.isOpen()) {
+        return false;
+    }
+
+    vector<Rect> rects;
+    for (int y = 0; y < size.height; y += tileSize) {
+        for (int x = 0; x < size.width; x += tileSize) {
+            rects.push_back(Rect(x, y, tileSize, tileSize) & Rect(Point(0, 0), size));
+        }
+    }
+
+    int batchSize = TaskScheduler::shared().getNumThreads();
+    vector<vector<uchar>> encoded(batchSize);
+    for (size_t start = 0; start < rects.size(); start += batchSize) {
+        if (TaskScope::isCancelled()) {
+            return false;
+        }
+        int count = (int) std::min<size_t>(batchSize, rects.size() - start);
+        parallelFor(Range(0, count), [&](const Range &range) {
+            Mat tile;
+            for (int i = range.start; i < range.end; i++) {
+                render(rects[start + i], tile);
+                writer.encode(rects[start + i], tile, encoded[i]);
+            }
+        });
+        for (int i = 0; i < count; i++) {
+            if (!writer.write(rects[start + i], encoded[i])) {
+                return false;
+            }
+        }
+    }
+    return writer.finish();
+}
+
+#endif /* TiledImageWriter_hpp */
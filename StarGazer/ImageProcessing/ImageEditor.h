@@ -21,15 +21,6 @@ NS_ASSUME_NONNULL_BEGIN
 
 @interface ImageEditor : NSObject
 
-#ifdef __cplusplus
-
-@property cv::Mat combinedImage;
-@property cv::Mat maxedImage;
-@property cv::Mat stackedImage;
-@property cv::Mat mask;
-
-#endif
-
 - (instancetype) initAtPath:(NSString *)path numImages:(int) numImages withMask: (UIImage *) mask;
 
 
@@ -45,6 +36,8 @@ NS_ASSUME_NONNULL_BEGIN
 
 - (void) exportRawImage: (NSString *) path;
 
+- (void) cancelExport;
+
 @end
 
 NS_ASSUME_NONNULL_END
@@ -13,13 +13,26 @@
 #import "ImageMerger.hpp"
 #import "SaveBinaryCV.hpp"
 #import "blend.hpp"
+#import "EditorEngine.hpp"
 #include "enhance.hpp"
 
 using namespace std;
 using namespace cv;
 
 
-@implementation ImageEditor
+@implementation ImageEditor {
+    /**
+     Renders the project. Immutable, so renders and exports may run on several queues at once.
+     */
+    shared_ptr<const EditorEngine> engine;
+
+    EditParameters parameters;
+
+    /**
+     Cancels the running export.
+     */
+    CancellationToken exportToken;
+}
 
 const int MASK_EROSION_RADIUS = 1;
 const int MASK_BLUR_RADIUS = 15;
@@ -31,233 +44,84 @@ const int MASK_BLUR_RADIUS = 15;
 - (instancetype) initAtPath:(NSString *)path numImages:(int) numImages withMask: (UIImage *) mask{
     self = [super init];
     
-    pathString = std::string([path UTF8String]);
-    
-    std::ifstream ifs(pathString, std::ios::binary);
-    readMatBinary(ifs, _combinedImage);
-    resize(_combinedImage, _combinedImage, cv::Size(_combinedImage.cols / 3, _combinedImage.rows / 3));
-    _combinedImage.convertTo(_combinedImage, CV_32F);
-    _combinedImage /= numImages;
-    
-    readMatBinary(ifs, _maxedImage);
-    resize(_maxedImage, _maxedImage, cv::Size(_maxedImage.cols / 3, _maxedImage.rows / 3));
-    _maxedImage.convertTo(_maxedImage, CV_32F);
-    
-    readMatBinary(ifs, _stackedImage);
-    resize(_stackedImage, _stackedImage, cv::Size(_stackedImage.cols / 3, _stackedImage.rows / 3));
-    _stackedImage.convertTo(_stackedImage, CV_32F);
-    _stackedImage /= numImages;
-    
-    readMatBinary(ifs, _mask);
-    if (_mask.empty()) {
-        _mask = Mat::ones(_stackedImage.rows, _stackedImage.cols, CV_32F);
-    } else {
-        resize(_mask, _mask, cv::Size(_mask.cols / 3, _mask.rows / 3));
-    }
+    engine = std::make_shared<const EditorEngine>(std::string([path UTF8String]), numImages);
     /*
-    if (_combinedImage.empty() || _maxedImage.empty() || _stackedImage.empty() || ![mask isKindOfClass:[UIImage class]]) {
+    if (engine->empty() || ![mask isKindOfClass:[UIImage class]]) {
         return nil;
     }*/
-
-    numImgs = numImages;
     
     return self;
 }
 
 - (UIImage *) getFilteredImagePreview {
     Mat result;
-    applyFilters(_combinedImage, _maxedImage, _stackedImage, _mask, result);
+    engine->renderPreview(parameters, result);
     return [UIImage imageWithCVMat: result];
 }
 
 
 - (UIImage *) getFilteredImage {
     Mat result;
-    createFilteredImage(result);
+    engine->render(parameters, result);
     return [UIImage imageWithCVMat: result];
 }
 
+/**
+ Streams the filtered image in 16 bit into a tiled TIFF, or a FITS file if the path ends in .fits or .fit.
+ The stack is rendered tile by tile from the mapped checkpoint, so the full resolution image is never held.
+ */
 - (void) exportRawImage: (NSString *) path {
-    Mat result;
-    createFilteredImage(result, false);
-    
-    cv::cvtColor(result, result, COLOR_BGR2RGB);
-    
-    //result.convertTo(result, CV_16U);
-    //result = result * 256;
-    
-    std::cout << [path UTF8String] << std::endl;
+    CancellationToken token;
+    @synchronized (self) {
+        exportToken = token;
+    }
+    if (!engine->exportImage(parameters, [path UTF8String], token)) {
+        std::cout << "Export to " << [path UTF8String] << " failed" << std::endl;
+    }
+}
 
-    std::vector<Mat> imgs;
-    split(result, imgs);
-    imwrite([path UTF8String], result);
-    
+/**
+ Stops a running export, it returns as soon as the tiles in flight are done.
+ */
+- (void) cancelExport {
+    @synchronized (self) {
+        exportToken.cancel();
+    }
 }
 
 /**
- Set a skyPop value in range [0, 1]
+ Set a starPop value in range [0, 1]
  */
 - (void) setStarPop: (double) factor {
-    // Convert skyPop value to range [0, 1]
-    starPop = factor;
+    parameters.setStarPop(factor);
 }
 
 /**
- Set a contrast level in range [0, 1]
+ Set a light pollution reduction in range [0, 1]
  */
 - (void) setLightPolReduction: (double) factor {
-    //Convert contrast value to range [1, 256]
-    lightPol = factor;
+    parameters.setLightPolReduction(factor);
 }
 
 /**
  Set a color correction level in range [0.75, 1.25]
  */
 - (void) setColor: (double) factor {
-    color = (factor * 0.5) + 0.75;
+    parameters.setColor(factor);
 }
 
 /**
  Set a saturation level in range [0.5, 1.5]
  */
 - (void) setSaturation: (double) factor {
-    saturation = factor + 0.5;
+    parameters.setSaturation(factor);
 }
 
 /**
  Set a brightness value in range [0, 2]
  */
 - (void) setBrightness: (double) factor {
-    // Convert brightness value to range [0, 10]
-    brightness = (factor * 2);
-}
-
-#ifdef __cplusplus
-
-
-double lightPol;
-double starPop;
-double skyPop;
-double color;
-double saturation;
-double brightness;
-
-int numImgs;
-string pathString;
-
-int maskFeather = 35;
-
-void applyFilters16bit(Mat &imageCombined, Mat &imageMaxed, Mat &foreground, Mat &mask, Mat &result, bool reduceNoise = false) {
-    // Apply skyPop
-    addWeighted(imageCombined, 1 - starPop, imageMaxed, starPop, 0, result, CV_32F);
-    
-    adaptStarColor(result, result, color, saturation, brightness);
-    
-    result *= 256;
-    result.convertTo(result, CV_16U);
-    
-    equalizeIntensity(result, result);
-    
-    reduceLightPollution(result, result, lightPol);
-    
-    //result /= 256;
-    //result.convertTo(result, CV_8U);
-
-    Mat foregroundNormal;
-    foreground.copyTo(foregroundNormal);
-    foregroundNormal *= 256;
-    foregroundNormal.convertTo(foregroundNormal, CV_16U);
-    
-    std::cout << "Foreground type: " << foregroundNormal.type() << std::endl;
-    
-    // Apply mask
-    
-    if (!mask.empty()) {
-        //Mat floatMask;
-        //cvtColor(mask, floatMask, COLOR_GRAY2BGR);
-        //floatMask.convertTo(floatMask, CV_32FC3);
-        
-        applyMask(result, mask, result, CV_16U);
-        applyMask(foregroundNormal, 1 - mask, foregroundNormal, CV_16U);
-        
-        addWeighted(foregroundNormal, 1, result, 1, 0, result, CV_16U);
-    }
-    
-    if (reduceNoise) {
-        noiseReduction(result, result, 3);
-    }
+    parameters.setBrightness(factor);
 }
 
-void applyFilters(Mat &imageCombined, Mat &imageMaxed, Mat &foreground, Mat &mask, Mat &result, bool reduceNoise = false) {
-    // Apply skyPop
-    addWeighted(imageCombined, 1 - starPop, imageMaxed, starPop, 0, result, CV_32F);
-    
-    adaptStarColor(result, result, color, saturation, brightness);
-    
-    result *= 256;
-    result.convertTo(result, CV_16U);
-    
-    equalizeIntensity(result, result);
-    
-    reduceLightPollution(result, result, lightPol);
-    
-    result /= 256;
-    result.convertTo(result, CV_8U);
-
-    Mat foregroundNormal;
-    foreground.convertTo(foregroundNormal, CV_8U);
-
-    // Apply mask
-    if (!mask.empty()) {
-        //Mat floatMask;
-        //cvtColor(mask, floatMask, COLOR_GRAY2BGR);
-        //floatMask.convertTo(floatMask, CV_32FC3);
-        
-        applyMask(result, mask, result);
-        applyMask(foregroundNormal, 1 - mask, foregroundNormal);
-        
-        addWeighted(foregroundNormal, 1, result, 1, 0, result, CV_8U);
-        
-        
-    } else {
-        result.convertTo(result, CV_8UC3);
-    }
-    
-    if (reduceNoise) {
-        noiseReduction(result, result, 3);
-    }
-
-}
-
-void createFilteredImage(Mat &result, bool to8bit = true) {
-    std::ifstream ifs(pathString, std::ios::binary);
-    
-    Mat combinedImage, maxedImage, stackedImage, mask;
-    readMatBinary(ifs, combinedImage);
-    combinedImage.convertTo(combinedImage, CV_32F);
-    combinedImage /= numImgs;
-    
-    readMatBinary(ifs, maxedImage);
-    maxedImage.convertTo(maxedImage, CV_32F);
-    
-    readMatBinary(ifs, stackedImage);
-    stackedImage.convertTo(stackedImage, CV_32F);
-    stackedImage /= numImgs;
-    
-    readMatBinary(ifs, mask);
-    if (mask.empty()) {
-        mask = Mat::ones(stackedImage.rows, stackedImage.cols, CV_32F);
-    }
-    
-    applyFilters16bit(combinedImage, maxedImage, stackedImage, mask, result);
-
-    if (to8bit) {
-        result /= 256;
-        result.convertTo(result, CV_8U);
-    }
-}
-
-
-#endif
-
 @end
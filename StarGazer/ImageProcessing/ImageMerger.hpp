@@ -13,14 +13,36 @@
 #include <opencv2/opencv.hpp>
 #include <fstream>
 #include <chrono>
+#include <map>
+#include <optional>
 
 #include "StarMatcher.hpp"
+#include "StarTracker.hpp"
+#include "StarDetector.hpp"
+#include "MeshAlignment.hpp"
+#include "FrameQuality.hpp"
+#include "homography.hpp"
 #include "SaveBinaryCV.hpp"
 #include "blend.hpp"
 #include "enhance.hpp"
+#include "SessionRecorder.hpp"
+#include "MemoryBudget.hpp"
+#include "TaskScheduler.hpp"
+#include "TiledCanvas.hpp"
+#include "PreviewBuffer.hpp"
+#include "TrackingOverlay.hpp"
+#include "FrameView.hpp"
+#include "WarpAccumulator.hpp"
+#include "StackStatistics.hpp"
+#include "AdaptiveQuality.hpp"
+#include "DrizzleCanvas.hpp"
+#include "SparseCanvas.hpp"
+#include "ClaheMapping.hpp"
 
 #define CHECKPOINT_FILENAME "/checkpoint.stargazer"
 #define METADATA_FILENAME "/checkpoint.meta"
+#define DRIZZLE_FILENAME "/drizzle.stargazer"
+#define MOSAIC_FILENAME "/mosaic.stargazer"
 
 using namespace std;
 using namespace cv;
@@ -36,6 +58,303 @@ struct MergingException : public exception {
     }
 };
 
+/**
+ Writes the sum of the weights of the aligned frames, appended to a checkpoint after the mask.
+ */
+inline void writeWeightSum(std::ofstream &ofs, double weightSum) {
+    writeMatBinary(ofs, Mat(1, 1, CV_64F, Scalar(weightSum)));
+}
+
+/**
+ Reads the sum of the weights appended to a checkpoint after the mask.
+ Checkpoints written before frames were weighted end with the mask, all their frames had weight 1.
+ */
+inline double readWeightSum(std::ifstream &ifs, int numImages) {
+    if (!ifs.good() || ifs.peek() == std::ifstream::traits_type::eof()) {
+        return numImages;
+    }
+    Mat weightSum;
+    readMatBinary(ifs, weightSum);
+    return weightSum.empty() ? numImages : weightSum.at<double>(0);
+}
+
+/**
+ Writes the measurements of the reference of the quality screen after the sum of the weights, so frames added after
+ resuming are weighted against the same reference. nullptr if frames are not scored.
+ */
+inline void writeReferenceQuality(std::ofstream &ofs, const FrameQuality *reference) {
+    if (reference == nullptr) {
+        writeMatBinary(ofs, Mat());
+        return;
+    }
+    writeMatBinary(ofs, (Mat_<double>(1, 4) << reference->background, reference->noise, reference->starEstimate,
+                         reference->sharpness));
+}
+
+/**
+ Reads the reference written by writeReferenceQuality.
+ @return False if the checkpoint has no reference, e.g. because it was written before references were stored.
+ */
+inline bool readReferenceQuality(std::ifstream &ifs, FrameQuality &reference) {
+    if (!ifs.good() || ifs.peek() == std::ifstream::traits_type::eof()) {
+        return false;
+    }
+    Mat values;
+    readMatBinary(ifs, values);
+    if (values.total() < 4 || values.type() != CV_64F) {
+        return false;
+    }
+    reference.background = (float) values.at<double>(0);
+    reference.noise = (float) values.at<double>(1);
+    reference.starEstimate = (int) values.at<double>(2);
+    reference.sharpness = (float) values.at<double>(3);
+    return true;
+}
+
+/**
+ Settings of a stacking session.
+ */
+struct MergerOptions {
+    /**
+     Toggles if the stars will be rendered onto the image
+     */
+    bool visualiseTrackingPoints = false;
+
+    /**
+     Budget for the memory held by the merger, nullptr for no limit.
+     With a budget, the mask is stored as 8 bit fixed point and the stacks are held as tiles,
+     which are spilled to spillDirectory if they do not fit into the budget.
+     */
+    std::shared_ptr<MemoryBudget> memoryBudget;
+
+    /**
+     Directory the stacks are spilled to. Spilling is disabled if empty.
+     */
+    string spillDirectory;
+
+    /**
+     Edge length of the tiles the stacks are split into if a memory budget is set.
+     */
+    int tileSize = 512;
+
+    /**
+     Tiles of a spilled stack kept in memory, 0 for TiledCanvas::RESIDENT_SHARE of the budget still available.
+     The rest of the budget is left to the drizzled stack, the mosaic and other sessions sharing the budget.
+     */
+    int maxResidentTiles = 0;
+
+    /**
+     Longest side of the preview. 0 returns the full resolution max stack as preview, unless the stack is spilled.
+     */
+    int previewMaxDimension = 0;
+
+    /**
+     Every merged frame is added to a downscaled preview, only every n-th frame publishes it.
+     */
+    int previewInterval = 1;
+
+    /**
+     Stars are detected in the frame downsampled this many times by 2 and refined at full resolution.
+     0 detects stars at full resolution.
+     */
+    int detectionLevels = 0;
+
+    /**
+     Stars are tracked in windows around their predicted positions instead of being detected in the whole frame.
+     A full detection runs every trackingInterval frames and whenever too many stars are lost. 0 disables tracking.
+     */
+    int trackingInterval = 0;
+
+    /**
+     Radius of the window a tracked star is searched in.
+     */
+    int trackingWindowRadius = 12;
+
+    /**
+     Edge length of the tiles the foreground mask is classified in. Tiles that are entirely sky or entirely foreground
+     skip the masking before detection and the planes of the stack the mask discards. 0 processes every pixel.
+     Foreground tiles skip the max as well, so the foreground of the maxed plane stays that of the reference frame.
+     Only the live preview shows the maxed plane, the processed image takes its foreground from the unaligned sum.
+     */
+    int maskTileSize = MaskTiles::DEFAULT_TILE_SIZE;
+
+    /**
+     Hot pixel map of the calibration frames, see Calibration::getHotPixels. Hot pixels are cleared before stars are
+     detected. Only set by stack_frames, the app does not calibrate its frames.
+     */
+    Mat hotPixels;
+
+    /**
+     Scores every frame on a thumbnail before detection and rejects frames that clearly fail, see QualityScreen.
+     */
+    bool screenQuality = false;
+
+    /**
+     Limits of the quality screen relative to the reference frame.
+     */
+    QualityLimits qualityLimits;
+
+    /**
+     Weights every frame by its quality score in the sum of the aligned frames, so better frames contribute more.
+     Frames are scored by the quality screen, which only rejects frames if screenQuality is set. The aligned sum is kept
+     as float, so the weights are not rounded, and the reference of the screen is stored with the checkpoint.
+     */
+    bool weightFrames = false;
+
+    /**
+     Stretch of the processed image. The midtone and asinh stretches are derived from statistics kept up to date
+     while stacking, so they need no analysis of the whole image. Their statistics only sample the sky, so with a
+     foreground mask the foreground is still equalised as with CLAHE.
+     */
+    StretchMode stretch = StretchMode::CLAHE;
+
+    /**
+     Level of the sky background after a midtone or asinh stretch, in range (0, 1).
+     */
+    float stretchTarget = 0.25f;
+
+    /**
+     Lowers the quality of alignment and previews while frames arrive faster than they are merged, see AdaptiveQuality.
+     */
+    bool adaptiveQuality = false;
+
+    /**
+     Interval of the frames in milliseconds for adaptive quality, 0 to measure it from ImageMerger::frameArrived.
+     */
+    double frameInterval = 0;
+
+    /**
+     Scale of the canvas accepted frames are additionally drizzled onto, e.g. 1.5 or 2, see DrizzleCanvas.
+     0 disables drizzling.
+     */
+    float drizzleScale = 0;
+
+    /**
+     Edge length of a drizzled drop relative to a frame pixel, in range (0, 1].
+     */
+    float drizzleDropSize = 1;
+
+    /**
+     Corrects the homography locally in a grid of this many cells along the longer side, for the distortion of wide
+     angle lenses, see MeshAlignment. 0 aligns with the homography alone.
+     */
+    int meshCells = 0;
+
+    /**
+     Additionally adds accepted frames to a sparse canvas that grows with the area the frames cover, see SparseCanvas.
+     Nothing is clipped to the reference frame and every pixel is averaged over the frames that covered it. Only the
+     sky is added, weighted by the foreground mask.
+     The mosaic is an additional output, the stack itself stays clipped to the reference frame, since checkpoints,
+     the editor and exports all expect planes of the frame size. While the sky drifts out of the reference frame, the
+     reference stars are replaced by those of recent frames, so frames keep aligning as the mosaic grows.
+     */
+    bool mosaic = false;
+
+    static MergerOptions withVisualisation(bool visualiseTrackingPoints) {
+        MergerOptions options;
+        options.visualiseTrackingPoints = visualiseTrackingPoints;
+        return options;
+    }
+
+    /**
+     The settings that change the decisions of the merger, as recorded with a session.
+     */
+    SessionSettings sessionSettings() const {
+        SessionSettings settings;
+        settings.detectionLevels = detectionLevels;
+        settings.trackingInterval = trackingInterval;
+        settings.trackingWindowRadius = trackingWindowRadius;
+        settings.maskTileSize = maskTileSize;
+        settings.screenQuality = screenQuality;
+        settings.qualityLimits = qualityLimits;
+        settings.weightFrames = weightFrames;
+        settings.adaptiveQuality = adaptiveQuality;
+        settings.frameInterval = frameInterval;
+        settings.drizzleScale = drizzleScale;
+        settings.drizzleDropSize = drizzleDropSize;
+        settings.meshCells = meshCells;
+        settings.mosaic = mosaic;
+        settings.hotPixels = hotPixels;
+        return settings;
+    }
+
+    /**
+     Takes over the settings a session was recorded with, the other options are kept.
+     */
+    void applySessionSettings(const SessionSettings &settings) {
+        detectionLevels = settings.detectionLevels;
+        trackingInterval = settings.trackingInterval;
+        trackingWindowRadius = settings.trackingWindowRadius;
+        maskTileSize = settings.maskTileSize;
+        screenQuality = settings.screenQuality;
+        qualityLimits = settings.qualityLimits;
+        weightFrames = settings.weightFrames;
+        adaptiveQuality = settings.adaptiveQuality;
+        frameInterval = settings.frameInterval;
+        drizzleScale = settings.drizzleScale;
+        drizzleDropSize = settings.drizzleDropSize;
+        meshCells = settings.meshCells;
+        mosaic = settings.mosaic;
+        hotPixels = settings.hotPixels;
+    }
+};
+
+/**
+ Planes of the stack.
+ */
+enum StackPlane {
+    /**
+     All aligned images are added so they can be averaged later. 16 bit, float if frames are weighted.
+     */
+    COMBINED_PLANE = 0,
+
+    /**
+     Max over all aligned images. 8 bit.
+     */
+    MAXED_PLANE = 1,
+
+    /**
+     All images are added without being aligned. Used to seperate foreground and background. 16 bit.
+     */
+    STACKED_PLANE = 2,
+};
+
+/**
+ Planes of the mosaic.
+ */
+enum MosaicPlane {
+    /**
+     Weighted sum of the aligned frames in 8 bit scale. Float.
+     */
+    MOSAIC_SUM_PLANE = 0,
+
+    /**
+     Max over the aligned frames. 8 bit.
+     */
+    MOSAIC_MAXED_PLANE = 1,
+
+    /**
+     Sum of the weights of the frames that covered a pixel, the sum is divided by it. Float.
+     */
+    MOSAIC_COVERAGE_PLANE = 2,
+};
+
+/**
+ Buffers reused for every frame of a session.
+ They are sized by the first frame, merging further frames of the same size does not allocate full size images.
+ */
+struct FrameWorkspace {
+    vector<Constellation> matchedConstellations;
+    vector<uchar> inlierMask;
+    WarpBuffers warpBuffers;
+    Mat combinedNormal;
+    Mat stackedNormal;
+    Mat inverseMask;
+    vector<Point2i> matchedPoints1;
+    vector<Point2i> matchedPoints2;
+    vector<MaskRegion> maskRegions;
+};
+
 class ImageMerger {
 private:
     /**
@@ -53,51 +372,71 @@ private:
      */
     const int SIMPLE_MATCHER_THRESHOLD = 500;
 
-    bool firstImageAdded = false;
+    /**
+     Lowest weight of a frame, so a poorly scored frame that could still be aligned is never dropped entirely.
+     */
+    const float MIN_FRAME_WEIGHT = 0.1f;
 
     /**
-    Current stack all future aligned images will be merged on.
-    Images will be added so they can be averaged later.
+     Frames whose aligned bounding box is larger than this many frames are not added to the mosaic.
      */
-    Mat currentCombined;
+    const double MAX_MOSAIC_FRAME_AREA = 4;
 
     /**
-    Current stack all imges will be merged onto.
-    Images are merged onto the stack using a max operation, so the stack contains the max over all images.
+     With the mosaic, the reference stars are replaced by those of the current frame once a frame matches fewer than
+     this fraction of the inliers the first frame after the last replacement had.
      */
-    Mat currentMaxed;
-    
+    const double MOSAIC_REFRESH_FRACTION = 0.5;
+
+    /**
+     Longest side of the preview of a spilled stack without a preview size, so previews never assemble the stack.
+     */
+    const int SPILLED_PREVIEW_DIMENSION = 2048;
+
+    bool firstImageAdded = false;
+
+    MergerOptions options;
+
+    /**
+    Current stack all future images will be merged onto, see StackPlane for the planes.
+    Held as a single tile in memory, or as tiles within the memory budget if one is set.
+     */
+    std::unique_ptr<TiledCanvas> stack;
+
     /**
-    Current stack all imges will be merged onto.
-    Images are merged onto the stack without being aligned. Used to spereate foreground and background.
+    Downscaled max stack used as preview, only used if a preview size is set.
      */
-    Mat currentStacked;
+    std::unique_ptr<PreviewBuffer> previewBuffer;
 
     /**
     Mask that seperates fromground from backgrounds in the image.
+    Float in range [0, 1], or 8 bit fixed point if a memory budget is set.
      */
     Mat foregroundMask;
+
+    /**
+     Tile classification of the foreground mask, empty without a mask or if mask tiles are disabled.
+     */
+    MaskTiles maskTiles;
     
     int numImages;
     int numFailed;
 
+    /**
+     Sum of the weights of all merged frames, the aligned sum is divided by it. Equals numImages without weighting.
+     */
+    double weightSum;
+
     float threshold;
 
     Mat totalHomography;
 
-    Mat lastImage;
-
     vector<Point2i> lastStars;
-
-    /**
-    Toggles if the stars will be rendered onto the image
-     */
-    bool visualiseTrackingPoints;
     
     /**
-     Mat containing the stars if visualiseTrackingPoints is enabled
+     Stars, matches and inliers of the last merged frame if visualiseTrackingPoints is enabled
      */
-    Mat starContours;
+    TrackingOverlay trackingOverlay;
     
     /**
     Determinat used to continously monitor stacking. Determinat should only change slightly between frames.
@@ -110,82 +449,681 @@ private:
      */
     std::unique_ptr<StarMatcher> matcher;
 
+    /**
+     Tracks the reference stars between frames, only used if a tracking interval is set.
+     */
+    std::unique_ptr<StarTracker> tracker;
+
+    /**
+     Pixel average of the sky used as border of aligned images. Updated by every full detection.
+     */
+    Scalar borderValue;
+
+    /**
+     Samples of the aligned sums the statistics and the stretch of the stack are computed from.
+     */
+    StackStatistics statistics;
+
+    /**
+     Scores frames before detection, only used if screenQuality is set.
+     */
+    std::unique_ptr<QualityScreen> qualityScreen;
+
+    /**
+     Quality of the last frame, the default quality if frames are not screened.
+     */
+    FrameQuality lastQuality;
+
+    /**
+     Buffers reused between frames.
+     */
+    FrameWorkspace workspace;
+
+    /**
+     Detects the stars of new frames, with the foreground masked out.
+     */
+    StarDetector detector;
+
+    /**
+     Memory of the full size buffers besides the stacks, reserved from the memory budget.
+     */
+    MemoryReservation workspaceReservation;
+
+    /**
+     Local corrections of the alignment, only used if mesh cells are set.
+     */
+    std::unique_ptr<MeshAlignment> mesh;
+
+    /**
+     Stack growing with the covered area, only used if the mosaic is enabled.
+     */
+    std::unique_ptr<SparseCanvas> mosaic;
+
+    /**
+     Inliers of the first frame aligned with the current reference stars, 0 until it is aligned. Only used with the
+     mosaic.
+     */
+    size_t referenceInliers = 0;
+
+    /**
+     Drizzled stack at a finer scale than the frames, only used if a drizzle scale is set.
+     */
+    std::unique_ptr<DrizzleCanvas> drizzle;
+
+    /**
+     Picks the quality of every frame, only used if adaptive quality is enabled.
+     */
+    std::unique_ptr<AdaptiveQuality> adaptiveQuality;
+
+    /**
+     Settings of the frame being merged.
+     */
+    QualitySettings quality;
+
+    /**
+     Settings the next frame is merged with instead of those of adaptive quality, set when replaying a session.
+     */
+    std::optional<QualitySettings> nextQuality;
+
+    /**
+     Threshold of every detection level used so far, the threshold of the current level is kept in threshold.
+     */
+    std::map<int, float> levelThresholds;
+
+    /**
+     Set after switching to a detection level without a threshold, the next full detection finds one.
+     */
+    bool thresholdNeeded = false;
+
+    /**
+     Last preview and the frames it was handed out again, only kept with adaptive quality.
+     */
+    Mat lastPreview;
+    int framesSincePreview = 0;
+
+    void initQuality() {
+        quality.detectionLevels = options.detectionLevels;
+        if (options.adaptiveQuality) {
+            adaptiveQuality = std::make_unique<AdaptiveQuality>(options.detectionLevels, options.frameInterval);
+        }
+    }
+
+    /**
+     Switches to the settings of the next frame.
+     */
+    void applyQuality(const QualitySettings &settings) {
+        if (settings.detectionLevels != detector.getLevels()) {
+            levelThresholds[detector.getLevels()] = threshold;
+            detector.setLevels(settings.detectionLevels);
+            auto known = levelThresholds.find(settings.detectionLevels);
+            thresholdNeeded = known == levelThresholds.end();
+            if (!thresholdNeeded) {
+                threshold = known->second;
+            }
+            // Tracking needs the threshold of the level as well
+            if (tracker) {
+                tracker->invalidate();
+            }
+        }
+        quality = settings;
+    }
+
+    /**
+     Refreshes the preview, or hands out the last one while the quality skips refreshes.
+     */
+    void refreshPreview(Mat &preview) {
+        if (!adaptiveQuality) {
+            getPreview(preview);
+            return;
+        }
+        if (quality.refreshPreview || lastPreview.empty() || ++framesSincePreview >= AdaptiveQuality::PREVIEW_STRIDE) {
+            getPreview(lastPreview);
+            framesSincePreview = 0;
+        }
+        preview = lastPreview;
+    }
+
+    /**
+     Reserves the full size buffers needed besides the stack from the memory budget.
+     Throws if they do not fit.
+     */
+    void reserveWorkspace(Size size) {
+        if (options.memoryBudget == nullptr) {
+            return;
+        }
+        if (!workspaceReservation.reserve(options.memoryBudget, workspaceBytes(size, options, !foregroundMask.empty()))) {
+            throw MergingException("Memory budget too small for a single frame");
+        }
+    }
+
+    /**
+     Types of the planes of a stack resumed from sums of the given depths. 32 bit sums of merged checkpoints stay 32 bit,
+     16 bit aligned sums become float if frames are weighted from now on.
+     */
+    vector<int> resumedPlaneTypes(int combinedDepth, int stackedDepth) {
+        int combinedType = CV_32FC3;
+        if (combinedDepth == CV_16U && !options.weightFrames) {
+            combinedType = CV_16UC3;
+        } else if (combinedDepth == CV_32S && !options.weightFrames) {
+            combinedType = CV_32SC3;
+        }
+        return {combinedType, CV_8UC3, stackedDepth == CV_16U ? CV_16UC3 : CV_32SC3};
+    }
+
+    /**
+     Reads the size and the depths of the sums of a checkpoint without reading its planes.
+     @return False if the checkpoint is empty.
+     */
+    static bool readSumDepths(std::ifstream &ifs, Size &size, int &combinedDepth, int &stackedDepth) {
+        std::streamoff start = ifs.tellg();
+        bool found = true;
+        for (int plane = 0; plane <= STACKED_PLANE && found; plane++) {
+            int rows, cols, type;
+            found = TiledCanvas::readMatHeader(ifs, rows, cols, type);
+            if (!found) {
+                break;
+            }
+            if (plane == COMBINED_PLANE) {
+                size = Size(cols, rows);
+                combinedDepth = CV_MAT_DEPTH(type);
+            } else if (plane == STACKED_PLANE) {
+                stackedDepth = CV_MAT_DEPTH(type);
+            }
+            ifs.seekg((std::streamoff) ((size_t) rows * cols * CV_ELEM_SIZE(type)), std::ios::cur);
+        }
+        ifs.clear();
+        ifs.seekg(start);
+        return found;
+    }
+
+    /**
+     Creates the stack, spilled to disk if it does not fit into the memory budget.
+     @param planeTypes Types of the planes, see stackPlaneTypes
+     */
+    void createStack(Size size, const vector<int> &planeTypes) {
+        int tileSize = options.memoryBudget != nullptr ? options.tileSize : std::max(size.width, size.height);
+        try {
+            stack = std::make_unique<TiledCanvas>(size, planeTypes, tileSize,
+                                                  options.memoryBudget, options.spillDirectory,
+                                                  options.maxResidentTiles);
+        } catch (const CanvasException &e) {
+            throw MergingException(e.what());
+        }
+    }
+
+    /**
+     Creates the downscaled preview if a preview size is set or the stack is spilled.
+     */
+    void createPreview() {
+        if (options.previewMaxDimension > 0 || stack->isSpilled()) {
+            int dimension = options.previewMaxDimension > 0 ? options.previewMaxDimension : SPILLED_PREVIEW_DIMENSION;
+            previewBuffer = std::make_unique<PreviewBuffer>(stack->getSize(), dimension, options.previewInterval);
+        }
+    }
+
+    /**
+     Creates the drizzle canvas if drizzling is enabled, spilled to disk like the stack.
+     Drizzling is an addition to the stack, so a canvas that does not fit only disables it.
+     */
+    void createDrizzle(Size frameSize) {
+        if (options.drizzleScale <= 0) {
+            return;
+        }
+        try {
+            drizzle = std::make_unique<DrizzleCanvas>(frameSize, options.drizzleScale, options.drizzleDropSize,
+                                                      options.tileSize, options.memoryBudget, options.spillDirectory);
+        } catch (const CanvasException &e) {
+            std::cout << "Drizzling disabled: " << e.what() << std::endl;
+            drizzle.reset();
+        }
+    }
+
+    /**
+     Creates the mosaic if it is enabled, its tiles are spilled to disk like the stack.
+     */
+    void createMosaic() {
+        if (options.mosaic) {
+            mosaic = std::make_unique<SparseCanvas>(vector<int>{CV_32FC3, CV_8UC3, CV_32FC1}, options.tileSize,
+                                                    options.memoryBudget, options.spillDirectory);
+        }
+    }
+
+    /**
+     Replaces the reference stars with the stars of an aligned frame in stack coordinates, once the frames match
+     clearly fewer reference stars than after the last replacement. The matcher and the tracker are rebuilt for them.
+     Without it, the stars of the reference drift out of the frames and frames stop aligning long before the mosaic
+     covers the sky they reach.
+     @param inliers Number of matches the homography of the frame explains
+     */
+    void refreshReferenceStars(const vector<Point2i> &stars, const Mat &h, size_t inliers) {
+        if (referenceInliers == 0) {
+            referenceInliers = inliers;
+            return;
+        }
+        if (inliers >= MOSAIC_REFRESH_FRACTION * referenceInliers || stars.size() < MIN_STARS_PER_IMAGE) {
+            return;
+        }
+
+        vector<Point2f> framePoints(stars.begin(), stars.end()), stackPoints;
+        perspectiveTransform(framePoints, stackPoints, h);
+        lastStars.clear();
+        for (auto &point: stackPoints) {
+            lastStars.push_back(Point2i(cvRound(point.x), cvRound(point.y)));
+        }
+        matcher = std::make_unique<StarMatcher>(lastStars);
+        if (tracker) {
+            tracker = std::make_unique<StarTracker>(lastStars, options.trackingWindowRadius, options.trackingInterval);
+            tracker->setMask(foregroundMask);
+            tracker->update(h, true);
+        }
+        referenceInliers = 0;
+        std::cout << "Reference stars refreshed, " << lastStars.size() << " stars" << std::endl;
+    }
+
+    /**
+     Adds an aligned frame to the tiles of the mosaic it covers, allocating tiles it covers for the first time.
+     */
+    void accumulateMosaic(const FrameView &frame, const Mat &h, float weight, const Mat &offsets = Mat()) {
+        vector<Point2f> corners = {Point2f(0, 0), Point2f(frame.size().width, 0),
+                                   Point2f(0, frame.size().height), Point2f(frame.size().width, frame.size().height)};
+        perspectiveTransform(corners, corners, h);
+        Rect area = boundingRect(corners);
+
+        // A degenerate homography would allocate a huge area
+        if ((double) area.area() > MAX_MOSAIC_FRAME_AREA * frame.size().area()) {
+            std::cout << "Frame not added to the mosaic, aligned area too large" << std::endl;
+            return;
+        }
+        try {
+            for (auto &index: mosaic->tilesIn(area)) {
+                CanvasTile &tile = mosaic->acquire(index);
+                accumulateCovered(frame, h, tile.rect.tl(), tile.planes[MOSAIC_SUM_PLANE],
+                                  tile.planes[MOSAIC_MAXED_PLANE], tile.planes[MOSAIC_COVERAGE_PLANE], weight, offsets,
+                                  foregroundMask);
+            }
+        } catch (const CanvasException &e) {
+            throw MergingException(e.what());
+        }
+    }
+
+    /**
+     Sets the foreground mask used by detection and accumulation, and classifies its tiles.
+     */
+    void setForegroundMask() {
+        detector.setMask(foregroundMask, options.maskTileSize);
+        if (!foregroundMask.empty() && options.maskTileSize > 0) {
+            maskTiles = MaskTiles(foregroundMask, options.maskTileSize);
+            std::cout << "Mask tiles: " << maskTiles.fraction(MaskTileClass::SKY) * 100 << "% sky, "
+                      << maskTiles.fraction(MaskTileClass::FOREGROUND) * 100 << "% foreground" << std::endl;
+        }
+    }
+
+    /**
+     Adds an image to the stack.
+     The image is warped onto every tile separately, so the aligned image is never larger than a tile.
+     @param h Homography aligning the image with the stack
+     @param border Value used for pixels outside of the warped image
+     @param weight Weight of the image in the aligned sum
+     @param sparse Skips the planes the foreground mask discards. The reference is added to all planes,
+                   so the preview shows its foreground.
+     @param offsets Local corrections of the mesh alignment, empty to warp with the homography alone
+     */
+    void accumulate(const FrameView &frame, const Mat &h, const Scalar &border, float weight = 1, bool sparse = true,
+                    const Mat &offsets = Mat()) {
+        for (int i = 0; i < stack->numTiles(); i++) {
+            CanvasTile &tile = stack->acquire(i);
+            accumulateMaskedTile(frame, h, border, tile.rect, tile.planes[MAXED_PLANE], tile.planes[COMBINED_PLANE],
+                                 tile.planes[STACKED_PLANE], workspace.warpBuffers,
+                                 sparse ? maskTiles : MaskTiles(), workspace.maskRegions, weight, offsets);
+            statistics.update(tile.rect, tile.planes[COMBINED_PLANE]);
+        }
+    }
+
+    /**
+     Writes the mask as float, the format of the checkpoint, without converting the whole mask at once.
+     */
+    void writeMaskBinary(std::ofstream &ofs) {
+        if (foregroundMask.empty() || foregroundMask.depth() == CV_32F) {
+            writeMatBinary(ofs, foregroundMask);
+            return;
+        }
+        int type = CV_32F;
+        ofs.write((const char *) (&foregroundMask.rows), sizeof(int));
+        ofs.write((const char *) (&foregroundMask.cols), sizeof(int));
+        ofs.write((const char *) (&type), sizeof(int));
+        Mat row;
+        for (int y = 0; y < foregroundMask.rows; y++) {
+            foregroundMask.row(y).convertTo(row, CV_32F, 1.0 / 255);
+            ofs.write((const char *) row.data, row.total() * row.elemSize());
+        }
+    }
+
+    /**
+     Receives every frame and merging decision, used to record sessions.
+     */
+    std::shared_ptr<MergeObserver> observer;
+
+    /**
+     Time spent in every stage of the last frame.
+     */
+    StageTimings lastTimings;
+
+    /**
+     Index of the next frame, counting both merged and failed frames.
+     */
+    int nextFrameIndex() {
+        return numImages + numFailed;
+    }
+
+    void startFrame(int index, const FrameView &frame, const Mat &segmentation) {
+        if (observer) {
+            seedFrameRandomGenerators(index);
+            // Only copied if the frame cannot be handed out as a Mat directly
+            Mat image;
+            if (!frame.asMat(image)) {
+                frame.toMat(image);
+            }
+            observer->frameStarted(index, image, segmentation);
+        }
+    }
+
+    void finishFrame(FrameRecord &record, FrameDecision decision) {
+        record.decision = decision;
+        lastTimings = record.timings;
+        if (adaptiveQuality && decision != FrameDecision::Reference) {
+            adaptiveQuality->frameMerged(record.timings.total());
+        }
+        if (observer) {
+            observer->frameFinished(record);
+        }
+    }
+
+    bool rejectFrame(FrameRecord &record, FrameDecision decision, Mat &preview, StageTimer &timer) {
+        numFailed++;
+        if (tracker) {
+            tracker->invalidate();
+        }
+        refreshPreview(preview);
+        record.timings.preview = timer.lap();
+        finishFrame(record, decision);
+        return false;
+    }
+
 public:
+    /**
+     Types of the planes of a new stack. The aligned sum is float if frames are weighted, so the weighted frames are
+     added without rounding and only the average is rounded.
+     */
+    static vector<int> stackPlaneTypes(const MergerOptions &options) {
+        return {options.weightFrames ? CV_32FC3 : CV_16UC3, CV_8UC3, CV_16UC3};
+    }
+
+    /**
+     Memory of the full size buffers a merger with a memory budget reserves besides the stacks.
+     @param masked True if the stack has a foreground mask
+     */
+    static size_t workspaceBytes(Size size, const MergerOptions &options, bool masked) {
+        // Detection buffers and a full resolution preview, detection buffers shrink with coarse to fine detection
+        size_t bytesPerPixel = options.detectionLevels > 0 ? 1 : 3;
+        bytesPerPixel += options.previewMaxDimension > 0 ? 0 : 3;
+        if (masked) {
+            // The mask is 8 bit fixed point with a budget
+            bytesPerPixel += 1 + 3;
+        }
+        // Warp buffers of a tile, the warped frame in its own layout has up to 4 channels, and the processing buffers
+        size_t tileBytes = (size_t) options.tileSize * options.tileSize * (3 + 4 + 3 + 3 + 3 + 1);
+        // The table of the mesh and the map of a tile
+        size_t meshBytes = options.meshCells > 0
+                           ? MeshAlignment::tableBytes(size) + (size_t) options.tileSize * options.tileSize * 8 : 0;
+        return (size_t) size.area() * bytesPerPixel + tileBytes + meshBytes;
+    }
+
     /**
      * Creates a new image merger and tries to initialize all values.
      * If not enough features are found ion the initial image, an exception is thrown.
      * @param image
+     * @param observer Optional observer that receives every frame and decision, e.g. a SessionRecorder.
      */
-    ImageMerger(Mat &image, Mat &segmentation, bool visualiseTrackingPoints = false) : visualiseTrackingPoints(visualiseTrackingPoints) {
-        Mat imageMasked;
-        
+    ImageMerger(Mat &image, Mat &segmentation, bool visualiseTrackingPoints = false, std::shared_ptr<MergeObserver> observer = nullptr) :
+            ImageMerger(image, segmentation, MergerOptions::withVisualisation(visualiseTrackingPoints), observer) {
+    }
+
+    /**
+     * Creates a new image merger with the given settings.
+     * Throws if not enough features are found in the initial image or if the stack does not fit into the memory budget.
+     */
+    ImageMerger(Mat &image, Mat &segmentation, MergerOptions options, std::shared_ptr<MergeObserver> observer = nullptr) :
+            ImageMerger(FrameView(image), segmentation, options, observer) {
+    }
+
+    /**
+     * Creates a new image merger from a frame in an external buffer. The buffer is only read during the call.
+     * Throws if not enough features are found in the initial frame or if the stack does not fit into the memory budget.
+     */
+    ImageMerger(const FrameView &frame, Mat &segmentation, MergerOptions options, std::shared_ptr<MergeObserver> observer = nullptr) :
+            options(options), detector(options.detectionLevels), observer(observer) {
+        detector.setHotPixels(options.hotPixels);
+        initQuality();
+        FrameRecord record;
+        record.quality = quality;
+        if (observer) {
+            observer->sessionStarted(options.sessionSettings());
+        }
+        startFrame(0, frame, segmentation);
+        StageTimer timer;
+
         if (!segmentation.empty()) {
             createTrackingMask(segmentation, foregroundMask);
-            resize(foregroundMask, foregroundMask, image.size(), 0, 0, INTER_LINEAR);
-            
-            // Apply mask to image.
-            applyMask(image, foregroundMask, imageMasked);
-        } else {
-            image.copyTo(imageMasked);
+            if (options.memoryBudget != nullptr) {
+                // Convert before resizing, so no full size float mask is ever allocated
+                foregroundMask.convertTo(foregroundMask, CV_8U, 255);
+            }
+            resize(foregroundMask, foregroundMask, frame.size(), 0, 0, INTER_LINEAR);
+            setForegroundMask();
+        }
+        reserveWorkspace(frame.size());
+
+        // The reference frame is the reference of the quality screen
+        if (options.screenQuality || options.weightFrames) {
+            qualityScreen = std::make_unique<QualityScreen>(options.qualityLimits);
+            qualityScreen->setMask(foregroundMask);
+            qualityScreen->evaluate(frame, lastQuality);
         }
         
+        // Apply mask to image.
+        const Mat &imageMasked = detector.detectionImage(frame);
+        record.timings.masking = timer.lap();
+        
         // Find an initial threshold to be used in future images
         std::cout << "Finding initial threshold..." << std::endl;
-        threshold = getThreshold(imageMasked);
+        threshold = detector.findThreshold(imageMasked);
         std::cout << "Initial threshold: " << threshold << std::endl;
+        record.threshold = threshold;
         if (threshold == numeric_limits<float>::infinity()) {
+            record.timings.detection = timer.lap();
+            finishFrame(record, FrameDecision::NotEnoughStars);
             throw MergingException("Could not find initial threshold");
         }
 
         std::cout << "Finding initial stars..." << std::endl;
         //Find the star centers for the first image
-        Mat contour;
-        getStarCenters(imageMasked, threshold, contour, lastStars);
+        detector.detect(imageMasked, frame, threshold, lastStars);
+        borderValue = cv::mean(imageMasked);
         std::cout << "Found " << lastStars.size() << " stars" << std::endl;
+        record.stars = lastStars;
+        record.timings.detection = timer.lap();
 
         if (lastStars.size() < MIN_STARS_PER_IMAGE) {
+            finishFrame(record, FrameDecision::NotEnoughStars);
             throw MergingException("Not enough stars found in initial image");
         }
 
         // Initialize the matcher
         matcher = std::make_unique<StarMatcher>(lastStars);
-
-        // Initialize the current stacks
-        image.copyTo(lastImage);
-        lastImage.convertTo(currentCombined, CV_16U);
-        lastImage.convertTo(currentStacked, CV_16U);
-
-        currentMaxed = image.clone();
+        if (options.trackingInterval > 0) {
+            tracker = std::make_unique<StarTracker>(lastStars, options.trackingWindowRadius, options.trackingInterval);
+            tracker->setMask(foregroundMask);
+        }
+        record.timings.matching = timer.lap();
 
         // Init the total homography matrix as identity
         totalHomography = Mat::eye(3, 3, CV_64FC1);
 
-        size_t sizeInBytes = currentCombined.total() * currentCombined.elemSize();
-        std::cout << "Size in bytes: " << sizeInBytes << std::endl;
+        if (options.meshCells > 0) {
+            mesh = std::make_unique<MeshAlignment>(frame.size(), options.meshCells);
+        }
+
+        // Initialize the current stacks
+        createStack(frame.size(), stackPlaneTypes(options));
+        statistics = StackStatistics(frame.size(), foregroundMask);
+        accumulate(frame, totalHomography, Scalar(), 1, false);
+        createDrizzle(frame.size());
+        if (drizzle) {
+            drizzle->add(frame, totalHomography, 1, foregroundMask);
+        }
+        createMosaic();
+        if (mosaic) {
+            accumulateMosaic(frame, totalHomography, 1);
+        }
+
+        createPreview();
+        if (previewBuffer) {
+            previewBuffer->add(frame, totalHomography, Scalar());
+        }
+
+        size_t sizeInBytes = (size_t) frame.size().area() * TiledCanvas::bytesPerPixel(stackPlaneTypes(options));
+        std::cout << "Size in bytes: " << sizeInBytes << (stack->isSpilled() ? " (spilled)" : "") << std::endl;
         
         numImages = 1;
         numFailed = 0;
+        weightSum = 1;
+
+        record.homography = totalHomography;
+        record.timings.accumulation = timer.lap();
+        finishFrame(record, FrameDecision::Reference);
     }
     
     /**
      Continue processing from a previously saved checkpoint
      */
-    ImageMerger(string checkpoint, int numImages, bool visualiseTrackingPoints = false) : visualiseTrackingPoints(visualiseTrackingPoints) {
+    ImageMerger(string checkpoint, int numImages, bool visualiseTrackingPoints = false) :
+            ImageMerger(checkpoint, numImages, MergerOptions::withVisualisation(visualiseTrackingPoints)) {
+    }
+
+    /**
+     Continue processing from a previously saved checkpoint.
+     With a memory budget the stack is read tile by tile and never held in memory as a whole.
+     Sums stored as 32 bit, e.g. by the CheckpointMerger, stay 32 bit, see resumedPlaneTypes.
+     @param numImages Number of frames in the checkpoint, -1 to read it from the metadata file
+     */
+    ImageMerger(string checkpoint, int numImages, MergerOptions options) : options(options), detector(options.detectionLevels) {
+        detector.setHotPixels(options.hotPixels);
+        initQuality();
         std::cout << "Checkpoint path: " << checkpoint + CHECKPOINT_FILENAME << std::endl;
-        
+
+        if (numImages < 0) {
+            std::ifstream meta(checkpoint + METADATA_FILENAME);
+            if (!(meta >> numImages)) {
+                throw MergingException("Checkpoint has no metadata");
+            }
+        }
+
         std::ifstream ifs(checkpoint + CHECKPOINT_FILENAME, std::ios::binary);
 
-        readMatBinary(ifs, currentCombined);
-        currentCombined.convertTo(currentCombined, CV_16U);
-        
-        readMatBinary(ifs, currentMaxed);
-        currentMaxed.convertTo(currentMaxed, CV_8U);
-        
-        readMatBinary(ifs, currentStacked);
-        currentStacked.convertTo(currentStacked, CV_16U);
+        FrameQuality storedReference;
+        bool hasStoredReference;
+        if (options.memoryBudget != nullptr) {
+            Size size;
+            int combinedDepth, stackedDepth;
+            if (!readSumDepths(ifs, size, combinedDepth, stackedDepth)) {
+                throw MergingException("Checkpoint is empty");
+            }
+
+            createStack(size, resumedPlaneTypes(combinedDepth, stackedDepth));
+            stack->readPlaneBinary(ifs, COMBINED_PLANE);
+            stack->readPlaneBinary(ifs, MAXED_PLANE);
+            stack->readPlaneBinary(ifs, STACKED_PLANE);
+
+            readMatBinary(ifs, foregroundMask);
+            foregroundMask.convertTo(foregroundMask, CV_8U, 255);
+            weightSum = readWeightSum(ifs, numImages);
+            hasStoredReference = readReferenceQuality(ifs, storedReference);
+        } else {
+            Mat currentCombined, currentMaxed, currentStacked;
+            readMatBinary(ifs, currentCombined);
+            readMatBinary(ifs, currentMaxed);
+            readMatBinary(ifs, currentStacked);
+            vector<int> planeTypes = resumedPlaneTypes(currentCombined.depth(), currentStacked.depth());
+            currentCombined.convertTo(currentCombined, planeTypes[COMBINED_PLANE]);
+            currentMaxed.convertTo(currentMaxed, CV_8U);
+            currentStacked.convertTo(currentStacked, planeTypes[STACKED_PLANE]);
+
+            stack = std::make_unique<TiledCanvas>(vector<Mat>{currentCombined, currentMaxed, currentStacked});
+
+            readMatBinary(ifs, foregroundMask);
+            foregroundMask.convertTo(foregroundMask, CV_32F);
+            weightSum = readWeightSum(ifs, numImages);
+            hasStoredReference = readReferenceQuality(ifs, storedReference);
+        }
+        setForegroundMask();
+
+        createMosaic();
+        if (mosaic) {
+            std::ifstream mosaicStream(checkpoint + MOSAIC_FILENAME, std::ios::binary);
+            try {
+                if (!mosaicStream || !mosaic->readBinary(mosaicStream)) {
+                    std::cout << "No mosaic in checkpoint" << std::endl;
+                }
+            } catch (const CanvasException &e) {
+                std::cout << "Mosaic not resumed: " << e.what() << std::endl;
+                mosaic.reset();
+                createMosaic();
+            }
+        }
+
+        // The corrections are fitted again from the next frames
+        if (options.meshCells > 0) {
+            mesh = std::make_unique<MeshAlignment>(stack->getSize(), options.meshCells);
+        }
+
+        // The samples are taken once from the checkpoint and kept up to date from then on
+        statistics = StackStatistics(stack->getSize(), foregroundMask);
+        for (int i = 0; i < stack->numTiles(); i++) {
+            CanvasTile &tile = stack->acquire(i);
+            statistics.update(tile.rect, tile.planes[COMBINED_PLANE]);
+        }
+
+        createPreview();
+        if (previewBuffer) {
+            for (int i = 0; i < stack->numTiles(); i++) {
+                CanvasTile &tile = stack->acquire(i);
+                previewBuffer->resetTile(tile.rect, tile.planes[MAXED_PLANE]);
+            }
+        }
+
+        // A checkpoint without a drizzled stack starts drizzling with the next frame
+        createDrizzle(stack->getSize());
+        if (drizzle) {
+            std::ifstream drizzleStream(checkpoint + DRIZZLE_FILENAME, std::ios::binary);
+            try {
+                if (!drizzleStream || !drizzle->readBinary(drizzleStream)) {
+                    std::cout << "No drizzled stack in checkpoint" << std::endl;
+                }
+            } catch (const CanvasException &e) {
+                std::cout << "Drizzled stack not resumed: " << e.what() << std::endl;
+                drizzle.reset();
+                createDrizzle(stack->getSize());
+            }
+        }
         
-        readMatBinary(ifs, foregroundMask);
-        foregroundMask.convertTo(foregroundMask, CV_32F);
+        // Without a stored reference, the first frame after resuming becomes the reference of the quality screen
+        if (options.screenQuality || options.weightFrames) {
+            qualityScreen = std::make_unique<QualityScreen>(options.qualityLimits);
+            qualityScreen->setMask(foregroundMask);
+            if (hasStoredReference) {
+                qualityScreen->setReference(storedReference);
+            }
+        }
         
         this->numImages = numImages;
         numFailed = 0;
@@ -200,39 +1138,216 @@ public:
      * @param previewImage
      */
     void getPreview(Mat &previewImage) {
-        //previewImage = currentMaxed;
-        previewImage = currentMaxed.clone();
+        Mat maxed;
+        if (previewBuffer) {
+            // Shared with the preview buffer, must not be written to
+            maxed = previewBuffer->get();
+        } else {
+            // Only stacks held in memory have no preview buffer
+            maxed = stack->plane(MAXED_PLANE).clone();
+        }
+        previewImage = maxed;
         
-        if (visualiseTrackingPoints) {
-            std::cout << "added contours" << std::endl;
-            if (!starContours.empty()) {
-                addWeighted(previewImage, 0.5, starContours, 5, 0.0, previewImage);
-            }
+        if (options.visualiseTrackingPoints && !trackingOverlay.empty()) {
+            // Drawn at preview resolution onto a copy, the preview itself may be shared
+            Mat overlay = maxed.clone();
+            trackingOverlay.draw(overlay);
+            previewImage = overlay;
         }
     } 
 
     /**
      * Returns the processed image.
+     * With a memory budget, the image is reserved from the budget while it is processed and the equalisation works
+     * tile by tile. Throws if the image does not fit.
      */
     void getProcessed(Mat &image) {
-        if (!foregroundMask.empty()) {
-            Mat combinedNormal = currentCombined / numImages;
-            Mat stackedNormal = currentStacked / numImages;
-            
-            combinedNormal.convertTo(combinedNormal, CV_8UC3);
-            applyMask(combinedNormal, foregroundMask, combinedNormal);
-            
-            stackedNormal.convertTo(stackedNormal, CV_8UC3);
-            applyMask(stackedNormal, 1 - foregroundMask, stackedNormal);
-                  
-            addWeighted(combinedNormal, 1, stackedNormal, 1, 0, image);
-
-            autoEnhance(image, image);
-            
-            //blendMasked(combinedNormal, stackedNormal, foregroundMask, image);
+        MemoryReservation imageReservation;
+        if (options.memoryBudget != nullptr &&
+            !imageReservation.reserve(options.memoryBudget, (size_t) stack->getSize().area() * 3)) {
+            throw MergingException("Memory budget too small for the processed image");
+        }
+        image.create(stack->getSize(), CV_8UC3);
+
+        // The stretch of the sky is fused with the division of the sums, instead of equalising the finished image
+        StretchLut lut;
+        if (options.stretch != StretchMode::CLAHE) {
+            statistics.createStretch(weightSum, options.stretch, options.stretchTarget, lut);
+        }
+
+        // Processed tile by tile, so a spilled stack never needs to be resident as a whole
+        vector<Rect> rects;
+        for (int i = 0; i < stack->numTiles(); i++) {
+            CanvasTile &tile = stack->acquire(i);
+            Mat result = image(tile.rect);
+            composeProcessedTile(tile.planes[COMBINED_PLANE], tile.planes[STACKED_PLANE],
+                                 foregroundMask.empty() ? Mat() : foregroundMask(tile.rect), weightSum, numImages, lut,
+                                 workspace, result);
+            rects.push_back(tile.rect);
+        }
+        equaliseProcessed(rects, foregroundMask, !lut.empty(), workspace, image);
+    }
+
+    /**
+     * Composes a tile of the processed image from the sums of the stack. The sky is the aligned sum, stretched by the
+     * lookup tables unless they are empty, the foreground the unaligned sum.
+     * Shared by every stack that renders like the merger, e.g. PartialStack.
+     * @param mask Foreground mask of the tile, empty without segmentation
+     * @param buffers Buffers reused between tiles
+     */
+    static void composeProcessedTile(const Mat &combined, const Mat &stacked, const Mat &mask, double weightSum,
+                                     int numImages, const StretchLut &lut, FrameWorkspace &buffers, Mat &result) {
+        if (mask.empty()) {
+            if (lut.empty()) {
+                combined.convertTo(result, CV_8U, 1.0 / weightSum);
+            } else {
+                lut.apply(combined, weightSum, result);
+            }
+            return;
+        }
+
+        if (lut.empty()) {
+            combined.convertTo(buffers.combinedNormal, CV_8U, 1.0 / weightSum);
         } else {
-            Mat combinedNormal = currentCombined / numImages;
-            combinedNormal.convertTo(image, CV_8UC3);
+            lut.apply(combined, weightSum, buffers.combinedNormal);
+        }
+        applyMask(buffers.combinedNormal, mask, buffers.combinedNormal);
+
+        stacked.convertTo(buffers.stackedNormal, CV_8U, 1.0 / numImages);
+        invertMask(mask, buffers.inverseMask);
+        applyMask(buffers.stackedNormal, buffers.inverseMask, buffers.stackedNormal);
+
+        add(buffers.combinedNormal, buffers.stackedNormal, result);
+    }
+
+    /**
+     * Equalises a composed image with a foreground, with one mapping for the whole image applied tile by tile, so no
+     * full size buffers are needed besides the image. Nothing is done without a foreground.
+     * @param rects Tiles of the image
+     * @param stretched True if the sky was stretched, only the foreground is equalised then
+     */
+    static void equaliseProcessed(const vector<Rect> &rects, const Mat &mask, bool stretched, FrameWorkspace &buffers,
+                                  Mat &image) {
+        if (mask.empty()) {
+            return;
+        }
+        // The stretch only knows the statistics of the sky, the foreground is still equalised with a stretched sky.
+        ClaheMapping mapping(image.size());
+        mapping.build(image);
+        for (const Rect &rect: rects) {
+            Mat result = image(rect);
+            if (!stretched) {
+                mapping.apply(result, rect.tl(), result);
+                continue;
+            }
+            Mat maskTile = mask(rect);
+            mapping.apply(result, rect.tl(), buffers.stackedNormal);
+            invertMask(maskTile, buffers.inverseMask);
+            applyMask(buffers.stackedNormal, buffers.inverseMask, buffers.stackedNormal);
+            applyMask(result, maskTile, buffers.combinedNormal);
+            add(buffers.combinedNormal, buffers.stackedNormal, result);
+        }
+    }
+
+    /**
+     * Returns the drizzled stack, 8 bit or 16 bit RGB at the drizzle scale, see DrizzleCanvas::getAverage.
+     * Only the sky is drizzled, the foreground is taken from the unaligned sum, upscaled, like in the processed image.
+     * @return False if drizzling is disabled
+     */
+    bool getDrizzled(Mat &image, int depth = CV_8U) {
+        if (!drizzle) {
+            return false;
+        }
+        drizzle->getAverage(image, depth);
+        if (foregroundMask.empty()) {
+            return true;
+        }
+
+        float scale = drizzle->getScale();
+        double outputScale = (depth == CV_16U ? 257.0 : 1.0) / numImages;
+        Mat stackedTile, maskTile, inverseMask, drizzled;
+        for (int i = 0; i < stack->numTiles(); i++) {
+            CanvasTile &tile = stack->acquire(i);
+            Rect target = Rect(Point(cvRound(tile.rect.x * scale), cvRound(tile.rect.y * scale)),
+                               Point(cvRound(tile.rect.br().x * scale), cvRound(tile.rect.br().y * scale)))
+                          & Rect(Point(0, 0), image.size());
+            if (target.empty()) {
+                continue;
+            }
+            tile.planes[STACKED_PLANE].convertTo(stackedTile, CV_32F, outputScale);
+            resize(stackedTile, stackedTile, target.size(), 0, 0, INTER_LINEAR);
+            foregroundMask(tile.rect).convertTo(maskTile, CV_32F, foregroundMask.depth() == CV_8U ? 1.0 / 255 : 1.0);
+            resize(maskTile, maskTile, target.size(), 0, 0, INTER_LINEAR);
+            invertMask(maskTile, inverseMask);
+
+            Mat result = image(target);
+            result.convertTo(drizzled, CV_32F);
+            blendLinear(drizzled, stackedTile, maskTile, inverseMask, drizzled);
+            drizzled.convertTo(result, depth);
+        }
+        return true;
+    }
+
+    /**
+     * Returns the mosaic as 8 bit RGB average over the bounding box of its tiles. Pixels no frame covered
+     * and the foreground are black. Assembled tile by tile, a spilled mosaic is never resident as a whole.
+     * @param origin Receives the position of the top left corner of the image relative to the reference frame
+     * @return False if the mosaic is disabled
+     */
+    bool getMosaic(Mat &image, Point &origin) {
+        if (!mosaic) {
+            return false;
+        }
+        Rect bounds = mosaic->bounds();
+        origin = bounds.tl();
+        image = Mat::zeros(bounds.size(), CV_8UC3);
+        Mat average;
+        for (auto &index: mosaic->allocatedTiles()) {
+            CanvasTile &tile = mosaic->acquire(index);
+            const Mat &sum = tile.planes[MOSAIC_SUM_PLANE];
+            const Mat &coverage = tile.planes[MOSAIC_COVERAGE_PLANE];
+            average.create(tile.rect.size(), CV_32FC3);
+            for (int y = 0; y < tile.rect.height; y++) {
+                const float *sumRow = sum.ptr<float>(y);
+                const float *coverageRow = coverage.ptr<float>(y);
+                float *averageRow = average.ptr<float>(y);
+                for (int x = 0; x < tile.rect.width; x++) {
+                    float inverse = coverageRow[x] > 0 ? 1.0f / coverageRow[x] : 0;
+                    averageRow[x * 3] = sumRow[x * 3] * inverse;
+                    averageRow[x * 3 + 1] = sumRow[x * 3 + 1] * inverse;
+                    averageRow[x * 3 + 2] = sumRow[x * 3 + 2] * inverse;
+                }
+            }
+            Mat target = image(tile.rect - origin);
+            average.convertTo(target, CV_8U);
+        }
+        return true;
+    }
+
+    /**
+     * Notes that a frame was captured and will be merged, used by adaptive quality to measure the frame interval
+     * and the frames waiting. Can be called from any thread.
+     */
+    void frameArrived() {
+        if (adaptiveQuality) {
+            adaptiveQuality->frameArrived();
+        }
+    }
+
+    /**
+     * Merges the next frame with the given settings instead of those picked by adaptive quality, so a replayed session
+     * takes the decisions of the recording, which depended on the timing of the recording device.
+     */
+    void setNextQuality(const QualitySettings &settings) {
+        nextQuality = settings;
+    }
+
+    /**
+     * Notes that a frame announced by frameArrived will not be merged.
+     */
+    void frameDropped() {
+        if (adaptiveQuality) {
+            adaptiveQuality->frameDropped();
         }
     }
 
@@ -244,66 +1359,127 @@ public:
      * @return True if the operation was successful, false otherwise.
      */
     bool mergeImageOnStack(Mat &image, Mat &preview) {
-        Mat imageMasked;
-        if (!foregroundMask.empty()) {
-            // Apply mask to image.
-            applyMask(image, foregroundMask, imageMasked);
-        } else {
-            image.copyTo(imageMasked);
-        }
-        
-        // Compute the stars in the current image
-        vector<Point2i> stars;
-        Mat contours;
-        threshold = getStarCenters(imageMasked, threshold, contours, stars);
-        
-        if (stars.size() < MIN_STARS_PER_IMAGE) {
-            std::cout << "Not enough stars found" << std::endl;
-            numFailed++;
-            getPreview(preview);
-            return false;
+        return mergeFrame(FrameView(image), preview);
+    }
+
+    /**
+     * Tries to merge a frame in an external buffer on top of the stack.
+     * The frame is read in its own layout by detection, tracking and accumulation, it is not copied before accumulation.
+     * The buffer is only read during the call.
+     * @return True if the operation was successful, false otherwise.
+     */
+    bool mergeFrame(const FrameView &frame, Mat &preview) {
+        TaskScope scope(TaskPriority::STACKING);
+        if (nextQuality) {
+            applyQuality(*nextQuality);
+            nextQuality.reset();
+        } else if (adaptiveQuality) {
+            applyQuality(adaptiveQuality->getSettings());
         }
+        FrameRecord record;
+        record.quality = quality;
+        record.index = nextFrameIndex();
+        startFrame(record.index, frame, Mat());
+        StageTimer timer;
 
-        // Match the stars with the last image
-        vector<DMatch> matches;
-        std::cout << "Last star size: " << lastStars.size() << ", new stars size: " << stars.size() << std::endl;
+        vector<Point2i> &stars = record.stars;
+        vector<DMatch> &matches = record.matches;
+        record.threshold = threshold;
 
-        /*
-        if (std::max(lastStars.size(), stars.size()) > SIMPLE_MATCHER_THRESHOLD) {
-            matchStars(lastStars, stars, matches);
-        } else {
-            matchStarsSimple(lastStars, stars, matches);
+        // Reject frames that clearly fail on a thumbnail, before any full resolution work
+        if (qualityScreen && !qualityScreen->evaluate(frame, lastQuality) && options.screenQuality) {
+            record.timings.detection = timer.lap();
+            std::cout << "Frame rejected by quality screen: " << lastQuality.rejection << std::endl;
+            return rejectFrame(record, FrameDecision::LowQuality, preview, timer);
         }
-         */
-        Mat featureVis = Mat::zeros(imageMasked.rows, imageMasked.cols, CV_8UC1);
-        matcher->matchStars(stars, matches, featureVis);
 
+        // Follow the stars of the last frame if possible, only touches small windows around every star
+        bool tracked = !thresholdNeeded && tracker && tracker->isDue() && tracker->track(frame, threshold, stars, matches, MIN_MATCHED_STARS);
+        record.timings.detection += timer.lap();
+        workspace.matchedConstellations.clear();
+
+        if (!tracked) {
+            stars.clear();
+            matches.clear();
+
+            // Apply mask to image, downsampled for coarse to fine detection.
+            const Mat &imageMasked = detector.detectionImage(frame);
+            record.timings.masking = timer.lap();
+
+            // The first frame at a new detection level finds the threshold of the level
+            if (thresholdNeeded) {
+                float levelThreshold = detector.findThreshold(imageMasked);
+                if (levelThreshold != numeric_limits<float>::infinity()) {
+                    threshold = levelThreshold;
+                    thresholdNeeded = false;
+                }
+            }
+
+            // Compute the stars in the current image
+            threshold = detector.detect(imageMasked, frame, threshold, stars);
+            record.timings.detection += timer.lap();
+
+            if (stars.size() < MIN_STARS_PER_IMAGE) {
+                std::cout << "Not enough stars found" << std::endl;
+                return rejectFrame(record, FrameDecision::NotEnoughStars, preview, timer);
+            }
+
+            // Match the stars with the last image
+            std::cout << "Last star size: " << lastStars.size() << ", new stars size: " << stars.size() << std::endl;
+
+            /*
+            if (std::max(lastStars.size(), stars.size()) > SIMPLE_MATCHER_THRESHOLD) {
+                matchStars(lastStars, stars, matches);
+            } else {
+                matchStarsSimple(lastStars, stars, matches);
+            }
+             */
+            // The matched constellations are only kept if the tracking points are visualised
+            matcher->matchStars(stars, matches, options.visualiseTrackingPoints ? &workspace.matchedConstellations : nullptr);
+
+            // Use the pixel average of the sky as border of aligned images
+            borderValue = cv::mean(imageMasked);
+        }
 
         // Extract the star centers from the matches
-        std::vector<Point2i> matched_points1, matched_points2;
+        std::vector<Point2i> &matched_points1 = workspace.matchedPoints1;
+        std::vector<Point2i> &matched_points2 = workspace.matchedPoints2;
+        matched_points1.clear();
+        matched_points2.clear();
         for (size_t i = 0; i < matches.size(); i++) {
             matched_points1.push_back(lastStars[matches[i].queryIdx]);
             matched_points2.push_back(stars[matches[i].trainIdx]);
         }
+        record.timings.matching = timer.lap();
 
         if (matched_points1.size() < MIN_MATCHED_STARS || matched_points2.size() < MIN_MATCHED_STARS) {
             std::cout << "Not enough stars could be matched" << std::endl;
-            numFailed++;
-            getPreview(preview);
-            return false;
+            return rejectFrame(record, FrameDecision::NotEnoughMatches, preview, timer);
         }
 
         std::cout << "Found " << matched_points1.size() << " points to match" << std::endl;
 
-        // Find homography
-        auto h = findHomography(matched_points2, matched_points1, RANSAC, 3, noArray(), 2000, 0.995);
+        // Find homography, or a similarity while the quality is reduced
+        workspace.inlierMask.clear();
+        Mat h;
+        if (quality.similarity) {
+            Mat affine = estimateAffinePartial2D(matched_points2, matched_points1, workspace.inlierMask, RANSAC, 3,
+                                                 quality.ransacIterations, 0.995);
+            if (!affine.empty()) {
+                h = Mat::eye(3, 3, CV_64F);
+                affine.copyTo(h.rowRange(0, 2));
+            }
+        } else {
+            h = findHomography(matched_points2, matched_points1, RANSAC, 3, workspace.inlierMask,
+                               quality.ransacIterations, 0.995);
+        }
+        record.homography = h;
+        record.timings.homography = timer.lap();
 
         // If no homography was found, return
         if (h.empty()) {
             std::cout << "No homography found" << std::endl;
-            numFailed++;
-            getPreview(preview);
-            return false;
+            return rejectFrame(record, FrameDecision::NoHomography, preview, timer);
         }
 
         // Homogrpahies should always (almost) perserve the size of an image -> det around 1
@@ -312,65 +1488,116 @@ public:
         
         if (ratio < 0.9 || ratio > 1.1) {
             std::cout << "Homography scale invalid" << std::endl;
-            numFailed++;
-            getPreview(preview);
-            return false;
+            return rejectFrame(record, FrameDecision::InvalidScale, preview, timer);
         }
         currentDeterminant = cv::determinant(h);
         
         // Append to the current total homography
         totalHomography = totalHomography * h;
         
+        if (tracker) {
+            tracker->update(h, !tracked);
+        }
+
+        // Fit the local corrections to the matches the homography explains
+        if (mesh) {
+            mesh->fit(matched_points1, matched_points2, h, workspace.inlierMask);
+        }
+
         // Use homography to warp image, set border of aligned image to pixel average of the sky
-        auto average = cv::mean(imageMasked);
-        Mat alignedImage;
-        warpPerspective(image, alignedImage, h, imageMasked.size(), INTER_LINEAR, BORDER_CONSTANT, average);
+        const Scalar &average = borderValue;
         
         /**
-         Create a visulaisation of the current tracking points if requested
+         Keep the tracking points for the visualisation if requested, they are only drawn when a preview is requested
          */
-        if (visualiseTrackingPoints) {
-            std::vector<cv::Mat> channels(3);
-            channels.at(0) = contours;
-            channels.at(1) = featureVis;
-            channels.at(2) = featureVis;
-            
-            cv::merge(channels, starContours);
-            //warpPerspective(starContours, starContours, h, featureVis.size());
-        }
-                
-        max(currentMaxed, alignedImage, currentMaxed);
-
-        // Add image to the current stacks
-        alignedImage.convertTo(alignedImage, CV_16U);
-        addWeighted(currentCombined, 1, alignedImage, 1, 0.0, currentCombined, CV_16U);
-
-        // Add image without alignment
-        Mat doubleImage;
-        image.convertTo(doubleImage, CV_16U);
-        addWeighted(currentStacked, 1, doubleImage, 1, 0.0, currentStacked, CV_16U);
-        
-        
-        // Update last image and stars
-        lastImage = image;
-        
+        if (options.visualiseTrackingPoints) {
+            trackingOverlay.frameSize = frame.size();
+            trackingOverlay.stars = stars;
+            trackingOverlay.triangles.swap(workspace.matchedConstellations);
+            trackingOverlay.inliers.clear();
+            for (size_t i = 0; i < workspace.inlierMask.size() && i < matched_points2.size(); i++) {
+                if (workspace.inlierMask[i]) {
+                    trackingOverlay.inliers.push_back(matched_points2[i]);
+                }
+            }
+        }
+        record.timings.warping = timer.lap();
+
+        // Warp the image onto the stack
+        float weight = options.weightFrames ? std::max(lastQuality.score, MIN_FRAME_WEIGHT) : 1;
+        Mat offsets = mesh ? mesh->getOffsets() : Mat();
+        accumulate(frame, h, average, weight, true, offsets);
+        if (drizzle) {
+            drizzle->add(frame, h, weight, foregroundMask, offsets);
+        }
+        if (mosaic) {
+            accumulateMosaic(frame, h, weight, offsets);
+            size_t inliers = workspace.inlierMask.empty() ? matched_points1.size()
+                             : (size_t) std::count(workspace.inlierMask.begin(), workspace.inlierMask.end(), 1);
+            refreshReferenceStars(stars, h, inliers);
+        }
+        if (previewBuffer) {
+            previewBuffer->add(frame, h, average);
+        }
         
         //lastStars = stars;
         numImages++;
+        weightSum += weight;
+        record.timings.accumulation = timer.lap();
 
-        getPreview(preview);
+        refreshPreview(preview);
+        record.timings.preview = timer.lap();
 
+        finishFrame(record, FrameDecision::Accepted);
         return true;
     }
 
-    
+    /**
+     Returns the statistics of the sky of the averaged stack, computed from samples kept while stacking.
+     */
+    void getStatistics(ChannelStatistics channels[3]) {
+        statistics.compute(weightSum, channels);
+    }
+
+    /**
+     Returns the quality of the last frame as measured by the quality screen, e.g. to weight it.
+     */
+    FrameQuality getLastQuality() {
+        return lastQuality;
+    }
+
+    /**
+     Returns the time spent in every stage of the last frame.
+     */
+    StageTimings getLastTimings() {
+        return lastTimings;
+    }
+
+    /**
+     Writes the checkpoint, the number of frames goes to the metadata file next to it like for partial stacks.
+     */
     void saveToDirectory(string dir) {
         // Save combined
         std::ofstream ofs(dir + CHECKPOINT_FILENAME, std::ios::binary);
-        writeMatBinary(ofs, currentCombined);
-        writeMatBinary(ofs, currentMaxed);
-        writeMatBinary(ofs, currentStacked);
-        writeMatBinary(ofs, foregroundMask);
+        stack->writePlaneBinary(ofs, COMBINED_PLANE);
+        stack->writePlaneBinary(ofs, MAXED_PLANE);
+        stack->writePlaneBinary(ofs, STACKED_PLANE);
+        writeMaskBinary(ofs);
+        writeWeightSum(ofs, weightSum);
+        bool scored = qualityScreen && qualityScreen->isReferenced();
+        writeReferenceQuality(ofs, scored ? &qualityScreen->getReference() : nullptr);
+
+        std::ofstream meta(dir + METADATA_FILENAME);
+        meta << numImages << std::endl;
+
+        if (drizzle) {
+            std::ofstream drizzleStream(dir + DRIZZLE_FILENAME, std::ios::binary);
+            drizzle->writeBinary(drizzleStream);
+        }
+        if (mosaic) {
+            std::ofstream mosaicStream(dir + MOSAIC_FILENAME, std::ios::binary);
+            mosaic->writeBinary(mosaicStream);
+        }
     }
 
 };
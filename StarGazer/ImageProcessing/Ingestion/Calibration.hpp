@@ -0,0 +1,315 @@
+//
+//  Calibration.hpp
+//  StarGazer
+//
+//  Master bias, dark and flat frames built from calibration frames one frame at a time, and the correction of frames
+//  with them while they are converted into the layout of the stack.
+//  Only the offline tools calibrate, build_masters builds the masters and stack_frames --calibration applies them.
+//  The app stacks its frames uncalibrated.
+//
+
+#ifndef Calibration_hpp
+#define Calibration_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+
+#include "FrameView.hpp"
+#include "FrameSource.hpp"
+#include "SaveBinaryCV.hpp"
+
+#define CALIBRATION_FILENAME "/calibration.stargazer"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Averages calibration frames into a master frame without holding more than the running sum.
+ * Values are scaled to 8 bit like the stack, but kept as float so 16 bit frames keep their precision.
+ */
+class MasterFrameBuilder {
+private:
+    Mat sum;
+    int count = 0;
+
+    template<typename T>
+    void addRows(const FrameView &frame, const Range &range) {
+        float scale = sizeof(T) == 1 ? 1.0f : 1.0f / 257;
+        int step = frame.step();
+        for (int y = range.start; y < range.end; y++) {
+            float *sumRow = sum.ptr<float>(y);
+            for (int c = 0; c < 3; c++) {
+                const T *row = frame.ptr<T>(c, y);
+                for (int x = 0; x < sum.cols; x++) {
+                    sumRow[x * 3 + c] += row[x * step] * scale;
+                }
+            }
+        }
+    }
+
+public:
+    /**
+     * Adds a calibration frame, read in its own layout.
+     * @return False if the frame does not have the size of the previous frames.
+     */
+    bool add(const FrameView &frame) {
+        if (sum.empty()) {
+            sum = Mat::zeros(frame.size(), CV_32FC3);
+        } else if (frame.size() != sum.size()) {
+            return false;
+        }
+        parallelFor(Range(0, sum.rows), [&](const Range &range) {
+            if (frame.depth() == CV_16U) {
+                addRows<ushort>(frame, range);
+            } else {
+                addRows<uchar>(frame, range);
+            }
+        });
+        count++;
+        return true;
+    }
+
+    int getCount() {
+        return count;
+    }
+
+    /**
+     * Returns the average of the added frames as CV_32FC3, empty if no frame was added.
+     */
+    void getMaster(Mat &master) {
+        if (count == 0) {
+            master.release();
+            return;
+        }
+        sum.convertTo(master, CV_32F, 1.0 / count);
+    }
+};
+
+/**
+ * Master frames and the per pixel correction derived from them.
+ * Frames are corrected as (frame - dark) / flat, with the bias taking the place of a missing dark.
+ * Pixels that stand out in the dark are marked as hot pixels, star detection ignores them.
+ * Read only once prepared, so one calibration can be shared by all decode threads.
+ */
+class Calibration {
+private:
+    /**
+     * Pixels brighter than the mean of the dark by this many standard deviations are hot.
+     */
+    const double HOT_PIXEL_SIGMA = 5;
+
+    /**
+     * Hot pixels need to exceed the mean of the dark by at least this much, so the noise of a clean dark is not marked.
+     */
+    const double HOT_PIXEL_MIN_EXCESS = 4;
+
+    /**
+     * Smallest value of the normalised flat, darker pixels of the flat are not amplified any further.
+     */
+    const float MIN_FLAT = 0.05f;
+
+    Mat bias;
+    Mat dark;
+    Mat flat;
+
+    /**
+     * Subtracted from every frame, the dark or the bias. Empty if neither is set.
+     */
+    Mat offset;
+
+    /**
+     * Multiplied with every frame, the inverse of the normalised flat. Empty without a flat.
+     */
+    Mat gain;
+
+    /**
+     * 8 bit map of the hot pixels and their direct neighbours, empty without a dark.
+     */
+    Mat hotPixels;
+
+    void prepare() {
+        offset = !dark.empty() ? dark : bias;
+
+        gain.release();
+        if (!flat.empty()) {
+            Mat normalised = flat.clone();
+            if (!bias.empty()) {
+                subtract(normalised, bias, normalised);
+            }
+            // Every channel is normalised separately, so the colour of the flat light does not tint the frames
+            Scalar channelMean = cv::mean(normalised);
+            vector<Mat> channels;
+            split(normalised, channels);
+            for (int c = 0; c < 3; c++) {
+                channels[c] *= 1.0 / std::max(channelMean[c], 1e-6);
+                cv::max(channels[c], MIN_FLAT, channels[c]);
+            }
+            merge(channels, normalised);
+            divide(1.0, normalised, gain, CV_32F);
+        }
+
+        hotPixels.release();
+        if (!dark.empty()) {
+            Mat excess = dark.clone();
+            if (!bias.empty()) {
+                subtract(excess, bias, excess);
+            }
+            vector<Mat> channels;
+            split(excess, channels);
+            Mat brightest;
+            cv::max(channels[0], channels[1], brightest);
+            cv::max(brightest, channels[2], brightest);
+
+            Scalar mean, stddev;
+            meanStdDev(brightest, mean, stddev);
+            double limit = mean[0] + std::max(HOT_PIXEL_SIGMA * stddev[0], HOT_PIXEL_MIN_EXCESS);
+            cv::threshold(brightest, hotPixels, limit, 255, THRESH_BINARY);
+            hotPixels.convertTo(hotPixels, CV_8U);
+
+            // A star centered next to a hot pixel is as likely to be the hot pixel itself
+            dilate(hotPixels, hotPixels, getStructuringElement(MORPH_RECT, Size(3, 3)));
+            std::cout << "Hot pixels: " << countNonZero(hotPixels) << std::endl;
+        }
+    }
+
+    template<typename T>
+    void applyRows(const FrameView &frame, Mat &out, const Range &range) const {
+        float scale = sizeof(T) == 1 ? 1.0f : 1.0f / 257;
+        int step = frame.step();
+        bool hasOffset = !offset.empty();
+        bool hasGain = !gain.empty();
+        for (int y = range.start; y < range.end; y++) {
+            uchar *outRow = out.ptr<uchar>(y);
+            const float *offsetRow = hasOffset ? offset.ptr<float>(y) : nullptr;
+            const float *gainRow = hasGain ? gain.ptr<float>(y) : nullptr;
+            for (int c = 0; c < 3; c++) {
+                const T *row = frame.ptr<T>(c, y);
+                for (int x = 0; x < out.cols; x++) {
+                    float value = row[x * step] * scale;
+                    if (hasOffset) {
+                        value -= offsetRow[x * 3 + c];
+                    }
+                    if (hasGain) {
+                        value *= gainRow[x * 3 + c];
+                    }
+                    outRow[x * 3 + c] = saturate_cast<uchar>(value);
+                }
+            }
+        }
+    }
+
+public:
+    Calibration() {
+    }
+
+    /**
+     * @param bias Master bias, CV_32FC3 in 8 bit scale, or empty
+     * @param dark Master dark of the exposure of the frames, including the bias, or empty
+     * @param flat Master flat, including the bias, or empty
+     */
+    Calibration(const Mat &bias, const Mat &dark, const Mat &flat) : bias(bias), dark(dark), flat(flat) {
+        prepare();
+    }
+
+    bool empty() const {
+        return offset.empty() && gain.empty();
+    }
+
+    Size size() const {
+        return !offset.empty() ? offset.size() : gain.size();
+    }
+
+    const Mat &getHotPixels() const {
+        return hotPixels;
+    }
+
+    /**
+     * Corrects a frame and converts it into an 8 bit, 3 channel image in stack order in a single pass.
+     * The frame is read in its own layout, 16 bit frames are corrected before they are scaled to 8 bit.
+     * @return False if the frame does not have the size of the masters, nothing is written in that case.
+     */
+    bool apply(const FrameView &frame, Mat &out) const {
+        if (frame.size() != size()) {
+            return false;
+        }
+        out.create(frame.size(), CV_8UC3);
+        parallelFor(Range(0, out.rows), [&](const Range &range) {
+            if (frame.depth() == CV_16U) {
+                applyRows<ushort>(frame, out, range);
+            } else {
+                applyRows<uchar>(frame, out, range);
+            }
+        });
+        return true;
+    }
+
+    /**
+     * Writes the masters in the checkpoint format, the derived correction is recomputed when reading.
+     */
+    void writeToDirectory(const string &dir) const {
+        std::ofstream ofs(dir + CALIBRATION_FILENAME, std::ios::binary);
+        writeMatBinary(ofs, bias);
+        writeMatBinary(ofs, dark);
+        writeMatBinary(ofs, flat);
+    }
+
+    /**
+     * Reads masters written by writeToDirectory.
+     * @return False if no calibration could be read.
+     */
+    bool readFromDirectory(const string &dir) {
+        std::ifstream ifs(dir + CALIBRATION_FILENAME, std::ios::binary);
+        if (!ifs.is_open()) {
+            return false;
+        }
+        bias.release();
+        dark.release();
+        flat.release();
+        readMatBinary(ifs, bias);
+        readMatBinary(ifs, dark);
+        readMatBinary(ifs, flat);
+        prepare();
+        return !empty();
+    }
+};
+
+/**
+ * Calibrates the frames of a source while they are decoded, so on the decode threads of a PrefetchingFrameSource.
+ * Calibrated frames are 8 bit in stack order. Frames that do not match the masters fail to decode, so they are skipped
+ * instead of being stacked without the correction.
+ */
+class CalibratedFrameSource : public FrameSource {
+private:
+    std::unique_ptr<FrameSource> source;
+    std::shared_ptr<const Calibration> calibration;
+
+public:
+    CalibratedFrameSource(std::unique_ptr<FrameSource> source, std::shared_ptr<const Calibration> calibration) :
+            source(std::move(source)), calibration(calibration) {
+    }
+
+    int count() override {
+        return source->count();
+    }
+
+    bool isRandomAccess() override {
+        return source->isRandomAccess();
+    }
+
+    bool decode(int index, DecodedFrame &frame) override {
+        DecodedFrame raw;
+        if (!source->decode(index, raw)) {
+            return false;
+        }
+        if (!calibration->apply(raw.view, frame.buffer)) {
+            std::cout << "Frame " << index << " does not match the calibration frames" << std::endl;
+            return false;
+        }
+        frame.index = raw.index;
+        frame.view = FrameView(frame.buffer);
+        return true;
+    }
+};
+
+#endif /* Calibration_hpp */
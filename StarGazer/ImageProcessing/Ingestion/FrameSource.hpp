@@ -0,0 +1,404 @@
+//
+//  FrameSource.hpp
+//  StarGazer
+//
+//  Sources of frames for offline stacking: image directories, video files and raw binary dumps.
+//  Decoding is moved off the stacking thread by the PrefetchingFrameSource.
+//
+
+#ifndef FrameSource_hpp
+#define FrameSource_hpp
+
+#include <stdio.h>
+#include <string.h>
+#include <opencv2/opencv.hpp>
+#include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FrameView.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * A decoded frame. The view describes the pixels held by the buffer.
+ */
+struct DecodedFrame {
+    int index = -1;
+    Mat buffer;
+    FrameView view;
+};
+
+/**
+ * Decodes frames by index.
+ */
+class FrameSource {
+public:
+    virtual ~FrameSource() {
+    }
+
+    /**
+     * Number of frames, -1 if unknown before the end is reached.
+     * Can be called while frames are decoded on another thread.
+     */
+    virtual int count() = 0;
+
+    /**
+     * True if frames can be decoded in any order and from several threads at once.
+     * Other sources are only ever asked for the frames in order, from a single thread.
+     */
+    virtual bool isRandomAccess() {
+        return false;
+    }
+
+    /**
+     * Decodes a frame.
+     * @return False at the end of the source or if the frame could not be decoded. Sources of known count are only
+     * at their end past the last frame, frames before it that fail are skipped.
+     */
+    virtual bool decode(int index, DecodedFrame &frame) = 0;
+};
+
+/**
+ * Image files of a directory in lexicographic order. 16 bit images keep their depth.
+ */
+class ImageDirectorySource : public FrameSource {
+private:
+    vector<string> paths;
+
+public:
+    ImageDirectorySource(const string &directory, const vector<string> &extensions = {".jpg", ".jpeg", ".png", ".tif", ".tiff"}) {
+        for (auto &entry: std::filesystem::directory_iterator(directory)) {
+            string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (entry.is_regular_file() && std::find(extensions.begin(), extensions.end(), extension) != extensions.end()) {
+                paths.push_back(entry.path().string());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+    }
+
+    int count() override {
+        return (int) paths.size();
+    }
+
+    bool isRandomAccess() override {
+        return true;
+    }
+
+    bool decode(int index, DecodedFrame &frame) override {
+        if (index < 0 || index >= paths.size()) {
+            return false;
+        }
+        frame.buffer = imread(paths[index], IMREAD_COLOR | IMREAD_ANYDEPTH);
+        if (frame.buffer.empty()) {
+            std::cout << "Could not decode " << paths[index] << std::endl;
+            return false;
+        }
+        if (frame.buffer.depth() != CV_8U && frame.buffer.depth() != CV_16U) {
+            frame.buffer.convertTo(frame.buffer, CV_16U);
+        }
+        frame.index = index;
+        frame.view = FrameView(frame.buffer);
+        return true;
+    }
+};
+
+/**
+ * Frames of a video file, decoded with the decoders of OpenCV. Sequential only.
+ */
+class VideoFileSource : public FrameSource {
+private:
+    VideoCapture capture;
+    int nextIndex = 0;
+
+    /**
+     * Read once, the capture is used by the decode thread afterwards.
+     */
+    int frames = -1;
+
+public:
+    VideoFileSource(const string &path) : capture(path) {
+        if (!capture.isOpened()) {
+            std::cout << "Could not open video " << path << std::endl;
+            return;
+        }
+        int reported = (int) capture.get(CAP_PROP_FRAME_COUNT);
+        frames = reported > 0 ? reported : -1;
+    }
+
+    int count() override {
+        return frames;
+    }
+
+    bool decode(int index, DecodedFrame &frame) override {
+        // Frames can only be skipped forward
+        while (nextIndex < index && capture.grab()) {
+            nextIndex++;
+        }
+        if (nextIndex != index || !capture.read(frame.buffer) || frame.buffer.empty()) {
+            return false;
+        }
+        nextIndex++;
+        frame.index = index;
+        frame.view = FrameView(frame.buffer);
+        return true;
+    }
+};
+
+/**
+ * Frames of equal size stored back to back in a binary file, e.g. a dump of camera buffers.
+ * Frames are read into memory as they are and handed out in their own layout.
+ */
+class RawFrameSource : public FrameSource {
+private:
+    int fd;
+    Size size;
+    PixelLayout layout;
+    int depth;
+    size_t rowStride;
+    size_t headerBytes;
+    size_t frameBytes;
+    int frames = 0;
+
+public:
+    /**
+     * @param rowStride Bytes per row, 0 for unpadded rows
+     * @param headerBytes Bytes skipped at the start of the file
+     */
+    RawFrameSource(const string &path, Size size, PixelLayout layout, int depth = CV_8U, size_t rowStride = 0, size_t headerBytes = 0) :
+            size(size), layout(layout), depth(depth), headerBytes(headerBytes) {
+        size_t elemSize = depth == CV_16U ? 2 : 1;
+        int channels = layout == PixelLayout::RGBA || layout == PixelLayout::BGRA ? 4 : (layout == PixelLayout::PLANAR_RGB ? 1 : 3);
+        this->rowStride = rowStride > 0 ? rowStride : size.width * channels * elemSize;
+        frameBytes = this->rowStride * size.height * (layout == PixelLayout::PLANAR_RGB ? 3 : 1);
+
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cout << "Could not open raw frames " << path << std::endl;
+            return;
+        }
+        off_t fileBytes = lseek(fd, 0, SEEK_END);
+        if (fileBytes > (off_t) headerBytes) {
+            frames = (int) ((fileBytes - headerBytes) / frameBytes);
+        }
+    }
+
+    virtual ~RawFrameSource() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int count() override {
+        return frames;
+    }
+
+    bool isRandomAccess() override {
+        return true;
+    }
+
+    bool decode(int index, DecodedFrame &frame) override {
+        if (index < 0 || index >= frames) {
+            return false;
+        }
+        frame.buffer.create(1, (int) frameBytes, CV_8U);
+        ssize_t read = pread(fd, frame.buffer.data, frameBytes, (off_t) (headerBytes + frameBytes * index));
+        if (read != (ssize_t) frameBytes) {
+            return false;
+        }
+
+        const uchar *data = frame.buffer.data;
+        if (layout == PixelLayout::PLANAR_RGB) {
+            size_t planeBytes = rowStride * size.height;
+            frame.view = FrameView::planar(data, data + planeBytes, data + 2 * planeBytes, size, rowStride, depth);
+        } else {
+            frame.view = FrameView(data, size, rowStride, layout, depth);
+        }
+        frame.index = index;
+        return true;
+    }
+};
+
+/**
+ * A contiguous range of the frames of a random access source, e.g. the share of one process of a split capture.
+ * Frames are renumbered from 0.
+ */
+class RangeFrameSource : public FrameSource {
+private:
+    std::unique_ptr<FrameSource> source;
+    int begin;
+    int end;
+
+public:
+    /**
+     * @param end First frame after the range, clamped to the frames of the source
+     */
+    RangeFrameSource(std::unique_ptr<FrameSource> source, int begin, int end) : source(std::move(source)), begin(begin) {
+        this->end = std::max(begin, std::min(end, this->source->count()));
+    }
+
+    int count() override {
+        return end - begin;
+    }
+
+    bool isRandomAccess() override {
+        return true;
+    }
+
+    bool decode(int index, DecodedFrame &frame) override {
+        if (index < 0 || index >= count() || !source->decode(begin + index, frame)) {
+            return false;
+        }
+        frame.index = index;
+        return true;
+    }
+};
+
+/**
+ * Decodes frames of a source ahead of time on worker threads.
+ * Random access sources are decoded by all workers in parallel, other sources by a single worker.
+ * At most queueSize decoded frames are held, frames are handed out in order.
+ * Frames that fail to decode are skipped and counted, if the source knows its count. Otherwise the first failure is
+ * taken as its end.
+ */
+class PrefetchingFrameSource {
+private:
+    std::unique_ptr<FrameSource> source;
+    size_t queueSize;
+    int numFrames;
+
+    std::mutex mutex;
+    std::condition_variable frameDecoded;
+    std::condition_variable frameTaken;
+
+    /**
+     * Decoded frames waiting to be handed out, by index. Frames that failed to decode are held with index -1.
+     */
+    std::map<int, DecodedFrame> decoded;
+
+    /**
+     * Frames from here on are not handed out, the count of the source or the first failure if it is unknown.
+     */
+    int endIndex;
+
+    int numSkipped = 0;
+
+    int nextIndex = 0;
+    int nextToDecode = 0;
+    bool stopped = false;
+
+    vector<std::thread> workers;
+
+    void work() {
+        while (true) {
+            int index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frameTaken.wait(lock, [&] {
+                    return stopped || nextToDecode >= endIndex || nextToDecode < nextIndex + (int) queueSize;
+                });
+                if (stopped || nextToDecode >= endIndex) {
+                    return;
+                }
+                index = nextToDecode++;
+            }
+
+            DecodedFrame frame;
+            bool success = source->decode(index, frame);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (success) {
+                decoded[index] = std::move(frame);
+            } else if (numFrames >= 0 && index < numFrames) {
+                decoded[index] = DecodedFrame();
+            } else {
+                endIndex = std::min(endIndex, index);
+            }
+            frameDecoded.notify_all();
+        }
+    }
+
+public:
+    /**
+     * @param queueSize Number of decoded frames held ahead of the consumer
+     * @param numWorkers Decode threads, only used for random access sources
+     */
+    PrefetchingFrameSource(std::unique_ptr<FrameSource> source, size_t queueSize = 8, int numWorkers = 4) :
+            source(std::move(source)), queueSize(std::max<size_t>(queueSize, 1)) {
+        numFrames = this->source->count();
+        endIndex = numFrames >= 0 ? numFrames : std::numeric_limits<int>::max();
+        int threads = this->source->isRandomAccess() ? std::max(numWorkers, 1) : 1;
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back(&PrefetchingFrameSource::work, this);
+        }
+    }
+
+    PrefetchingFrameSource(const PrefetchingFrameSource &) = delete;
+    PrefetchingFrameSource &operator=(const PrefetchingFrameSource &) = delete;
+
+    virtual ~PrefetchingFrameSource() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        frameTaken.notify_all();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Number of frames as reported by the source when prefetching started, -1 if unknown.
+     */
+    int count() {
+        return numFrames;
+    }
+
+    /**
+     * Number of frames skipped so far because they could not be decoded.
+     */
+    int getNumSkipped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return numSkipped;
+    }
+
+    /**
+     * Waits for the next frame in order that could be decoded.
+     * @return False once the source is exhausted.
+     */
+    bool next(DecodedFrame &frame) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            frameDecoded.wait(lock, [&] {
+                return nextIndex >= endIndex || decoded.count(nextIndex) > 0;
+            });
+            if (nextIndex >= endIndex) {
+                return false;
+            }
+
+            auto entry = decoded.find(nextIndex);
+            bool skipped = entry->second.index < 0;
+            if (!skipped) {
+                frame = std::move(entry->second);
+            }
+            decoded.erase(entry);
+            nextIndex++;
+            frameTaken.notify_all();
+            if (!skipped) {
+                return true;
+            }
+            std::cout << "Skipping frame " << nextIndex - 1 << ", it could not be decoded" << std::endl;
+            numSkipped++;
+        }
+    }
+};
+
+#endif /* FrameSource_hpp */
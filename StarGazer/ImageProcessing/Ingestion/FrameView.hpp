@@ -0,0 +1,320 @@
+//
+//  FrameView.hpp
+//  StarGazer
+//
+//  Borrowed view of a frame in an external buffer, read by the merger without copying it first.
+//
+
+#ifndef FrameView_hpp
+#define FrameView_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "TaskScheduler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Channels of a frame in memory order.
+ * The stack keeps the channel order it is fed with, R, G, B for the app. Mats are taken as they are, i.e. as RGB.
+ */
+enum class PixelLayout : int {
+    RGB = 0,
+    BGR = 1,
+    RGBA = 2,
+    BGRA = 3,
+
+    /**
+     * One plane per channel, each plane with the same row stride.
+     */
+    PLANAR_RGB = 4,
+};
+
+/**
+ * Parses the name of a layout as given on the command line: rgb, bgr, rgba, bgra or planar.
+ * @return False if the name is unknown, nothing is written in that case.
+ */
+inline bool parseLayout(const string &name, PixelLayout &layout) {
+    const char *names[] = {"rgb", "bgr", "rgba", "bgra", "planar"};
+    for (int i = 0; i < 5; i++) {
+        if (name == names[i]) {
+            layout = (PixelLayout) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * A frame in memory owned by the caller, e.g. a bitmap context or a decoder buffer.
+ * Rows may be padded, 8 and 16 bit channels are supported. 16 bit values are scaled to 8 bit when read.
+ *
+ * The view does not copy or own the pixels, the buffer has to stay valid while the view is used.
+ */
+class FrameView {
+private:
+    Size frameSize;
+    int frameDepth = CV_8U;
+    PixelLayout frameLayout = PixelLayout::RGB;
+
+    /**
+     * First pixel of every channel, in stack order.
+     */
+    const uchar *channels[3] = {nullptr, nullptr, nullptr};
+
+    /**
+     * Distance between two pixels of a channel in elements.
+     */
+    int pixelStride = 3;
+
+    size_t rowStride = 0;
+
+    /**
+     * Weights of COLOR_BGR2GRAY in 14 bit fixed point, applied to the channels in stack order.
+     * Gray values match cvtColor of a stack ordered Mat, so detection does not depend on the layout.
+     */
+    static const int GRAY_WEIGHT_0 = 1868;
+    static const int GRAY_WEIGHT_1 = 9617;
+    static const int GRAY_WEIGHT_2 = 4899;
+
+    void setInterleaved(const uchar *data, PixelLayout layout) {
+        size_t elemSize = frameDepth == CV_16U ? 2 : 1;
+        bool reversed = layout == PixelLayout::BGR || layout == PixelLayout::BGRA;
+        pixelStride = layout == PixelLayout::RGBA || layout == PixelLayout::BGRA ? 4 : 3;
+        for (int c = 0; c < 3; c++) {
+            channels[c] = data + (reversed ? 2 - c : c) * elemSize;
+        }
+    }
+
+    template<typename T>
+    void downscaleRows(const Range &range, Mat &out) const {
+        for (int y = range.start; y < range.end; y++) {
+            int y0 = y * frameSize.height / out.rows;
+            int y1 = std::max((y + 1) * frameSize.height / out.rows, y0 + 1);
+            uchar *outRow = out.ptr<uchar>(y);
+            for (int x = 0; x < out.cols; x++) {
+                int x0 = x * frameSize.width / out.cols;
+                int x1 = std::max((x + 1) * frameSize.width / out.cols, x0 + 1);
+                for (int c = 0; c < 3; c++) {
+                    double sum = 0;
+                    for (int sy = y0; sy < y1; sy++) {
+                        const T *row = ptr<T>(c, sy);
+                        for (int sx = x0; sx < x1; sx++) {
+                            sum += row[sx * pixelStride];
+                        }
+                    }
+                    outRow[x * 3 + c] = to8U<T>(sum / ((y1 - y0) * (x1 - x0)));
+                }
+            }
+        }
+    }
+
+    template<typename T>
+    void grayRows(const Rect &roi, Mat &out) const {
+        for (int y = 0; y < roi.height; y++) {
+            const T *c0 = ptr<T>(0, roi.y + y) + roi.x * pixelStride;
+            const T *c1 = ptr<T>(1, roi.y + y) + roi.x * pixelStride;
+            const T *c2 = ptr<T>(2, roi.y + y) + roi.x * pixelStride;
+            uchar *outRow = out.ptr<uchar>(y);
+            for (int x = 0; x < roi.width; x++) {
+                int offset = x * pixelStride;
+                outRow[x] = (uchar) ((to8U<T>(c0[offset]) * GRAY_WEIGHT_0 + to8U<T>(c1[offset]) * GRAY_WEIGHT_1 +
+                                      to8U<T>(c2[offset]) * GRAY_WEIGHT_2 + (1 << 13)) >> 14);
+            }
+        }
+    }
+
+    template<typename T>
+    void copyRows(const Range &range, Mat &out) const {
+        for (int y = range.start; y < range.end; y++) {
+            uchar *outRow = out.ptr<uchar>(y);
+            for (int c = 0; c < 3; c++) {
+                const T *row = ptr<T>(c, y);
+                for (int x = 0; x < frameSize.width; x++) {
+                    outRow[x * 3 + c] = to8U<T>(row[x * pixelStride]);
+                }
+            }
+        }
+    }
+
+public:
+    FrameView() {
+    }
+
+    /**
+     * Views an interleaved buffer.
+     * @param rowStride Bytes between the starts of two rows
+     * @param depth CV_8U or CV_16U
+     */
+    FrameView(const void *data, Size size, size_t rowStride, PixelLayout layout, int depth = CV_8U) :
+            frameSize(size), frameDepth(depth), frameLayout(layout), rowStride(rowStride) {
+        CV_Assert(depth == CV_8U || depth == CV_16U);
+        CV_Assert(layout != PixelLayout::PLANAR_RGB);
+        setInterleaved((const uchar *) data, layout);
+    }
+
+    /**
+     * Views a Mat with 3 or 4 channels in stack order. The Mat has to outlive the view.
+     */
+    explicit FrameView(const Mat &image) :
+            FrameView(image.data, image.size(), image.step[0], image.channels() == 4 ? PixelLayout::RGBA : PixelLayout::RGB, image.depth()) {
+        CV_Assert(image.channels() == 3 || image.channels() == 4);
+    }
+
+    /**
+     * Views three separate channel planes.
+     * @param rowStride Bytes between the starts of two rows of a plane
+     */
+    static FrameView planar(const void *red, const void *green, const void *blue, Size size, size_t rowStride, int depth = CV_8U) {
+        CV_Assert(depth == CV_8U || depth == CV_16U);
+        FrameView view;
+        view.frameSize = size;
+        view.frameDepth = depth;
+        view.frameLayout = PixelLayout::PLANAR_RGB;
+        view.rowStride = rowStride;
+        view.pixelStride = 1;
+        view.channels[0] = (const uchar *) red;
+        view.channels[1] = (const uchar *) green;
+        view.channels[2] = (const uchar *) blue;
+        return view;
+    }
+
+    Size size() const {
+        return frameSize;
+    }
+
+    int depth() const {
+        return frameDepth;
+    }
+
+    PixelLayout layout() const {
+        return frameLayout;
+    }
+
+    bool empty() const {
+        return frameSize.area() == 0 || channels[0] == nullptr;
+    }
+
+    /**
+     * Returns a pointer to the first value of a channel in a row. Values of a channel are step() elements apart.
+     */
+    template<typename T>
+    const T *ptr(int channel, int y) const {
+        return (const T *) (channels[channel] + y * rowStride);
+    }
+
+    int step() const {
+        return pixelStride;
+    }
+
+    /**
+     * Scales a channel value to 8 bit.
+     */
+    template<typename T>
+    static uchar to8U(double value) {
+        return saturate_cast<uchar>(sizeof(T) == 1 ? value : value / 257.0);
+    }
+
+    /**
+     * Wraps the frame in a Mat header if it is already an 8 bit, 3 channel image in stack order.
+     * The header shares the buffer of the view.
+     * @return False if the frame has a different layout, nothing is written in that case.
+     */
+    bool asMat(Mat &header) const {
+        if (frameDepth != CV_8U || frameLayout != PixelLayout::RGB) {
+            return false;
+        }
+        header = Mat(frameSize, CV_8UC3, (void *) channels[0], rowStride);
+        return true;
+    }
+
+    /**
+     * Wraps an interleaved 8 bit frame in a Mat header of its own layout with 3 or 4 channels, e.g. an RGBA bitmap.
+     * The header shares the buffer of the view.
+     * @param order Receives the channel of the header holding every channel in stack order
+     * @return False for 16 bit and planar frames, nothing is written in that case.
+     */
+    bool asInterleavedMat(Mat &header, int order[3]) const {
+        if (frameDepth != CV_8U || frameLayout == PixelLayout::PLANAR_RGB) {
+            return false;
+        }
+        bool reversed = frameLayout == PixelLayout::BGR || frameLayout == PixelLayout::BGRA;
+        header = Mat(frameSize, CV_8UC(pixelStride), (void *) channels[reversed ? 2 : 0], rowStride);
+        for (int c = 0; c < 3; c++) {
+            order[c] = reversed ? 2 - c : c;
+        }
+        return true;
+    }
+
+    /**
+     * Copies the frame into an 8 bit, 3 channel image in stack order.
+     */
+    void toMat(Mat &out) const {
+        Mat header;
+        if (asMat(header)) {
+            header.copyTo(out);
+            return;
+        }
+        out.create(frameSize, CV_8UC3);
+        parallelFor(Range(0, frameSize.height), [&](const Range &range) {
+            if (frameDepth == CV_16U) {
+                copyRows<ushort>(range, out);
+            } else {
+                copyRows<uchar>(range, out);
+            }
+        });
+    }
+
+    /**
+     * Downscales the frame into an 8 bit, 3 channel image by averaging the covered pixels.
+     * Interleaved 8 bit frames of every layout are resized by OpenCV in their own layout and only the small result is
+     * reordered, so the result does not depend on the layout, e.g. for a replay of RGBA frames recorded as RGB.
+     */
+    void downscale(Size size, Mat &out) const {
+        Mat header;
+        if (asMat(header)) {
+            resize(header, out, size, 0, 0, INTER_AREA);
+            return;
+        }
+        int order[3];
+        if (asInterleavedMat(header, order)) {
+            Mat scaled;
+            resize(header, scaled, size, 0, 0, INTER_AREA);
+            out.create(size, CV_8UC3);
+            int fromTo[] = {order[0], 0, order[1], 1, order[2], 2};
+            mixChannels(&scaled, 1, &out, 1, fromTo, 3);
+            return;
+        }
+
+        // Planar and 16 bit frames are averaged over whole blocks of pixels
+        out.create(size, CV_8UC3);
+        parallelFor(Range(0, size.height), [&](const Range &range) {
+            if (frameDepth == CV_16U) {
+                downscaleRows<ushort>(range, out);
+            } else {
+                downscaleRows<uchar>(range, out);
+            }
+        });
+    }
+
+    /**
+     * Converts a region of the frame to 8 bit grayscale.
+     */
+    void gray(const Rect &roi, Mat &out) const {
+        Mat header;
+        if (asMat(header)) {
+            cvtColor(header(roi), out, cv::COLOR_BGR2GRAY);
+            return;
+        }
+        out.create(roi.size(), CV_8UC1);
+        if (frameDepth == CV_16U) {
+            grayRows<ushort>(roi, out);
+        } else {
+            grayRows<uchar>(roi, out);
+        }
+    }
+};
+
+#endif /* FrameView_hpp */
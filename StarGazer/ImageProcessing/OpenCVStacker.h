@@ -20,6 +20,12 @@ NS_ASSUME_NONNULL_BEGIN
 
 - (instancetype) initWithImage:(UIImage *)image withMask: (nullable UIImage *)mask visaliseTrackingPoints: (bool)enabled;
 
+/**
+ * Same as initWithImage, but records every frame and merging decision to the given directory.
+ * Recorded sessions can be replayed with Tools/replay_session.cpp.
+ */
+- (instancetype) initWithImage:(UIImage *)image withMask: (nullable UIImage *)mask visaliseTrackingPoints: (bool)enabled recordSessionTo: (nullable NSString *)path;
+
 - (instancetype) initFromCheckpoint: (NSString *)path processed: (int)numImages visualiseTrackingPoints: (bool)enabled;
 
 /**
@@ -38,6 +44,17 @@ NS_ASSUME_NONNULL_BEGIN
 
 - (nullable UIImage *)getPreviewImage;
 
+/**
+ * Notes that a frame was captured and will be passed to addAndProcess, so the stacker can lower its quality while
+ * it falls behind the capture.
+ */
+- (void) frameCaptured;
+
+/**
+ * Notes that a frame announced by frameCaptured will not be passed to addAndProcess.
+ */
+- (void) frameDropped;
+
 - (void) saveFiles: (NSString *) path;
 
 - (void) deallocMerger;
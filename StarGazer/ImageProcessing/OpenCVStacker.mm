@@ -17,20 +17,65 @@ using namespace std;
 using namespace cv;
 
 
-@implementation OpenCVStacker
+@implementation OpenCVStacker {
+    /**
+     Merger of this stacker, every stacker runs its own session.
+     Frames are announced from the capture thread while the merger may be released on another one, so it is only read
+     and replaced atomically, every method works on its own reference.
+     */
+    shared_ptr<ImageMerger> merger;
+}
+
+/**
+ Longest side of the previews shown while stacking.
+ */
+const int PREVIEW_MAX_DIMENSION = 1920;
+
+/**
+ Stars are detected at half resolution and refined at full resolution.
+ */
+const int DETECTION_LEVELS = 1;
 
-unique_ptr<ImageMerger> merger;
+/**
+ Stars are tracked between frames, a full detection runs every TRACKING_INTERVAL frames.
+ */
+const int TRACKING_INTERVAL = 10;
+
+MergerOptions mergerOptions(bool visualiseTrackingPoints) {
+    MergerOptions options = MergerOptions::withVisualisation(visualiseTrackingPoints);
+    options.previewMaxDimension = PREVIEW_MAX_DIMENSION;
+    options.detectionLevels = DETECTION_LEVELS;
+    options.trackingInterval = TRACKING_INTERVAL;
+    // Better frames contribute more to the stack
+    options.weightFrames = true;
+    // Equalised like the images of the editor, which does not use the stretch of the statistics yet
+    options.stretch = StretchMode::CLAHE;
+    // Alignment and previews get cheaper while the capture is faster than stacking
+    options.adaptiveQuality = true;
+    return options;
+}
+
+#pragma mark Private
+
+- (shared_ptr<ImageMerger>) currentMerger {
+    return std::atomic_load(&merger);
+}
 
 #pragma mark Public
 
 - (instancetype) initWithImage:(UIImage *)image withMask: (nullable UIImage *)mask visaliseTrackingPoints: (bool)enabled{
+    return [self initWithImage:image withMask:mask visaliseTrackingPoints:enabled recordSessionTo:nil];
+}
+
+- (instancetype) initWithImage:(UIImage *)image withMask: (nullable UIImage *)mask visaliseTrackingPoints: (bool)enabled recordSessionTo: (nullable NSString *)path {
     NSLog (@"OpenCVStacker initWithImage");
 
     self = [super init];
     if (self) {
         if ([image isKindOfClass:[UIImage class]]) {
             UIImage *rotatedImage = [image rotateToImageOrientation];
-            Mat cvImage = [rotatedImage CVMat3];
+            // The RGBA bitmap is read in place, it is not converted to RGB first
+            Mat cvImage = [rotatedImage CVMat];
 
             Mat cvMask;
             if (mask != nil && [mask isKindOfClass:[UIImage class]]) {
@@ -39,7 +84,11 @@ unique_ptr<ImageMerger> merger;
             }
             
             try {
-                merger = make_unique<ImageMerger>(cvImage, cvMask, enabled);
+                std::shared_ptr<MergeObserver> recorder;
+                if (path != nil) {
+                    recorder = std::make_shared<SessionRecorder>(std::string([path UTF8String]));
+                }
+                std::atomic_store(&merger, make_shared<ImageMerger>(FrameView(cvImage), cvMask, mergerOptions(enabled), recorder));
             } catch (const MergingException& e) {
                 NSLog(@"OpenCVStacker initWithImage: %s", e.what());
                 return nil;
@@ -56,7 +105,7 @@ unique_ptr<ImageMerger> merger;
 - (instancetype) initFromCheckpoint: (NSString *)path processed: (int)numImages visualiseTrackingPoints: (bool)enabled {
     auto pathString = std::string([path UTF8String]);
     
-    merger = make_unique<ImageMerger>(pathString, numImages, enabled);
+    std::atomic_store(&merger, make_shared<ImageMerger>(pathString, numImages, mergerOptions(enabled)));
     
     return self;
 }
@@ -66,14 +115,18 @@ unique_ptr<ImageMerger> merger;
     cv::Mat mask;
     if ([image isKindOfClass:[UIImage class]]) {
         UIImage *rotatedImage = [image rotateToImageOrientation];
-        matImage = [rotatedImage CVMat3];
+        matImage = [rotatedImage CVMat];
     } else {
         return nullptr;
     }
 
+    shared_ptr<ImageMerger> current = [self currentMerger];
+    if (current == nullptr) {
+        return nil;
+    }
     Mat preview;
 
-    if (merger->mergeImageOnStack(matImage, preview)) {
+    if (current->mergeFrame(FrameView(matImage), preview)) {
        std::cout << "Merge successful" << std::endl;
     } else {
         std::cout << "Merge failed" << std::endl;
@@ -88,12 +141,13 @@ unique_ptr<ImageMerger> merger;
  If the init operation of the merger has failed, returns nil
  */
 - (nullable UIImage *)getProcessedImage {
-    if (merger == nullptr) {
+    shared_ptr<ImageMerger> current = [self currentMerger];
+    if (current == nullptr) {
         return nil;
     }
     
     Mat preview;
-    merger->getProcessed(preview);
+    current->getProcessed(preview);
     return [UIImage imageWithCVMat:preview];
 }
 
@@ -102,20 +156,41 @@ unique_ptr<ImageMerger> merger;
  If the init operation of the merger has failed, returns nil
  */
 - (nullable UIImage *)getPreviewImage {
-    if (merger == nullptr) {
+    shared_ptr<ImageMerger> current = [self currentMerger];
+    if (current == nullptr) {
         return nil;
     }
     
     Mat preview;
-    merger->getPreview(preview);
+    current->getPreview(preview);
     return [UIImage imageWithCVMat:preview];
 }
 
+- (void) frameCaptured {
+    shared_ptr<ImageMerger> current = [self currentMerger];
+    if (current != nullptr) {
+        current->frameArrived();
+    }
+}
+
+- (void) frameDropped {
+    shared_ptr<ImageMerger> current = [self currentMerger];
+    if (current != nullptr) {
+        current->frameDropped();
+    }
+}
+
 - (void) saveFiles: (NSString *) path {
-    merger->saveToDirectory(std::string([path UTF8String]));
+    shared_ptr<ImageMerger> current = [self currentMerger];
+    if (current != nullptr) {
+        current->saveToDirectory(std::string([path UTF8String]));
+    }
 }
 
+/**
+ Releases the merger. A call still using it on another thread keeps it alive until it returns.
+ */
 - (void) deallocMerger {
-    merger.reset();
+    std::atomic_store(&merger, shared_ptr<ImageMerger>());
 }
 @end
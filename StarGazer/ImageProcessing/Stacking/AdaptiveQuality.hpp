@@ -0,0 +1,209 @@
+//
+//  AdaptiveQuality.hpp
+//  StarGazer
+//
+//  Trades alignment quality for speed while frames arrive faster than they are merged, and returns to full quality
+//  once the merger has caught up, so live stacking keeps up with the camera on slower devices.
+//
+
+#ifndef AdaptiveQuality_hpp
+#define AdaptiveQuality_hpp
+
+#include <stdio.h>
+#include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+
+using namespace std;
+
+/**
+ * Settings of a frame at a quality level.
+ */
+struct QualitySettings {
+    /**
+     * Number of times frames are downsampled by 2 before detection.
+     */
+    int detectionLevels = 0;
+
+    int ransacIterations = 2000;
+
+    /**
+     * Aligns with a similarity, rotation, translation and uniform scale, instead of a homography.
+     */
+    bool similarity = false;
+
+    /**
+     * Refreshes the preview after every frame, otherwise only every PREVIEW_STRIDE frames.
+     */
+    bool refreshPreview = true;
+};
+
+/**
+ * Picks the quality level of the next frame from the latency of the last frames and the interval they arrive in.
+ * Every level is cheaper than the one before: the preview is refreshed less often, RANSAC runs fewer iterations,
+ * the model is reduced to a similarity and stars are detected one level coarser.
+ * Falling behind lowers the quality after a few frames. Getting back to the better level needs its latency, estimated
+ * from the ratio measured when it was left, to fit the interval with headroom, so the level does not oscillate.
+ */
+class AdaptiveQuality {
+private:
+    static const int NUM_LEVELS = 5;
+
+    /**
+     * Reduced RANSAC iterations, enough for the mostly correct matches of consecutive frames.
+     */
+    static const int FAST_RANSAC_ITERATIONS = 300;
+
+    /**
+     * Behind if a frame takes longer than this fraction of the interval.
+     */
+    constexpr static const double BEHIND_FRACTION = 0.9;
+
+    /**
+     * A better level is only chosen if its latency stays below this fraction of the interval.
+     */
+    constexpr static const double AHEAD_FRACTION = 0.7;
+
+    /**
+     * Behind if more frames than this wait to be merged.
+     */
+    static const int MAX_BACKLOG = 2;
+
+    /**
+     * Frames to stay at a level before lowering it again, and twice as many before raising it.
+     */
+    static const int MIN_FRAMES_AT_LEVEL = 3;
+
+    /**
+     * Weight of the newest value in the averages.
+     */
+    constexpr static const double RECENT_WEIGHT = 0.25;
+
+    int baseDetectionLevels;
+    int level = 0;
+    int framesAtLevel = 0;
+
+    /**
+     * Average latency of a frame at the current level in milliseconds, 0 before the first frame at the level.
+     */
+    double latency = 0;
+
+    /**
+     * Latency of every level relative to the next cheaper one, measured when the quality was lowered, 0 if unknown.
+     * Ratios stay valid while the load of the device changes, absolute latencies of other levels would not.
+     */
+    double relativeLatency[NUM_LEVELS] = {0};
+
+    /**
+     * Latency of the level that was left for a cheaper one, until the ratio of both is measured.
+     */
+    double leftLatency = 0;
+
+    void setLevel(int newLevel) {
+        leftLatency = newLevel > level ? latency : 0;
+        level = newLevel;
+        latency = 0;
+        framesAtLevel = 0;
+    }
+
+    std::mutex mutex;
+    double fixedInterval;
+    double arrivalInterval = 0;
+    std::chrono::steady_clock::time_point lastArrival;
+    int arrived = 0;
+    int merged = 0;
+
+    static void average(double &value, double sample) {
+        value = value == 0 ? sample : value + RECENT_WEIGHT * (sample - value);
+    }
+
+public:
+    static const int PREVIEW_STRIDE = 4;
+
+    /**
+     * @param baseDetectionLevels Detection levels at full quality
+     * @param frameInterval Interval of the frames in milliseconds, 0 to measure it from frameArrived
+     */
+    AdaptiveQuality(int baseDetectionLevels, double frameInterval = 0) :
+            baseDetectionLevels(baseDetectionLevels), fixedInterval(frameInterval) {
+    }
+
+    /**
+     * Notes that a frame was captured and waits to be merged. Can be called from any thread.
+     */
+    void frameArrived() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (arrived > 0) {
+            average(arrivalInterval, std::chrono::duration<double, std::milli>(now - lastArrival).count());
+        }
+        lastArrival = now;
+        arrived++;
+    }
+
+    /**
+     * Notes that a frame that arrived will not be merged, e.g. because it could not be decoded.
+     */
+    void frameDropped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        merged = std::min(merged + 1, arrived);
+    }
+
+    /**
+     * Records the latency of a merged or rejected frame and picks the level of the next frame.
+     */
+    void frameMerged(double milliseconds) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Frames that were not announced by frameArrived are not counted, so they cannot hide a backlog later
+        merged = std::min(merged + 1, arrived);
+        average(latency, milliseconds);
+        framesAtLevel++;
+        if (framesAtLevel == MIN_FRAMES_AT_LEVEL && leftLatency > 0) {
+            relativeLatency[level - 1] = leftLatency / latency;
+            leftLatency = 0;
+        }
+
+        double interval = fixedInterval > 0 ? fixedInterval : arrivalInterval;
+        int backlog = std::max(0, arrived - merged);
+        if (interval <= 0) {
+            return;
+        }
+
+        bool behind = latency > BEHIND_FRACTION * interval || backlog > MAX_BACKLOG;
+        if (behind && level < NUM_LEVELS - 1 && framesAtLevel >= MIN_FRAMES_AT_LEVEL) {
+            setLevel(level + 1);
+            std::cout << "Behind the capture, quality level " << level << std::endl;
+        } else if (!behind && level > 0 && backlog == 0 && framesAtLevel >= 2 * MIN_FRAMES_AT_LEVEL) {
+            // A better level whose cost was never measured is assumed to take twice as long
+            double ratio = relativeLatency[level - 1] > 0 ? relativeLatency[level - 1] : 2;
+            if (latency * ratio < AHEAD_FRACTION * interval) {
+                setLevel(level - 1);
+                std::cout << "Caught up with the capture, quality level " << level << std::endl;
+            }
+        }
+    }
+
+    /**
+     * Settings for the next frame.
+     */
+    QualitySettings getSettings() {
+        std::lock_guard<std::mutex> lock(mutex);
+        QualitySettings settings;
+        settings.refreshPreview = level < 1;
+        settings.ransacIterations = level < 2 ? settings.ransacIterations : FAST_RANSAC_ITERATIONS;
+        settings.similarity = level >= 3;
+        settings.detectionLevels = baseDetectionLevels + (level >= 4 ? 1 : 0);
+        return settings;
+    }
+
+    /**
+     * Level of the next frame, 0 is full quality.
+     */
+    int getLevel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return level;
+    }
+};
+
+#endif /* AdaptiveQuality_hpp */
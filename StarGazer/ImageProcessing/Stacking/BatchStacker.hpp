@@ -0,0 +1,333 @@
+//
+//  BatchStacker.hpp
+//  StarGazer
+//
+//  Stacks already captured frames on all cores. Every worker aligns frames against the reference and adds them to
+//  its own partial stack, the partial stacks are combined by a parallel tree reduction at the end.
+//
+
+#ifndef BatchStacker_hpp
+#define BatchStacker_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <thread>
+
+#include "ImageMerger.hpp"
+#include "FrameSource.hpp"
+#include "PartialStack.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Settings of a batch stacking run.
+ */
+struct BatchOptions {
+    /**
+     Number of workers, 0 for one per core. Every worker holds its own partial stack.
+     */
+    int workers = 0;
+
+    /**
+     Stars are detected in the frame downsampled this many times by 2, see MergerOptions.
+     */
+    int detectionLevels = 0;
+
+    /**
+     Edge length of the tiles the foreground mask is classified in, see MergerOptions. 0 processes every pixel.
+     */
+    int maskTileSize = MaskTiles::DEFAULT_TILE_SIZE;
+
+    /**
+     Hot pixel map of the calibration frames, see MergerOptions.
+     */
+    Mat hotPixels;
+
+    /**
+     Rejects frames that clearly fail on a thumbnail before alignment, see MergerOptions.
+     */
+    bool screenQuality = false;
+    QualityLimits qualityLimits;
+
+    /**
+     Weights every frame by its quality score in the aligned sum, see MergerOptions.
+     */
+    bool weightFrames = false;
+
+    /**
+     Stretch of the processed image, see MergerOptions.
+     */
+    StretchMode stretch = StretchMode::CLAHE;
+    float stretchTarget = 0.25f;
+
+    /**
+     Budget for the partial stacks, fewer workers are used if the partial stacks do not fit. Without a budget, the
+     partial stacks are limited to half of the physical memory.
+     */
+    std::shared_ptr<MemoryBudget> memoryBudget;
+};
+
+class BatchStacker {
+private:
+    /**
+     Same limits as the ImageMerger.
+     */
+    const int MIN_STARS_PER_IMAGE = 5;
+    const int MIN_MATCHED_STARS = 5;
+    const float MIN_FRAME_WEIGHT = 0.1f;
+
+    /**
+     Share of the physical memory the partial stacks may take without a memory budget.
+     */
+    const double DEFAULT_MEMORY_FRACTION = 0.5;
+
+    /**
+     Everything a worker needs to align frames, so workers share nothing but the read only reference.
+     */
+    struct Worker {
+        StarDetector detector;
+        std::unique_ptr<StarMatcher> matcher;
+        vector<Point2i> stars;
+        vector<DMatch> matches;
+        vector<Point2i> matchedPoints1;
+        vector<Point2i> matchedPoints2;
+        WarpBuffers warpBuffers;
+        vector<MaskRegion> maskRegions;
+
+        /**
+         Copy of the screen of the reference, so every worker tracks the recent background of its own frames.
+         */
+        QualityScreen screen;
+        FrameQuality quality;
+
+        Worker(int levels, const QualityScreen &screen) : detector(levels), screen(screen) {
+        }
+    };
+
+    BatchOptions options;
+    Size size;
+
+    /**
+     Float mask in range [0, 1] seperating foreground from background, empty without segmentation.
+     */
+    Mat foregroundMask;
+    MaskTiles maskTiles;
+
+    /**
+     Detection threshold of the reference, used for every frame since frames arrive in no particular order.
+     */
+    float threshold;
+    vector<Point2i> referenceStars;
+    Scalar borderValue;
+
+    /**
+     Quality screen holding the reference measurements, copied by every worker.
+     */
+    QualityScreen qualityScreen;
+
+    /**
+     One partial stack per worker. After stacking, the first one holds the result.
+     */
+    vector<PartialStack> partials;
+    MemoryReservation reservation;
+
+    /**
+     Aligns a frame with the reference.
+     @param h Receives the homography aligning the frame with the reference
+     */
+    bool align(Worker &worker, const FrameView &frame, Mat &h) {
+        if (frame.size() != size) {
+            return false;
+        }
+        bool screened = options.screenQuality || options.weightFrames;
+        if (screened && !worker.screen.evaluate(frame, worker.quality) && options.screenQuality) {
+            return false;
+        }
+
+        const Mat &detectionInput = worker.detector.detectionImage(frame);
+        worker.stars.clear();
+        worker.detector.detect(detectionInput, frame, threshold, worker.stars);
+        if (worker.stars.size() < MIN_STARS_PER_IMAGE) {
+            return false;
+        }
+
+        worker.matches.clear();
+        worker.matcher->matchStars(worker.stars, worker.matches);
+
+        worker.matchedPoints1.clear();
+        worker.matchedPoints2.clear();
+        for (auto &match: worker.matches) {
+            worker.matchedPoints1.push_back(referenceStars[match.queryIdx]);
+            worker.matchedPoints2.push_back(worker.stars[match.trainIdx]);
+        }
+        if (worker.matchedPoints1.size() < MIN_MATCHED_STARS) {
+            return false;
+        }
+
+        h = findHomography(worker.matchedPoints2, worker.matchedPoints1, RANSAC, 3, noArray(), 2000, 0.995);
+        if (h.empty()) {
+            return false;
+        }
+
+        // Every frame is aligned with the reference directly, so the scale has to stay close to the reference
+        double determinant = cv::determinant(h);
+        return determinant >= 0.9 && determinant <= 1.1;
+    }
+
+    void work(Worker &worker, PartialStack &partial, PrefetchingFrameSource &frames) {
+        TaskScope scope(TaskPriority::BATCH);
+        DecodedFrame frame;
+        Mat h;
+        while (frames.next(frame)) {
+            if (!align(worker, frame.view, h)) {
+                partial.numFailed++;
+                continue;
+            }
+            float weight = options.weightFrames ? std::max(worker.quality.score, MIN_FRAME_WEIGHT) : 1;
+            accumulateMaskedTile(frame.view, h, borderValue, Rect(Point(0, 0), size), partial.maxed, partial.combined,
+                                 partial.stacked, worker.warpBuffers, maskTiles, worker.maskRegions, weight);
+            partial.numImages++;
+            partial.weightSum += weight;
+        }
+    }
+
+    /**
+     Merges all partial stacks into the first one, pairs of partial stacks are merged in parallel.
+     */
+    void reduce() {
+        for (size_t stride = 1; stride < partials.size(); stride *= 2) {
+            int pairs = (int) ((partials.size() + 2 * stride - 1) / (2 * stride));
+            parallelFor(Range(0, pairs), [&](const Range &range) {
+                for (int i = range.start; i < range.end; i++) {
+                    size_t target = i * 2 * stride;
+                    if (target + stride < partials.size()) {
+                        partials[target].merge(partials[target + stride]);
+                    }
+                }
+            });
+        }
+        partials.resize(1);
+        reservation.reserve(options.memoryBudget, (size_t) size.area() * PartialStack::bytesPerPixel());
+    }
+
+public:
+    /**
+     Detects the stars of the reference frame all other frames are aligned with.
+     Throws a MergingException if not enough stars are found or if not even a single partial stack fits into the budget.
+     */
+    BatchStacker(const FrameView &reference, Mat &segmentation, BatchOptions options) :
+            options(options), size(reference.size()), qualityScreen(options.qualityLimits) {
+        if (!segmentation.empty()) {
+            createTrackingMask(segmentation, foregroundMask);
+            resize(foregroundMask, foregroundMask, size, 0, 0, INTER_LINEAR);
+            if (options.maskTileSize > 0) {
+                maskTiles = MaskTiles(foregroundMask, options.maskTileSize);
+            }
+        }
+
+        StarDetector detector(options.detectionLevels);
+        detector.setMask(foregroundMask, options.maskTileSize);
+        detector.setHotPixels(options.hotPixels);
+        const Mat &detectionInput = detector.detectionImage(reference);
+        threshold = detector.findThreshold(detectionInput);
+        if (threshold == numeric_limits<float>::infinity()) {
+            throw MergingException("Could not find initial threshold");
+        }
+        detector.detect(detectionInput, reference, threshold, referenceStars);
+        if (referenceStars.size() < MIN_STARS_PER_IMAGE) {
+            throw MergingException("Not enough stars found in initial image");
+        }
+        borderValue = cv::mean(detectionInput);
+        if (options.screenQuality || options.weightFrames) {
+            FrameQuality quality;
+            qualityScreen.setMask(foregroundMask);
+            qualityScreen.evaluate(reference, quality);
+        }
+
+        int workers = options.workers > 0 ? options.workers : std::max(1, (int) std::thread::hardware_concurrency());
+        size_t partialBytes = (size_t) size.area() * PartialStack::bytesPerPixel();
+        if (options.memoryBudget != nullptr) {
+            workers = (int) std::min<size_t>(workers, options.memoryBudget->available() / partialBytes);
+            if (workers < 1 || !reservation.reserve(options.memoryBudget, workers * partialBytes)) {
+                throw MergingException("Memory budget too small for a single partial stack");
+            }
+        } else {
+            // Every partial stack is a full frame, on many cores they easily exceed the memory of the machine
+            size_t limit = (size_t) (MemoryBudget::physicalMemory() * DEFAULT_MEMORY_FRACTION);
+            int fitting = (int) std::min<size_t>(limit / partialBytes, workers);
+            if (limit > 0 && fitting < workers) {
+                workers = std::max(1, fitting);
+                std::cout << "Partial stacks limited to half of the physical memory, using " << workers << " workers"
+                          << std::endl;
+            }
+        }
+
+        partials.resize(workers);
+        for (auto &partial: partials) {
+            partial.create(size);
+        }
+
+        WarpBuffers warpBuffers;
+        accumulateTile(reference, Mat::eye(3, 3, CV_64FC1), Scalar(), Rect(Point(0, 0), size), partials[0].maxed,
+                       partials[0].combined, partials[0].stacked, warpBuffers);
+        partials[0].numImages = 1;
+        partials[0].weightSum = 1;
+    }
+
+    /**
+     Aligns and adds all frames of a source with one thread per partial stack, then reduces the partial stacks.
+     Can only be called once.
+     */
+    void stack(PrefetchingFrameSource &frames) {
+        TaskScope scope(TaskPriority::BATCH);
+        vector<std::unique_ptr<Worker>> workers;
+        vector<std::thread> threads;
+        for (int i = 0; i < partials.size(); i++) {
+            workers.push_back(std::make_unique<Worker>(options.detectionLevels, qualityScreen));
+            workers[i]->detector.setMask(foregroundMask, options.maskTileSize);
+            workers[i]->detector.setHotPixels(options.hotPixels);
+            workers[i]->matcher = std::make_unique<StarMatcher>(referenceStars);
+        }
+        for (int i = 0; i < partials.size(); i++) {
+            threads.emplace_back(&BatchStacker::work, this, std::ref(*workers[i]), std::ref(partials[i]), std::ref(frames));
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        std::cout << "Reducing " << partials.size() << " partial stacks" << std::endl;
+        reduce();
+    }
+
+    int getNumImages() {
+        return partials[0].numImages;
+    }
+
+    int getNumFailed() {
+        return partials[0].numFailed;
+    }
+
+    /**
+     Returns the stacked image, composed like ImageMerger::getProcessed.
+     */
+    void getProcessed(Mat &image) {
+        partials[0].getProcessed(foregroundMask, image, options.stretch, options.stretchTarget);
+    }
+
+    /**
+     Writes the result in the checkpoint format of the ImageMerger. The sums are stored as 32 bit.
+     */
+    void saveToDirectory(string dir) {
+        partials[0].writeCheckpoint(dir, foregroundMask);
+    }
+
+    /**
+     Returns the result, only valid after stacking.
+     */
+    PartialStack &getResult() {
+        return partials[0];
+    }
+};
+
+#endif /* BatchStacker_hpp */
@@ -0,0 +1,177 @@
+//
+//  CheckpointMerger.hpp
+//  StarGazer
+//
+//  Combines the checkpoints of several stacking runs over parts of the same capture into a single stack.
+//  Every run stacks onto its own reference frame, the runs are registered with each other by star matching.
+//
+
+#ifndef CheckpointMerger_hpp
+#define CheckpointMerger_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "ImageMerger.hpp"
+#include "PartialStack.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Merges partial stacks into the first one added.
+ Stars are detected in the average of every partial stack and matched with the stars of the first one. The sums and
+ the max are warped onto the first partial stack, the unaligned foreground sums are added as they are, since all
+ parts were taken from the same position.
+ */
+class CheckpointMerger {
+private:
+    /**
+     Same limits as the ImageMerger.
+     */
+    const int MIN_STARS_PER_IMAGE = 5;
+    const int MIN_MATCHED_STARS = 5;
+
+    StarDetector detector;
+    std::unique_ptr<StarMatcher> matcher;
+    vector<Point2i> referenceStars;
+
+    PartialStack result;
+
+    /**
+     Float foreground mask of the first partial stack.
+     */
+    Mat foregroundMask;
+
+    Mat average;
+    Mat warped;
+
+    /**
+     Detects the stars of a partial stack in the average of its aligned frames.
+     */
+    bool detectStars(PartialStack &part, vector<Point2i> &stars) {
+        part.combined.convertTo(average, CV_8U, 1.0 / std::max(part.weightSum, 1e-6));
+        FrameView view(average);
+        const Mat &detectionInput = detector.detectionImage(view);
+
+        // Every part is only detected once, so the threshold is searched for every part
+        float threshold = detector.findThreshold(detectionInput);
+        if (threshold == numeric_limits<float>::infinity()) {
+            return false;
+        }
+        detector.detect(detectionInput, view, threshold, stars);
+        return stars.size() >= MIN_STARS_PER_IMAGE;
+    }
+
+    /**
+     Finds the homography aligning a partial stack with the first one.
+     */
+    bool registerPart(PartialStack &part, Mat &h) {
+        vector<Point2i> stars;
+        if (!detectStars(part, stars)) {
+            std::cout << "Not enough stars found in partial stack" << std::endl;
+            return false;
+        }
+
+        vector<DMatch> matches;
+        matcher->matchStars(stars, matches);
+        vector<Point2i> matchedPoints1, matchedPoints2;
+        for (auto &match: matches) {
+            matchedPoints1.push_back(referenceStars[match.queryIdx]);
+            matchedPoints2.push_back(stars[match.trainIdx]);
+        }
+        if (matchedPoints1.size() < MIN_MATCHED_STARS) {
+            std::cout << "Not enough stars could be matched with the reference" << std::endl;
+            return false;
+        }
+
+        h = findHomography(matchedPoints2, matchedPoints1, RANSAC, 3, noArray(), 2000, 0.995);
+        if (h.empty()) {
+            return false;
+        }
+        double determinant = cv::determinant(h);
+        return determinant >= 0.9 && determinant <= 1.1;
+    }
+
+public:
+    CheckpointMerger(int detectionLevels = 0) : detector(detectionLevels) {
+    }
+
+    /**
+     Adds a partial stack, which is released afterwards. The first partial stack is the reference of the result.
+     Throws a MergingException if not enough stars are found in the first partial stack.
+     @param mask Float foreground mask of the partial stack, only the mask of the first one is kept
+     @return False if the partial stack could not be registered with the reference, it is skipped in that case.
+     */
+    bool add(PartialStack &part, const Mat &mask) {
+        TaskScope scope(TaskPriority::BATCH);
+        if (result.numImages == 0) {
+            foregroundMask = mask;
+            detector.setMask(foregroundMask);
+            if (!detectStars(part, referenceStars)) {
+                throw MergingException("Not enough stars found in the reference partial stack");
+            }
+            matcher = std::make_unique<StarMatcher>(referenceStars);
+            result = part;
+            part = PartialStack();
+            return true;
+        }
+
+        Mat h;
+        if (part.size() != result.size() || !registerPart(part, h)) {
+            result.numFailed += part.numImages;
+            part = PartialStack();
+            return false;
+        }
+
+        // Borders take the average of the part like borders of single frames
+        warpPerspective(part.combined, warped, h, result.size(), INTER_LINEAR, BORDER_CONSTANT, cv::mean(part.combined));
+        cv::add(result.combined, warped, result.combined);
+
+        warpPerspective(part.maxed, warped, h, result.size(), INTER_LINEAR, BORDER_CONSTANT, cv::mean(part.maxed));
+        max(result.maxed, warped, result.maxed);
+
+        cv::add(result.stacked, part.stacked, result.stacked);
+        result.numImages += part.numImages;
+        result.numFailed += part.numFailed;
+        result.weightSum += part.weightSum;
+        part = PartialStack();
+        return true;
+    }
+
+    /**
+     Reads a checkpoint and adds it.
+     @param numImages Number of frames in the checkpoint, -1 to read it from its metadata
+     @return False if the checkpoint could not be read or registered.
+     */
+    bool addCheckpoint(const string &dir, int numImages = -1) {
+        PartialStack part;
+        Mat mask;
+        if (!part.readCheckpoint(dir, numImages, mask)) {
+            std::cout << "Could not read checkpoint in " << dir << std::endl;
+            return false;
+        }
+        return add(part, mask);
+    }
+
+    PartialStack &getResult() {
+        return result;
+    }
+
+    /**
+     Returns the merged image, composed like ImageMerger::getProcessed.
+     @param stretch Stretch of the sky, see MergerOptions
+     */
+    void getProcessed(Mat &image, StretchMode stretch = StretchMode::CLAHE, float stretchTarget = 0.25f) {
+        result.getProcessed(foregroundMask, image, stretch, stretchTarget);
+    }
+
+    /**
+     Writes the merged stack as a checkpoint with metadata.
+     */
+    void saveToDirectory(const string &dir) {
+        result.writeCheckpoint(dir, foregroundMask);
+    }
+};
+
+#endif /* CheckpointMerger_hpp */
@@ -0,0 +1,292 @@
+//
+//  DrizzleCanvas.hpp
+//  StarGazer
+//
+//  Drizzles aligned frames onto a canvas finer than the frames, recovering resolution from the sub pixel offsets
+//  between dithered frames that bilinear warping onto a canvas of the frame size averages away.
+//
+
+#ifndef DrizzleCanvas_hpp
+#define DrizzleCanvas_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <cfloat>
+
+#include "FrameView.hpp"
+#include "TiledCanvas.hpp"
+#include "TaskScheduler.hpp"
+#include "MeshAlignment.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Planes of the drizzle canvas.
+ */
+enum DrizzlePlane {
+    /**
+     * Sum of the dropped values weighted by their overlap with every canvas pixel. Float RGB in 8 bit scale.
+     */
+    DRIZZLE_SUM_PLANE = 0,
+
+    /**
+     * Sum of the overlaps and frame weights of every canvas pixel. Float.
+     */
+    DRIZZLE_WEIGHT_PLANE = 1,
+};
+
+/**
+ * Scales a channel value to float in 8 bit scale, without rounding 16 bit frames to 8 bit first.
+ */
+template<typename T>
+static inline float drizzleValue(T value) {
+    return sizeof(T) == 1 ? (float) value : value / 257.0f;
+}
+
+/**
+ * Drops the pixels of a frame onto a band of rows of a canvas tile.
+ * Only the part of the frame that maps into the band is read, so bands of a tile can be drizzled in parallel.
+ *
+ * @param toCanvas Maps pixel centers of the frame to pixel corners of the canvas
+ * @param fromCanvas Inverse of toCanvas
+ * @param radius Half the edge length of a drop on the canvas
+ * @param mask Foreground mask in frame coordinates, float or 8 bit fixed point, empty to drop every pixel. Drops are
+ *             weighted by the mask, so the foreground, which moves against the sky, is not drizzled.
+ * @param offsets Offsets of the mesh alignment in stack coordinates, see MeshAlignment::offsetAt, empty for none
+ * @param scale Scale of the canvas, to find the stack pixel of a canvas position
+ * @param rect Area of the canvas covered by the tile
+ * @param rows Rows of the tile in the band
+ */
+template<typename T>
+static void drizzleRows(const FrameView &frame, const Matx33d &toCanvas, const Matx33d &fromCanvas, float radius,
+                        float weight, const Mat &mask, const Mat &offsets, float scale, const Rect &rect, Mat &sum,
+                        Mat &weights, const Range &rows) {
+    // Area of the frame that can drop onto the band, from the corners of the band widened by a drop
+    Rect2d band(rect.x - radius, rect.y + rows.start - radius, rect.width + 2 * radius, rows.size() + 2 * radius);
+    double minX = DBL_MAX, minY = DBL_MAX, maxX = -DBL_MAX, maxY = -DBL_MAX;
+    for (int i = 0; i < 4; i++) {
+        Vec3d corner = fromCanvas * Vec3d(i & 1 ? band.br().x : band.x, i & 2 ? band.br().y : band.y, 1);
+        if (corner[2] <= 0) {
+            // The band lies behind the horizon of the homography, no frame pixel maps into it
+            return;
+        }
+        minX = std::min(minX, corner[0] / corner[2]);
+        maxX = std::max(maxX, corner[0] / corner[2]);
+        minY = std::min(minY, corner[1] / corner[2]);
+        maxY = std::max(maxY, corner[1] / corner[2]);
+    }
+    // The offsets of the mesh move frame pixels by up to their maximum onto the band
+    int margin = offsets.empty() ? 0 : (int) std::ceil(MeshAlignment::MAX_OFFSET);
+    Rect area = Rect(Point(cvFloor(minX) - margin, cvFloor(minY) - margin),
+                     Point(cvCeil(maxX) + 1 + margin, cvCeil(maxY) + 1 + margin))
+                & Rect(Point(0, 0), frame.size());
+    if (area.empty()) {
+        return;
+    }
+
+    int step = frame.step();
+    vector<Point2f> framePoints(area.width), canvasPoints(area.width);
+    vector<float> dropWeights(area.width, weight);
+    Mat values(1, area.width, CV_32FC3), dropWeightRow(1, area.width, CV_32F, dropWeights.data()), interleavedRow;
+    float top = (float) (rect.y + rows.start), bottom = (float) (rect.y + rows.end);
+    float left = (float) rect.x, right = (float) (rect.x + rect.width);
+
+    // 8 bit interleaved frames are converted a whole row at a time, in their own layout
+    Mat header;
+    int order[3];
+    bool interleaved = frame.asInterleavedMat(header, order);
+    int fromTo[] = {order[0], 0, order[1], 1, order[2], 2};
+
+    for (int y = area.y; y < area.y + area.height; y++) {
+        // Positions, values and weights of the whole row first, then the drops are scattered one by one
+        for (int i = 0; i < area.width; i++) {
+            framePoints[i] = Point2f((float) (area.x + i), (float) y);
+        }
+        perspectiveTransform(framePoints, canvasPoints, toCanvas);
+        if (!offsets.empty()) {
+            // The mesh reads a stack pixel from its homography position plus its offset, so a frame pixel lands on
+            // the stack where the homography maps the pixel minus the offset
+            for (int i = 0; i < area.width; i++) {
+                Vec2f offset = MeshAlignment::offsetAt(offsets, cvFloor(canvasPoints[i].x / scale),
+                                                       cvFloor(canvasPoints[i].y / scale));
+                framePoints[i] -= Point2f(offset[0], offset[1]);
+            }
+            perspectiveTransform(framePoints, canvasPoints, toCanvas);
+        }
+
+        if (interleaved) {
+            header.row(y).colRange(area.x, area.x + area.width).convertTo(interleavedRow, CV_32F);
+            mixChannels(&interleavedRow, 1, &values, 1, fromTo, 3);
+        } else {
+            float *valueRow = values.ptr<float>();
+            for (int c = 0; c < 3; c++) {
+                const T *row = frame.ptr<T>(c, y) + area.x * step;
+                for (int i = 0; i < area.width; i++) {
+                    valueRow[i * 3 + c] = drizzleValue<T>(row[i * step]);
+                }
+            }
+        }
+        if (!mask.empty()) {
+            mask.row(y).colRange(area.x, area.x + area.width)
+                    .convertTo(dropWeightRow, CV_32F, mask.depth() == CV_8U ? weight / 255 : weight);
+        }
+
+        const Vec3f *dropValues = values.ptr<Vec3f>();
+        for (int i = 0; i < area.width; i++) {
+            const Point2f &center = canvasPoints[i];
+            float x0 = std::max(center.x - radius, left), x1 = std::min(center.x + radius, right);
+            float y0 = std::max(center.y - radius, top), y1 = std::min(center.y + radius, bottom);
+            if (x0 >= x1 || y0 >= y1 || dropWeights[i] <= 0) {
+                continue;
+            }
+
+            // Add the drop to every canvas pixel it overlaps, weighted by the area of the overlap
+            for (int cy = (int) y0; cy < y1; cy++) {
+                float overlapY = std::min(y1, cy + 1.0f) - std::max(y0, (float) cy);
+                float *sumRow = sum.ptr<float>(cy - rect.y);
+                float *weightRow = weights.ptr<float>(cy - rect.y);
+                for (int cx = (int) x0; cx < x1; cx++) {
+                    float overlap = (std::min(x1, cx + 1.0f) - std::max(x0, (float) cx)) * overlapY * dropWeights[i];
+                    int tileX = cx - rect.x;
+                    sumRow[tileX * 3] += dropValues[i][0] * overlap;
+                    sumRow[tileX * 3 + 1] += dropValues[i][1] * overlap;
+                    sumRow[tileX * 3 + 2] += dropValues[i][2] * overlap;
+                    weightRow[tileX] += overlap;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Stack on a canvas scaled from the frame size, e.g. 1.5 or 2 times, filled by drizzling.
+ * Every frame pixel is shrunk to a drop, mapped onto the canvas with the homography of the frame and added to the
+ * canvas pixels it overlaps, weighted by the overlap. The canvas holds the weighted sums and the weights, the
+ * average is their ratio, so canvas pixels covered by many or by few drops are both exact averages.
+ *
+ * The canvas is a TiledCanvas: within a memory budget it is split into tiles and spilled to disk if it does not
+ * fit, e.g. the 1.5 GB of a 2 times canvas of a 24 MP frame. Every tile is drizzled in bands of rows in parallel.
+ */
+class DrizzleCanvas {
+private:
+    std::unique_ptr<TiledCanvas> canvas;
+    float scale;
+    float dropSize;
+
+public:
+    /**
+     * Throws a CanvasException if the canvas does not fit into the memory budget.
+     * @param frameSize Size of the frames, the canvas is scaled from it
+     * @param scale Scale of the canvas, e.g. 1.5 or 2
+     * @param dropSize Edge length of a drop relative to a frame pixel, in range (0, 1]. Smaller drops keep more
+     *                 resolution but need more frames to cover every canvas pixel.
+     * @param tileSize Edge length of the tiles of the canvas if a budget is set
+     */
+    DrizzleCanvas(Size frameSize, float scale, float dropSize, int tileSize,
+                  std::shared_ptr<MemoryBudget> budget = nullptr, string spillDirectory = "") :
+            scale(scale), dropSize(std::min(std::max(dropSize, 0.1f), 1.0f)) {
+        Size size(cvRound(frameSize.width * scale), cvRound(frameSize.height * scale));
+        canvas = std::make_unique<TiledCanvas>(size, vector<int>{CV_32FC3, CV_32FC1},
+                                               budget != nullptr ? tileSize : std::max(size.width, size.height),
+                                               budget, spillDirectory);
+        std::cout << "Drizzle canvas " << size << (canvas->isSpilled() ? " (spilled)" : "") << std::endl;
+    }
+
+    Size getSize() {
+        return canvas->getSize();
+    }
+
+    float getScale() {
+        return scale;
+    }
+
+    bool isSpilled() {
+        return canvas->isSpilled();
+    }
+
+    /**
+     * Drizzles a frame onto the canvas.
+     * @param h Homography aligning the frame with the stack, in frame coordinates
+     * @param weight Weight of the frame
+     * @param mask Foreground mask of the frame, see drizzleRows
+     * @param offsets Offsets of the mesh alignment, empty to drizzle with the homography alone
+     */
+    void add(const FrameView &frame, const Mat &h, float weight = 1, const Mat &mask = Mat(),
+             const Mat &offsets = Mat()) {
+        // Pixel centers of the frame to pixel corners of the canvas
+        Matx33d toScaledCorners(scale, 0, scale * 0.5, 0, scale, scale * 0.5, 0, 0, 1);
+        Matx33d toCanvas = toScaledCorners * Matx33d(h);
+        Matx33d fromCanvas = toCanvas.inv();
+
+        // The homographies of a session are close to affine, the drop is scaled by the area change at the center
+        Matx33d local = Matx33d(h);
+        double area = std::abs(local(0, 0) * local(1, 1) - local(0, 1) * local(1, 0)) / (local(2, 2) * local(2, 2));
+        float radius = (float) (0.5 * dropSize * scale * std::sqrt(area));
+
+        for (int i = 0; i < canvas->numTiles(); i++) {
+            CanvasTile &tile = canvas->acquire(i);
+            Mat &sum = tile.planes[DRIZZLE_SUM_PLANE];
+            Mat &weights = tile.planes[DRIZZLE_WEIGHT_PLANE];
+            parallelFor(Range(0, tile.rect.height), [&](const Range &rows) {
+                if (frame.depth() == CV_16U) {
+                    drizzleRows<ushort>(frame, toCanvas, fromCanvas, radius, weight, mask, offsets, scale, tile.rect, sum,
+                                        weights, rows);
+                } else {
+                    drizzleRows<uchar>(frame, toCanvas, fromCanvas, radius, weight, mask, offsets, scale, tile.rect, sum,
+                                       weights, rows);
+                }
+            });
+        }
+    }
+
+    /**
+     * Returns the average of the drizzled frames, 8 bit or 16 bit RGB. Pixels no drop covered are black, with a mask
+     * this includes the foreground.
+     * Assembled tile by tile, so a spilled canvas is never resident as a whole.
+     */
+    void getAverage(Mat &image, int depth = CV_8U) {
+        image.create(canvas->getSize(), CV_MAKETYPE(depth, 3));
+        double outputScale = depth == CV_16U ? 257 : 1;
+        Mat average;
+        for (int i = 0; i < canvas->numTiles(); i++) {
+            CanvasTile &tile = canvas->acquire(i);
+            const Mat &sum = tile.planes[DRIZZLE_SUM_PLANE];
+            const Mat &weights = tile.planes[DRIZZLE_WEIGHT_PLANE];
+            average.create(tile.rect.size(), CV_32FC3);
+            for (int y = 0; y < tile.rect.height; y++) {
+                const float *sumRow = sum.ptr<float>(y);
+                const float *weightRow = weights.ptr<float>(y);
+                float *averageRow = average.ptr<float>(y);
+                for (int x = 0; x < tile.rect.width; x++) {
+                    float inverse = weightRow[x] > 0 ? 1.0f / weightRow[x] : 0;
+                    averageRow[x * 3] = sumRow[x * 3] * inverse;
+                    averageRow[x * 3 + 1] = sumRow[x * 3 + 1] * inverse;
+                    averageRow[x * 3 + 2] = sumRow[x * 3 + 2] * inverse;
+                }
+            }
+            Mat target = image(tile.rect);
+            average.convertTo(target, depth, outputScale);
+        }
+    }
+
+    /**
+     * Writes the sums and weights in the format of writeMatBinary.
+     */
+    void writeBinary(std::ofstream &ofs) {
+        canvas->writePlaneBinary(ofs, DRIZZLE_SUM_PLANE);
+        canvas->writePlaneBinary(ofs, DRIZZLE_WEIGHT_PLANE);
+    }
+
+    /**
+     * Reads the sums and weights written by writeBinary.
+     * Throws a CanvasException if they were drizzled at another scale.
+     * @return False if nothing was stored
+     */
+    bool readBinary(std::ifstream &ifs) {
+        return canvas->readPlaneBinary(ifs, DRIZZLE_SUM_PLANE) && canvas->readPlaneBinary(ifs, DRIZZLE_WEIGHT_PLANE);
+    }
+};
+
+#endif /* DrizzleCanvas_hpp */
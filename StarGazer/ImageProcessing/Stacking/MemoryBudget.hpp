@@ -0,0 +1,131 @@
+//
+//  MemoryBudget.hpp
+//  StarGazer
+//
+//  Keeps track of the memory held by stacking buffers.
+//
+
+#ifndef MemoryBudget_hpp
+#define MemoryBudget_hpp
+
+#include <stdio.h>
+#include <mutex>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <unistd.h>
+
+/**
+ * Upper bound for the memory held by buffers that reserve from it.
+ * Reservations are all or nothing, a buffer that does not fit has to be spilled or refused.
+ * Thread safe, a budget can be shared by several mergers.
+ */
+class MemoryBudget {
+private:
+    std::mutex mutex;
+    size_t limit;
+    size_t used = 0;
+
+public:
+    /**
+     * @param limit Maximum number of bytes that can be reserved
+     */
+    MemoryBudget(size_t limit) : limit(limit) {
+    }
+
+    /**
+     * A budget without limit, every reservation succeeds.
+     */
+    static std::shared_ptr<MemoryBudget> unlimited() {
+        return std::make_shared<MemoryBudget>(std::numeric_limits<size_t>::max());
+    }
+
+    /**
+     * Physical memory of the machine in bytes, 0 if it cannot be determined.
+     */
+    static size_t physicalMemory() {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long pageSize = sysconf(_SC_PAGESIZE);
+        return pages > 0 && pageSize > 0 ? (size_t) pages * (size_t) pageSize : 0;
+    }
+
+    /**
+     * Reserves the given number of bytes if they are still available.
+     * @return True if the bytes were reserved.
+     */
+    bool tryReserve(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (bytes > limit - used) {
+            return false;
+        }
+        used += bytes;
+        return true;
+    }
+
+    void release(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= std::min(bytes, used);
+    }
+
+    size_t available() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return limit - used;
+    }
+
+    size_t getUsed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    size_t getLimit() {
+        return limit;
+    }
+};
+
+/**
+ * Reservation that is returned to the budget when it goes out of scope.
+ */
+class MemoryReservation {
+private:
+    std::shared_ptr<MemoryBudget> budget;
+    size_t bytes = 0;
+
+public:
+    MemoryReservation() {
+    }
+
+    MemoryReservation(const MemoryReservation &) = delete;
+    MemoryReservation &operator=(const MemoryReservation &) = delete;
+
+    ~MemoryReservation() {
+        reset();
+    }
+
+    /**
+     * Reserves the given number of bytes, replacing a previous reservation.
+     * @return False if the budget could not provide the bytes. Nothing is reserved in that case.
+     */
+    bool reserve(std::shared_ptr<MemoryBudget> budget, size_t bytes) {
+        reset();
+        if (budget == nullptr || !budget->tryReserve(bytes)) {
+            return false;
+        }
+        this->budget = budget;
+        this->bytes = bytes;
+        return true;
+    }
+
+    void reset() {
+        if (budget != nullptr) {
+            budget->release(bytes);
+        }
+        budget.reset();
+        bytes = 0;
+    }
+
+    size_t size() {
+        return bytes;
+    }
+};
+
+#endif /* MemoryBudget_hpp */
@@ -0,0 +1,141 @@
+//
+//  PartialStack.hpp
+//  StarGazer
+//
+//  Sums and max of a subset of the frames of a capture, stored in the checkpoint format of the ImageMerger.
+//
+
+#ifndef PartialStack_hpp
+#define PartialStack_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+
+#include "ImageMerger.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Sums and max of a subset of the frames. Sums are 32 bit, so thousands of frames can be added without saturating.
+ The aligned sum is float, so weighted frames are added without rounding.
+ Partial stacks are associative, merging them in any order gives the same result up to float rounding.
+ */
+struct PartialStack {
+    Mat combined;
+    Mat maxed;
+    Mat stacked;
+    int numImages = 0;
+    int numFailed = 0;
+
+    /**
+     Sum of the weights of the frames in the aligned sum, equals numImages if frames are not weighted.
+     */
+    double weightSum = 0;
+
+    static size_t bytesPerPixel() {
+        return TiledCanvas::bytesPerPixel({CV_32FC3, CV_8UC3, CV_32SC3});
+    }
+
+    void create(Size size) {
+        combined = Mat::zeros(size, CV_32FC3);
+        maxed = Mat::zeros(size, CV_8UC3);
+        stacked = Mat::zeros(size, CV_32SC3);
+    }
+
+    Size size() {
+        return maxed.size();
+    }
+
+    /**
+     Adds another partial stack with the same reference to this one and releases it.
+     */
+    void merge(PartialStack &other) {
+        add(combined, other.combined, combined);
+        max(maxed, other.maxed, maxed);
+        add(stacked, other.stacked, stacked);
+        numImages += other.numImages;
+        numFailed += other.numFailed;
+        weightSum += other.weightSum;
+        other = PartialStack();
+    }
+
+    /**
+     Returns the stacked image, composed and stretched by the same code as ImageMerger::getProcessed.
+     @param mask Float foreground mask, empty if the capture has no segmentation
+     @param stretch Stretch of the sky, see MergerOptions
+     */
+    void getProcessed(const Mat &mask, Mat &image, StretchMode stretch = StretchMode::CLAHE,
+                      float stretchTarget = 0.25f) {
+        StretchLut lut;
+        if (stretch != StretchMode::CLAHE) {
+            StackStatistics statistics(size(), mask);
+            statistics.update(Rect(Point(0, 0), size()), combined);
+            statistics.createStretch(weightSum, stretch, stretchTarget, lut);
+        }
+
+        FrameWorkspace buffers;
+        image.create(size(), CV_8UC3);
+        ImageMerger::composeProcessedTile(combined, stacked, mask, weightSum, numImages, lut, buffers, image);
+        ImageMerger::equaliseProcessed({Rect(Point(0, 0), size())}, mask, !lut.empty(), buffers, image);
+    }
+
+    /**
+     Writes the stack in the checkpoint format of the ImageMerger, the sums are stored as 32 bit.
+     The sum of the weights follows the mask like in checkpoints of the ImageMerger.
+     The number of frames is written to the metadata file next to the checkpoint.
+     */
+    void writeCheckpoint(const string &dir, const Mat &mask) {
+        std::ofstream ofs(dir + CHECKPOINT_FILENAME, std::ios::binary);
+        writeMatBinary(ofs, combined);
+        writeMatBinary(ofs, maxed);
+        writeMatBinary(ofs, stacked);
+        writeMatBinary(ofs, mask);
+        writeWeightSum(ofs, weightSum);
+
+        std::ofstream meta(dir + METADATA_FILENAME);
+        meta << numImages << std::endl;
+    }
+
+    /**
+     Reads a checkpoint written by the ImageMerger or by writeCheckpoint.
+     @param numImages Number of frames in the checkpoint, -1 to read it from the metadata file
+     @param mask Receives the float foreground mask, empty if the checkpoint has none
+     @return False if the checkpoint or its number of frames could not be read.
+     */
+    bool readCheckpoint(const string &dir, int numImages, Mat &mask) {
+        std::ifstream ifs(dir + CHECKPOINT_FILENAME, std::ios::binary);
+        if (!ifs.is_open()) {
+            return false;
+        }
+        if (numImages < 0) {
+            std::ifstream meta(dir + METADATA_FILENAME);
+            if (!(meta >> numImages)) {
+                return false;
+            }
+        }
+
+        readMatBinary(ifs, combined);
+        readMatBinary(ifs, maxed);
+        readMatBinary(ifs, stacked);
+        mask.release();
+        readMatBinary(ifs, mask);
+        weightSum = readWeightSum(ifs, numImages);
+        if (combined.empty() || maxed.empty() || stacked.empty()) {
+            return false;
+        }
+
+        combined.convertTo(combined, CV_32F);
+        maxed.convertTo(maxed, CV_8U);
+        stacked.convertTo(stacked, CV_32S);
+        if (!mask.empty()) {
+            mask.convertTo(mask, CV_32F);
+        }
+        this->numImages = numImages;
+        numFailed = 0;
+        return true;
+    }
+};
+
+#endif /* PartialStack_hpp */
@@ -0,0 +1,131 @@
+//
+//  PreviewBuffer.hpp
+//  StarGazer
+//
+//  Downscaled max stack that is updated while stacking, used for previews.
+//
+
+#ifndef PreviewBuffer_hpp
+#define PreviewBuffer_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "FrameView.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Keeps a max stack at preview resolution.
+ * Frames are downscaled first and then aligned at preview resolution, so an update only warps preview sized images.
+ *
+ * Double buffered: the front buffer is handed out without copying and is never written while a consumer holds it.
+ * Every frame is added to the back buffer, which is only published every updateInterval frames.
+ */
+class PreviewBuffer {
+private:
+    Size fullSize;
+    Size previewSize;
+
+    /**
+     * Scales full resolution coordinates to preview coordinates.
+     */
+    Mat scale;
+    Mat scaleInverse;
+
+    int updateInterval;
+    int framesSinceUpdate = 0;
+
+    Mat front;
+    Mat back;
+
+    Mat scaledFrame;
+    Mat alignedFrame;
+
+    void publish() {
+        // Reuse the front buffer if no consumer holds it anymore, otherwise leave it to the consumer
+        if (front.empty() || front.u == nullptr || front.u->refcount > 1) {
+            front = Mat(previewSize, back.type());
+        }
+        back.copyTo(front);
+    }
+
+public:
+    /**
+     * @param fullSize Size of the stacked frames
+     * @param maxDimension Longest side of the preview
+     * @param updateInterval Only every n-th frame publishes the preview
+     */
+    PreviewBuffer(Size fullSize, int maxDimension, int updateInterval = 1) : fullSize(fullSize), updateInterval(std::max(updateInterval, 1)) {
+        double factor = std::min(1.0, (double) maxDimension / std::max(fullSize.width, fullSize.height));
+        previewSize = Size(std::max(1, cvRound(fullSize.width * factor)), std::max(1, cvRound(fullSize.height * factor)));
+
+        double scaleX = (double) previewSize.width / fullSize.width;
+        double scaleY = (double) previewSize.height / fullSize.height;
+        scale = (Mat_<double>(3, 3) << scaleX, 0, 0, 0, scaleY, 0, 0, 0, 1);
+        scaleInverse = scale.inv();
+
+        back = Mat::zeros(previewSize, CV_8UC3);
+    }
+
+    /**
+     * Initialises the preview from an existing full resolution max stack, e.g. when resuming from a checkpoint.
+     */
+    void reset(const Mat &maxed) {
+        resize(maxed, back, previewSize, 0, 0, INTER_AREA);
+        framesSinceUpdate = 0;
+        publish();
+    }
+
+    /**
+     * Initialises the area of one tile of an existing full resolution max stack, so a spilled stack is never
+     * assembled as a whole.
+     * @param rect Area of the stack covered by the tile
+     */
+    void resetTile(const Rect &rect, const Mat &maxed) {
+        double scaleX = scale.at<double>(0, 0), scaleY = scale.at<double>(1, 1);
+        Rect scaled = Rect(Point(cvRound(rect.x * scaleX), cvRound(rect.y * scaleY)),
+                           Point(cvRound(rect.br().x * scaleX), cvRound(rect.br().y * scaleY)))
+                      & Rect(Point(0, 0), previewSize);
+        if (!scaled.empty()) {
+            Mat target = back(scaled);
+            resize(maxed, target, scaled.size(), 0, 0, INTER_AREA);
+        }
+        framesSinceUpdate = 0;
+        publish();
+    }
+
+    /**
+     * Adds a frame to the preview and publishes the preview if it is due.
+     * Every frame is added, the preview is small enough that only publishing is worth throttling.
+     * @param h Homography aligning the full resolution frame with the stack
+     * @param border Value used for pixels outside of the warped frame
+     */
+    void add(const FrameView &image, const Mat &h, const Scalar &border) {
+        image.downscale(previewSize, scaledFrame);
+
+        // Express the homography in preview coordinates
+        Mat scaledHomography = scale * h * scaleInverse;
+        warpPerspective(scaledFrame, alignedFrame, scaledHomography, previewSize, INTER_LINEAR, BORDER_CONSTANT, border);
+
+        max(back, alignedFrame, back);
+        if (front.empty() || ++framesSinceUpdate >= updateInterval) {
+            framesSinceUpdate = 0;
+            publish();
+        }
+    }
+
+    /**
+     * Returns the last published preview. The Mat is not copied and stays valid and unchanged while it is held.
+     */
+    Mat get() {
+        return front;
+    }
+
+    Size size() {
+        return previewSize;
+    }
+};
+
+#endif /* PreviewBuffer_hpp */
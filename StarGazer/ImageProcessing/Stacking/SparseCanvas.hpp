@@ -0,0 +1,297 @@
+//
+//  SparseCanvas.hpp
+//  StarGazer
+//
+//  Stack planes on an unbounded grid of tiles, allocated when frames first cover them. The canvas grows with the
+//  area of the sky the frames cover, e.g. as the sky rotates through the frame over hours or for mosaics.
+//
+
+#ifndef SparseCanvas_hpp
+#define SparseCanvas_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <map>
+#include <list>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "TiledCanvas.hpp"
+#include "MemoryBudget.hpp"
+#include "SaveBinaryCV.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Tiles of equal size at any position, negative positions included. Only tiles that were acquired hold memory, so the
+ * memory is proportional to the covered area and not to its bounding box.
+ * With a memory budget, the least recently used tiles are spilled to a file in the spill directory once the budget is
+ * exhausted and read back when they are acquired again.
+ * Not thread safe.
+ */
+class SparseCanvas {
+private:
+    struct SparseTile {
+        CanvasTile tile;
+
+        /**
+         * Position of the tile in the spill file in tiles, -1 if it was never spilled.
+         */
+        long long slot = -1;
+
+        bool resident = false;
+        MemoryReservation reservation;
+        list<pair<int, int>>::iterator position;
+    };
+
+    int tileSize;
+    vector<int> planeTypes;
+    size_t tileBytes;
+
+    /**
+     * Tiles by their row and column, ordered so the tiles are written in the same order every time.
+     */
+    std::map<pair<int, int>, std::unique_ptr<SparseTile>> tiles;
+
+    /**
+     * Resident tiles, most recently used first.
+     */
+    list<pair<int, int>> residentTiles;
+
+    std::shared_ptr<MemoryBudget> budget;
+    string spillDirectory;
+    int fd = -1;
+    long long numSlots = 0;
+
+    static int floorDivide(int value, int divisor) {
+        return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+    }
+
+    void openSpillFile() {
+        string path = spillDirectory + "/sparse-XXXXXX";
+        vector<char> pathBuffer(path.begin(), path.end());
+        pathBuffer.push_back('\0');
+        fd = mkstemp(pathBuffer.data());
+        if (fd < 0) {
+            throw CanvasException("Could not create spill file");
+        }
+        // The file is only referenced by the descriptor, it is removed as soon as the canvas is destroyed
+        unlink(pathBuffer.data());
+    }
+
+    /**
+     * Reads or writes the planes of a tile from or to its slot of the spill file.
+     */
+    bool transfer(SparseTile &sparseTile, bool write) {
+        off_t offset = (off_t) (sparseTile.slot * tileBytes);
+        for (auto &plane: sparseTile.tile.planes) {
+            size_t bytes = plane.total() * plane.elemSize();
+            ssize_t done = write ? pwrite(fd, plane.data, bytes, offset) : pread(fd, plane.data, bytes, offset);
+            if (done != (ssize_t) bytes) {
+                return false;
+            }
+            offset += (off_t) bytes;
+        }
+        return true;
+    }
+
+    void evictLeastRecentlyUsed() {
+        SparseTile &sparseTile = *tiles[residentTiles.back()];
+        residentTiles.pop_back();
+
+        if (fd < 0) {
+            openSpillFile();
+        }
+        if (sparseTile.slot < 0) {
+            sparseTile.slot = numSlots++;
+        }
+        if (!transfer(sparseTile, true)) {
+            throw CanvasException("Could not spill canvas tile");
+        }
+        sparseTile.tile.planes.clear();
+        sparseTile.reservation.reset();
+        sparseTile.resident = false;
+    }
+
+    /**
+     * Reserves the memory of a tile, spilling other tiles until it fits.
+     */
+    void reserveTile(SparseTile &sparseTile) {
+        if (budget == nullptr) {
+            return;
+        }
+        while (!sparseTile.reservation.reserve(budget, tileBytes)) {
+            if (spillDirectory.empty()) {
+                throw CanvasException("Canvas does not fit into the memory budget");
+            }
+            if (residentTiles.empty()) {
+                throw CanvasException("Memory budget too small to hold a single tile");
+            }
+            evictLeastRecentlyUsed();
+        }
+    }
+
+public:
+    /**
+     * Creates an empty canvas.
+     * @param budget Budget the tiles reserve their memory from, nullptr for no limit
+     * @param spillDirectory Directory tiles are spilled to, tiles beyond the budget are refused if empty
+     */
+    SparseCanvas(vector<int> planeTypes, int tileSize, std::shared_ptr<MemoryBudget> budget = nullptr,
+                 string spillDirectory = "") :
+            tileSize(std::max(tileSize, 1)), planeTypes(planeTypes), budget(budget), spillDirectory(spillDirectory) {
+        tileBytes = (size_t) this->tileSize * this->tileSize * TiledCanvas::bytesPerPixel(planeTypes);
+    }
+
+    SparseCanvas(const SparseCanvas &) = delete;
+    SparseCanvas &operator=(const SparseCanvas &) = delete;
+
+    virtual ~SparseCanvas() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int getTileSize() {
+        return tileSize;
+    }
+
+    size_t numTiles() {
+        return tiles.size();
+    }
+
+    bool isSpilled() {
+        return fd >= 0;
+    }
+
+    /**
+     * Area covered by the tile at the given column and row.
+     */
+    Rect tileRect(Point index) {
+        return Rect(index.x * tileSize, index.y * tileSize, tileSize, tileSize);
+    }
+
+    /**
+     * Columns and rows of all tiles overlapping an area, allocated or not.
+     */
+    vector<Point> tilesIn(const Rect &area) {
+        vector<Point> indices;
+        if (area.empty()) {
+            return indices;
+        }
+        int x0 = floorDivide(area.x, tileSize), x1 = floorDivide(area.x + area.width - 1, tileSize);
+        int y0 = floorDivide(area.y, tileSize), y1 = floorDivide(area.y + area.height - 1, tileSize);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                indices.push_back(Point(x, y));
+            }
+        }
+        return indices;
+    }
+
+    /**
+     * Columns and rows of the allocated tiles.
+     */
+    vector<Point> allocatedTiles() {
+        vector<Point> indices;
+        for (auto &entry: tiles) {
+            indices.push_back(Point(entry.first.second, entry.first.first));
+        }
+        return indices;
+    }
+
+    /**
+     * Bounding box of the allocated tiles, empty if there are none.
+     */
+    Rect bounds() {
+        Rect result;
+        for (auto &entry: tiles) {
+            Rect rect = tileRect(Point(entry.first.second, entry.first.first));
+            result = result.empty() ? rect : result | rect;
+        }
+        return result;
+    }
+
+    /**
+     * Makes a tile resident and returns it, allocating it zero initialised on first use. May spill other tiles.
+     * The planes are only valid until the next call to acquire.
+     * Throws a CanvasException if the tile does not fit into the memory budget.
+     */
+    CanvasTile &acquire(Point index) {
+        auto key = make_pair(index.y, index.x);
+        auto found = tiles.find(key);
+        if (found == tiles.end()) {
+            found = tiles.emplace(key, std::make_unique<SparseTile>()).first;
+            found->second->tile.index = -1;
+            found->second->tile.rect = tileRect(index);
+        }
+        SparseTile &sparseTile = *found->second;
+
+        if (sparseTile.resident) {
+            residentTiles.splice(residentTiles.begin(), residentTiles, sparseTile.position);
+            return sparseTile.tile;
+        }
+
+        reserveTile(sparseTile);
+        for (auto type: planeTypes) {
+            sparseTile.tile.planes.push_back(Mat::zeros(tileSize, tileSize, type));
+        }
+        if (sparseTile.slot >= 0 && !transfer(sparseTile, false)) {
+            throw CanvasException("Could not read spilled canvas tile");
+        }
+        sparseTile.resident = true;
+        residentTiles.push_front(key);
+        sparseTile.position = residentTiles.begin();
+        return sparseTile.tile;
+    }
+
+    /**
+     * Writes the tile size, the number of tiles and every tile with its column, row and planes.
+     */
+    void writeBinary(std::ofstream &ofs) {
+        int header[3] = {tileSize, (int) tiles.size(), (int) planeTypes.size()};
+        ofs.write((const char *) header, sizeof(header));
+        for (auto index: allocatedTiles()) {
+            ofs.write((const char *) &index.x, sizeof(int));
+            ofs.write((const char *) &index.y, sizeof(int));
+            CanvasTile &tile = acquire(index);
+            for (auto &plane: tile.planes) {
+                writeMatBinary(ofs, plane);
+            }
+        }
+    }
+
+    /**
+     * Reads the tiles written by writeBinary into an empty canvas.
+     * Throws a CanvasException if they were written with another tile size or other planes.
+     * @return False if nothing was stored
+     */
+    bool readBinary(std::ifstream &ifs) {
+        int header[3];
+        if (!ifs.read((char *) header, sizeof(header))) {
+            return false;
+        }
+        if (header[0] != tileSize || header[2] != (int) planeTypes.size()) {
+            throw CanvasException("Stored tiles do not match the canvas");
+        }
+        Mat stored;
+        for (int i = 0; i < header[1]; i++) {
+            Point index;
+            ifs.read((char *) &index.x, sizeof(int));
+            ifs.read((char *) &index.y, sizeof(int));
+            CanvasTile &tile = acquire(index);
+            for (int p = 0; p < planeTypes.size(); p++) {
+                readMatBinary(ifs, stored);
+                if (stored.size() != tile.planes[p].size() || stored.type() != planeTypes[p]) {
+                    throw CanvasException("Stored tiles do not match the canvas");
+                }
+                stored.copyTo(tile.planes[p]);
+            }
+        }
+        return true;
+    }
+};
+
+#endif /* SparseCanvas_hpp */
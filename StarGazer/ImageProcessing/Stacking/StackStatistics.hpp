@@ -0,0 +1,296 @@
+//
+//  StackStatistics.hpp
+//  StarGazer
+//
+//  Statistics of the averaged stack, kept up to date on a sparse grid of sky pixels while frames are accumulated,
+//  and the stretch derived from them as a lookup table.
+//
+
+#ifndef StackStatistics_hpp
+#define StackStatistics_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "TaskScheduler.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ How the processed image is stretched.
+ */
+enum class StretchMode {
+    /**
+     Contrast limited histogram equalisation of the whole image, see autoEnhance.
+     */
+    CLAHE = 0,
+
+    /**
+     Midtone transfer function that maps the background to a target level, like a screen transfer function.
+     */
+    MIDTONE = 1,
+
+    /**
+     Inverse hyperbolic sine, keeps the colour of bright stars better than the midtone transfer function.
+     */
+    ASINH = 2,
+};
+
+/**
+ Statistics of one channel of the averaged stack, levels in 8 bit scale.
+ */
+struct ChannelStatistics {
+    /**
+     Median of the sampled sky.
+     */
+    float background = 0;
+
+    /**
+     Normalised median absolute deviation of the sampled sky.
+     */
+    float noise = 0;
+
+    /**
+     Histogram of the sampled sky with StackStatistics::HISTOGRAM_BINS bins over [0, 256).
+     */
+    vector<int> histogram;
+};
+
+/**
+ Maps the average of the aligned sums to 8 bit, one table per channel indexed with 8 fractional bits.
+ */
+struct StretchLut {
+    static const int SIZE = 256 * 256;
+
+    vector<uchar> tables[3];
+
+    bool empty() const {
+        return tables[0].empty();
+    }
+
+    /**
+     Divides the sums by the sum of the weights and stretches them in a single pass.
+     @param sums Sums of the aligned frames with 3 channels, 16 bit, 32 bit or float
+     */
+    void apply(const Mat &sums, double weightSum, Mat &out) const {
+        out.create(sums.size(), CV_8UC3);
+        double scale = 256.0 / weightSum;
+        int depth = sums.depth();
+        parallelFor(Range(0, sums.rows), [&](const Range &range) {
+            for (int y = range.start; y < range.end; y++) {
+                uchar *outRow = out.ptr<uchar>(y);
+                for (int x = 0; x < sums.cols * 3; x++) {
+                    double sum = depth == CV_32F ? sums.ptr<float>(y)[x]
+                                                 : (depth == CV_32S ? sums.ptr<int>(y)[x] : sums.ptr<ushort>(y)[x]);
+                    int index = std::min(SIZE - 1, std::max(0, (int) (sum * scale)));
+                    outRow[x] = tables[x % 3][index];
+                }
+            }
+        });
+    }
+};
+
+/**
+ Samples the aligned sums of the stack on a grid of sky pixels.
+ The samples are refreshed for every tile right after a frame was added to it, so the statistics and the stretch
+ are available at any time without another pass over the stack, and without loading spilled tiles.
+ */
+class StackStatistics {
+private:
+    /**
+     Distance between two samples in both directions.
+     */
+    static const int SAMPLE_STEP = 8;
+
+    /**
+     Pixels of the mask below this value are foreground and not sampled.
+     */
+    constexpr static const double SKY_THRESHOLD = 0.5;
+
+    /**
+     Background is clipped this many noise levels below the median, as in the usual screen transfer function.
+     */
+    constexpr static const float SHADOWS_CLIP = -2.8f;
+
+    Size size;
+
+    /**
+     Sums of the aligned frames at every sample, CV_32FC3 with one sample per SAMPLE_STEP pixels.
+     */
+    Mat samples;
+
+    /**
+     Non-zero for samples on the sky, empty if all samples are sky.
+     */
+    Mat skySamples;
+
+    static float median(const vector<int> &histogram, size_t total, float binWidth) {
+        size_t count = 0;
+        for (size_t i = 0; i < histogram.size(); i++) {
+            count += histogram[i];
+            if (count > total / 2) {
+                return (i + 0.5f) * binWidth;
+            }
+        }
+        return histogram.size() * binWidth;
+    }
+
+    static float midtoneTransfer(float midtone, float x) {
+        if (x <= 0 || x >= 1) {
+            return std::min(std::max(x, 0.0f), 1.0f);
+        }
+        return (midtone - 1) * x / ((2 * midtone - 1) * x - midtone);
+    }
+
+    /**
+     Strength of the inverse hyperbolic sine that maps the background to the target.
+     Without a strength large enough, the background is brighter than the target already and the stretch stays linear.
+     */
+    static float asinhStrength(float background, float target) {
+        if (background <= 0 || background >= target) {
+            return 1e-3f;
+        }
+        float low = 1e-3f, high = 1e5f;
+        for (int i = 0; i < 60; i++) {
+            float strength = std::sqrt(low * high);
+            if (std::asinh(strength * background) / std::asinh(strength) < target) {
+                low = strength;
+            } else {
+                high = strength;
+            }
+        }
+        return std::sqrt(low * high);
+    }
+
+public:
+    static const int HISTOGRAM_BINS = 1024;
+
+    StackStatistics() {
+    }
+
+    /**
+     @param mask Foreground mask of the stack, float or 8 bit fixed point. Empty to sample every pixel.
+     */
+    StackStatistics(Size size, const Mat &mask) : size(size) {
+        Size grid((size.width + SAMPLE_STEP - 1) / SAMPLE_STEP, (size.height + SAMPLE_STEP - 1) / SAMPLE_STEP);
+        samples = Mat::zeros(grid, CV_32FC3);
+        if (mask.empty()) {
+            return;
+        }
+        double threshold = SKY_THRESHOLD * (mask.depth() == CV_8U ? 255 : 1);
+        skySamples.create(grid, CV_8U);
+        for (int y = 0; y < grid.height; y++) {
+            for (int x = 0; x < grid.width; x++) {
+                double value = mask.depth() == CV_8U ? mask.at<uchar>(y * SAMPLE_STEP, x * SAMPLE_STEP)
+                                                     : mask.at<float>(y * SAMPLE_STEP, x * SAMPLE_STEP);
+                skySamples.at<uchar>(y, x) = value >= threshold ? 1 : 0;
+            }
+        }
+    }
+
+    bool empty() const {
+        return samples.empty();
+    }
+
+    /**
+     Refreshes the samples within a tile of the stack.
+     @param rect Area of the stack covered by the tile
+     @param combined Sums of the aligned frames of the tile, 16 bit, 32 bit or float
+     */
+    void update(const Rect &rect, const Mat &combined) {
+        if (empty()) {
+            return;
+        }
+        int x0 = (rect.x + SAMPLE_STEP - 1) / SAMPLE_STEP, x1 = (rect.x + rect.width - 1) / SAMPLE_STEP;
+        int y0 = (rect.y + SAMPLE_STEP - 1) / SAMPLE_STEP, y1 = (rect.y + rect.height - 1) / SAMPLE_STEP;
+        int depth = combined.depth();
+        for (int y = y0; y <= y1; y++) {
+            Vec3f *sampleRow = samples.ptr<Vec3f>(y);
+            int tileY = y * SAMPLE_STEP - rect.y;
+            for (int x = x0; x <= x1; x++) {
+                int tileX = x * SAMPLE_STEP - rect.x;
+                if (depth == CV_32F) {
+                    sampleRow[x] = combined.at<Vec3f>(tileY, tileX);
+                } else if (depth == CV_32S) {
+                    sampleRow[x] = Vec3f(combined.at<Vec3i>(tileY, tileX));
+                } else {
+                    sampleRow[x] = Vec3f(combined.at<Vec3w>(tileY, tileX));
+                }
+            }
+        }
+    }
+
+    /**
+     Computes the statistics of the averaged stack from the samples.
+     */
+    void compute(double weightSum, ChannelStatistics statistics[3]) const {
+        float binWidth = 256.0f / HISTOGRAM_BINS;
+        double scale = 1.0 / (weightSum * binWidth);
+        for (int c = 0; c < 3; c++) {
+            statistics[c].histogram.assign(HISTOGRAM_BINS, 0);
+        }
+
+        size_t total = 0;
+        for (int y = 0; y < samples.rows; y++) {
+            const Vec3f *sampleRow = samples.ptr<Vec3f>(y);
+            const uchar *skyRow = skySamples.empty() ? nullptr : skySamples.ptr<uchar>(y);
+            for (int x = 0; x < samples.cols; x++) {
+                if (skyRow != nullptr && !skyRow[x]) {
+                    continue;
+                }
+                for (int c = 0; c < 3; c++) {
+                    int bin = std::min(HISTOGRAM_BINS - 1, std::max(0, (int) (sampleRow[x][c] * scale)));
+                    statistics[c].histogram[bin]++;
+                }
+                total++;
+            }
+        }
+
+        for (int c = 0; c < 3; c++) {
+            ChannelStatistics &channel = statistics[c];
+            channel.background = median(channel.histogram, total, binWidth);
+
+            // Median absolute deviation from the histogram, deviations are folded around the median
+            vector<int> deviations(HISTOGRAM_BINS, 0);
+            for (int i = 0; i < HISTOGRAM_BINS; i++) {
+                int bin = (int) (std::abs((i + 0.5f) * binWidth - channel.background) / binWidth);
+                deviations[std::min(HISTOGRAM_BINS - 1, bin)] += channel.histogram[i];
+            }
+            channel.noise = 1.4826f * median(deviations, total, binWidth);
+        }
+    }
+
+    /**
+     Builds the lookup tables of a stretch that maps the background of every channel to the target level.
+     Every channel is stretched on its own, which also neutralises a tinted background.
+     @param target Level of the background after stretching in range (0, 1)
+     */
+    void createStretch(double weightSum, StretchMode mode, float target, StretchLut &lut) const {
+        ChannelStatistics statistics[3];
+        compute(weightSum, statistics);
+
+        for (int c = 0; c < 3; c++) {
+            float background = statistics[c].background / 255;
+            float shadows = std::max(0.0f, background + SHADOWS_CLIP * statistics[c].noise / 255);
+            float range = std::max(1 - shadows, 1e-6f);
+            float normalisedBackground = (background - shadows) / range;
+
+            // Solving the transfer function for the midtone that maps the background to the target is the transfer
+            // function itself with both swapped. A black background keeps the image linear.
+            float midtone = normalisedBackground > 0 ? midtoneTransfer(target, normalisedBackground) : 0.5f;
+            float strength = asinhStrength(normalisedBackground, target);
+            float strengthNorm = std::asinh(strength);
+
+            vector<uchar> &table = lut.tables[c];
+            table.resize(StretchLut::SIZE);
+            for (int i = 0; i < StretchLut::SIZE; i++) {
+                float x = std::min(std::max((i / (256.0f * 255) - shadows) / range, 0.0f), 1.0f);
+                float y = mode == StretchMode::ASINH ? std::asinh(strength * x) / strengthNorm : midtoneTransfer(midtone, x);
+                table[i] = saturate_cast<uchar>(y * 255);
+            }
+        }
+    }
+};
+
+#endif /* StackStatistics_hpp */
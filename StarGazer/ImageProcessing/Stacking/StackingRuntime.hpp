@@ -0,0 +1,396 @@
+//
+//  StackingRuntime.hpp
+//  StarGazer
+//
+//  Hosts many stacking sessions in one process, e.g. one per camera feed. The sessions share a pool of workers and a
+//  memory budget, new sessions are only admitted while the budget can hold them.
+//
+
+#ifndef StackingRuntime_hpp
+#define StackingRuntime_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "ImageMerger.hpp"
+#include "FrameSource.hpp"
+#include "MemoryBudget.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Settings of a runtime.
+ */
+struct RuntimeOptions {
+    /**
+     Number of worker threads shared by all sessions.
+     */
+    int workers = std::max(1, (int) std::thread::hardware_concurrency());
+
+    /**
+     Sessions beyond this number are not admitted.
+     */
+    int maxSessions = 64;
+
+    /**
+     Frames waiting to be merged per session. A session that falls behind drops its oldest frames, so live feeds stay
+     current.
+     */
+    int maxQueuedFrames = 4;
+
+    /**
+     Budget shared by the stacks, workspaces and queued frames of all sessions, nullptr for no limit.
+     */
+    std::shared_ptr<MemoryBudget> memoryBudget;
+
+    /**
+     Tiles of the stack a session has to be able to keep in memory to be admitted, the others are spilled.
+     */
+    int minResidentTiles = 4;
+};
+
+/**
+ Counters of a session.
+ */
+struct SessionStatus {
+    int merged = 0;
+    int failed = 0;
+
+    /**
+     Frames dropped because the session fell behind or the memory budget was exhausted.
+     */
+    int dropped = 0;
+
+    int queued = 0;
+};
+
+/**
+ A stacking session of the runtime. Frames are merged in the order they were submitted, one at a time.
+ The merger may be read at any time, reads wait for the frame that is being merged.
+ A session counts towards the sessions of the runtime until it is closed or destroyed, whichever comes first.
+ */
+class StackingSession {
+    friend class StackingRuntime;
+
+private:
+    struct QueuedFrame {
+        DecodedFrame frame;
+        std::unique_ptr<MemoryReservation> reservation;
+    };
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::deque<QueuedFrame> queue;
+    SessionStatus status;
+    Mat preview;
+
+    /**
+     True while the session is waiting for a worker or being merged by one. A session is never merged by two workers.
+     */
+    bool scheduled = false;
+    bool closed = false;
+
+    std::mutex mergerMutex;
+    std::unique_ptr<ImageMerger> merger;
+
+    /**
+     Number of admitted sessions of the runtime, shared so a session can give up its admission after the runtime is
+     gone. Reset once the admission was given up.
+     */
+    std::shared_ptr<std::atomic<int>> admissions;
+
+    StackingSession(std::unique_ptr<ImageMerger> merger, std::shared_ptr<std::atomic<int>> admissions) :
+            merger(std::move(merger)), admissions(std::move(admissions)) {
+        status.merged = 1;
+    }
+
+    /**
+     Gives up the admission of the session, only the first call counts. Called with the mutex held.
+     */
+    void releaseAdmission() {
+        if (admissions) {
+            (*admissions)--;
+            admissions.reset();
+        }
+    }
+
+public:
+    /**
+     A session dropped without being closed, e.g. after an error, gives up its admission here. The stack is released
+     from the memory budget with the merger.
+     */
+    ~StackingSession() {
+        std::lock_guard<std::mutex> lock(mutex);
+        releaseAdmission();
+    }
+
+    SessionStatus getStatus() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return status;
+    }
+
+    /**
+     Preview of the last frame that was merged, empty before the first one.
+     */
+    void getPreview(Mat &image) {
+        std::lock_guard<std::mutex> lock(mutex);
+        preview.copyTo(image);
+    }
+
+    void getProcessed(Mat &image) {
+        std::lock_guard<std::mutex> lock(mergerMutex);
+        merger->getProcessed(image);
+    }
+
+    void saveToDirectory(const string &dir) {
+        std::lock_guard<std::mutex> lock(mergerMutex);
+        merger->saveToDirectory(dir);
+    }
+};
+
+/**
+ Merges the frames of all sessions on a shared pool of workers.
+ Sessions with frames waiting take turns, every turn merges a single frame, so a fast feed cannot starve a slow one.
+ Every merge still runs the OpenCV kernels in parallel, while all workers are busy they run on the calling worker.
+ */
+class StackingRuntime {
+private:
+    RuntimeOptions options;
+
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+
+    /**
+     Sessions with frames waiting, in the order they get their next turn.
+     */
+    std::deque<std::shared_ptr<StackingSession>> ready;
+
+    /**
+     Sessions admitted and neither closed nor destroyed yet. Only raised with the mutex held, so sessions opened at the
+     same time cannot exceed the limit, sessions lower it on their own.
+     */
+    std::shared_ptr<std::atomic<int>> numSessions = std::make_shared<std::atomic<int>>(0);
+    bool stopping = false;
+
+    vector<std::thread> workers;
+
+    /**
+     Memory a session needs at least: its workspace and a few tiles of its stack.
+     */
+    size_t admissionBytes(Size size, const MergerOptions &mergerOptions, bool masked) {
+        size_t tileBytes = (size_t) mergerOptions.tileSize * mergerOptions.tileSize
+                           * TiledCanvas::bytesPerPixel(ImageMerger::stackPlaneTypes(mergerOptions));
+        return ImageMerger::workspaceBytes(size, mergerOptions, masked) + tileBytes * options.minResidentTiles;
+    }
+
+    void schedule(const std::shared_ptr<StackingSession> &session) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(session);
+        }
+        workAvailable.notify_one();
+    }
+
+    void work() {
+        while (true) {
+            std::shared_ptr<StackingSession> session;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                workAvailable.wait(lock, [&]() { return stopping || !ready.empty(); });
+                if (stopping) {
+                    return;
+                }
+                session = ready.front();
+                ready.pop_front();
+            }
+
+            StackingSession::QueuedFrame queued;
+            {
+                std::lock_guard<std::mutex> lock(session->mutex);
+                if (session->queue.empty()) {
+                    // Nothing left to merge, e.g. after the runtime discarded the frames of the session
+                    session->scheduled = false;
+                    session->idle.notify_all();
+                    continue;
+                }
+                queued = std::move(session->queue.front());
+                session->queue.pop_front();
+                session->status.queued = (int) session->queue.size();
+            }
+
+            Mat preview;
+            bool merged = false;
+            {
+                std::lock_guard<std::mutex> lock(session->mergerMutex);
+                try {
+                    merged = session->merger->mergeFrame(queued.frame.view, preview);
+                } catch (const std::exception &e) {
+                    std::cout << "Merging failed: " << e.what() << std::endl;
+                }
+            }
+            // The frame and its reservation are released before the next turn
+            queued = StackingSession::QueuedFrame();
+
+            bool more;
+            {
+                std::lock_guard<std::mutex> lock(session->mutex);
+                if (merged) {
+                    session->status.merged++;
+                    session->preview = preview;
+                } else {
+                    session->status.failed++;
+                }
+                more = !session->queue.empty();
+                session->scheduled = more;
+            }
+            if (more) {
+                // Back to the end of the line
+                schedule(session);
+            } else {
+                session->idle.notify_all();
+            }
+        }
+    }
+
+public:
+    StackingRuntime(RuntimeOptions options = RuntimeOptions()) : options(options) {
+        for (int i = 0; i < options.workers; i++) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    /**
+     Stops the workers. Frames still waiting are discarded and the sessions waiting for them are closed, sessions stay
+     readable.
+     */
+    ~StackingRuntime() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+
+        // Sessions still waiting for a turn will never get one, so closing them must not wait
+        for (auto &session: ready) {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            session->status.dropped += (int) session->queue.size();
+            session->queue.clear();
+            session->status.queued = 0;
+            session->scheduled = false;
+            session->closed = true;
+            session->releaseAdmission();
+            session->idle.notify_all();
+        }
+        ready.clear();
+    }
+
+    StackingRuntime(const StackingRuntime &) = delete;
+    StackingRuntime &operator=(const StackingRuntime &) = delete;
+
+    /**
+     Opens a session with its reference frame, on the calling thread.
+     The merger of the session uses the memory budget of the runtime.
+     Throws a MergingException if the reference frame is rejected.
+     @return nullptr if the session is not admitted, because there are too many sessions or the budget is exhausted
+     */
+    std::shared_ptr<StackingSession> open(const FrameView &reference, Mat &mask, MergerOptions mergerOptions,
+                                          std::shared_ptr<MergeObserver> observer = nullptr) {
+        mergerOptions.memoryBudget = options.memoryBudget;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (*numSessions >= options.maxSessions) {
+                return nullptr;
+            }
+            if (options.memoryBudget != nullptr
+                && options.memoryBudget->available() < admissionBytes(reference.size(), mergerOptions, !mask.empty())) {
+                return nullptr;
+            }
+            // Counted before the merger is created, so sessions opened at the same time cannot exceed the limit
+            (*numSessions)++;
+        }
+
+        try {
+            auto merger = std::make_unique<ImageMerger>(reference, mask, mergerOptions, observer);
+            return std::shared_ptr<StackingSession>(new StackingSession(std::move(merger), numSessions));
+        } catch (...) {
+            (*numSessions)--;
+            throw;
+        }
+    }
+
+    /**
+     Queues a frame of a session, returns immediately.
+     The buffer of the frame is held until the frame was merged, the view must not point to memory owned elsewhere.
+     @return False if the frame was dropped
+     */
+    bool submit(const std::shared_ptr<StackingSession> &session, DecodedFrame &&frame) {
+        StackingSession::QueuedFrame queued;
+        queued.reservation = std::make_unique<MemoryReservation>();
+        size_t bytes = frame.buffer.total() * frame.buffer.elemSize();
+
+        bool start;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            if (session->closed) {
+                return false;
+            }
+            // Make room by dropping the oldest frames, live feeds prefer current frames over complete ones
+            while (!session->queue.empty() && (int) session->queue.size() >= options.maxQueuedFrames) {
+                session->queue.pop_front();
+                session->status.dropped++;
+                session->merger->frameDropped();
+            }
+            // Older frames are only dropped for memory while another one stays queued. A scheduled worker takes the
+            // front frame, so the queue of a scheduled session is never emptied here, the new frame is dropped instead.
+            while (options.memoryBudget != nullptr && !queued.reservation->reserve(options.memoryBudget, bytes)) {
+                if (session->queue.size() <= 1) {
+                    session->status.dropped++;
+                    return false;
+                }
+                session->queue.pop_front();
+                session->status.dropped++;
+                session->merger->frameDropped();
+            }
+            queued.frame = std::move(frame);
+            session->queue.push_back(std::move(queued));
+            session->merger->frameArrived();
+            session->status.queued = (int) session->queue.size();
+            start = !session->scheduled;
+            session->scheduled = true;
+        }
+        if (start) {
+            schedule(session);
+        }
+        return true;
+    }
+
+    /**
+     Stops accepting frames for a session and waits until the frames already queued are merged.
+     The session no longer counts towards the sessions of the runtime, but stays readable and its stack stays in the
+     memory budget until it is released. Closing a session twice does nothing.
+     */
+    void close(const std::shared_ptr<StackingSession> &session) {
+        std::unique_lock<std::mutex> lock(session->mutex);
+        if (session->closed) {
+            return;
+        }
+        session->closed = true;
+        session->idle.wait(lock, [&]() { return !session->scheduled; });
+        session->releaseAdmission();
+    }
+
+    int getNumSessions() {
+        return *numSessions;
+    }
+};
+
+#endif /* StackingRuntime_hpp */
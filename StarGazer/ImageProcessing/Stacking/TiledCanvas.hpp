@@ -0,0 +1,384 @@
+//
+//  TiledCanvas.hpp
+//  StarGazer
+//
+//  Stack planes split into tiles. Tiles are held in memory if the memory budget allows,
+//  otherwise they are spilled to a memory mapped file and only the most recently used tiles stay resident.
+//
+
+#ifndef TiledCanvas_hpp
+#define TiledCanvas_hpp
+
+#include <stdio.h>
+#include <string.h>
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <list>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "MemoryBudget.hpp"
+#include "SaveBinaryCV.hpp"
+
+using namespace std;
+using namespace cv;
+
+struct CanvasException : public exception {
+    const char *info;
+
+    CanvasException(const char *info) : info(info) {
+    }
+
+    const char *what() const throw() {
+        return info;
+    }
+};
+
+/**
+ * One tile of the canvas.
+ * The planes are only valid until the tile is evicted, which can happen on every call to acquire.
+ */
+struct CanvasTile {
+    int index;
+
+    /**
+     * Area of the canvas covered by this tile.
+     */
+    Rect rect;
+
+    /**
+     * One Mat of rect.size() for every plane of the canvas.
+     */
+    vector<Mat> planes;
+};
+
+/**
+ * A set of equally sized planes, e.g. the sum and max of a stack, split into tiles.
+ * Not thread safe.
+ */
+class TiledCanvas {
+private:
+    Size size;
+    int tileSize;
+    int tilesX;
+    int tilesY;
+
+    vector<int> planeTypes;
+
+    vector<CanvasTile> tiles;
+
+    /**
+     * Planes covering the whole canvas if the canvas is held in memory.
+     */
+    vector<Mat> heapPlanes;
+
+    /**
+     * Spill file, -1 if the canvas is held in memory.
+     */
+    int fd = -1;
+
+    /**
+     * Offset of every plane inside the slot of a tile in the spill file.
+     */
+    vector<size_t> planeOffsets;
+
+    /**
+     * Bytes of all planes of one tile, rounded up to full pages.
+     */
+    size_t slotBytes = 0;
+
+    size_t maxResidentTiles = 0;
+    vector<uchar *> mappings;
+
+    /**
+     * Mapped tiles, most recently used first.
+     */
+    list<int> residentTiles;
+    vector<list<int>::iterator> residentPosition;
+
+    MemoryReservation reservation;
+
+    void initTiles() {
+        tilesX = (size.width + tileSize - 1) / tileSize;
+        tilesY = (size.height + tileSize - 1) / tileSize;
+
+        tiles.resize(tilesX * tilesY);
+        for (int i = 0; i < tiles.size(); i++) {
+            int x = (i % tilesX) * tileSize;
+            int y = (i / tilesX) * tileSize;
+            tiles[i].index = i;
+            tiles[i].rect = Rect(x, y, std::min(tileSize, size.width - x), std::min(tileSize, size.height - y));
+        }
+    }
+
+    void initSpillFile(const string &spillDirectory) {
+        size_t offset = 0;
+        for (auto type: planeTypes) {
+            planeOffsets.push_back(offset);
+            offset += (size_t) tileSize * tileSize * CV_ELEM_SIZE(type);
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        slotBytes = (offset + page - 1) / page * page;
+
+        string path = spillDirectory + "/stack-XXXXXX";
+        vector<char> pathBuffer(path.begin(), path.end());
+        pathBuffer.push_back('\0');
+        fd = mkstemp(pathBuffer.data());
+        if (fd < 0) {
+            throw CanvasException("Could not create spill file");
+        }
+        // The file is only referenced by the descriptor, it is removed as soon as the canvas is destroyed
+        unlink(pathBuffer.data());
+
+        // The file is sparse and reads as zeros until tiles are written
+        if (ftruncate(fd, (off_t) (slotBytes * tiles.size())) != 0) {
+            close(fd);
+            fd = -1;
+            throw CanvasException("Could not allocate spill file");
+        }
+
+        mappings.assign(tiles.size(), nullptr);
+        residentPosition.resize(tiles.size());
+    }
+
+    void evictLeastRecentlyUsed() {
+        int index = residentTiles.back();
+        residentTiles.pop_back();
+
+        tiles[index].planes.clear();
+        munmap(mappings[index], slotBytes);
+        mappings[index] = nullptr;
+    }
+
+public:
+    /**
+     * Share of the available budget a spilled canvas keeps resident if no tile count is given. The rest is left to
+     * the other buffers reserving from the same budget, e.g. further canvases, frames and other sessions.
+     */
+    constexpr static const double RESIDENT_SHARE = 0.25;
+
+    /**
+     * Creates a zero initialised canvas.
+     * The canvas is held in memory if the budget allows it. Otherwise it is spilled to a file in spillDirectory,
+     * keeping maxResidentTiles tiles resident, or RESIDENT_SHARE of the available budget if it is 0.
+     * Throws a CanvasException if the canvas cannot be held within the budget.
+     * @param budget Budget the canvas reserves its memory from, nullptr for no limit.
+     */
+    TiledCanvas(Size size, vector<int> planeTypes, int tileSize, std::shared_ptr<MemoryBudget> budget = nullptr,
+                string spillDirectory = "", int maxResidentTiles = 0) :
+            size(size), tileSize(std::max(tileSize, 1)), planeTypes(planeTypes) {
+        initTiles();
+
+        size_t canvasBytes = (size_t) size.area() * bytesPerPixel(planeTypes);
+        if (budget == nullptr || reservation.reserve(budget, canvasBytes)) {
+            for (auto type: planeTypes) {
+                heapPlanes.push_back(Mat::zeros(size, type));
+            }
+            for (auto &tile: tiles) {
+                for (auto &heapPlane: heapPlanes) {
+                    tile.planes.push_back(heapPlane(tile.rect));
+                }
+            }
+            return;
+        }
+
+        if (spillDirectory.empty()) {
+            throw CanvasException("Stack does not fit into the memory budget");
+        }
+
+        initSpillFile(spillDirectory);
+        if (maxResidentTiles > 0) {
+            this->maxResidentTiles = maxResidentTiles;
+        } else {
+            this->maxResidentTiles = (size_t) (budget->available() * RESIDENT_SHARE) / slotBytes;
+        }
+        this->maxResidentTiles = std::min(this->maxResidentTiles, tiles.size());
+        if (this->maxResidentTiles < 1 || !reservation.reserve(budget, this->maxResidentTiles * slotBytes)) {
+            close(fd);
+            fd = -1;
+            throw CanvasException("Memory budget too small to hold a single tile");
+        }
+    }
+
+    /**
+     * Wraps existing planes of equal size in a canvas held in memory with a single tile.
+     */
+    TiledCanvas(vector<Mat> planes) : size(planes[0].size()), tileSize(std::max(planes[0].cols, planes[0].rows)) {
+        initTiles();
+        for (auto &plane: planes) {
+            planeTypes.push_back(plane.type());
+            heapPlanes.push_back(plane);
+        }
+        tiles[0].planes = heapPlanes;
+    }
+
+    TiledCanvas(const TiledCanvas &) = delete;
+    TiledCanvas &operator=(const TiledCanvas &) = delete;
+
+    virtual ~TiledCanvas() {
+        while (!residentTiles.empty()) {
+            evictLeastRecentlyUsed();
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    static size_t bytesPerPixel(const vector<int> &planeTypes) {
+        size_t bytes = 0;
+        for (auto type: planeTypes) {
+            bytes += CV_ELEM_SIZE(type);
+        }
+        return bytes;
+    }
+
+    Size getSize() {
+        return size;
+    }
+
+    int numTiles() {
+        return (int) tiles.size();
+    }
+
+    int numPlanes() {
+        return (int) planeTypes.size();
+    }
+
+    int planeType(int plane) {
+        return planeTypes[plane];
+    }
+
+    Rect tileRect(int index) {
+        return tiles[index].rect;
+    }
+
+    bool isSpilled() {
+        return fd >= 0;
+    }
+
+    /**
+     * Makes a tile resident and returns it. May evict the least recently used tile.
+     */
+    CanvasTile &acquire(int index) {
+        CanvasTile &tile = tiles[index];
+        if (fd < 0) {
+            return tile;
+        }
+
+        if (mappings[index] != nullptr) {
+            residentTiles.splice(residentTiles.begin(), residentTiles, residentPosition[index]);
+            return tile;
+        }
+
+        while (residentTiles.size() >= maxResidentTiles) {
+            evictLeastRecentlyUsed();
+        }
+
+        void *data = mmap(nullptr, slotBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) (slotBytes * index));
+        if (data == MAP_FAILED) {
+            throw CanvasException("Could not map stack tile");
+        }
+        mappings[index] = (uchar *) data;
+
+        tile.planes.clear();
+        for (int p = 0; p < planeTypes.size(); p++) {
+            tile.planes.push_back(Mat(tile.rect.size(), planeTypes[p], mappings[index] + planeOffsets[p]));
+        }
+
+        residentTiles.push_front(index);
+        residentPosition[index] = residentTiles.begin();
+        return tile;
+    }
+
+    /**
+     * Returns a plane covering the whole canvas.
+     * Shares the memory of the canvas if it is held in memory, otherwise the plane is assembled from the tiles into
+     * a full size Mat outside of the budget, so it is not meant for spilled canvases.
+     */
+    Mat plane(int plane) {
+        if (fd < 0) {
+            return heapPlanes[plane];
+        }
+        Mat result(size, planeTypes[plane]);
+        for (int i = 0; i < tiles.size(); i++) {
+            CanvasTile &tile = acquire(i);
+            tile.planes[plane].copyTo(result(tile.rect));
+        }
+        return result;
+    }
+
+    /**
+     * Writes a plane in the format of writeMatBinary without assembling it in memory.
+     */
+    void writePlaneBinary(std::ofstream &ofs, int plane) {
+        if (fd < 0) {
+            writeMatBinary(ofs, heapPlanes[plane]);
+            return;
+        }
+
+        int type = planeTypes[plane];
+        size_t elemSize = CV_ELEM_SIZE(type);
+        ofs.write((const char *) (&size.height), sizeof(int));
+        ofs.write((const char *) (&size.width), sizeof(int));
+        ofs.write((const char *) (&type), sizeof(int));
+
+        std::streamoff base = ofs.tellp();
+        for (int i = 0; i < tiles.size(); i++) {
+            CanvasTile &tile = acquire(i);
+            for (int y = 0; y < tile.rect.height; y++) {
+                ofs.seekp(base + (std::streamoff) (((size_t) (tile.rect.y + y) * size.width + tile.rect.x) * elemSize));
+                ofs.write((const char *) tile.planes[plane].ptr(y), tile.rect.width * elemSize);
+            }
+        }
+        ofs.seekp(base + (std::streamoff) (size.area() * elemSize));
+    }
+
+    /**
+     * Reads a plane written by writeMatBinary into the canvas without assembling it in memory.
+     * Converts the stored type to the type of the plane.
+     * @return False if the stored Mat is empty.
+     */
+    bool readPlaneBinary(std::ifstream &ifs, int plane) {
+        int rows, cols, type;
+        if (!readMatHeader(ifs, rows, cols, type)) {
+            return false;
+        }
+        if (rows != size.height || cols != size.width) {
+            throw CanvasException("Stored plane does not match the canvas size");
+        }
+
+        size_t elemSize = CV_ELEM_SIZE(type);
+        Mat row(1, tileSize, type);
+        std::streamoff base = ifs.tellg();
+        for (int i = 0; i < tiles.size(); i++) {
+            CanvasTile &tile = acquire(i);
+            Mat rowRoi = row.colRange(0, tile.rect.width);
+            for (int y = 0; y < tile.rect.height; y++) {
+                ifs.seekg(base + (std::streamoff) (((size_t) (tile.rect.y + y) * size.width + tile.rect.x) * elemSize));
+                ifs.read((char *) rowRoi.data, tile.rect.width * elemSize);
+                Mat target = tile.planes[plane].row(y);
+                rowRoi.convertTo(target, planeTypes[plane]);
+            }
+        }
+        ifs.seekg(base + (std::streamoff) ((size_t) rows * cols * elemSize));
+        return true;
+    }
+
+    /**
+     * Reads the header written by writeMatBinary.
+     * @return False if the stored Mat is empty.
+     */
+    static bool readMatHeader(std::ifstream &ifs, int &rows, int &cols, int &type) {
+        rows = 0;
+        ifs.read((char *) (&rows), sizeof(int));
+        if (rows == 0) {
+            return false;
+        }
+        ifs.read((char *) (&cols), sizeof(int));
+        ifs.read((char *) (&type), sizeof(int));
+        return ifs.good();
+    }
+};
+
+#endif /* TiledCanvas_hpp */
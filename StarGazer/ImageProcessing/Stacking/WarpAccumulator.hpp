@@ -0,0 +1,429 @@
+//
+//  WarpAccumulator.hpp
+//  StarGazer
+//
+//  Adds frames to tiles of the stack, warping and accumulating them in a single pass where possible.
+//
+
+#ifndef WarpAccumulator_hpp
+#define WarpAccumulator_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "FrameView.hpp"
+#include "MaskTiles.hpp"
+#include "MeshAlignment.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Planes of a tile a frame is added to.
+ */
+enum AccumulatedPlanes {
+    /**
+     * Max and sum of the aligned frames.
+     */
+    ALIGNED_PLANES = 1,
+
+    /**
+     * Sum of the unaligned frames.
+     */
+    UNALIGNED_PLANE = 2,
+
+    ALL_PLANES = ALIGNED_PLANES | UNALIGNED_PLANE,
+};
+
+/**
+ * Bilinear sample of a frame, neighbours outside of the frame take the border value like BORDER_CONSTANT.
+ */
+template<typename T>
+static inline void sampleBilinear(const FrameView &frame, double x, double y, const Scalar &border, double *out) {
+    int x0 = cvFloor(x);
+    int y0 = cvFloor(y);
+    double fx = x - x0;
+    double fy = y - y0;
+    double weights[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+    Size size = frame.size();
+    int step = frame.step();
+
+    out[0] = out[1] = out[2] = 0;
+    for (int n = 0; n < 4; n++) {
+        int sx = x0 + (n & 1);
+        int sy = y0 + (n >> 1);
+        bool inside = sx >= 0 && sy >= 0 && sx < size.width && sy < size.height;
+        for (int c = 0; c < 3; c++) {
+            double value = inside ? FrameView::to8U<T>(frame.ptr<T>(c, sy)[sx * step]) : border[c];
+            out[c] += weights[n] * value;
+        }
+    }
+}
+
+template<typename T, typename C, typename S>
+static void accumulateWarpedRows(const FrameView &frame, const Matx33d &inverse, const Scalar &border, Point origin,
+                                 Mat &maxed, Mat &combined, Mat &stacked, int planes, float weight, const Mat &offsets,
+                                 const Range &range) {
+    Size size = frame.size();
+    int step = frame.step();
+    double sample[3];
+    const double offsetScale = 1.0 / MeshAlignment::OFFSET_SCALE;
+
+    for (int y = range.start; y < range.end; y++) {
+        uchar *maxedRow = maxed.ptr<uchar>(y);
+        C *combinedRow = combined.ptr<C>(y);
+        S *stackedRow = stacked.ptr<S>(y);
+        int frameY = origin.y + y;
+        const Vec2s *offsetRow = offsets.empty() ? nullptr : offsets.ptr<Vec2s>(frameY) + origin.x;
+
+        if (!(planes & ALIGNED_PLANES)) {
+            for (int x = 0; x < maxed.cols; x++) {
+                for (int c = 0; c < 3; c++) {
+                    uchar unaligned = FrameView::to8U<T>(frame.ptr<T>(c, frameY)[(origin.x + x) * step]);
+                    stackedRow[x * 3 + c] = saturate_cast<S>(stackedRow[x * 3 + c] + unaligned);
+                }
+            }
+            continue;
+        }
+
+        for (int x = 0; x < maxed.cols; x++) {
+            int frameX = origin.x + x;
+
+            // Position of the stack pixel in the frame
+            double w = inverse(2, 0) * frameX + inverse(2, 1) * frameY + inverse(2, 2);
+            w = w != 0 ? 1.0 / w : 0;
+            double sx = (inverse(0, 0) * frameX + inverse(0, 1) * frameY + inverse(0, 2)) * w;
+            double sy = (inverse(1, 0) * frameX + inverse(1, 1) * frameY + inverse(1, 2)) * w;
+            if (offsetRow) {
+                // Local correction of the mesh alignment
+                sx += offsetRow[x][0] * offsetScale;
+                sy += offsetRow[x][1] * offsetScale;
+            }
+
+            if (sx > -1 && sy > -1 && sx < size.width && sy < size.height) {
+                sampleBilinear<T>(frame, sx, sy, border, sample);
+            } else {
+                sample[0] = border[0];
+                sample[1] = border[1];
+                sample[2] = border[2];
+            }
+
+            for (int c = 0; c < 3; c++) {
+                uchar aligned = saturate_cast<uchar>(sample[c]);
+                maxedRow[x * 3 + c] = std::max(maxedRow[x * 3 + c], aligned);
+                combinedRow[x * 3 + c] = saturate_cast<C>(combinedRow[x * 3 + c] + aligned * weight);
+                if (!(planes & UNALIGNED_PLANE)) {
+                    continue;
+                }
+
+                // The unaligned frame is added at the same position
+                uchar unaligned = FrameView::to8U<T>(frame.ptr<T>(c, frameY)[frameX * step]);
+                stackedRow[x * 3 + c] = saturate_cast<S>(stackedRow[x * 3 + c] + unaligned);
+            }
+        }
+    }
+}
+
+template<typename T, typename C>
+static void accumulateWarpedSums(const FrameView &frame, const Matx33d &inverse, const Scalar &border, Point origin,
+                                 Mat &maxed, Mat &combined, Mat &stacked, int planes, float weight, const Mat &offsets,
+                                 const Range &range) {
+    if (stacked.depth() == CV_32S) {
+        accumulateWarpedRows<T, C, int>(frame, inverse, border, origin, maxed, combined, stacked, planes, weight, offsets, range);
+    } else {
+        accumulateWarpedRows<T, C, ushort>(frame, inverse, border, origin, maxed, combined, stacked, planes, weight, offsets, range);
+    }
+}
+
+template<typename T>
+static void accumulateWarpedFrame(const FrameView &frame, const Matx33d &inverse, const Scalar &border, Point origin,
+                                  Mat &maxed, Mat &combined, Mat &stacked, int planes, float weight, const Mat &offsets,
+                                  const Range &range) {
+    if (combined.depth() == CV_32F) {
+        accumulateWarpedSums<T, float>(frame, inverse, border, origin, maxed, combined, stacked, planes, weight, offsets, range);
+    } else if (combined.depth() == CV_32S) {
+        accumulateWarpedSums<T, int>(frame, inverse, border, origin, maxed, combined, stacked, planes, weight, offsets, range);
+    } else {
+        accumulateWarpedSums<T, ushort>(frame, inverse, border, origin, maxed, combined, stacked, planes, weight, offsets, range);
+    }
+}
+
+/**
+ * Warps a frame onto one tile of the stack and adds it to the planes of the tile.
+ * Reads the frame in its own layout, neither a converted copy of the frame nor an aligned image are created.
+ * Equivalent to warpPerspective with INTER_LINEAR and BORDER_CONSTANT followed by max and add, up to rounding.
+ *
+ * @param h Homography aligning the frame with the stack
+ * @param border Value used for pixels outside of the warped frame
+ * @param origin Position of the tile in the stack, the stack has the size of the frame
+ * @param maxed 8 bit max of the tile
+ * @param combined Sum of the aligned frames of the tile, 16 bit, 32 bit or float. Weighted frames are only added
+ *                 without rounding to a float sum.
+ * @param stacked Sum of the unaligned frames of the tile, 16 or 32 bit
+ * @param planes AccumulatedPlanes the frame is added to, the other planes are left untouched
+ * @param weight Weight of the frame in the sum of the aligned frames, the max and the unaligned sum are not weighted
+ * @param offsets Offsets of the mesh alignment added to the positions in the frame, covering the stack, see
+ *                MeshAlignment::getOffsets. Empty to warp with the homography alone.
+ */
+inline void accumulateWarped(const FrameView &frame, const Mat &h, const Scalar &border, Point origin,
+                             Mat &maxed, Mat &combined, Mat &stacked, int planes = ALL_PLANES, float weight = 1,
+                             const Mat &offsets = Mat()) {
+    Matx33d inverse = Matx33d(h).inv();
+    parallelFor(Range(0, maxed.rows), [&](const Range &range) {
+        if (frame.depth() == CV_16U) {
+            accumulateWarpedFrame<ushort>(frame, inverse, border, origin, maxed, combined, stacked, planes, weight, offsets, range);
+        } else {
+            accumulateWarpedFrame<uchar>(frame, inverse, border, origin, maxed, combined, stacked, planes, weight, offsets, range);
+        }
+    });
+}
+
+template<typename T>
+static void accumulateCoveredRows(const FrameView &frame, const Matx33d &inverse, Point origin, Mat &sum, Mat &maxed,
+                                  Mat &coverage, float weight, const Mat &offsets, const Mat &mask, const Range &range) {
+    Size size = frame.size();
+    double sample[3];
+
+    for (int y = range.start; y < range.end; y++) {
+        float *sumRow = sum.ptr<float>(y);
+        uchar *maxedRow = maxed.ptr<uchar>(y);
+        float *coverageRow = coverage.ptr<float>(y);
+        int stackY = origin.y + y;
+
+        for (int x = 0; x < sum.cols; x++) {
+            int stackX = origin.x + x;
+            double w = inverse(2, 0) * stackX + inverse(2, 1) * stackY + inverse(2, 2);
+            w = w != 0 ? 1.0 / w : 0;
+            double sx = (inverse(0, 0) * stackX + inverse(0, 1) * stackY + inverse(0, 2)) * w;
+            double sy = (inverse(1, 0) * stackX + inverse(1, 1) * stackY + inverse(1, 2)) * w;
+            if (!offsets.empty()) {
+                Vec2f offset = MeshAlignment::offsetAt(offsets, stackX, stackY);
+                sx += offset[0];
+                sy += offset[1];
+            }
+            if (!(sx >= 0 && sy >= 0 && sx <= size.width - 1 && sy <= size.height - 1)) {
+                continue;
+            }
+
+            // The foreground is fixed in the frame, so the mask is read at the position in the frame
+            float pixelWeight = weight;
+            if (!mask.empty()) {
+                int mx = cvRound(sx), my = cvRound(sy);
+                pixelWeight *= mask.depth() == CV_8U ? mask.at<uchar>(my, mx) / 255.0f : mask.at<float>(my, mx);
+                if (pixelWeight <= 0) {
+                    continue;
+                }
+            }
+
+            // Neighbours outside of the frame only occur with a weight of 0 on the last row and column
+            sampleBilinear<T>(frame, sx, sy, Scalar(), sample);
+            for (int c = 0; c < 3; c++) {
+                sumRow[x * 3 + c] += (float) sample[c] * pixelWeight;
+                maxedRow[x * 3 + c] = std::max(maxedRow[x * 3 + c], saturate_cast<uchar>(sample[c]));
+            }
+            coverageRow[x] += pixelWeight;
+        }
+    }
+}
+
+/**
+ * Warps a frame onto a tile and adds it only where the frame covers the tile, counting the coverage of every pixel.
+ * Pixels outside of the frame are left untouched instead of being filled with a border value, so the average of a
+ * pixel is its sum divided by its own coverage.
+ *
+ * @param h Homography aligning the frame with the stack
+ * @param origin Position of the tile in the stack, may be outside of the reference frame
+ * @param sum Float RGB sum of the aligned frames in 8 bit scale
+ * @param maxed 8 bit max of the aligned frames
+ * @param coverage Float sum of the weights of the frames that covered every pixel
+ * @param weight Weight of the frame
+ * @param offsets Offsets of the mesh alignment, see MeshAlignment::offsetAt. Empty to warp with the homography alone.
+ * @param mask Foreground mask in frame coordinates, float or 8 bit fixed point. Every pixel is weighted by the mask at
+ *             its position in the frame, so the foreground is left out. Empty to add every pixel.
+ */
+inline void accumulateCovered(const FrameView &frame, const Mat &h, Point origin, Mat &sum, Mat &maxed, Mat &coverage,
+                              float weight = 1, const Mat &offsets = Mat(), const Mat &mask = Mat()) {
+    Matx33d inverse = Matx33d(h).inv();
+    parallelFor(Range(0, sum.rows), [&](const Range &range) {
+        if (frame.depth() == CV_16U) {
+            accumulateCoveredRows<ushort>(frame, inverse, origin, sum, maxed, coverage, weight, offsets, mask, range);
+        } else {
+            accumulateCoveredRows<uchar>(frame, inverse, origin, sum, maxed, coverage, weight, offsets, mask, range);
+        }
+    });
+}
+
+/**
+ * Buffers of accumulateTile, reused between calls and never larger than the largest tile.
+ */
+struct WarpBuffers {
+    /**
+     * Frame warped onto the tile, 8 bit RGB.
+     */
+    Mat aligned;
+
+    /**
+     * Frame warped onto the tile in its own layout, before its channels are reordered.
+     */
+    Mat warped;
+
+    /**
+     * Unaligned tile of the frame with its channels reordered.
+     */
+    Mat unaligned;
+
+    /**
+     * Position in the frame of every pixel of the tile, CV_32FC2, only used with the mesh alignment.
+     */
+    Mat map;
+};
+
+/**
+ * Returns the top left corner of a reused buffer, grown if it is smaller than the size. Smaller tiles use a corner of
+ * the buffer, so tiles of varying size do not reallocate it.
+ */
+static inline Mat tileBuffer(Mat &buffer, Size size, int type) {
+    if (buffer.type() != type || buffer.cols < size.width || buffer.rows < size.height) {
+        buffer.create(std::max(buffer.rows, size.height), std::max(buffer.cols, size.width), type);
+    }
+    return buffer(Rect(Point(0, 0), size));
+}
+
+/**
+ * Fills the map of a tile for cv::remap with the position of every tile pixel in the frame, the homography corrected
+ * by the offsets of the mesh alignment.
+ *
+ * @param rect Area of the stack covered by the tile, inside the table of offsets
+ * @param map CV_32FC2 of the size of the tile
+ */
+inline void buildMeshMap(const Mat &h, const Rect &rect, const Mat &offsets, Mat &map) {
+    Matx33d inverse = Matx33d(h).inv();
+    const float offsetScale = 1.0f / MeshAlignment::OFFSET_SCALE;
+    parallelFor(Range(0, rect.height), [&](const Range &range) {
+        for (int y = range.start; y < range.end; y++) {
+            int stackY = rect.y + y;
+            const Vec2s *offsetRow = offsets.ptr<Vec2s>(stackY) + rect.x;
+            Vec2f *mapRow = map.ptr<Vec2f>(y);
+            for (int x = 0; x < rect.width; x++) {
+                int stackX = rect.x + x;
+                double w = inverse(2, 0) * stackX + inverse(2, 1) * stackY + inverse(2, 2);
+                w = w != 0 ? 1.0 / w : 0;
+                double sx = (inverse(0, 0) * stackX + inverse(0, 1) * stackY + inverse(0, 2)) * w;
+                double sy = (inverse(1, 0) * stackX + inverse(1, 1) * stackY + inverse(1, 2)) * w;
+                mapRow[x] = Vec2f((float) sx + offsetRow[x][0] * offsetScale, (float) sy + offsetRow[x][1] * offsetScale);
+            }
+        }
+    });
+}
+
+/**
+ * Adds a frame to one tile of the stack.
+ * Interleaved 8 bit frames are warped by OpenCV into buffers that are never larger than the largest tile. Frames in
+ * another layout than RGB, e.g. the RGBA bitmaps of the app, are warped in their own layout and their channels are
+ * reordered afterwards. Interpolation works per channel, so they are accumulated exactly like the RGB copies the
+ * SessionRecorder keeps, and a replay gives the same stack.
+ * With the mesh alignment, interleaved frames are remapped through a map of the tile instead of warped with the
+ * homography. 16 bit and planar frames are read in place by accumulateWarped.
+ *
+ * @param rect Area of the stack covered by the tile
+ * @param combined Sum of the aligned frames, 16 bit, 32 bit or float. The sums keep their depth, so weighted frames
+ *                 are only added without rounding to a float sum.
+ * @param planes AccumulatedPlanes the frame is added to, the other planes are left untouched
+ * @param weight Weight of the frame in the sum of the aligned frames, applied while adding
+ * @param offsets Offsets of the mesh alignment, empty to warp with the homography alone
+ */
+inline void accumulateTile(const FrameView &frame, const Mat &h, const Scalar &border, const Rect &rect,
+                           Mat &maxed, Mat &combined, Mat &stacked, WarpBuffers &buffers, int planes = ALL_PLANES,
+                           float weight = 1, const Mat &offsets = Mat()) {
+    Mat image;
+    int order[3];
+    if (!frame.asInterleavedMat(image, order)) {
+        accumulateWarped(frame, h, border, rect.tl(), maxed, combined, stacked, planes, weight, offsets);
+        return;
+    }
+    bool reorder = image.channels() != 3 || order[0] != 0;
+    const int fromTo[6] = {order[0], 0, order[1], 1, order[2], 2};
+
+    if (planes & UNALIGNED_PLANE) {
+        // Add image without alignment
+        Mat unaligned = image(rect);
+        if (reorder) {
+            Mat reordered = tileBuffer(buffers.unaligned, rect.size(), CV_8UC3);
+            mixChannels(&unaligned, 1, &reordered, 1, fromTo, 3);
+            unaligned = reordered;
+        }
+        add(stacked, unaligned, stacked, noArray(), stacked.depth());
+    }
+    if (!(planes & ALIGNED_PLANES)) {
+        return;
+    }
+
+    Mat aligned = tileBuffer(buffers.aligned, rect.size(), CV_8UC3);
+    Mat warped = reorder ? tileBuffer(buffers.warped, rect.size(), image.type()) : aligned;
+    Scalar frameBorder = border;
+    if (reorder) {
+        frameBorder = Scalar();
+        for (int c = 0; c < 3; c++) {
+            frameBorder[order[c]] = border[c];
+        }
+    }
+    if (offsets.empty()) {
+        // Shift the homography so the origin of the tile becomes the origin of the aligned image
+        Mat shift = (Mat_<double>(3, 3) << 1, 0, -rect.x, 0, 1, -rect.y, 0, 0, 1);
+        Mat tileHomography = shift * h;
+        warpPerspective(image, warped, tileHomography, rect.size(), INTER_LINEAR, BORDER_CONSTANT, frameBorder);
+    } else {
+        Mat map = tileBuffer(buffers.map, rect.size(), CV_32FC2);
+        buildMeshMap(h, rect, offsets, map);
+        remap(image, warped, map, noArray(), INTER_LINEAR, BORDER_CONSTANT, frameBorder);
+    }
+    if (reorder) {
+        mixChannels(&warped, 1, &aligned, 1, fromTo, 3);
+    }
+
+    max(maxed, aligned, maxed);
+
+    // Add image to the current stacks, the 8 bit images are widened and weighted while adding
+    if (weight == 1) {
+        add(combined, aligned, combined, noArray(), combined.depth());
+    } else {
+        addWeighted(combined, 1, aligned, weight, 0, combined, combined.depth());
+    }
+}
+
+/**
+ * Adds a frame to one tile of the stack, skipping the planes the foreground mask discards in every region of the tile.
+ * The processed image only uses the aligned planes where the mask is sky and the unaligned sum where it is foreground,
+ * so sky regions skip the unaligned sum and foreground regions skip the warp.
+ *
+ * @param rect Area of the stack covered by the tile, the planes cover the same area
+ * @param maskTiles Classification of the foreground mask, every region is treated as mixed if empty
+ * @param regions Buffer for the regions of the tile, reused between calls
+ * @param weight Weight of the frame in the sum of the aligned frames
+ * @param offsets Offsets of the mesh alignment, empty to warp with the homography alone
+ */
+inline void accumulateMaskedTile(const FrameView &frame, const Mat &h, const Scalar &border, const Rect &rect,
+                                 Mat &maxed, Mat &combined, Mat &stacked, WarpBuffers &buffers,
+                                 const MaskTiles &maskTiles, vector<MaskRegion> &regions, float weight = 1,
+                                 const Mat &offsets = Mat()) {
+    if (maskTiles.empty()) {
+        accumulateTile(frame, h, border, rect, maxed, combined, stacked, buffers, ALL_PLANES, weight, offsets);
+        return;
+    }
+
+    maskTiles.regions(rect, regions);
+    for (auto &region: regions) {
+        Rect local = region.rect - rect.tl();
+        Mat maxedRegion = maxed(local), combinedRegion = combined(local), stackedRegion = stacked(local);
+        int planes = ALL_PLANES;
+        if (region.type == MaskTileClass::SKY) {
+            planes = ALIGNED_PLANES;
+        } else if (region.type == MaskTileClass::FOREGROUND) {
+            planes = UNALIGNED_PLANE;
+        }
+        accumulateTile(frame, h, border, region.rect, maxedRegion, combinedRegion, stackedRegion, buffers, planes,
+                       weight, offsets);
+    }
+}
+
+#endif /* WarpAccumulator_hpp */
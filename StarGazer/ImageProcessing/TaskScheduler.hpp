@@ -0,0 +1,434 @@
+//
+//  TaskScheduler.hpp
+//  StarGazer
+//
+//  Work stealing scheduler for the parallel loops of the alignment, accumulation and editor kernels.
+//  Work carries a priority class, so an interactive preview is not stuck behind stacking or an export.
+//
+
+#ifndef TaskScheduler_hpp
+#define TaskScheduler_hpp
+
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <optional>
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Priority classes, lower values run first.
+ */
+enum class TaskPriority {
+    /**
+     * Work a user is waiting for, e.g. the preview of the editor.
+     */
+    INTERACTIVE = 0,
+
+    /**
+     * Merging frames while they are captured.
+     */
+    STACKING = 1,
+
+    /**
+     * Exports, batch stacking and other work nobody watches.
+     */
+    BATCH = 2,
+};
+
+/**
+ * Shared flag to cancel work cooperatively. Copies refer to the same flag.
+ */
+class CancellationToken {
+private:
+    std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+
+public:
+    void cancel() const {
+        *flag = true;
+    }
+
+    bool isCancelled() const {
+        return *flag;
+    }
+};
+
+/**
+ * Runs the kernels of OpenCV single threaded while any scope is alive. The scheduler keeps every core busy with its
+ * own chunks, OpenCV threads started from inside a chunk would only compete with the workers. The thread count of
+ * OpenCV is global, so it is set once the first scope starts and restored when the last one ends.
+ */
+class SerialOpenCVScope {
+private:
+    static std::mutex &mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static int &depth() {
+        static int depth = 0;
+        return depth;
+    }
+
+    static int &previousThreads() {
+        static int threads = 0;
+        return threads;
+    }
+
+public:
+    SerialOpenCVScope() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (depth()++ == 0) {
+            previousThreads() = cv::getNumThreads();
+            cv::setNumThreads(1);
+        }
+    }
+
+    ~SerialOpenCVScope() {
+        std::lock_guard<std::mutex> lock(mutex());
+        if (--depth() == 0) {
+            cv::setNumThreads(previousThreads());
+        }
+    }
+
+    SerialOpenCVScope(const SerialOpenCVScope &) = delete;
+    SerialOpenCVScope &operator=(const SerialOpenCVScope &) = delete;
+};
+
+/**
+ * Priority and cancellation of the work started by the current thread. Parallel loops inherit both, including loops
+ * nested in the tasks of other loops.
+ */
+class TaskScope {
+private:
+    static TaskPriority &currentPriority() {
+        static thread_local TaskPriority priority = TaskPriority::STACKING;
+        return priority;
+    }
+
+    static CancellationToken &currentToken() {
+        static thread_local CancellationToken token;
+        return token;
+    }
+
+    TaskPriority previousPriority;
+    CancellationToken previousToken;
+
+    /**
+     * Batch work runs on many threads at once, e.g. one per partial stack, so its OpenCV kernels stay single threaded.
+     */
+    std::optional<SerialOpenCVScope> serial;
+
+public:
+    /**
+     * Runs the work of the current thread with the priority until the scope ends, cancelled with the token.
+     */
+    TaskScope(TaskPriority priority, const CancellationToken &token) :
+            previousPriority(currentPriority()), previousToken(currentToken()) {
+        currentPriority() = priority;
+        currentToken() = token;
+        if (priority == TaskPriority::BATCH) {
+            serial.emplace();
+        }
+    }
+
+    /**
+     * Runs the work of the current thread with the priority until the scope ends, keeps the cancellation token.
+     */
+    TaskScope(TaskPriority priority) : TaskScope(priority, currentToken()) {
+    }
+
+    ~TaskScope() {
+        currentPriority() = previousPriority;
+        currentToken() = previousToken;
+    }
+
+    TaskScope(const TaskScope &) = delete;
+    TaskScope &operator=(const TaskScope &) = delete;
+
+    static TaskPriority priority() {
+        return currentPriority();
+    }
+
+    static const CancellationToken &token() {
+        return currentToken();
+    }
+
+    static bool isCancelled() {
+        return currentToken().isCancelled();
+    }
+};
+
+/**
+ * Every worker owns a deque per priority. Workers take their own newest task, then the oldest task submitted from
+ * outside, then steal the oldest task of another worker, always trying all sources of a priority before the next
+ * lower one. A running task is never interrupted, so loops are split into chunks small enough that urgent work only
+ * waits for the end of a chunk. Chunks run the OpenCV kernels they call single threaded, see SerialOpenCVScope.
+ */
+class TaskScheduler {
+private:
+    static const int NUM_PRIORITIES = 3;
+
+    /**
+     * Loops are split into this many chunks per thread, so urgent work finds a free worker soon.
+     */
+    static const int CHUNKS_PER_THREAD = 4;
+
+    struct Task {
+        std::function<void()> run;
+    };
+
+    struct TaskQueues {
+        std::mutex mutex;
+        std::deque<Task> queues[NUM_PRIORITIES];
+    };
+
+    /**
+     * Counts the chunks of a loop that did not finish yet.
+     */
+    struct TaskGroup {
+        std::atomic<int> remaining;
+        std::mutex mutex;
+        std::exception_ptr error;
+
+        TaskGroup(int count) : remaining(count) {
+        }
+    };
+
+    vector<std::unique_ptr<TaskQueues>> local;
+    TaskQueues injected;
+    vector<std::thread> workers;
+
+    /**
+     * Guards sleeping: workers wait on wake for any task, threads waiting for a loop wait on progress for a task they
+     * may run or for the end of their loop. Both are signalled with the mutex held, so no signal is lost.
+     */
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::condition_variable progress;
+    int numWaiting = 0;
+    bool stopping = false;
+
+    /**
+     * Queued tasks per priority.
+     */
+    std::atomic<int> pending[NUM_PRIORITIES] = {};
+
+    /**
+     * True if a task of at least the given priority is queued.
+     */
+    bool hasPending(TaskPriority lowest) {
+        for (int priority = 0; priority <= (int) lowest; priority++) {
+            if (pending[priority] > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static TaskScheduler *&threadOwner() {
+        static thread_local TaskScheduler *owner = nullptr;
+        return owner;
+    }
+
+    static int &threadIndex() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    /**
+     * Index of the worker of this scheduler running on the current thread, -1 on other threads.
+     */
+    int workerIndex() {
+        return threadOwner() == this ? threadIndex() : -1;
+    }
+
+    void push(Task &&task, TaskPriority priority) {
+        int index = workerIndex();
+        TaskQueues &queues = index >= 0 ? *local[index] : injected;
+        {
+            std::lock_guard<std::mutex> lock(queues.mutex);
+            queues.queues[(int) priority].push_back(std::move(task));
+        }
+        pending[(int) priority]++;
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wake.notify_one();
+        if (numWaiting > 0) {
+            progress.notify_all();
+        }
+    }
+
+    /**
+     * Wakes the threads waiting for a loop once its last chunk finished.
+     */
+    void finished(TaskGroup &group) {
+        if (--group.remaining == 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            progress.notify_all();
+        }
+    }
+
+    static bool pop(TaskQueues &queues, int priority, bool newest, Task &task) {
+        std::lock_guard<std::mutex> lock(queues.mutex);
+        std::deque<Task> &queue = queues.queues[priority];
+        if (queue.empty()) {
+            return false;
+        }
+        if (newest) {
+            task = std::move(queue.back());
+            queue.pop_back();
+        } else {
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+        return true;
+    }
+
+    /**
+     * Runs a single task of at least the given priority.
+     * @return False if there was none
+     */
+    bool runOne(TaskPriority lowest) {
+        int index = workerIndex();
+        Task task;
+        for (int priority = 0; priority <= (int) lowest; priority++) {
+            bool found = (index >= 0 && pop(*local[index], priority, true, task)) || pop(injected, priority, false, task);
+            for (size_t i = 1; !found && i <= local.size(); i++) {
+                size_t victim = (std::max(index, 0) + i) % local.size();
+                found = (int) victim != index && pop(*local[victim], priority, false, task);
+            }
+            if (found) {
+                pending[priority]--;
+                task.run();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int index) {
+        threadOwner() = this;
+        threadIndex() = index;
+        while (true) {
+            if (runOne(TaskPriority::BATCH)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [&]() { return stopping || hasPending(TaskPriority::BATCH); });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+public:
+    /**
+     * @param numThreads Number of workers, the thread waiting for a loop works on it as well
+     */
+    TaskScheduler(int numThreads = std::max(1, (int) std::thread::hardware_concurrency() - 1)) {
+        for (int i = 0; i < numThreads; i++) {
+            local.push_back(std::make_unique<TaskQueues>());
+        }
+        for (int i = 0; i < numThreads; i++) {
+            workers.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+    TaskScheduler(const TaskScheduler &) = delete;
+    TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+    /**
+     * Scheduler shared by all kernels of the process.
+     */
+    static TaskScheduler &shared() {
+        static TaskScheduler scheduler;
+        return scheduler;
+    }
+
+    int getNumThreads() {
+        return (int) workers.size() + 1;
+    }
+
+    /**
+     * Runs the body over chunks of the range, with the priority and the cancellation token of the current scope.
+     * The calling thread runs chunks as well while it waits. Chunks that did not start before the token was
+     * cancelled are skipped, the caller checks TaskScope::isCancelled afterwards.
+     * Rethrows the first exception thrown by the body.
+     * @param chunks Number of chunks, 0 to split by the number of threads
+     */
+    void parallelFor(const Range &range, const std::function<void(const Range &)> &body, int chunks = 0) {
+        int length = range.end - range.start;
+        if (length <= 0 || TaskScope::isCancelled()) {
+            return;
+        }
+        chunks = std::min(length, chunks > 0 ? chunks : getNumThreads() * CHUNKS_PER_THREAD);
+        if (chunks <= 1 || workers.empty()) {
+            body(range);
+            return;
+        }
+
+        TaskPriority priority = TaskScope::priority();
+        CancellationToken token = TaskScope::token();
+        auto group = std::make_shared<TaskGroup>(chunks);
+        for (int i = 0; i < chunks; i++) {
+            Range chunk(range.start + (int) ((long long) length * i / chunks),
+                        range.start + (int) ((long long) length * (i + 1) / chunks));
+            push(Task{[this, group, chunk, priority, token, &body]() {
+                if (!token.isCancelled()) {
+                    SerialOpenCVScope serial;
+                    TaskScope scope(priority, token);
+                    try {
+                        body(chunk);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(group->mutex);
+                        if (!group->error) {
+                            group->error = std::current_exception();
+                        }
+                    }
+                }
+                finished(*group);
+            }}, priority);
+        }
+
+        // Help with the loop and anything more urgent, but not with less urgent work. Sleeps while the remaining
+        // chunks run on other workers, until one of them queues work this thread may run or the loop is done.
+        while (group->remaining > 0) {
+            if (runOne(priority)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            numWaiting++;
+            progress.wait(lock, [&]() { return group->remaining == 0 || hasPending(priority); });
+            numWaiting--;
+        }
+        if (group->error) {
+            std::rethrow_exception(group->error);
+        }
+    }
+};
+
+/**
+ * Runs a parallel loop on the shared scheduler, a drop in replacement of cv::parallel_for_ for the kernels.
+ */
+inline void parallelFor(const Range &range, const std::function<void(const Range &)> &body, int chunks = 0) {
+    TaskScheduler::shared().parallelFor(range, body, chunks);
+}
+
+#endif /* TaskScheduler_hpp */
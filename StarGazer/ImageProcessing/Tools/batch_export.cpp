@@ -0,0 +1,143 @@
+//
+//  batch_export.cpp
+//  StarGazer
+//
+//  Exports several projects, each with several presets, concurrently. Every project is opened once by an
+//  EditorEngine, which is shared by all exports of its presets.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IEnhancement -IExport -I. Tools/batch_export.cpp Enhancement/blend.cpp \
+//        Enhancement/enhance.cpp -o batch_export $(pkg-config --cflags --libs opencv4) -lz
+//
+//  Usage: batch_export <output-dir> <checkpoint-dir>... [--preset <name>=<starPop>,<lightPol>,<color>,<saturation>,<brightness>]...
+//                      [--jobs <n>] [--format tif|fits]
+//
+//  Preset values are slider positions in range [0, 1] as in the app. Without presets, every project is exported with
+//  the sliders in the middle. Exports are written to <output-dir>/<project>-<preset>.<format>.
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include "EditorEngine.hpp"
+
+using namespace std;
+using namespace cv;
+
+struct Preset {
+    string name;
+    EditParameters parameters;
+};
+
+static bool parsePreset(const string &value, Preset &preset) {
+    size_t separator = value.find('=');
+    if (separator == string::npos) {
+        return false;
+    }
+    preset.name = value.substr(0, separator);
+    double sliders[5];
+    if (sscanf(value.c_str() + separator + 1, "%lf,%lf,%lf,%lf,%lf",
+               &sliders[0], &sliders[1], &sliders[2], &sliders[3], &sliders[4]) != 5) {
+        return false;
+    }
+    preset.parameters.setStarPop(sliders[0]);
+    preset.parameters.setLightPolReduction(sliders[1]);
+    preset.parameters.setColor(sliders[2]);
+    preset.parameters.setSaturation(sliders[3]);
+    preset.parameters.setBrightness(sliders[4]);
+    return true;
+}
+
+static string baseName(string path) {
+    while (path.size() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+    return path.substr(path.find_last_of('/') + 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <output-dir> <checkpoint-dir>... [--preset <name>=<values>]... "
+                  << "[--jobs <n>] [--format tif|fits]" << std::endl;
+        return 2;
+    }
+
+    string outputDir = argv[1];
+    vector<string> projects;
+    vector<Preset> presets;
+    int jobs = std::max(1u, std::thread::hardware_concurrency());
+    string format = "tif";
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--preset" && i + 1 < argc) {
+            Preset preset;
+            if (!parsePreset(argv[++i], preset)) {
+                std::cout << "Invalid preset " << argv[i] << std::endl;
+                return 2;
+            }
+            presets.push_back(preset);
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 2;
+        } else {
+            projects.push_back(arg);
+        }
+    }
+    if (presets.empty()) {
+        Preset preset;
+        parsePreset("default=0.5,0.5,0.5,0.5,0.5", preset);
+        presets.push_back(preset);
+    }
+
+    vector<shared_ptr<const EditorEngine>> engines;
+    for (auto &project: projects) {
+        int numImages = 0;
+        std::ifstream meta(project + "/checkpoint.meta");
+        meta >> numImages;
+        auto engine = std::make_shared<const EditorEngine>(project + "/checkpoint.stargazer", std::max(1, numImages));
+        if (engine->empty() || numImages <= 0) {
+            std::cout << "No checkpoint found in " << project << std::endl;
+            return 1;
+        }
+        engines.push_back(engine);
+    }
+
+    // Every job takes the next export, the engines are shared between the jobs
+    size_t numExports = engines.size() * presets.size();
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(0);
+    std::mutex outputMutex;
+    auto start = std::chrono::steady_clock::now();
+    vector<std::thread> threads;
+    for (int j = 0; j < jobs; j++) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < numExports; i = next++) {
+                size_t project = i / presets.size();
+                const Preset &preset = presets[i % presets.size()];
+                string path = outputDir + "/" + baseName(projects[project]) + "-" + preset.name + "." + format;
+                bool success = engines[project]->exportImage(preset.parameters, path);
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cout << (success ? "Exported " : "Failed ") << path << std::endl;
+                if (!success) {
+                    failed++;
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << numExports << " exports with " << jobs << " jobs in " << seconds << " s" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+//
+//  build_masters.cpp
+//  StarGazer
+//
+//  Averages directories of bias, dark and flat frames into master frames and writes them as a calibration file,
+//  which stack_frames applies with --calibration. Frames are added one at a time while they are decoded.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IExport -IIngestion -I. Tools/build_masters.cpp Export/SaveBinaryCV.cpp \
+//        -o build_masters $(pkg-config --cflags --libs opencv4)
+//
+//  Usage: build_masters <output-dir> [--bias <dir>] [--dark <dir>] [--flat <dir>]
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+
+#include "FrameSource.hpp"
+#include "Calibration.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Averages all frames of a directory, empty if the directory is not set.
+ */
+bool buildMaster(const string &dir, const string &name, Mat &master) {
+    if (dir.empty()) {
+        return true;
+    }
+    PrefetchingFrameSource frames(std::make_unique<ImageDirectorySource>(dir));
+    MasterFrameBuilder builder;
+    DecodedFrame frame;
+    while (frames.next(frame)) {
+        if (!builder.add(frame.view)) {
+            std::cout << "Skipped " << name << " frame " << frame.index << " of a different size" << std::endl;
+        }
+    }
+    builder.getMaster(master);
+    std::cout << "Master " << name << " from " << builder.getCount() << " frames" << std::endl;
+    return !master.empty();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <output-dir> [--bias <dir>] [--dark <dir>] [--flat <dir>]" << std::endl;
+        return 2;
+    }
+
+    string outputDir = argv[1];
+    string biasDir, darkDir, flatDir;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--bias" && i + 1 < argc) {
+            biasDir = argv[++i];
+        } else if (arg == "--dark" && i + 1 < argc) {
+            darkDir = argv[++i];
+        } else if (arg == "--flat" && i + 1 < argc) {
+            flatDir = argv[++i];
+        } else {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    Mat bias, dark, flat;
+    if (!buildMaster(biasDir, "bias", bias) || !buildMaster(darkDir, "dark", dark) || !buildMaster(flatDir, "flat", flat)) {
+        std::cout << "No frames found" << std::endl;
+        return 1;
+    }
+
+    Calibration calibration(bias, dark, flat);
+    if (calibration.empty()) {
+        std::cout << "No calibration frames given" << std::endl;
+        return 1;
+    }
+    calibration.writeToDirectory(outputDir);
+    return 0;
+}
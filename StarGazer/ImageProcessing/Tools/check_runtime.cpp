@@ -0,0 +1,211 @@
+//
+//  check_runtime.cpp
+//  StarGazer
+//
+//  Feeds several sessions of a StackingRuntime with synthetic star fields as fast as possible, against a memory
+//  budget that only holds a couple of queued frames, and checks that every submitted frame is accounted for.
+//  Also destroys a runtime with frames still queued and drops sessions without closing them. Exits with 1 if a check
+//  fails.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IAlignment -IEnhancement -IExport -IDiagnostics -IStacking -IIngestion -I. \
+//        Tools/check_runtime.cpp Alignment/homography.cpp Enhancement/blend.cpp Enhancement/enhance.cpp \
+//        Export/SaveBinaryCV.cpp -o check_runtime $(pkg-config --cflags --libs opencv4)
+//
+//  Usage: check_runtime [--sessions <n>] [--frames <n>] [--workers <n>]
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <thread>
+
+#include "StackingRuntime.hpp"
+
+using namespace std;
+using namespace cv;
+
+static const Size FRAME_SIZE(640, 480);
+static const int MAX_SHIFT = 40;
+
+static int failures = 0;
+
+static void check(bool condition, const string &message) {
+    if (!condition) {
+        std::cout << "FAILED: " << message << std::endl;
+        failures++;
+    }
+}
+
+/**
+ A random star field larger than the frames, so frames can be cut from it at drifting positions.
+ */
+static Mat createStarField(unsigned int seed) {
+    RNG rng(seed);
+    Mat field = Mat::zeros(FRAME_SIZE.height + 2 * MAX_SHIFT, FRAME_SIZE.width + 2 * MAX_SHIFT, CV_8UC3);
+    for (int i = 0; i < 300; i++) {
+        Point center(rng.uniform(0, field.cols), rng.uniform(0, field.rows));
+        int brightness = rng.uniform(80, 256);
+        circle(field, center, rng.uniform(1, 3), Scalar::all(brightness), FILLED, LINE_AA);
+    }
+    GaussianBlur(field, field, Size(5, 5), 1);
+    return field;
+}
+
+static DecodedFrame cutFrame(const Mat &field, int index) {
+    DecodedFrame frame;
+    Point offset(MAX_SHIFT + (index % MAX_SHIFT) / 2, MAX_SHIFT - (index % MAX_SHIFT) / 3);
+    frame.buffer = field(Rect(offset, FRAME_SIZE)).clone();
+    Mat noise(FRAME_SIZE, CV_8UC3);
+    randu(noise, Scalar::all(0), Scalar::all(8));
+    frame.buffer += noise;
+    frame.index = index;
+    frame.view = FrameView(frame.buffer);
+    return frame;
+}
+
+/**
+ Every frame that was submitted, and the reference, is either merged, failed or dropped once the session is idle.
+ */
+static void checkAccounted(const SessionStatus &status, int submitted, const string &name) {
+    check(status.queued == 0, name + ": frames still queued");
+    check(status.merged + status.failed + status.dropped == submitted + 1,
+          name + ": " + to_string(status.merged) + " merged, " + to_string(status.failed) + " failed, "
+          + to_string(status.dropped) + " dropped of " + to_string(submitted + 1) + " frames");
+}
+
+/**
+ Several sessions submitting concurrently while the budget only holds about two queued frames.
+ */
+static void checkSmallBudget(int numSessions, int numFrames, int workers) {
+    RuntimeOptions options;
+    options.workers = workers;
+    options.maxQueuedFrames = 4;
+    options.memoryBudget = std::make_shared<MemoryBudget>((size_t) 512 << 20);
+    StackingRuntime runtime(options);
+
+    vector<Mat> fields;
+    vector<std::shared_ptr<StackingSession>> sessions;
+    for (int i = 0; i < numSessions; i++) {
+        fields.push_back(createStarField(i + 1));
+        DecodedFrame reference = cutFrame(fields[i], 0);
+        Mat mask;
+        try {
+            auto session = runtime.open(reference.view, mask, MergerOptions());
+            check(session != nullptr, "session " + to_string(i) + " not admitted");
+            sessions.push_back(session);
+        } catch (const MergingException &e) {
+            check(false, string("reference rejected: ") + e.what());
+        }
+    }
+    if ((int) sessions.size() != numSessions) {
+        return;
+    }
+
+    // Everything but two frames is taken from the budget, so queued frames compete for memory
+    size_t frameBytes = (size_t) FRAME_SIZE.area() * 3;
+    MemoryReservation hog;
+    size_t available = options.memoryBudget->available();
+    hog.reserve(options.memoryBudget, available > 2 * frameBytes ? available - 2 * frameBytes : 0);
+
+    vector<std::thread> feeders;
+    for (int i = 0; i < numSessions; i++) {
+        feeders.emplace_back([&, i]() {
+            for (int f = 1; f <= numFrames; f++) {
+                runtime.submit(sessions[i], cutFrame(fields[i], f));
+            }
+            runtime.close(sessions[i]);
+        });
+    }
+    for (auto &feeder: feeders) {
+        feeder.join();
+    }
+
+    int dropped = 0;
+    for (int i = 0; i < numSessions; i++) {
+        SessionStatus status = sessions[i]->getStatus();
+        checkAccounted(status, numFrames, "session " + to_string(i));
+        dropped += status.dropped;
+        std::cout << "Session " << i << ": merged " << status.merged << ", failed " << status.failed
+                  << ", dropped " << status.dropped << std::endl;
+    }
+    check(dropped > 0, "the budget never dropped a frame");
+    check(runtime.getNumSessions() == 0, "sessions still open");
+}
+
+/**
+ A runtime destroyed with frames queued discards them and leaves its sessions idle.
+ */
+static void checkShutdown(int numFrames) {
+    Mat field = createStarField(42);
+    std::shared_ptr<StackingSession> session;
+    {
+        RuntimeOptions options;
+        options.workers = 1;
+        options.maxQueuedFrames = numFrames;
+        StackingRuntime runtime(options);
+        DecodedFrame reference = cutFrame(field, 0);
+        Mat mask;
+        session = runtime.open(reference.view, mask, MergerOptions());
+        for (int f = 1; f <= numFrames; f++) {
+            runtime.submit(session, cutFrame(field, f));
+        }
+    }
+    checkAccounted(session->getStatus(), numFrames, "shut down session");
+}
+
+/**
+ Sessions dropped without being closed give up their admission, so they do not exhaust the sessions of the runtime.
+ */
+static void checkDroppedSessions(int numFrames) {
+    Mat field = createStarField(7);
+    RuntimeOptions options;
+    options.workers = 1;
+    options.maxSessions = 2;
+    StackingRuntime runtime(options);
+    for (int i = 0; i < 4; i++) {
+        DecodedFrame reference = cutFrame(field, 0);
+        Mat mask;
+        auto session = runtime.open(reference.view, mask, MergerOptions());
+        check(session != nullptr, "session " + to_string(i) + " not admitted after dropping the previous ones");
+        if (session == nullptr) {
+            return;
+        }
+        // Only closed sessions get frames, so a dropped session is not kept alive by a worker
+        if (i % 2 == 0) {
+            for (int f = 1; f <= numFrames; f++) {
+                runtime.submit(session, cutFrame(field, f));
+            }
+            runtime.close(session);
+            runtime.close(session);
+        }
+    }
+    check(runtime.getNumSessions() == 0, to_string(runtime.getNumSessions()) + " dropped sessions still admitted");
+}
+
+int main(int argc, char **argv) {
+    int numSessions = 4, numFrames = 40, workers = 2;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--sessions" && i + 1 < argc) {
+            numSessions = atoi(argv[++i]);
+        } else if (arg == "--frames" && i + 1 < argc) {
+            numFrames = atoi(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else {
+            std::cout << "Usage: " << argv[0] << " [--sessions <n>] [--frames <n>] [--workers <n>]" << std::endl;
+            return 2;
+        }
+    }
+
+    checkSmallBudget(numSessions, numFrames, workers);
+    checkShutdown(numFrames);
+    checkDroppedSessions(numFrames);
+
+    if (failures > 0) {
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
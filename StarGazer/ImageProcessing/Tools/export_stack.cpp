@@ -0,0 +1,83 @@
+//
+//  export_stack.cpp
+//  StarGazer
+//
+//  Exports the linear average of a checkpoint in 16 bit as tiled TIFF or FITS, for processing in astronomy software.
+//  The checkpoint is mapped and streamed tile by tile, so stacks larger than the memory can be exported.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IExport -I. Tools/export_stack.cpp -o export_stack \
+//        $(pkg-config --cflags --libs opencv4) -lz
+//
+//  Usage: export_stack <checkpoint-dir> <output.tif|output.fits> [--tile-size <n>] [--uncompressed]
+//
+//  The number of frames is read from checkpoint.meta in the checkpoint directory.
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+
+#include "MappedCheckpoint.hpp"
+#include "TiledImageWriter.hpp"
+
+using namespace std;
+using namespace cv;
+
+static bool endsWith(const string &value, const string &suffix) {
+    return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <checkpoint-dir> <output.tif|output.fits> [--tile-size <n>] [--uncompressed]"
+                  << std::endl;
+        return 2;
+    }
+
+    string checkpointDir = argv[1];
+    string output = argv[2];
+    int tileSize = 512;
+    bool compress = true;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--tile-size" && i + 1 < argc) {
+            tileSize = std::max(16, atoi(argv[++i]) / 16 * 16);
+        } else if (arg == "--uncompressed") {
+            compress = false;
+        } else {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    int numImages = 0;
+    std::ifstream meta(checkpointDir + "/checkpoint.meta");
+    meta >> numImages;
+    MappedCheckpoint checkpoint(checkpointDir + "/checkpoint.stargazer");
+    if (!checkpoint.isOpen() || numImages <= 0) {
+        std::cout << "No checkpoint found in " << checkpointDir << std::endl;
+        return 1;
+    }
+
+    unique_ptr<TiledImageWriter> writer;
+    if (endsWith(output, ".fits") || endsWith(output, ".fit")) {
+        writer = std::make_unique<FitsWriter>(output, checkpoint.size());
+    } else {
+        writer = std::make_unique<TiledTiffWriter>(output, checkpoint.size(), tileSize, compress);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool success = exportTiled(checkpoint.size(), tileSize, *writer, [&](const Rect &rect, Mat &tile) {
+        checkpoint.renderLinear(rect, numImages, tile);
+    });
+    if (!success) {
+        std::cout << "Could not write " << output << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Exported " << checkpoint.size().width << "x" << checkpoint.size().height << " from " << numImages
+              << " frames in " << seconds << " s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,270 @@
+//
+//  replay_session.cpp
+//  StarGazer
+//
+//  Replays a session recorded by the SessionRecorder and compares every decision of the merger with the recording.
+//  The merger takes the settings of the recording and merges every frame at its recorded quality, the options on the
+//  command line override the recorded settings. Every frame is also downscaled in the layouts the app feeds, which have
+//  to give the same result as the recorded RGB copy.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IAlignment -IEnhancement -IExport -IDiagnostics -IStacking -IIngestion -I. \
+//        Tools/replay_session.cpp Alignment/homography.cpp Enhancement/blend.cpp Enhancement/enhance.cpp \
+//        Export/SaveBinaryCV.cpp -o replay_session $(pkg-config --cflags --libs opencv4)
+//
+//  Usage: replay_session <session-dir> [--tolerance <value>] [--checkpoint <dir>] [--output <dir>]
+//                                      [--threads <n>] [--visualise] [--detection-levels <n>]
+//                                      [--tracking-interval <n>] [--screen-quality] [--weight-frames]
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <iomanip>
+
+#include "homography.hpp"
+#include "ImageMerger.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Compares the decisions taken during the replay with the recorded ones.
+ */
+class ReplayVerifier : public MergeObserver {
+private:
+    FrameRecord expected;
+    double tolerance;
+
+    void report(const FrameRecord &record, const string &message) {
+        std::cout << "Frame " << record.index << ": " << message << std::endl;
+        mismatches++;
+    }
+
+public:
+    int mismatches = 0;
+    int frames = 0;
+    vector<StageTimings> recordedTimings;
+    vector<StageTimings> replayedTimings;
+
+    ReplayVerifier(double tolerance) : tolerance(tolerance) {
+    }
+
+    void expect(const FrameRecord &record) {
+        expected = record;
+    }
+
+    void frameFinished(const FrameRecord &record) override {
+        frames++;
+        recordedTimings.push_back(expected.timings);
+        replayedTimings.push_back(record.timings);
+
+        if (record.index != expected.index) {
+            report(record, "index differs, recorded " + to_string(expected.index));
+        }
+        if (record.decision != expected.decision) {
+            report(record, string("decision ") + frameDecisionName(record.decision) +
+                           ", recorded " + frameDecisionName(expected.decision));
+        }
+        if (std::abs(record.threshold - expected.threshold) > tolerance) {
+            report(record, "threshold " + to_string(record.threshold) + ", recorded " + to_string(expected.threshold));
+        }
+        if (record.stars != expected.stars) {
+            report(record, to_string(record.stars.size()) + " stars, recorded " + to_string(expected.stars.size()));
+        }
+        if (record.matches.size() != expected.matches.size()) {
+            report(record, to_string(record.matches.size()) + " matches, recorded " + to_string(expected.matches.size()));
+        }
+        if (record.homography.empty() != expected.homography.empty()) {
+            report(record, "homography presence differs");
+        } else if (!record.homography.empty()) {
+            double diff = cv::norm(record.homography, expected.homography, NORM_INF);
+            if (diff > tolerance) {
+                report(record, "homography differs by " + to_string(diff));
+            }
+        }
+    }
+};
+
+void printTimings(const string &name, const vector<StageTimings> &timings) {
+    StageTimings sum, peak;
+    for (auto &t: timings) {
+        sum.masking += t.masking;
+        sum.detection += t.detection;
+        sum.matching += t.matching;
+        sum.homography += t.homography;
+        sum.warping += t.warping;
+        sum.accumulation += t.accumulation;
+        sum.preview += t.preview;
+        peak.masking = std::max(peak.masking, t.masking);
+        peak.detection = std::max(peak.detection, t.detection);
+        peak.matching = std::max(peak.matching, t.matching);
+        peak.homography = std::max(peak.homography, t.homography);
+        peak.warping = std::max(peak.warping, t.warping);
+        peak.accumulation = std::max(peak.accumulation, t.accumulation);
+        peak.preview = std::max(peak.preview, t.preview);
+    }
+    double n = std::max<size_t>(timings.size(), 1);
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << name << " (mean / max ms over " << timings.size() << " frames)" << std::endl;
+    std::cout << "  masking      " << sum.masking / n << " / " << peak.masking << std::endl;
+    std::cout << "  detection    " << sum.detection / n << " / " << peak.detection << std::endl;
+    std::cout << "  matching     " << sum.matching / n << " / " << peak.matching << std::endl;
+    std::cout << "  homography   " << sum.homography / n << " / " << peak.homography << std::endl;
+    std::cout << "  warping      " << sum.warping / n << " / " << peak.warping << std::endl;
+    std::cout << "  accumulation " << sum.accumulation / n << " / " << peak.accumulation << std::endl;
+    std::cout << "  preview      " << sum.preview / n << " / " << peak.preview << std::endl;
+    std::cout << "  total        " << sum.total() / n << std::endl;
+}
+
+/**
+ Compares two checkpoints plane by plane. Returns the number of planes that differ by more than the tolerance.
+ */
+int compareCheckpoints(const string &replayed, const string &recorded, double tolerance) {
+    std::ifstream ifsReplayed(replayed + CHECKPOINT_FILENAME, std::ios::binary);
+    std::ifstream ifsRecorded(recorded + CHECKPOINT_FILENAME, std::ios::binary);
+    if (!ifsRecorded.is_open()) {
+        std::cout << "No recorded checkpoint in " << recorded << ", skipping stack comparison" << std::endl;
+        return 0;
+    }
+
+    const char *names[] = {"combined", "maxed", "stacked", "mask"};
+    int differences = 0;
+    for (auto name: names) {
+        Mat a, b;
+        readMatBinary(ifsReplayed, a);
+        readMatBinary(ifsRecorded, b);
+        if (a.empty() && b.empty()) {
+            continue;
+        }
+        if (a.size() != b.size() || a.type() != b.type()) {
+            std::cout << "Stack " << name << " has a different size or type" << std::endl;
+            differences++;
+            continue;
+        }
+        double diff = cv::norm(a, b, NORM_INF);
+        std::cout << "Stack " << name << " max difference: " << diff << std::endl;
+        if (diff > tolerance) {
+            differences++;
+        }
+    }
+    return differences;
+}
+
+/**
+ Downscales a recorded RGB frame as RGBA and BGRA view like the app feeds it, and compares the results with the RGB
+ view, at half size and at a size that is no integer fraction. Returns the number of layouts that differ.
+ */
+int checkLayouts(const Mat &image) {
+    Mat rgba, bgra;
+    cvtColor(image, rgba, COLOR_RGB2RGBA);
+    cvtColor(image, bgra, COLOR_RGB2BGRA);
+    FrameView views[] = {
+            FrameView(rgba),
+            FrameView(bgra.data, bgra.size(), bgra.step[0], PixelLayout::BGRA),
+    };
+    const char *names[] = {"RGBA", "BGRA"};
+
+    Size sizes[] = {image.size() / 2, Size(std::max(1, image.cols * 3 / 7), std::max(1, image.rows * 3 / 7))};
+    int differences = 0;
+    for (auto &size: sizes) {
+        Mat expected;
+        FrameView(image).downscale(size, expected);
+        for (int i = 0; i < 2; i++) {
+            Mat scaled;
+            views[i].downscale(size, scaled);
+            if (cv::norm(scaled, expected, NORM_INF) != 0) {
+                std::cout << names[i] << " frame downscaled to " << size << " differs from the RGB frame" << std::endl;
+                differences++;
+            }
+        }
+    }
+    return differences;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <session-dir> [--tolerance <value>] [--checkpoint <dir>] "
+                  << "[--output <dir>] [--threads <n>] [--visualise] [--detection-levels <n>] [--tracking-interval <n>] "
+                  << "[--screen-quality] [--weight-frames]" << std::endl;
+        return 2;
+    }
+
+    string sessionDir = argv[1];
+    string checkpointDir = sessionDir;
+    string outputDir;
+    double tolerance = 0;
+
+    SessionReader reader(sessionDir);
+    if (!reader.isOpen()) {
+        std::cout << "No valid session of version " << SESSION_VERSION << " found in " << sessionDir << std::endl;
+        return 2;
+    }
+    MergerOptions options;
+    options.applySessionSettings(reader.getSettings());
+
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--tolerance" && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpointDir = argv[++i];
+        } else if (arg == "--output" && i + 1 < argc) {
+            outputDir = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            cv::setNumThreads(atoi(argv[++i]));
+        } else if (arg == "--visualise") {
+            options.visualiseTrackingPoints = true;
+        } else if (arg == "--detection-levels" && i + 1 < argc) {
+            options.detectionLevels = atoi(argv[++i]);
+        } else if (arg == "--tracking-interval" && i + 1 < argc) {
+            options.trackingInterval = atoi(argv[++i]);
+        } else if (arg == "--screen-quality") {
+            options.screenQuality = true;
+        } else if (arg == "--weight-frames") {
+            options.weightFrames = true;
+        } else {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    Mat image, segmentation, preview;
+    FrameRecord expected;
+    if (!reader.next(image, segmentation, expected)) {
+        std::cout << "Session does not contain a reference frame" << std::endl;
+        return 2;
+    }
+
+    auto verifier = std::make_shared<ReplayVerifier>(tolerance);
+    verifier->expect(expected);
+
+    std::unique_ptr<ImageMerger> merger;
+    try {
+        merger = std::make_unique<ImageMerger>(image, segmentation, options, verifier);
+    } catch (const MergingException &e) {
+        std::cout << "Reference frame rejected: " << e.what() << std::endl;
+        return verifier->mismatches == 0 ? 0 : 1;
+    }
+
+    int layoutDifferences = checkLayouts(image);
+    while (reader.next(image, segmentation, expected)) {
+        layoutDifferences += checkLayouts(image);
+        verifier->expect(expected);
+        merger->setNextQuality(expected.quality);
+        merger->mergeImageOnStack(image, preview);
+    }
+
+    std::cout << std::endl << "Replayed " << verifier->frames << " frames, "
+              << verifier->mismatches << " mismatches, " << layoutDifferences << " layout differences" << std::endl;
+    printTimings("Recorded", verifier->recordedTimings);
+    printTimings("Replayed", verifier->replayedTimings);
+
+    int differences = 0;
+    if (!outputDir.empty()) {
+        merger->saveToDirectory(outputDir);
+        differences = compareCheckpoints(outputDir, checkpointDir, tolerance);
+    }
+
+    return verifier->mismatches == 0 && differences == 0 && layoutDifferences == 0 ? 0 : 1;
+}
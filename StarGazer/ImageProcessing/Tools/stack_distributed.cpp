@@ -0,0 +1,210 @@
+//
+//  stack_distributed.cpp
+//  StarGazer
+//
+//  Splits a capture into contiguous ranges of frames, stacks every range in its own process and merges the
+//  checkpoints of the processes with the CheckpointMerger. The merge step can also be run on its own, to combine
+//  checkpoints that were stacked on other machines.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IAlignment -IEnhancement -IExport -IDiagnostics -IStacking -IIngestion -I. \
+//        Tools/stack_distributed.cpp Alignment/homography.cpp Enhancement/blend.cpp Enhancement/enhance.cpp \
+//        Export/SaveBinaryCV.cpp -o stack_distributed $(pkg-config --cflags --libs opencv4)
+//
+//  Usage: stack_distributed <input> <output-dir> [--processes <n>] [--raw <width>x<height> <layout> <depth>]
+//                           [--mask <path>] [--batch-workers <n>] [--detection-levels <n>]
+//         stack_distributed --merge <output-dir> <checkpoint-dir>... [--detection-levels <n>]
+//
+//  Every process writes its checkpoint to <output-dir>/part-<i>, the merged checkpoint is written to <output-dir>.
+//  <layout> is one of rgb, bgr, rgba, bgra, planar, <depth> is 8 or 16.
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <filesystem>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ImageMerger.hpp"
+#include "FrameSource.hpp"
+#include "BatchStacker.hpp"
+#include "CheckpointMerger.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Stacks a range of frames onto the first frame of the range and writes the checkpoint. Runs in a child process.
+ */
+int stackRange(std::unique_ptr<FrameSource> source, int begin, int end, Mat &mask, BatchOptions options,
+               const string &partDir) {
+    PrefetchingFrameSource frames(std::make_unique<RangeFrameSource>(std::move(source), begin, end));
+    DecodedFrame reference;
+    if (!frames.next(reference)) {
+        std::cout << "No frames in range " << begin << "-" << end << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<BatchStacker> stacker;
+    try {
+        stacker = std::make_unique<BatchStacker>(reference.view, mask, options);
+    } catch (const MergingException &e) {
+        std::cout << "Reference frame " << begin << " rejected: " << e.what() << std::endl;
+        return 1;
+    }
+    stacker->stack(frames);
+    std::cout << "Range " << begin << "-" << end << ": merged " << stacker->getNumImages() << " frames, "
+              << stacker->getNumFailed() << " failed" << std::endl;
+
+    std::filesystem::create_directories(partDir);
+    stacker->saveToDirectory(partDir);
+    return 0;
+}
+
+/**
+ Merges checkpoints into the output directory, checkpoints that cannot be registered are skipped.
+ */
+int mergeCheckpoints(const vector<string> &partDirs, int detectionLevels, const string &outputDir) {
+    CheckpointMerger merger(detectionLevels);
+    int merged = 0;
+    for (auto &dir: partDirs) {
+        try {
+            if (merger.addCheckpoint(dir)) {
+                merged++;
+            } else {
+                std::cout << "Skipped checkpoint " << dir << std::endl;
+            }
+        } catch (const MergingException &e) {
+            std::cout << "Reference checkpoint " << dir << " rejected: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (merged == 0) {
+        std::cout << "No checkpoints merged" << std::endl;
+        return 1;
+    }
+
+    PartialStack &result = merger.getResult();
+    std::cout << "Merged " << merged << " checkpoints with " << result.numImages << " frames, "
+              << result.numFailed << " failed" << std::endl;
+
+    merger.saveToDirectory(outputDir);
+    Mat processed;
+    merger.getProcessed(processed);
+    imwrite(outputDir + "/processed.png", processed);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <input> <output-dir> [--processes <n>] "
+                  << "[--raw <width>x<height> <layout> <depth>] [--mask <path>] [--batch-workers <n>] "
+                  << "[--detection-levels <n>]" << std::endl
+                  << "       " << argv[0] << " --merge <output-dir> <checkpoint-dir>... [--detection-levels <n>]"
+                  << std::endl;
+        return 2;
+    }
+
+    if (string(argv[1]) == "--merge") {
+        string outputDir = argv[2];
+        vector<string> partDirs;
+        int detectionLevels = 0;
+        for (int i = 3; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--detection-levels" && i + 1 < argc) {
+                detectionLevels = atoi(argv[++i]);
+            } else {
+                partDirs.push_back(arg);
+            }
+        }
+        return mergeCheckpoints(partDirs, detectionLevels, outputDir);
+    }
+
+    string input = argv[1];
+    string outputDir = argv[2];
+    int processes = 4;
+    bool raw = false;
+    Size rawSize;
+    PixelLayout rawLayout = PixelLayout::RGB;
+    int rawDepth = CV_8U;
+    string maskPath;
+    BatchOptions options;
+    options.workers = 1;
+
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--processes" && i + 1 < argc) {
+            processes = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--raw" && i + 3 < argc) {
+            raw = true;
+            if (sscanf(argv[++i], "%dx%d", &rawSize.width, &rawSize.height) != 2 || !parseLayout(argv[++i], rawLayout)) {
+                std::cout << "Invalid raw frame format" << std::endl;
+                return 2;
+            }
+            rawDepth = atoi(argv[++i]) == 16 ? CV_16U : CV_8U;
+        } else if (arg == "--mask" && i + 1 < argc) {
+            maskPath = argv[++i];
+        } else if (arg == "--batch-workers" && i + 1 < argc) {
+            options.workers = atoi(argv[++i]);
+        } else if (arg == "--detection-levels" && i + 1 < argc) {
+            options.detectionLevels = atoi(argv[++i]);
+        } else {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    // Sources are only opened for counting here, every process opens its own after the fork
+    auto openSource = [&]() -> std::unique_ptr<FrameSource> {
+        if (raw) {
+            return std::make_unique<RawFrameSource>(input, rawSize, rawLayout, rawDepth);
+        }
+        return std::make_unique<ImageDirectorySource>(input);
+    };
+    int numFrames = openSource()->count();
+    if (numFrames <= 0) {
+        std::cout << "No frames found in " << input << std::endl;
+        return 1;
+    }
+    processes = std::min(processes, numFrames);
+
+    Mat mask;
+    if (!maskPath.empty()) {
+        mask = imread(maskPath, IMREAD_GRAYSCALE);
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<pid_t> children;
+    vector<string> partDirs;
+    for (int i = 0; i < processes; i++) {
+        int begin = (int) ((long) numFrames * i / processes);
+        int end = (int) ((long) numFrames * (i + 1) / processes);
+        string partDir = outputDir + "/part-" + std::to_string(i);
+        partDirs.push_back(partDir);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(stackRange(openSource(), begin, end, mask, options, partDir));
+        } else if (pid < 0) {
+            std::cout << "Could not start process " << i << std::endl;
+            return 1;
+        }
+        children.push_back(pid);
+    }
+
+    vector<string> finished;
+    for (int i = 0; i < children.size(); i++) {
+        int status = 0;
+        waitpid(children[i], &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            finished.push_back(partDirs[i]);
+        } else {
+            std::cout << "Process " << i << " failed" << std::endl;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << "Stacked " << numFrames << " frames in " << processes << " processes, "
+              << numFrames / std::max(seconds, 1e-9) << " frames/s" << std::endl;
+
+    return mergeCheckpoints(finished, options.detectionLevels, outputDir);
+}
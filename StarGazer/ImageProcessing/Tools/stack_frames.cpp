@@ -0,0 +1,235 @@
+//
+//  stack_frames.cpp
+//  StarGazer
+//
+//  Stacks an image directory, a video file or a raw frame dump with the ImageMerger, or with the BatchStacker on all cores.
+//  Frames are decoded ahead of time by the PrefetchingFrameSource while the previous frames are merged.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IAlignment -IEnhancement -IExport -IDiagnostics -IStacking -IIngestion -I. \
+//        Tools/stack_frames.cpp Alignment/homography.cpp Enhancement/blend.cpp Enhancement/enhance.cpp \
+//        Export/SaveBinaryCV.cpp -o stack_frames $(pkg-config --cflags --libs opencv4)
+//
+//  Usage: stack_frames <input> <output-dir> [--video] [--raw <width>x<height> <layout> <depth>]
+//                      [--mask <path>] [--prefetch <n>] [--workers <n>] [--threads <n>]
+//                      [--detection-levels <n>] [--tracking-interval <n>] [--batch] [--batch-workers <n>]
+//                      [--mask-tiles <n>] [--calibration <dir>] [--screen-quality]
+//                      [--weight-frames] [--stretch clahe|midtone|asinh] [--drizzle <scale>] [--drop-size <n>]
+//                      [--budget-mb <n>] [--spill <dir>] [--mesh <cells>] [--mosaic]
+//
+//  <layout> is one of rgb, bgr, rgba, bgra, planar, <depth> is 8 or 16.
+//  <dir> of --calibration holds the masters written by build_masters, frames are calibrated while they are decoded.
+//  --drizzle additionally drizzles the frames onto a canvas of <scale> times the frame size, written as 16 bit
+//  drizzled.png. Combine with --budget-mb and --spill to keep large canvases on disk.
+//  --mesh corrects the alignment locally in a grid of <cells> along the longer side, for wide angle lenses.
+//  --mosaic additionally stacks onto a canvas that grows with the covered sky, written as mosaic.png.
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+
+#include "ImageMerger.hpp"
+#include "FrameSource.hpp"
+#include "BatchStacker.hpp"
+#include "Calibration.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ Stacks all frames with the BatchStacker, the first frame is the reference.
+ */
+int stackBatch(PrefetchingFrameSource &frames, DecodedFrame &reference, Mat &mask, BatchOptions options, const string &outputDir) {
+    std::unique_ptr<BatchStacker> stacker;
+    try {
+        stacker = std::make_unique<BatchStacker>(reference.view, mask, options);
+    } catch (const MergingException &e) {
+        std::cout << "Reference frame rejected: " << e.what() << std::endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    stacker->stack(frames);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int merged = stacker->getNumImages(), failed = stacker->getNumFailed();
+    std::cout << "Merged " << merged << " frames, " << failed << " failed, " << frames.getNumSkipped() << " skipped, "
+              << (merged + failed - 1) / std::max(seconds, 1e-9) << " frames/s" << std::endl;
+
+    stacker->saveToDirectory(outputDir);
+    Mat processed;
+    stacker->getProcessed(processed);
+    imwrite(outputDir + "/processed.png", processed);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <input> <output-dir> [--video] [--raw <width>x<height> <layout> <depth>] "
+                  << "[--mask <path>] [--prefetch <n>] [--workers <n>] [--threads <n>] "
+                  << "[--detection-levels <n>] [--tracking-interval <n>] [--batch] [--batch-workers <n>] "
+                  << "[--mask-tiles <n>] [--calibration <dir>] [--screen-quality] [--weight-frames] "
+                  << "[--stretch clahe|midtone|asinh] [--drizzle <scale>] [--drop-size <n>] [--budget-mb <n>] "
+                  << "[--spill <dir>] [--mesh <cells>] [--mosaic]" << std::endl;
+        return 2;
+    }
+
+    string input = argv[1];
+    string outputDir = argv[2];
+    bool video = false;
+    bool raw = false;
+    Size rawSize;
+    PixelLayout rawLayout = PixelLayout::RGB;
+    int rawDepth = CV_8U;
+    string maskPath;
+    int prefetch = 8;
+    int workers = 4;
+    MergerOptions options;
+    bool batch = false;
+    BatchOptions batchOptions;
+    string calibrationDir;
+
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--video") {
+            video = true;
+        } else if (arg == "--raw" && i + 3 < argc) {
+            raw = true;
+            if (sscanf(argv[++i], "%dx%d", &rawSize.width, &rawSize.height) != 2 || !parseLayout(argv[++i], rawLayout)) {
+                std::cout << "Invalid raw frame format" << std::endl;
+                return 2;
+            }
+            rawDepth = atoi(argv[++i]) == 16 ? CV_16U : CV_8U;
+        } else if (arg == "--mask" && i + 1 < argc) {
+            maskPath = argv[++i];
+        } else if (arg == "--prefetch" && i + 1 < argc) {
+            prefetch = atoi(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            cv::setNumThreads(atoi(argv[++i]));
+        } else if (arg == "--detection-levels" && i + 1 < argc) {
+            options.detectionLevels = atoi(argv[++i]);
+        } else if (arg == "--tracking-interval" && i + 1 < argc) {
+            options.trackingInterval = atoi(argv[++i]);
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--batch-workers" && i + 1 < argc) {
+            batchOptions.workers = atoi(argv[++i]);
+        } else if (arg == "--mask-tiles" && i + 1 < argc) {
+            options.maskTileSize = atoi(argv[++i]);
+        } else if (arg == "--screen-quality") {
+            options.screenQuality = true;
+        } else if (arg == "--weight-frames") {
+            options.weightFrames = true;
+        } else if (arg == "--stretch" && i + 1 < argc) {
+            string mode = argv[++i];
+            options.stretch = mode == "midtone" ? StretchMode::MIDTONE : mode == "asinh" ? StretchMode::ASINH : StretchMode::CLAHE;
+        } else if (arg == "--drizzle" && i + 1 < argc) {
+            options.drizzleScale = (float) atof(argv[++i]);
+        } else if (arg == "--drop-size" && i + 1 < argc) {
+            options.drizzleDropSize = (float) atof(argv[++i]);
+        } else if (arg == "--budget-mb" && i + 1 < argc) {
+            options.memoryBudget = std::make_shared<MemoryBudget>((size_t) atol(argv[++i]) << 20);
+        } else if (arg == "--spill" && i + 1 < argc) {
+            options.spillDirectory = argv[++i];
+        } else if (arg == "--mesh" && i + 1 < argc) {
+            options.meshCells = atoi(argv[++i]);
+        } else if (arg == "--mosaic") {
+            options.mosaic = true;
+        } else if (arg == "--calibration" && i + 1 < argc) {
+            calibrationDir = argv[++i];
+        } else {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    std::unique_ptr<FrameSource> source;
+    if (raw) {
+        source = std::make_unique<RawFrameSource>(input, rawSize, rawLayout, rawDepth);
+    } else if (video) {
+        source = std::make_unique<VideoFileSource>(input);
+    } else {
+        source = std::make_unique<ImageDirectorySource>(input);
+    }
+    if (!calibrationDir.empty()) {
+        auto calibration = std::make_shared<Calibration>();
+        if (!calibration->readFromDirectory(calibrationDir)) {
+            std::cout << "No calibration found in " << calibrationDir << std::endl;
+            return 1;
+        }
+        options.hotPixels = calibration->getHotPixels();
+        source = std::make_unique<CalibratedFrameSource>(std::move(source), calibration);
+    }
+    PrefetchingFrameSource frames(std::move(source), prefetch, workers);
+
+    Mat mask;
+    if (!maskPath.empty()) {
+        mask = imread(maskPath, IMREAD_GRAYSCALE);
+    }
+
+    DecodedFrame frame;
+    if (!frames.next(frame)) {
+        std::cout << "No frames found in " << input << std::endl;
+        return 1;
+    }
+
+    if (batch) {
+        batchOptions.detectionLevels = options.detectionLevels;
+        batchOptions.maskTileSize = options.maskTileSize;
+        batchOptions.hotPixels = options.hotPixels;
+        batchOptions.screenQuality = options.screenQuality;
+        batchOptions.weightFrames = options.weightFrames;
+        batchOptions.stretch = options.stretch;
+        batchOptions.stretchTarget = options.stretchTarget;
+        return stackBatch(frames, frame, mask, batchOptions, outputDir);
+    }
+
+    std::unique_ptr<ImageMerger> merger;
+    try {
+        merger = std::make_unique<ImageMerger>(frame.view, mask, options);
+    } catch (const MergingException &e) {
+        std::cout << "Reference frame rejected: " << e.what() << std::endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    int merged = 1, failed = 0;
+    Mat preview;
+    while (frames.next(frame)) {
+        if (merger->mergeFrame(frame.view, preview)) {
+            merged++;
+        } else {
+            failed++;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    std::cout << "Merged " << merged << " frames, " << failed << " failed, " << frames.getNumSkipped() << " skipped, "
+              << (merged + failed - 1) / std::max(seconds, 1e-9) << " frames/s" << std::endl;
+
+    ChannelStatistics channels[3];
+    merger->getStatistics(channels);
+    for (int c = 0; c < 3; c++) {
+        std::cout << "Channel " << c << ": background " << channels[c].background << ", noise " << channels[c].noise << std::endl;
+    }
+
+    merger->saveToDirectory(outputDir);
+    Mat processed;
+    merger->getProcessed(processed);
+    imwrite(outputDir + "/processed.png", processed);
+
+    Mat drizzled;
+    if (merger->getDrizzled(drizzled, CV_16U)) {
+        imwrite(outputDir + "/drizzled.png", drizzled);
+    }
+
+    Mat mosaic;
+    Point origin;
+    if (merger->getMosaic(mosaic, origin)) {
+        std::cout << "Mosaic " << mosaic.size() << " at " << origin << " relative to the reference frame" << std::endl;
+        imwrite(outputDir + "/mosaic.png", mosaic);
+    }
+    return 0;
+}
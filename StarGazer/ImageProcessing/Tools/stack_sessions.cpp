@@ -0,0 +1,137 @@
+//
+//  stack_sessions.cpp
+//  StarGazer
+//
+//  Stacks several image directories at once in a single StackingRuntime, as a server stacking many camera feeds
+//  would. Every directory is fed by its own thread, optionally paced like a live camera.
+//  Runs on Linux against a desktop OpenCV build, e.g. from StarGazer/ImageProcessing:
+//
+//    c++ -std=c++17 -O2 -pthread -IAlignment -IEnhancement -IExport -IDiagnostics -IStacking -IIngestion -I. \
+//        Tools/stack_sessions.cpp Alignment/homography.cpp Enhancement/blend.cpp Enhancement/enhance.cpp \
+//        Export/SaveBinaryCV.cpp -o stack_sessions $(pkg-config --cflags --libs opencv4)
+//
+//  Usage: stack_sessions <output-dir> <input-dir>... [--workers <n>] [--max-sessions <n>] [--queue <n>]
+//                        [--budget-mb <n>] [--spill <dir>] [--fps <n>] [--detection-levels <n>]
+//                        [--tracking-interval <n>] [--adaptive]
+//
+//  --adaptive lowers the quality of sessions that fall behind their feed, see AdaptiveQuality.
+//  Every session is saved to <output-dir>/<name of its input-dir>.
+//
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <thread>
+#include <chrono>
+
+#include "StackingRuntime.hpp"
+#include "FrameSource.hpp"
+
+using namespace std;
+using namespace cv;
+
+static string baseName(string path) {
+    while (path.size() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+    return path.substr(path.find_last_of('/') + 1);
+}
+
+/**
+ Opens a session for a directory and submits all its frames, paced to the frame rate if one is set.
+ */
+void feed(StackingRuntime &runtime, const string &input, const string &outputDir, MergerOptions options, double fps) {
+    PrefetchingFrameSource frames(std::make_unique<ImageDirectorySource>(input));
+    DecodedFrame reference;
+    if (!frames.next(reference)) {
+        std::cout << input << ": no frames" << std::endl;
+        return;
+    }
+
+    Mat mask;
+    std::shared_ptr<StackingSession> session;
+    try {
+        session = runtime.open(reference.view, mask, options);
+    } catch (const MergingException &e) {
+        std::cout << input << ": reference frame rejected: " << e.what() << std::endl;
+        return;
+    }
+    if (session == nullptr) {
+        std::cout << input << ": not admitted" << std::endl;
+        return;
+    }
+
+    auto interval = std::chrono::duration<double>(fps > 0 ? 1 / fps : 0);
+    auto due = std::chrono::steady_clock::now();
+    DecodedFrame frame;
+    while (frames.next(frame)) {
+        if (fps > 0) {
+            due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+            std::this_thread::sleep_until(due);
+        }
+        runtime.submit(session, std::move(frame));
+        frame = DecodedFrame();
+    }
+    runtime.close(session);
+
+    SessionStatus status = session->getStatus();
+    std::cout << input << ": merged " << status.merged << ", failed " << status.failed << ", dropped "
+              << status.dropped << std::endl;
+    session->saveToDirectory(outputDir + "/" + baseName(input));
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <output-dir> <input-dir>... [--workers <n>] [--max-sessions <n>] "
+                  << "[--queue <n>] [--budget-mb <n>] [--spill <dir>] [--fps <n>] [--detection-levels <n>] "
+                  << "[--tracking-interval <n>] [--adaptive]" << std::endl;
+        return 2;
+    }
+
+    string outputDir = argv[1];
+    vector<string> inputs;
+    RuntimeOptions runtimeOptions;
+    MergerOptions options;
+    double fps = 0;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) {
+            runtimeOptions.workers = atoi(argv[++i]);
+        } else if (arg == "--max-sessions" && i + 1 < argc) {
+            runtimeOptions.maxSessions = atoi(argv[++i]);
+        } else if (arg == "--queue" && i + 1 < argc) {
+            runtimeOptions.maxQueuedFrames = atoi(argv[++i]);
+        } else if (arg == "--budget-mb" && i + 1 < argc) {
+            runtimeOptions.memoryBudget = std::make_shared<MemoryBudget>((size_t) atol(argv[++i]) << 20);
+        } else if (arg == "--spill" && i + 1 < argc) {
+            options.spillDirectory = argv[++i];
+        } else if (arg == "--fps" && i + 1 < argc) {
+            fps = atof(argv[++i]);
+        } else if (arg == "--detection-levels" && i + 1 < argc) {
+            options.detectionLevels = atoi(argv[++i]);
+        } else if (arg == "--tracking-interval" && i + 1 < argc) {
+            options.trackingInterval = atoi(argv[++i]);
+        } else if (arg == "--adaptive") {
+            options.adaptiveQuality = true;
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cout << "Unknown argument " << arg << std::endl;
+            return 2;
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    {
+        StackingRuntime runtime(runtimeOptions);
+        vector<std::thread> feeders;
+        for (auto &input: inputs) {
+            feeders.emplace_back([&, input]() { feed(runtime, input, outputDir, options, fps); });
+        }
+        for (auto &feeder: feeders) {
+            feeder.join();
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    std::cout << inputs.size() << " sessions in " << seconds << " s" << std::endl;
+    return 0;
+}
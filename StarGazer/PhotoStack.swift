@@ -173,6 +173,10 @@ public class PhotoStack {
 
         }
         
+        // Lets the stacker lower its quality while frames queue up
+        let announced = self.stacker != nil
+        self.stacker?.frameCaptured()
+        
         self.dispatch.addOperation {
             let image = captureObject.toUIImage()
             
@@ -181,6 +185,9 @@ public class PhotoStack {
              */
             if image == nil {
                 print("Image invalid")
+                if announced {
+                    self.stacker?.frameDropped()
+                }
                 return
             }
             
@@ -224,10 +231,11 @@ public class PhotoStack {
                 let maskImage = ImageSegementation.segementImage(image: image!)
 
                 autoreleasepool {
+                    let recordingPath = DebugManager.readBool(option: .recordSession) ? self.captureProject.getUrl().path : nil
                     if self.maskEnabled {
-                        self.stacker = OpenCVStacker.init(image: image!, withMask: maskImage, visaliseTrackingPoints: true)
+                        self.stacker = OpenCVStacker.init(image: image!, withMask: maskImage, visaliseTrackingPoints: true, recordSessionTo: recordingPath)
                     } else {
-                        self.stacker = OpenCVStacker.init(image: image!, withMask: nil, visaliseTrackingPoints: true)
+                        self.stacker = OpenCVStacker.init(image: image!, withMask: nil, visaliseTrackingPoints: true, recordSessionTo: recordingPath)
                     }
 
                     self.numImages += 1
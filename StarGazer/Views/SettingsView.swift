@@ -46,6 +46,7 @@ struct SettingsView : View {
     
     @State private var applyMask = true
     @State private var shortExposure = true
+    @State private var recordSession = false
     @State private var rawEnabled = true
     
     var body: some View {
@@ -98,6 +99,10 @@ struct SettingsView : View {
                                 _ in
                                 DebugManager.saveBool(option: .shortExposure, state: shortExposure)
                             })
+                            Toggle("Record stacking session", isOn: $recordSession).onChange(of: recordSession, perform: {
+                                _ in
+                                DebugManager.saveBool(option: .recordSession, state: recordSession)
+                            })
                         }
                     #endif
                     
@@ -154,6 +159,7 @@ struct SettingsView : View {
         
             #if DEBUG
             self.shortExposure = DebugManager.readBool(option: .shortExposure)
+            self.recordSession = DebugManager.readBool(option: .recordSession)
             #endif
         })
         